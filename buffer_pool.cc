@@ -0,0 +1,285 @@
+// buffer_pool.cc
+
+#include "buffer_pool.h"
+#include <algorithm>
+#include <memory>
+#include <new>
+#include <cstdlib>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace quicftp {
+
+namespace {
+
+constexpr size_t kCacheLineSize = 64;
+constexpr size_t kHugePageSize = 2 * 1024 * 1024;
+
+size_t round_up(size_t value, size_t multiple) {
+  return (value + multiple - 1) / multiple * multiple;
+}
+
+BufferPool::Config config_from_env() {
+  BufferPool::Config config;
+  if (const char* env = std::getenv("QUICFTP_BUFFER_POOL_MAX")) {
+    size_t requested = std::strtoull(env, nullptr, 10);
+    if (requested > 0) config.max_bytes = requested;
+  }
+  if (const char* env = std::getenv("QUICFTP_HUGE_PAGES")) {
+    config.huge_pages = env[0] == '1';
+  }
+  return config;
+}
+
+} // namespace
+
+struct BufferRef::Block {
+  std::atomic<uint32_t> refs{0};
+  uint8_t* data = nullptr;
+  size_t capacity = 0;
+  size_t size = 0;
+  BufferPool* pool = nullptr; // null for one-off heap buffers
+};
+
+struct BufferPool::Slab {
+  void* base = nullptr;
+  size_t bytes = 0;
+  bool huge = false;
+  std::unique_ptr<BufferRef::Block[]> blocks;
+};
+
+BufferRef::~BufferRef() {
+  reset();
+}
+
+BufferRef::BufferRef(const BufferRef& other) : block_(other.block_) {
+  if (block_) {
+    block_->refs.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+BufferRef& BufferRef::operator=(const BufferRef& other) {
+  if (this != &other) {
+    BufferRef copy(other);
+    std::swap(block_, copy.block_);
+  }
+  return *this;
+}
+
+BufferRef::BufferRef(BufferRef&& other) noexcept : block_(other.block_) {
+  other.block_ = nullptr;
+}
+
+BufferRef& BufferRef::operator=(BufferRef&& other) noexcept {
+  if (this != &other) {
+    reset();
+    block_ = other.block_;
+    other.block_ = nullptr;
+  }
+  return *this;
+}
+
+uint8_t* BufferRef::data() const {
+  return block_ ? block_->data : nullptr;
+}
+
+size_t BufferRef::capacity() const {
+  return block_ ? block_->capacity : 0;
+}
+
+size_t BufferRef::size() const {
+  return block_ ? block_->size : 0;
+}
+
+void BufferRef::set_size(size_t size) {
+  if (block_) {
+    block_->size = std::min(size, block_->capacity);
+  }
+}
+
+bool BufferRef::pooled() const {
+  return block_ && block_->pool;
+}
+
+void BufferRef::reset() {
+  if (!block_) {
+    return;
+  }
+  Block* block = block_;
+  block_ = nullptr;
+  if (block->refs.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+    return;
+  }
+  if (block->pool) {
+    block->pool->release(block);
+  } else {
+    std::free(block->data);
+    delete block;
+  }
+}
+
+BufferPool& BufferPool::instance() {
+  static BufferPool pool(config_from_env());
+  return pool;
+}
+
+BufferPool::BufferPool(const Config& config) : config_(config) {
+  config_.buffer_size = round_up(std::max<size_t>(config_.buffer_size, kCacheLineSize), kCacheLineSize);
+  config_.buffers_per_slab = std::max<size_t>(config_.buffers_per_slab, 1);
+  stats_.buffer_size = config_.buffer_size;
+}
+
+BufferPool::~BufferPool() {
+  for (Slab& slab : slabs_) {
+    munmap(slab.base, slab.bytes);
+  }
+}
+
+BufferRef BufferPool::acquire(size_t size) {
+  if (size == 0) {
+    size = config_.buffer_size;
+  }
+
+  BufferRef::Block* block = nullptr;
+  if (size <= config_.buffer_size) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_.acquired++;
+    if (free_.empty()) {
+      grow();
+    }
+    if (!free_.empty()) {
+      block = free_.back();
+      free_.pop_back();
+      stats_.buffers_in_use++;
+      stats_.peak_in_use = std::max(stats_.peak_in_use, stats_.buffers_in_use);
+    } else {
+      stats_.fallback_allocations++;
+    }
+    publish_usage();
+  } else {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_.acquired++;
+    stats_.fallback_allocations++;
+    publish_usage();
+  }
+
+  if (!block) {
+    // Over the cap or oversized: a private heap buffer, freed on release
+    block = new BufferRef::Block;
+    block->capacity = round_up(size, kCacheLineSize);
+    block->data = static_cast<uint8_t*>(std::aligned_alloc(kCacheLineSize, block->capacity));
+    if (!block->data) {
+      delete block;
+      throw std::bad_alloc();
+    }
+  }
+  block->refs.store(1, std::memory_order_relaxed);
+  block->size = size;
+  return BufferRef(block);
+}
+
+bool BufferPool::find_slab(const void* data, size_t len, size_t& index) const {
+  const uint8_t* begin = static_cast<const uint8_t*>(data);
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (size_t i = 0; i < slabs_.size(); ++i) {
+    const uint8_t* base = static_cast<const uint8_t*>(slabs_[i].base);
+    if (begin >= base && begin + len <= base + slabs_[i].bytes) {
+      index = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool BufferPool::slab_region(size_t index, void*& base, size_t& bytes) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (index >= slabs_.size()) {
+    return false;
+  }
+  base = slabs_[index].base;
+  bytes = slabs_[index].bytes;
+  return true;
+}
+
+BufferPool::Stats BufferPool::stats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
+
+BufferPool::Usage BufferPool::usage() const {
+  Usage usage;
+  usage.buffers_in_use = in_use_.load(std::memory_order_relaxed);
+  usage.buffers_total = total_.load(std::memory_order_relaxed);
+  usage.slab_bytes = slab_bytes_.load(std::memory_order_relaxed);
+  usage.fallback_allocations = fallbacks_.load(std::memory_order_relaxed);
+  return usage;
+}
+
+void BufferPool::publish_usage() {
+  in_use_.store(stats_.buffers_in_use, std::memory_order_relaxed);
+  total_.store(stats_.buffers_total, std::memory_order_relaxed);
+  slab_bytes_.store(stats_.slab_bytes, std::memory_order_relaxed);
+  fallbacks_.store(stats_.fallback_allocations, std::memory_order_relaxed);
+}
+
+bool BufferPool::grow() {
+  size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  size_t bytes = round_up(config_.buffer_size * config_.buffers_per_slab, page);
+  if (stats_.slab_bytes + bytes > config_.max_bytes) {
+    return false;
+  }
+
+  Slab slab;
+  if (config_.huge_pages) {
+    // Explicit huge pages need a reserved pool; without one fall back to
+    // transparent huge pages on an ordinary mapping
+    size_t huge_bytes = round_up(bytes, kHugePageSize);
+    void* base = mmap(nullptr, huge_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+                      -1, 0);
+    if (base != MAP_FAILED) {
+      slab.base = base;
+      slab.bytes = huge_bytes;
+      slab.huge = true;
+    }
+  }
+  if (!slab.base) {
+    void* base = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+      return false;
+    }
+    if (config_.huge_pages) {
+      madvise(base, bytes, MADV_HUGEPAGE);
+    }
+    slab.base = base;
+    slab.bytes = bytes;
+  }
+
+  size_t count = slab.bytes / config_.buffer_size;
+  slab.blocks.reset(new BufferRef::Block[count]);
+  free_.reserve(free_.size() + count);
+  for (size_t i = count; i-- > 0;) {
+    BufferRef::Block& block = slab.blocks[i];
+    block.data = static_cast<uint8_t*>(slab.base) + i * config_.buffer_size;
+    block.capacity = config_.buffer_size;
+    block.pool = this;
+    free_.push_back(&block);
+  }
+
+  stats_.slabs++;
+  stats_.slab_bytes += slab.bytes;
+  if (slab.huge) {
+    stats_.huge_page_bytes += slab.bytes;
+  }
+  stats_.buffers_total += count;
+  slabs_.push_back(std::move(slab));
+  return true;
+}
+
+void BufferPool::release(BufferRef::Block* block) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  free_.push_back(block);
+  stats_.buffers_in_use--;
+  publish_usage();
+}
+
+} // namespace quicftp
@@ -0,0 +1,137 @@
+// buffer_pool.h
+// Pool of fixed-size I/O buffers shared by the client and server data paths
+// Buffers are carved out of page-aligned slabs (optionally huge pages) and
+// handed out as reference-counted BufferRefs, so a received message can be
+// parsed in place and its payload queued for the disk write without a copy.
+// Released buffers go back on a free list; once the slabs cover the working
+// set a transfer allocates nothing.
+
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace quicftp {
+
+class BufferPool;
+
+// Shared handle to one buffer; the last copy to go returns it to its pool
+class BufferRef {
+public:
+  BufferRef() = default;
+  ~BufferRef();
+  BufferRef(const BufferRef& other);
+  BufferRef& operator=(const BufferRef& other);
+  BufferRef(BufferRef&& other) noexcept;
+  BufferRef& operator=(BufferRef&& other) noexcept;
+
+  uint8_t* data() const;
+  size_t capacity() const;
+
+  // Bytes in use, set by whoever fills the buffer (at most capacity())
+  size_t size() const;
+  void set_size(size_t size);
+
+  bool empty() const { return block_ == nullptr; }
+  explicit operator bool() const { return block_ != nullptr; }
+
+  // True unless the buffer is a one-off heap allocation (pool at its cap,
+  // or a request larger than the pool's buffer size)
+  bool pooled() const;
+
+  void reset();
+
+private:
+  friend class BufferPool;
+  struct Block;
+
+  explicit BufferRef(Block* block) : block_(block) {}
+  Block* block_ = nullptr;
+};
+
+class BufferPool {
+public:
+  struct Config {
+    size_t buffer_size = 128 * 1024;         // payload bytes per buffer
+    size_t buffers_per_slab = 64;
+    size_t max_bytes = 256 * 1024 * 1024;    // cap on slab memory
+    bool huge_pages = false;                 // back slabs with huge pages if possible
+  };
+
+  struct Stats {
+    size_t buffer_size = 0;
+    size_t slabs = 0;
+    size_t slab_bytes = 0;
+    size_t huge_page_bytes = 0;       // part of slab_bytes on huge pages
+    size_t buffers_total = 0;
+    size_t buffers_in_use = 0;
+    size_t peak_in_use = 0;
+    uint64_t acquired = 0;            // buffers handed out, pooled or not
+    uint64_t fallback_allocations = 0; // handed out from the heap instead
+  };
+
+  // Process-wide pool. Configured from QUICFTP_BUFFER_POOL_MAX (bytes) and
+  // QUICFTP_HUGE_PAGES=1 on first use.
+  static BufferPool& instance();
+
+  explicit BufferPool(const Config& config);
+  ~BufferPool();
+
+  BufferPool(const BufferPool&) = delete;
+  BufferPool& operator=(const BufferPool&) = delete;
+
+  // A buffer with room for size bytes (the pool's buffer size by default),
+  // its size() set to that. Never fails: beyond the cap, or for larger
+  // requests, the buffer comes from the heap and is freed on release.
+  BufferRef acquire(size_t size = 0);
+
+  size_t buffer_size() const { return config_.buffer_size; }
+
+  // Index of the slab holding all of [data, data + len), for handing slabs
+  // to the kernel as fixed I/O buffers. False for heap buffers.
+  bool find_slab(const void* data, size_t len, size_t& index) const;
+
+  // Memory of slab index; slabs stay mapped for the life of the pool
+  bool slab_region(size_t index, void*& base, size_t& bytes) const;
+
+  Stats stats() const;
+
+  // Buffers in use and their memory, read without the lock so monitoring
+  // never holds up the data path; may trail stats() by an update
+  struct Usage {
+    size_t buffers_in_use = 0;
+    size_t buffers_total = 0;
+    size_t slab_bytes = 0;
+    uint64_t fallback_allocations = 0;
+  };
+  Usage usage() const;
+
+private:
+  friend class BufferRef;
+  struct Slab;
+
+  Config config_;
+  mutable std::mutex mutex_;
+  std::vector<Slab> slabs_;
+  std::vector<BufferRef::Block*> free_;
+  Stats stats_;
+  // Copies of stats_ fields for usage(), stored under mutex_
+  std::atomic<size_t> in_use_{0};
+  std::atomic<size_t> total_{0};
+  std::atomic<size_t> slab_bytes_{0};
+  std::atomic<uint64_t> fallbacks_{0};
+
+  // Refresh the copies (caller holds mutex_)
+  void publish_usage();
+
+  bool grow();
+  void release(BufferRef::Block* block);
+};
+
+} // namespace quicftp
+
+#endif
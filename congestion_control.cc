@@ -0,0 +1,499 @@
+// congestion_control.cc
+
+#include "congestion_control.h"
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <utility>
+
+namespace quicftp {
+
+namespace {
+
+using Clock = CongestionController::Clock;
+
+constexpr size_t kInitialWindowPackets = 10;
+constexpr size_t kMinimumWindowPackets = 2;
+
+// Loss-based windows stop growing here; far beyond any receive window
+constexpr size_t kMaxWindow = 256 * 1024 * 1024;
+
+// Pacing for window-based control: the window over one smoothed RTT, with
+// headroom so pacing never holds the window back (RFC 9002 section 7.7)
+constexpr double kSlowStartPacingGain = 2.0;
+constexpr double kPacingGain = 1.25;
+
+// Cubic (RFC 9438)
+constexpr double kCubicC = 0.4;
+constexpr double kCubicBeta = 0.7;
+
+// BBR
+constexpr double kStartupGain = 2.77; // 2/ln 2: doubles the rate every round
+constexpr double kDrainGain = 1.0 / kStartupGain;
+constexpr double kProbeBwCwndGain = 2.0;
+constexpr double kProbeBwGains[] = {1.25, 0.75, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0};
+constexpr size_t kProbeBwPhases = sizeof(kProbeBwGains) / sizeof(kProbeBwGains[0]);
+constexpr uint64_t kBwWindowRounds = 10;
+constexpr auto kMinRttWindow = std::chrono::seconds(10);
+constexpr auto kProbeRttDuration = std::chrono::milliseconds(200);
+constexpr size_t kProbeRttWindowPackets = 4;
+constexpr double kFullBwGrowth = 1.25;
+constexpr int kFullBwRounds = 3;
+// A round losing more than this share of its packets caps what is kept in
+// flight at kLossBeta of what was in flight when loss struck
+constexpr double kLossThreshold = 0.02;
+constexpr double kLossBeta = 0.7;
+
+double seconds(Clock::duration d) {
+  return std::chrono::duration<double>(d).count();
+}
+
+double window_pacing_rate(size_t cwnd, double gain, const CongestionController::Rtt& rtt) {
+  double srtt = std::max(seconds(rtt.smoothed), 1e-6);
+  return gain * static_cast<double>(cwnd) / srtt;
+}
+
+// Whether the window held the sender back before this ACK, so growing it
+// can help (RFC 9002 section 7.8)
+bool window_limited(const CongestionController::Ack& ack, size_t cwnd) {
+  return !ack.app_limited && ack.bytes_in_flight + ack.bytes_acked >= cwnd / 2;
+}
+
+// Slow start, then one packet more per window acknowledged; halve on loss
+class NewReno : public CongestionController {
+public:
+  explicit NewReno(size_t mss)
+    : mss_(mss)
+    , cwnd_(kInitialWindowPackets * mss)
+    , ssthresh_(SIZE_MAX)
+    , acked_in_window_(0)
+  {
+  }
+
+  void on_packet_sent(Clock::time_point, size_t, size_t) override {}
+
+  void on_ack(const Ack& ack, const Rtt&) override {
+    // Packets sent before the last loss was noticed say nothing new, and a
+    // sender that left the window half empty has not tested it
+    if (ack.largest_sent_at <= recovery_start_ || !window_limited(ack, cwnd_)) {
+      return;
+    }
+    if (cwnd_ < ssthresh_) {
+      cwnd_ += ack.bytes_acked;
+    } else {
+      acked_in_window_ += ack.bytes_acked;
+      if (acked_in_window_ >= cwnd_) {
+        acked_in_window_ -= cwnd_;
+        cwnd_ += mss_;
+      }
+    }
+    cwnd_ = std::min(cwnd_, kMaxWindow);
+  }
+
+  void on_loss(const Loss& loss, const Rtt&) override {
+    // One reduction per window of losses
+    if (loss.largest_sent_at > recovery_start_) {
+      recovery_start_ = loss.now;
+      ssthresh_ = std::max(cwnd_ / 2, kMinimumWindowPackets * mss_);
+      cwnd_ = ssthresh_;
+      acked_in_window_ = 0;
+    }
+    if (loss.persistent_congestion) {
+      cwnd_ = kMinimumWindowPackets * mss_;
+    }
+  }
+
+  size_t congestion_window() const override { return cwnd_; }
+
+  double pacing_rate(const Rtt& rtt) const override {
+    return window_pacing_rate(cwnd_, cwnd_ < ssthresh_ ? kSlowStartPacingGain : kPacingGain, rtt);
+  }
+
+  const char* name() const override { return "newreno"; }
+
+private:
+  size_t mss_;
+  size_t cwnd_;
+  size_t ssthresh_;
+  size_t acked_in_window_;
+  Clock::time_point recovery_start_;
+};
+
+// Grows along a cubic curve in time since the last loss, flattening out near
+// the window where that loss happened, so it regains a large window in a few
+// seconds whatever the RTT
+class Cubic : public CongestionController {
+public:
+  explicit Cubic(size_t mss)
+    : mss_(mss)
+    , cwnd_(kInitialWindowPackets * mss)
+    , ssthresh_(SIZE_MAX)
+    , w_max_(0)
+    , w_est_(0)
+    , k_(0)
+    , in_epoch_(false)
+  {
+  }
+
+  void on_packet_sent(Clock::time_point, size_t, size_t) override {}
+
+  void on_ack(const Ack& ack, const Rtt& rtt) override {
+    if (ack.largest_sent_at <= recovery_start_ || !window_limited(ack, cwnd_)) {
+      return;
+    }
+    if (cwnd_ < ssthresh_) {
+      cwnd_ = std::min(cwnd_ + ack.bytes_acked, kMaxWindow);
+      return;
+    }
+
+    double mss = static_cast<double>(mss_);
+    double cwnd = static_cast<double>(cwnd_);
+    if (!in_epoch_) {
+      in_epoch_ = true;
+      epoch_start_ = ack.now;
+      if (cwnd < w_max_) {
+        k_ = std::cbrt((w_max_ - cwnd) / mss / kCubicC);
+      } else {
+        k_ = 0;
+        w_max_ = cwnd;
+      }
+      w_est_ = cwnd;
+    }
+
+    // Where the curve will be an RTT from now, limited to 1.5x per RTT
+    double t = seconds(ack.now - epoch_start_) + seconds(rtt.smoothed);
+    double target = w_max_ + kCubicC * std::pow(t - k_, 3) * mss;
+    target = std::clamp(target, cwnd, 1.5 * cwnd);
+
+    // What Reno would have reached; Cubic never does worse
+    constexpr double kRenoAlpha = 3.0 * (1.0 - kCubicBeta) / (1.0 + kCubicBeta);
+    w_est_ += kRenoAlpha * mss * static_cast<double>(ack.bytes_acked) / cwnd;
+
+    double next = (w_est_ > target) ? w_est_
+                                    : cwnd + (target - cwnd) * static_cast<double>(ack.bytes_acked) / cwnd;
+    cwnd_ = std::min(static_cast<size_t>(next), kMaxWindow);
+  }
+
+  void on_loss(const Loss& loss, const Rtt&) override {
+    if (loss.largest_sent_at > recovery_start_) {
+      recovery_start_ = loss.now;
+      double cwnd = static_cast<double>(cwnd_);
+      // Fast convergence: give way to newer flows when losing ground
+      w_max_ = (cwnd < w_max_) ? cwnd * (1.0 + kCubicBeta) / 2.0 : cwnd;
+      ssthresh_ = std::max(static_cast<size_t>(cwnd * kCubicBeta), kMinimumWindowPackets * mss_);
+      cwnd_ = ssthresh_;
+      in_epoch_ = false;
+    }
+    if (loss.persistent_congestion) {
+      // Start over from the minimum window; slow start climbs back to ssthresh
+      cwnd_ = kMinimumWindowPackets * mss_;
+      in_epoch_ = false;
+    }
+  }
+
+  size_t congestion_window() const override { return cwnd_; }
+
+  double pacing_rate(const Rtt& rtt) const override {
+    return window_pacing_rate(cwnd_, cwnd_ < ssthresh_ ? kSlowStartPacingGain : kPacingGain, rtt);
+  }
+
+  const char* name() const override { return "cubic"; }
+
+private:
+  size_t mss_;
+  size_t cwnd_;
+  size_t ssthresh_;
+  double w_max_;  // window at the last loss, bytes
+  double w_est_;  // Reno-friendly estimate, bytes
+  double k_;      // seconds from epoch start to regain w_max_
+  bool in_epoch_;
+  Clock::time_point epoch_start_;
+  Clock::time_point recovery_start_;
+};
+
+// Paces at the bottleneck bandwidth seen over the last few rounds and keeps
+// about two bandwidth-delay products in flight. Startup doubles the rate each
+// round until it stops paying off; ProbeBw then cycles a round above the
+// estimate and one below it; every 10 seconds ProbeRtt drains the queue to
+// measure the minimum RTT afresh. Like BBRv2, a round with heavy loss caps
+// what is in flight (inflight_hi_), and loss-free probing raises the cap.
+class Bbr : public CongestionController {
+public:
+  explicit Bbr(size_t mss)
+    : mss_(mss)
+    , state_(State::Startup)
+    , pacing_gain_(kStartupGain)
+    , cwnd_gain_(kStartupGain)
+    , cwnd_(kInitialWindowPackets * mss)
+    , prior_cwnd_(0)
+    , inflight_hi_(SIZE_MAX)
+    , round_(0)
+    , next_round_delivered_(0)
+    , round_delivered_start_(0)
+    , lost_in_round_(0)
+    , inflight_at_loss_(0)
+    , min_rtt_(Clock::duration::max())
+    , full_bw_(0)
+    , full_bw_rounds_(0)
+    , filled_pipe_(false)
+    , cycle_index_(0)
+    , probe_rtt_round_(0)
+    , probe_rtt_started_(false)
+  {
+  }
+
+  void on_packet_sent(Clock::time_point, size_t, size_t) override {}
+
+  void on_ack(const Ack& ack, const Rtt& rtt) override {
+    // A round ends once a packet sent after it began is acknowledged
+    bool round_start = false;
+    if (ack.prior_delivered >= next_round_delivered_) {
+      next_round_delivered_ = ack.delivered;
+      round_++;
+      round_start = true;
+    }
+    update_bandwidth(ack);
+
+    bool min_rtt_expired = min_rtt_ != Clock::duration::max() && ack.now > min_rtt_stamp_ + kMinRttWindow;
+    if (rtt.latest < min_rtt_ || min_rtt_expired) {
+      min_rtt_ = rtt.latest;
+      min_rtt_stamp_ = ack.now;
+    }
+
+    if (round_start) {
+      end_round(ack);
+    }
+
+    switch (state_) {
+      case State::Startup:
+        if (filled_pipe_) {
+          state_ = State::Drain;
+          pacing_gain_ = kDrainGain;
+          cwnd_gain_ = kStartupGain;
+        }
+        break;
+      case State::Drain:
+        if (ack.bytes_in_flight <= bdp(1.0)) {
+          enter_probe_bw(ack.now);
+        }
+        break;
+      case State::ProbeBw:
+        advance_cycle(ack);
+        break;
+      case State::ProbeRtt:
+        handle_probe_rtt(ack);
+        break;
+    }
+
+    if (state_ != State::ProbeRtt && min_rtt_expired) {
+      state_ = State::ProbeRtt;
+      pacing_gain_ = 1.0;
+      cwnd_gain_ = 1.0;
+      prior_cwnd_ = cwnd_;
+      probe_rtt_started_ = false;
+    }
+
+    update_window(ack);
+  }
+
+  void on_loss(const Loss& loss, const Rtt&) override {
+    lost_in_round_ += loss.bytes_lost;
+    inflight_at_loss_ = std::max(inflight_at_loss_, loss.bytes_in_flight + loss.bytes_lost);
+  }
+
+  size_t congestion_window() const override { return cwnd_; }
+
+  double pacing_rate(const Rtt& rtt) const override {
+    double bw = max_bw();
+    if (bw <= 0) {
+      return window_pacing_rate(cwnd_, kStartupGain, rtt);
+    }
+    return pacing_gain_ * bw;
+  }
+
+  const char* name() const override { return "bbr"; }
+
+private:
+  enum class State { Startup, Drain, ProbeBw, ProbeRtt };
+
+  size_t mss_;
+  State state_;
+  double pacing_gain_;
+  double cwnd_gain_;
+  size_t cwnd_;
+  size_t prior_cwnd_;  // restored after ProbeRtt
+  size_t inflight_hi_; // loss-learned cap on bytes in flight
+
+  uint64_t round_;
+  uint64_t next_round_delivered_;
+  uint64_t round_delivered_start_;
+  uint64_t lost_in_round_;
+  size_t inflight_at_loss_;
+
+  // Windowed max of delivery rate samples: (round, bytes/s), rates falling
+  std::deque<std::pair<uint64_t, double>> bw_samples_;
+  Clock::duration min_rtt_;
+  Clock::time_point min_rtt_stamp_;
+
+  double full_bw_;
+  int full_bw_rounds_;
+  bool filled_pipe_;
+
+  size_t cycle_index_;
+  Clock::time_point cycle_stamp_;
+
+  uint64_t probe_rtt_round_;
+  bool probe_rtt_started_;
+  Clock::time_point probe_rtt_done_;
+
+  double max_bw() const {
+    return bw_samples_.empty() ? 0 : bw_samples_.front().second;
+  }
+
+  size_t bdp(double gain) const {
+    double bw = max_bw();
+    if (bw <= 0 || min_rtt_ == Clock::duration::max()) {
+      return kInitialWindowPackets * mss_;
+    }
+    return static_cast<size_t>(gain * bw * seconds(min_rtt_));
+  }
+
+  void update_bandwidth(const Ack& ack) {
+    double rate = ack.delivery_rate;
+    // An idle sender's samples only show what it offered, unless they beat
+    // the estimate anyway
+    if (rate <= 0 || (ack.app_limited && rate < max_bw())) {
+      return;
+    }
+    while (!bw_samples_.empty() && bw_samples_.back().second <= rate) {
+      bw_samples_.pop_back();
+    }
+    bw_samples_.emplace_back(round_, rate);
+    while (bw_samples_.front().first + kBwWindowRounds <= round_) {
+      bw_samples_.pop_front();
+    }
+  }
+
+  void end_round(const Ack& ack) {
+    uint64_t delivered = ack.delivered - round_delivered_start_;
+    if (lost_in_round_ > kLossThreshold * static_cast<double>(delivered + lost_in_round_)) {
+      inflight_hi_ = std::max({static_cast<size_t>(kLossBeta * static_cast<double>(inflight_at_loss_)), bdp(1.0),
+                               kProbeRttWindowPackets * mss_});
+      filled_pipe_ = true; // loss ends Startup as surely as a flat rate
+    } else if (state_ == State::ProbeBw && pacing_gain_ > 1.0 && inflight_hi_ != SIZE_MAX) {
+      inflight_hi_ += inflight_hi_ / 4;
+    }
+    lost_in_round_ = 0;
+    inflight_at_loss_ = 0;
+    round_delivered_start_ = ack.delivered;
+
+    if (!filled_pipe_ && !ack.app_limited) {
+      if (max_bw() >= full_bw_ * kFullBwGrowth) {
+        full_bw_ = max_bw();
+        full_bw_rounds_ = 0;
+      } else if (++full_bw_rounds_ >= kFullBwRounds) {
+        filled_pipe_ = true;
+      }
+    }
+  }
+
+  void enter_probe_bw(Clock::time_point now) {
+    state_ = State::ProbeBw;
+    cwnd_gain_ = kProbeBwCwndGain;
+    // Start anywhere but the drain phase, so flows do not probe in step
+    cycle_index_ = 2 + static_cast<size_t>(round_ % (kProbeBwPhases - 2));
+    cycle_stamp_ = now;
+    pacing_gain_ = kProbeBwGains[cycle_index_];
+  }
+
+  void advance_cycle(const Ack& ack) {
+    bool full_length = ack.now - cycle_stamp_ > min_rtt_;
+    bool done = full_length;
+    if (pacing_gain_ < 1.0) {
+      done = full_length || ack.bytes_in_flight <= bdp(1.0); // queue drained early
+    }
+    if (done) {
+      cycle_index_ = (cycle_index_ + 1) % kProbeBwPhases;
+      cycle_stamp_ = ack.now;
+      pacing_gain_ = kProbeBwGains[cycle_index_];
+    }
+  }
+
+  void handle_probe_rtt(const Ack& ack) {
+    size_t floor = kProbeRttWindowPackets * mss_;
+    if (!probe_rtt_started_) {
+      if (ack.bytes_in_flight <= floor) {
+        probe_rtt_started_ = true;
+        probe_rtt_done_ = ack.now + kProbeRttDuration;
+        probe_rtt_round_ = round_;
+      }
+      return;
+    }
+    if (round_ > probe_rtt_round_ && ack.now >= probe_rtt_done_) {
+      min_rtt_stamp_ = ack.now;
+      cwnd_ = std::max(cwnd_, prior_cwnd_);
+      if (filled_pipe_) {
+        enter_probe_bw(ack.now);
+      } else {
+        state_ = State::Startup;
+        pacing_gain_ = kStartupGain;
+        cwnd_gain_ = kStartupGain;
+      }
+    }
+  }
+
+  void update_window(const Ack& ack) {
+    // Quantum of slack so a delayed ACK does not stall the sender
+    size_t target = bdp(cwnd_gain_) + 3 * mss_;
+    if (filled_pipe_) {
+      cwnd_ = std::min(cwnd_ + ack.bytes_acked, target);
+    } else if (cwnd_ < target || ack.delivered < kInitialWindowPackets * mss_) {
+      cwnd_ += ack.bytes_acked;
+    }
+    cwnd_ = std::max(cwnd_, kProbeRttWindowPackets * mss_);
+    cwnd_ = std::min(cwnd_, inflight_hi_);
+    if (state_ == State::ProbeRtt) {
+      cwnd_ = std::min(cwnd_, kProbeRttWindowPackets * mss_);
+    }
+  }
+};
+
+} // namespace
+
+bool parse_congestion_algorithm(const std::string& text, CongestionAlgorithm& algorithm) {
+  if (text == "newreno") {
+    algorithm = CongestionAlgorithm::NewReno;
+  } else if (text == "cubic") {
+    algorithm = CongestionAlgorithm::Cubic;
+  } else if (text == "bbr") {
+    algorithm = CongestionAlgorithm::Bbr;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+const char* congestion_algorithm_name(CongestionAlgorithm algorithm) {
+  switch (algorithm) {
+    case CongestionAlgorithm::NewReno:
+      return "newreno";
+    case CongestionAlgorithm::Bbr:
+      return "bbr";
+    default:
+      return "cubic";
+  }
+}
+
+std::unique_ptr<CongestionController> CongestionController::create(CongestionAlgorithm algorithm,
+                                                                   size_t max_datagram_size) {
+  switch (algorithm) {
+    case CongestionAlgorithm::NewReno:
+      return std::make_unique<NewReno>(max_datagram_size);
+    case CongestionAlgorithm::Bbr:
+      return std::make_unique<Bbr>(max_datagram_size);
+    default:
+      return std::make_unique<Cubic>(max_datagram_size);
+  }
+}
+
+} // namespace quicftp
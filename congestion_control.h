@@ -0,0 +1,83 @@
+// congestion_control.h
+// Congestion controllers for the UDP transport
+// A controller sees every packet sent, every acknowledgement and every loss
+// of one connection, and answers how many bytes may be in flight and how
+// fast they should leave. NewReno and Cubic (RFC 9438) size a window from
+// losses; the BBR-style controller models the path's bottleneck bandwidth and
+// minimum RTT instead, and treats loss only as a cap on how much it keeps in
+// flight, so a little random loss on a long fat pipe does not halve its rate.
+
+#ifndef CONGESTION_CONTROL_H
+#define CONGESTION_CONTROL_H
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+namespace quicftp {
+
+enum class CongestionAlgorithm {
+  NewReno,
+  Cubic, // the default
+  Bbr
+};
+
+// "newreno", "cubic" or "bbr"
+bool parse_congestion_algorithm(const std::string& text, CongestionAlgorithm& algorithm);
+const char* congestion_algorithm_name(CongestionAlgorithm algorithm);
+
+class CongestionController {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  // The connection's RTT estimate (RFC 9002 section 5)
+  struct Rtt {
+    Clock::duration smoothed;
+    Clock::duration min;
+    Clock::duration latest;
+  };
+
+  // One ACK frame's worth of newly acknowledged packets
+  struct Ack {
+    Clock::time_point now;
+    size_t bytes_acked = 0;
+    size_t bytes_in_flight = 0;        // after these left flight
+    Clock::time_point largest_sent_at; // send time of the newest packet acked
+    uint64_t delivered = 0;            // bytes acked on the connection so far
+    uint64_t prior_delivered = 0;      // what delivered was when that packet went
+    double delivery_rate = 0;          // bytes per second over its flight; 0 if unknown
+    bool app_limited = false;          // it went while the sender had nothing more to send
+  };
+
+  // Packets declared lost together
+  struct Loss {
+    Clock::time_point now;
+    size_t bytes_lost = 0;
+    size_t bytes_in_flight = 0;        // after these left flight
+    Clock::time_point largest_sent_at; // send time of the newest packet lost
+    bool persistent_congestion = false; // they span several PTOs with nothing acked between
+  };
+
+  // A controller for packets of at most max_datagram_size bytes
+  static std::unique_ptr<CongestionController> create(CongestionAlgorithm algorithm, size_t max_datagram_size);
+
+  virtual ~CongestionController() = default;
+
+  virtual void on_packet_sent(Clock::time_point now, size_t bytes, size_t bytes_in_flight) = 0;
+  virtual void on_ack(const Ack& ack, const Rtt& rtt) = 0;
+  virtual void on_loss(const Loss& loss, const Rtt& rtt) = 0;
+
+  // Bytes that may be unacknowledged at once
+  virtual size_t congestion_window() const = 0;
+
+  // Bytes per second to pace packets at
+  virtual double pacing_rate(const Rtt& rtt) const = 0;
+
+  virtual const char* name() const = 0;
+};
+
+} // namespace quicftp
+
+#endif
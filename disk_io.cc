@@ -0,0 +1,727 @@
+// disk_io.cc
+
+#include "disk_io.h"
+#include "buffer_pool.h"
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <thread>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define QUICFTP_HAVE_IO_URING 1
+#endif
+
+namespace quicftp {
+
+namespace {
+
+constexpr size_t kMaxQueueDepth = 4096;
+
+// Threads serving a queue when io_uring is unavailable
+constexpr size_t kMaxPoolThreads = 4;
+
+// Sizes of the sparse fixed file and buffer tables of each ring
+constexpr unsigned kMaxFixedFiles = 1024;
+constexpr unsigned kMaxFixedBuffers = 64;
+
+DiskIo::Config config_from_env() {
+  DiskIo::Config config;
+  if (const char* env = std::getenv("QUICFTP_IO_DEPTH")) {
+    // "64" or "64,259:0=256,8:16=32"
+    std::string spec = env;
+    size_t start = 0;
+    while (start <= spec.size()) {
+      size_t comma = spec.find(',', start);
+      std::string item = spec.substr(start, comma == std::string::npos ? std::string::npos : comma - start);
+      unsigned major_id, minor_id;
+      size_t depth;
+      if (std::sscanf(item.c_str(), "%u:%u=%zu", &major_id, &minor_id, &depth) == 3 && depth > 0) {
+        config.device_depths[makedev(major_id, minor_id)] = depth;
+      } else if (std::sscanf(item.c_str(), "%zu", &depth) == 1 && depth > 0) {
+        config.queue_depth = depth;
+      }
+      if (comma == std::string::npos) break;
+      start = comma + 1;
+    }
+  }
+  if (const char* env = std::getenv("QUICFTP_IO_BACKEND")) {
+    config.use_uring = std::strcmp(env, "threads") != 0;
+  }
+  return config;
+}
+
+} // namespace
+
+// One kernel operation. A request is split into several when its buffers
+// are written as separate fixed-buffer operations; they share a Group.
+struct DiskQueue::Op {
+  enum class Kind { Writev, WriteFixed, Read, Fsync };
+
+  struct Group {
+    std::atomic<size_t> remaining{0};
+    std::atomic<ssize_t> bytes{0};
+    std::atomic<int> error{0};
+    Completion done;
+  };
+
+  Kind kind = Kind::Writev;
+  int fd = -1;
+  uint64_t offset = 0;
+  std::vector<struct iovec> iov; // what is left to transfer, from iov_first
+  size_t iov_first = 0;
+  uint16_t buf_index = 0;        // WriteFixed: registered slab
+  bool data_only = false;        // Fsync
+  size_t transferred = 0;
+  std::shared_ptr<Group> group;
+
+  bool is_write() const { return kind == Kind::Writev || kind == Kind::WriteFixed; }
+
+  // Step past n transferred bytes; returns the bytes still to go
+  size_t advance(size_t n) {
+    transferred += n;
+    offset += n;
+    size_t left = 0;
+    for (size_t i = iov_first; i < iov.size(); ++i) {
+      size_t step = std::min(n, iov[i].iov_len);
+      iov[i].iov_base = static_cast<uint8_t*>(iov[i].iov_base) + step;
+      iov[i].iov_len -= step;
+      n -= step;
+      left += iov[i].iov_len;
+    }
+    while (iov_first < iov.size() && iov[iov_first].iov_len == 0) {
+      ++iov_first;
+    }
+    return left;
+  }
+};
+
+struct DiskQueue::Backend {
+  explicit Backend(DiskQueue* queue) : queue_(queue) {}
+  virtual ~Backend() = default;
+
+  virtual const char* name() const = 0;
+  // Start op, which completes through queue_->complete(); true if it went
+  // through a registered file
+  virtual bool submit(Op* op) = 0;
+
+  // Registered buffer covering [data, data + len), if the backend has them
+  virtual bool fixed_buffer(const void*, size_t, uint16_t&) { return false; }
+  virtual bool register_file(int) { return false; }
+  virtual void unregister_file(int) {}
+
+protected:
+  DiskQueue* queue_;
+};
+
+// Blocking calls on a few threads; each op takes one thread for its duration
+struct DiskQueue::ThreadBackend : Backend {
+  ThreadBackend(DiskQueue* queue, size_t threads) : Backend(queue) {
+    for (size_t i = 0; i < threads; ++i) {
+      threads_.emplace_back([this]() { run(); });
+    }
+  }
+
+  ~ThreadBackend() override {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    cv_.notify_all();
+    for (std::thread& thread : threads_) {
+      thread.join();
+    }
+  }
+
+  const char* name() const override { return "threads"; }
+
+  bool submit(Op* op) override {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      ops_.push_back(op);
+    }
+    cv_.notify_one();
+    return false;
+  }
+
+private:
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<Op*> ops_;
+  bool stopping_ = false;
+  std::vector<std::thread> threads_;
+
+  void run() {
+    while (true) {
+      Op* op;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this]() { return stopping_ || !ops_.empty(); });
+        if (ops_.empty()) {
+          return;
+        }
+        op = ops_.front();
+        ops_.pop_front();
+      }
+      queue_->complete(op, perform(*op));
+    }
+  }
+
+  static ssize_t perform(const Op& op) {
+    while (true) {
+      ssize_t rc = 0;
+      switch (op.kind) {
+        case Op::Kind::Writev:
+        case Op::Kind::WriteFixed:
+          rc = pwritev(op.fd, op.iov.data() + op.iov_first, static_cast<int>(op.iov.size() - op.iov_first),
+                       static_cast<off_t>(op.offset));
+          break;
+        case Op::Kind::Read:
+          rc = pread(op.fd, op.iov[0].iov_base, op.iov[0].iov_len, static_cast<off_t>(op.offset));
+          break;
+        case Op::Kind::Fsync:
+          rc = op.data_only ? fdatasync(op.fd) : ::fsync(op.fd);
+          break;
+      }
+      if (rc >= 0) return rc;
+      if (errno != EINTR) return -errno;
+    }
+  }
+};
+
+#ifdef QUICFTP_HAVE_IO_URING
+
+// io_uring without liburing: the rings are mapped by hand and driven with
+// io_uring_enter. Submitters share the submission queue under a mutex; one
+// thread reaps completions.
+struct DiskQueue::UringBackend : Backend {
+  explicit UringBackend(DiskQueue* queue) : Backend(queue) {}
+
+  ~UringBackend() override {
+    if (reaper_.joinable()) {
+      running_ = false;
+      // A no-op completion wakes the reaper to notice
+      push(nullptr);
+      reaper_.join();
+    }
+    if (sqes_) munmap(sqes_, sqes_bytes_);
+    if (cq_ptr_ && cq_ptr_ != sq_ptr_) munmap(cq_ptr_, cq_bytes_);
+    if (sq_ptr_) munmap(sq_ptr_, sq_bytes_);
+    if (ring_fd_ >= 0) close(ring_fd_);
+  }
+
+  bool open(unsigned entries) {
+    struct io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    ring_fd_ = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+    if (ring_fd_ < 0) {
+      // ENOSYS, or EPERM where io_uring is disabled
+      return false;
+    }
+
+    sq_bytes_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_bytes_ = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+      sq_bytes_ = cq_bytes_ = std::max(sq_bytes_, cq_bytes_);
+    }
+    void* sq = mmap(nullptr, sq_bytes_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_,
+                    IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+      return false;
+    }
+    sq_ptr_ = sq;
+    if (single_mmap) {
+      cq_ptr_ = sq_ptr_;
+    } else {
+      void* cq = mmap(nullptr, cq_bytes_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_,
+                      IORING_OFF_CQ_RING);
+      if (cq == MAP_FAILED) {
+        return false;
+      }
+      cq_ptr_ = cq;
+    }
+    sqes_bytes_ = params.sq_entries * sizeof(struct io_uring_sqe);
+    void* sqes = mmap(nullptr, sqes_bytes_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_,
+                      IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+      return false;
+    }
+    sqes_ = static_cast<struct io_uring_sqe*>(sqes);
+
+    uint8_t* sq_base = static_cast<uint8_t*>(sq_ptr_);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq_base + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned*>(sq_base + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned*>(sq_base + params.sq_off.array);
+    uint8_t* cq_base = static_cast<uint8_t*>(cq_ptr_);
+    cq_head_ = reinterpret_cast<unsigned*>(cq_base + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq_base + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned*>(cq_base + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<struct io_uring_cqe*>(cq_base + params.cq_off.cqes);
+
+    // Empty tables, filled in as files are opened and slabs first written from.
+    // Both are optional; without them operations name fds and plain memory.
+    std::vector<int> no_files(kMaxFixedFiles, -1);
+    files_registered_ = syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_FILES, no_files.data(),
+                                kMaxFixedFiles) == 0;
+    file_slots_.assign(files_registered_ ? kMaxFixedFiles : 0, -1);
+#ifdef IORING_RSRC_REGISTER_SPARSE
+    struct io_uring_rsrc_register buffers;
+    std::memset(&buffers, 0, sizeof(buffers));
+    buffers.nr = kMaxFixedBuffers;
+    buffers.flags = IORING_RSRC_REGISTER_SPARSE;
+    buffers_registered_ = syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_BUFFERS2, &buffers,
+                                  sizeof(buffers)) == 0;
+#endif
+    buffer_state_.assign(kMaxFixedBuffers, SlabState::Unknown);
+
+    running_ = true;
+    reaper_ = std::thread([this]() { reap(); });
+    return true;
+  }
+
+  const char* name() const override { return "io_uring"; }
+
+  bool submit(Op* op) override {
+    return push(op);
+  }
+
+  bool fixed_buffer(const void* data, size_t len, uint16_t& index) override {
+    if (!buffers_registered_) {
+      return false;
+    }
+    size_t slab;
+    if (!BufferPool::instance().find_slab(data, len, slab) || slab >= kMaxFixedBuffers) {
+      return false;
+    }
+    std::lock_guard<std::mutex> lock(buffers_mutex_);
+    if (buffer_state_[slab] == SlabState::Unknown) {
+      buffer_state_[slab] = register_slab(slab) ? SlabState::Registered : SlabState::Unregistrable;
+    }
+    index = static_cast<uint16_t>(slab);
+    return buffer_state_[slab] == SlabState::Registered;
+  }
+
+  bool register_file(int fd) override {
+    std::lock_guard<std::mutex> lock(files_mutex_);
+    if (!files_registered_ || file_index_.count(fd) > 0) {
+      return false;
+    }
+    auto free_slot = std::find(file_slots_.begin(), file_slots_.end(), -1);
+    if (free_slot == file_slots_.end()) {
+      return false;
+    }
+    unsigned slot = static_cast<unsigned>(free_slot - file_slots_.begin());
+    if (!update_file(slot, fd)) {
+      return false;
+    }
+    file_slots_[slot] = fd;
+    file_index_[fd] = slot;
+    return true;
+  }
+
+  void unregister_file(int fd) override {
+    std::lock_guard<std::mutex> lock(files_mutex_);
+    auto it = file_index_.find(fd);
+    if (it == file_index_.end()) {
+      return;
+    }
+    update_file(it->second, -1);
+    file_slots_[it->second] = -1;
+    file_index_.erase(it);
+  }
+
+private:
+  enum class SlabState { Unknown, Registered, Unregistrable };
+
+  int ring_fd_ = -1;
+  void* sq_ptr_ = nullptr;
+  void* cq_ptr_ = nullptr;
+  size_t sq_bytes_ = 0;
+  size_t cq_bytes_ = 0;
+  size_t sqes_bytes_ = 0;
+  unsigned* sq_tail_ = nullptr;
+  unsigned sq_mask_ = 0;
+  unsigned* sq_array_ = nullptr;
+  struct io_uring_sqe* sqes_ = nullptr;
+  unsigned* cq_head_ = nullptr;
+  unsigned* cq_tail_ = nullptr;
+  unsigned cq_mask_ = 0;
+  struct io_uring_cqe* cqes_ = nullptr;
+
+  std::mutex sq_mutex_;
+  std::thread reaper_;
+  std::atomic<bool> running_{false};
+
+  std::mutex files_mutex_;
+  bool files_registered_ = false;
+  std::vector<int> file_slots_;
+  std::map<int, unsigned> file_index_;
+
+  std::mutex buffers_mutex_;
+  bool buffers_registered_ = false;
+  std::vector<SlabState> buffer_state_;
+
+  bool update_file(unsigned slot, int fd) {
+    struct io_uring_rsrc_update update;
+    std::memset(&update, 0, sizeof(update));
+    update.offset = slot;
+    update.data = reinterpret_cast<uint64_t>(&fd);
+    return syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_FILES_UPDATE, &update, 1) == 1;
+  }
+
+  bool register_slab(size_t slab) {
+#ifdef IORING_RSRC_REGISTER_SPARSE
+    struct iovec region;
+    if (!BufferPool::instance().slab_region(slab, region.iov_base, region.iov_len)) {
+      return false;
+    }
+    struct io_uring_rsrc_update2 update;
+    std::memset(&update, 0, sizeof(update));
+    update.offset = static_cast<uint32_t>(slab);
+    update.data = reinterpret_cast<uint64_t>(&region);
+    update.nr = 1;
+    // Fails where the pinned slab would exceed RLIMIT_MEMLOCK
+    return syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_BUFFERS_UPDATE, &update,
+                   sizeof(update)) == 1;
+#else
+    (void)slab;
+    return false;
+#endif
+  }
+
+  // Queue op (a wakeup no-op if null) and hand it to the kernel; true if
+  // it names a registered file
+  bool push(Op* op) {
+    std::lock_guard<std::mutex> lock(sq_mutex_);
+    unsigned tail = *sq_tail_;
+    unsigned index = tail & sq_mask_;
+    struct io_uring_sqe* sqe = &sqes_[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = reinterpret_cast<uint64_t>(op);
+    if (!op) {
+      sqe->opcode = IORING_OP_NOP;
+    } else {
+      fill(sqe, *op);
+    }
+    bool fixed_file = sqe->flags & IOSQE_FIXED_FILE;
+    sq_array_[index] = index;
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+
+    // Without SQPOLL the kernel consumes the entry inside this call, so the
+    // queue never holds more than the one just added
+    while (syscall(__NR_io_uring_enter, ring_fd_, 1, 0, 0, nullptr, 0) < 0) {
+      if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        break;
+      }
+      std::this_thread::yield();
+    }
+    return fixed_file;
+  }
+
+  void fill(struct io_uring_sqe* sqe, const Op& op) {
+    sqe->fd = op.fd;
+    {
+      std::lock_guard<std::mutex> lock(files_mutex_);
+      auto it = file_index_.find(op.fd);
+      if (it != file_index_.end()) {
+        sqe->fd = static_cast<int>(it->second);
+        sqe->flags |= IOSQE_FIXED_FILE;
+      }
+    }
+    sqe->off = op.offset;
+    switch (op.kind) {
+      case Op::Kind::Writev:
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->addr = reinterpret_cast<uint64_t>(op.iov.data() + op.iov_first);
+        sqe->len = static_cast<uint32_t>(op.iov.size() - op.iov_first);
+        break;
+      case Op::Kind::WriteFixed:
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->addr = reinterpret_cast<uint64_t>(op.iov[0].iov_base);
+        sqe->len = static_cast<uint32_t>(op.iov[0].iov_len);
+        sqe->buf_index = op.buf_index;
+        break;
+      case Op::Kind::Read:
+        sqe->opcode = IORING_OP_READV;
+        sqe->addr = reinterpret_cast<uint64_t>(op.iov.data());
+        sqe->len = 1;
+        break;
+      case Op::Kind::Fsync:
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fsync_flags = op.data_only ? IORING_FSYNC_DATASYNC : 0;
+        break;
+    }
+  }
+
+  void reap() {
+    while (true) {
+      unsigned head = *cq_head_;
+      if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+        syscall(__NR_io_uring_enter, ring_fd_, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+        continue;
+      }
+      const struct io_uring_cqe& cqe = cqes_[head & cq_mask_];
+      Op* op = reinterpret_cast<Op*>(cqe.user_data);
+      int result = cqe.res;
+      __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+      if (op) {
+        queue_->complete(op, result);
+      } else if (!running_) {
+        return;
+      }
+    }
+  }
+};
+
+#endif // QUICFTP_HAVE_IO_URING
+
+DiskQueue::DiskQueue(size_t depth, bool use_uring)
+  : depth_(std::clamp<size_t>(depth, 1, kMaxQueueDepth))
+  , in_flight_(0)
+{
+#ifdef QUICFTP_HAVE_IO_URING
+  if (use_uring) {
+    auto uring = std::make_unique<UringBackend>(this);
+    if (uring->open(static_cast<unsigned>(depth_))) {
+      backend_ = std::move(uring);
+    }
+  }
+#else
+  (void)use_uring;
+#endif
+  if (!backend_) {
+    backend_ = std::make_unique<ThreadBackend>(this, std::min(depth_, kMaxPoolThreads));
+  }
+  stats_.backend = backend_->name();
+  stats_.queue_depth = depth_;
+}
+
+DiskQueue::~DiskQueue() {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    room_cv_.wait(lock, [this]() { return in_flight_ == 0; });
+  }
+  backend_.reset();
+}
+
+bool DiskQueue::writev(int fd, uint64_t offset, const struct iovec* iov, int iovcnt, Completion done) {
+  if (fd < 0 || iovcnt <= 0) {
+    return false;
+  }
+  auto group = std::make_shared<Op::Group>();
+  group->done = std::move(done);
+
+  // Data entirely in registered pool slabs goes out as one fixed-buffer
+  // write per buffer, so the kernel skips pinning the pages each time
+  std::vector<uint16_t> indices(static_cast<size_t>(iovcnt));
+  bool fixed = static_cast<size_t>(iovcnt) <= depth_;
+  for (int i = 0; fixed && i < iovcnt; ++i) {
+    fixed = backend_->fixed_buffer(iov[i].iov_base, iov[i].iov_len, indices[i]);
+  }
+
+  std::vector<Op*> ops;
+  if (fixed) {
+    uint64_t pos = offset;
+    for (int i = 0; i < iovcnt; ++i) {
+      Op* op = new Op;
+      op->kind = Op::Kind::WriteFixed;
+      op->fd = fd;
+      op->offset = pos;
+      op->iov.assign(iov + i, iov + i + 1);
+      op->buf_index = indices[i];
+      op->group = group;
+      ops.push_back(op);
+      pos += iov[i].iov_len;
+    }
+  } else {
+    Op* op = new Op;
+    op->kind = Op::Kind::Writev;
+    op->fd = fd;
+    op->offset = offset;
+    op->iov.assign(iov, iov + iovcnt);
+    op->group = group;
+    ops.push_back(op);
+  }
+
+  group->remaining = ops.size();
+  reserve(ops.size());
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (fixed) {
+      stats_.fixed_buffer_ops += ops.size();
+    }
+  }
+  for (Op* op : ops) {
+    submit(op);
+  }
+  return true;
+}
+
+bool DiskQueue::read(int fd, uint64_t offset, void* buf, size_t len, Completion done) {
+  if (fd < 0) {
+    return false;
+  }
+  Op* op = new Op;
+  op->kind = Op::Kind::Read;
+  op->fd = fd;
+  op->offset = offset;
+  op->iov.push_back(iovec{buf, len});
+  op->group = std::make_shared<Op::Group>();
+  op->group->remaining = 1;
+  op->group->done = std::move(done);
+  reserve(1);
+  submit(op);
+  return true;
+}
+
+bool DiskQueue::fsync(int fd, bool data_only, Completion done) {
+  if (fd < 0) {
+    return false;
+  }
+  Op* op = new Op;
+  op->kind = Op::Kind::Fsync;
+  op->fd = fd;
+  op->data_only = data_only;
+  op->group = std::make_shared<Op::Group>();
+  op->group->remaining = 1;
+  op->group->done = std::move(done);
+  reserve(1);
+  submit(op);
+  return true;
+}
+
+void DiskQueue::register_file(int fd) {
+  if (fd >= 0) {
+    backend_->register_file(fd);
+  }
+}
+
+void DiskQueue::unregister_file(int fd) {
+  if (fd >= 0) {
+    backend_->unregister_file(fd);
+  }
+}
+
+DiskQueue::Stats DiskQueue::stats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Stats stats = stats_;
+  stats.in_flight = in_flight_;
+  return stats;
+}
+
+void DiskQueue::reserve(size_t count) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  // A request bigger than the whole queue still goes, alone
+  room_cv_.wait(lock, [this, count]() { return in_flight_ == 0 || in_flight_ + count <= depth_; });
+  in_flight_ += count;
+  stats_.peak_in_flight = std::max(stats_.peak_in_flight, in_flight_);
+}
+
+void DiskQueue::submit(Op* op) {
+  // op may be complete and gone as soon as the backend has it
+  bool fixed_file = backend_->submit(op);
+  std::lock_guard<std::mutex> lock(mutex_);
+  stats_.submitted++;
+  if (fixed_file) {
+    stats_.fixed_file_ops++;
+  }
+}
+
+void DiskQueue::complete(Op* op, ssize_t result) {
+  if (op->is_write() && result > 0) {
+    // Short write: carry on from where it stopped, in the same queue slot
+    if (op->advance(static_cast<size_t>(result)) > 0) {
+      submit(op);
+      return;
+    }
+  } else if (op->is_write() && result == 0) {
+    result = -EIO;
+  } else if (result > 0) {
+    op->transferred = static_cast<size_t>(result);
+  }
+
+  Op::Group& group = *op->group;
+  if (result < 0) {
+    int expected = 0;
+    group.error.compare_exchange_strong(expected, static_cast<int>(-result));
+  } else {
+    group.bytes += static_cast<ssize_t>(op->transferred);
+  }
+  std::shared_ptr<Op::Group> finished = (--group.remaining == 0) ? op->group : nullptr;
+  delete op;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    in_flight_--;
+    stats_.completed++;
+  }
+  room_cv_.notify_all();
+
+  if (finished && finished->done) {
+    int error = finished->error.load();
+    finished->done(error != 0 ? -static_cast<ssize_t>(error) : finished->bytes.load());
+  }
+}
+
+DiskIo& DiskIo::instance() {
+  static DiskIo io(config_from_env());
+  return io;
+}
+
+DiskIo::DiskIo(const Config& config) : config_(config) {
+}
+
+std::shared_ptr<DiskQueue> DiskIo::queue_for(int fd) {
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    return nullptr;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::shared_ptr<DiskQueue>& queue = queues_[st.st_dev];
+  if (!queue) {
+    auto depth = config_.device_depths.find(st.st_dev);
+    queue = std::make_shared<DiskQueue>(depth != config_.device_depths.end() ? depth->second : config_.queue_depth,
+                                        config_.use_uring);
+  }
+  return queue;
+}
+
+std::map<std::string, DiskQueue::Stats> DiskIo::stats() const {
+  std::map<std::string, DiskQueue::Stats> stats;
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto& [dev, queue] : queues_) {
+    stats[std::to_string(major(dev)) + ":" + std::to_string(minor(dev))] = queue->stats();
+  }
+  return stats;
+}
+
+ssize_t wait_for(const std::function<bool(DiskQueue::Completion)>& submit) {
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool done = false;
+  ssize_t result = 0;
+  bool submitted = submit([&](ssize_t r) {
+    std::lock_guard<std::mutex> lock(mutex);
+    result = r;
+    done = true;
+    cv.notify_one();
+  });
+  if (!submitted) {
+    return -EBADF;
+  }
+  std::unique_lock<std::mutex> lock(mutex);
+  cv.wait(lock, [&]() { return done; });
+  return result;
+}
+
+} // namespace quicftp
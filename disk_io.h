@@ -0,0 +1,125 @@
+// disk_io.h
+// Asynchronous storage I/O for the transfer paths
+// Writes, reads and syncs are submitted to a queue for the device the file
+// lives on and complete on that queue's own thread, so event loops never wait
+// on the disk. Queues run on io_uring, driven through raw system calls with
+// pool slabs registered as fixed buffers and open files as fixed files, and
+// fall back to a small thread pool making the same calls where io_uring is
+// unavailable.
+
+#ifndef DISK_IO_H
+#define DISK_IO_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <cstddef>
+#include <cstdint>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+namespace quicftp {
+
+class DiskQueue {
+public:
+  // Bytes transferred (0 for a sync), or -errno. Runs on the queue's
+  // completion thread and must not block.
+  using Completion = std::function<void(ssize_t result)>;
+
+  struct Stats {
+    std::string backend;              // "io_uring" or "threads"
+    size_t queue_depth = 0;
+    size_t in_flight = 0;
+    size_t peak_in_flight = 0;
+    uint64_t submitted = 0;           // operations, counting each retry of a short transfer
+    uint64_t completed = 0;
+    uint64_t fixed_buffer_ops = 0;    // writes from registered pool slabs
+    uint64_t fixed_file_ops = 0;      // operations on registered files
+  };
+
+  // Up to depth operations are in flight at once; submitters wait for room
+  DiskQueue(size_t depth, bool use_uring);
+  ~DiskQueue();
+
+  DiskQueue(const DiskQueue&) = delete;
+  DiskQueue& operator=(const DiskQueue&) = delete;
+
+  // Write the buffers at offset. They must stay valid until done runs; short
+  // writes are carried on by the queue, so done sees everything or an error.
+  bool writev(int fd, uint64_t offset, const struct iovec* iov, int iovcnt, Completion done);
+
+  // Read up to len bytes at offset into buf, valid until done runs
+  bool read(int fd, uint64_t offset, void* buf, size_t len, Completion done);
+
+  // Flush the file's data (and metadata unless data_only) to stable storage
+  bool fsync(int fd, bool data_only, Completion done);
+
+  // Files with many operations can be registered so each one skips the
+  // kernel's file table lookup. Unregister before closing fd, once nothing
+  // is in flight on it.
+  void register_file(int fd);
+  void unregister_file(int fd);
+
+  Stats stats() const;
+
+private:
+  struct Backend;
+  struct UringBackend;
+  struct ThreadBackend;
+  struct Op;
+
+  size_t depth_;
+  std::unique_ptr<Backend> backend_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable room_cv_;
+  size_t in_flight_;
+  Stats stats_;
+
+  // Wait for room for count operations, then account for them
+  void reserve(size_t count);
+  void submit(Op* op);
+  // Called by the backend for every finished operation
+  void complete(Op* op, ssize_t result);
+};
+
+// Registry of per-device queues
+class DiskIo {
+public:
+  struct Config {
+    size_t queue_depth = 64;                 // for devices without their own setting
+    std::map<dev_t, size_t> device_depths;   // by st_dev
+    bool use_uring = true;                   // false forces the thread pool
+  };
+
+  // Process-wide registry. Configured on first use from QUICFTP_IO_DEPTH,
+  // a default depth optionally followed by per-device overrides written
+  // major:minor=depth ("64,259:0=256"), and QUICFTP_IO_BACKEND=threads.
+  static DiskIo& instance();
+
+  explicit DiskIo(const Config& config);
+
+  // Queue for the device fd's file is on, created on first use; null only if
+  // fd cannot be examined
+  std::shared_ptr<DiskQueue> queue_for(int fd);
+
+  // Stats of every queue so far, keyed by "major:minor"
+  std::map<std::string, DiskQueue::Stats> stats() const;
+
+private:
+  Config config_;
+  mutable std::mutex mutex_;
+  std::map<dev_t, std::shared_ptr<DiskQueue>> queues_;
+};
+
+// Run an operation on queue and wait for its result; for callers that have
+// their own thread anyway
+ssize_t wait_for(const std::function<bool(DiskQueue::Completion)>& submit);
+
+} // namespace quicftp
+
+#endif
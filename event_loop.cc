@@ -0,0 +1,205 @@
+// event_loop.cc
+
+#include "event_loop.h"
+#include <cerrno>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+namespace quicftp {
+
+namespace {
+
+constexpr int kMaxEventsPerWait = 64;
+
+} // namespace
+
+EventLoop::EventLoop()
+  : epoll_fd_(-1)
+  , wakeup_fd_(-1)
+  , timer_fd_(-1)
+  , next_timer_id_(1)
+{
+}
+
+EventLoop::~EventLoop() {
+  if (timer_fd_ >= 0) close(timer_fd_);
+  if (wakeup_fd_ >= 0) close(wakeup_fd_);
+  if (epoll_fd_ >= 0) close(epoll_fd_);
+}
+
+bool EventLoop::initialize() {
+  if (epoll_fd_ >= 0) return true;
+
+  epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+  wakeup_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (epoll_fd_ < 0 || wakeup_fd_ < 0 || timer_fd_ < 0) {
+    return false;
+  }
+
+  for (int fd : {wakeup_fd_, timer_fd_}) {
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool EventLoop::is_initialized() const {
+  return epoll_fd_ >= 0;
+}
+
+bool EventLoop::add_fd(int fd, uint32_t events, FdCallback callback) {
+  struct epoll_event ev = {};
+  ev.events = events;
+  ev.data.fd = fd;
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) != 0) {
+    return false;
+  }
+  fd_callbacks_[fd] = std::make_shared<FdCallback>(std::move(callback));
+  return true;
+}
+
+bool EventLoop::modify_fd(int fd, uint32_t events) {
+  struct epoll_event ev = {};
+  ev.events = events;
+  ev.data.fd = fd;
+  return epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, fd, &ev) == 0;
+}
+
+void EventLoop::remove_fd(int fd) {
+  epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+  fd_callbacks_.erase(fd);
+}
+
+EventLoop::TimerId EventLoop::add_timer(int delay_ms, TimerCallback callback, int interval_ms) {
+  TimerId id = next_timer_id_++;
+  timers_[id] = Timer{std::move(callback), std::chrono::milliseconds(interval_ms)};
+  timer_queue_.emplace(Clock::now() + std::chrono::milliseconds(delay_ms), id);
+  arm_timer_fd();
+  return id;
+}
+
+void EventLoop::cancel_timer(TimerId id) {
+  // Queue entries of cancelled timers are skipped when they come due
+  timers_.erase(id);
+}
+
+void EventLoop::post(std::function<void()> task) {
+  {
+    std::lock_guard<std::mutex> lock(posted_mutex_);
+    posted_.push_back(std::move(task));
+  }
+  wakeup();
+}
+
+void EventLoop::wakeup() {
+  uint64_t one = 1;
+  ssize_t rc = write(wakeup_fd_, &one, sizeof(one));
+  (void)rc; // EAGAIN means a wakeup is already pending
+}
+
+void EventLoop::arm_timer_fd() {
+  while (!timer_queue_.empty() && timers_.find(timer_queue_.begin()->second) == timers_.end()) {
+    timer_queue_.erase(timer_queue_.begin());
+  }
+
+  struct itimerspec spec = {};
+  if (!timer_queue_.empty()) {
+    Clock::time_point deadline = timer_queue_.begin()->first;
+    if (deadline == armed_deadline_) return;
+    armed_deadline_ = deadline;
+
+    // steady_clock is CLOCK_MONOTONIC on Linux, so deadlines map directly
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline.time_since_epoch()).count();
+    if (ns <= 0) ns = 1; // all-zero would disarm the timer
+    spec.it_value.tv_sec = ns / 1000000000;
+    spec.it_value.tv_nsec = ns % 1000000000;
+  } else {
+    armed_deadline_ = Clock::time_point();
+  }
+  timerfd_settime(timer_fd_, TFD_TIMER_ABSTIME, &spec, nullptr);
+}
+
+int EventLoop::run_timers() {
+  int dispatched = 0;
+  Clock::time_point now = Clock::now();
+
+  while (!timer_queue_.empty() && timer_queue_.begin()->first <= now) {
+    TimerId id = timer_queue_.begin()->second;
+    timer_queue_.erase(timer_queue_.begin());
+
+    auto it = timers_.find(id);
+    if (it == timers_.end()) continue;
+
+    // Copy the callback: it may cancel or add timers while running
+    TimerCallback callback = it->second.callback;
+    if (it->second.interval.count() > 0) {
+      timer_queue_.emplace(now + it->second.interval, id);
+    } else {
+      timers_.erase(it);
+    }
+    callback();
+    dispatched++;
+  }
+
+  armed_deadline_ = Clock::time_point();
+  arm_timer_fd();
+  return dispatched;
+}
+
+int EventLoop::run_posted() {
+  std::vector<std::function<void()>> tasks;
+  {
+    std::lock_guard<std::mutex> lock(posted_mutex_);
+    tasks.swap(posted_);
+  }
+  for (auto& task : tasks) {
+    task();
+  }
+  return static_cast<int>(tasks.size());
+}
+
+int EventLoop::run_once(int timeout_ms) {
+  if (epoll_fd_ < 0) return 0;
+
+  struct epoll_event events[kMaxEventsPerWait];
+  int n = epoll_wait(epoll_fd_, events, kMaxEventsPerWait, timeout_ms);
+  if (n < 0) {
+    return (errno == EINTR) ? 0 : -1;
+  }
+
+  int dispatched = 0;
+  bool timers_due = false;
+  for (int i = 0; i < n; ++i) {
+    int fd = events[i].data.fd;
+    if (fd == wakeup_fd_) {
+      uint64_t count;
+      while (read(wakeup_fd_, &count, sizeof(count)) > 0) {}
+    } else if (fd == timer_fd_) {
+      uint64_t expirations;
+      while (read(timer_fd_, &expirations, sizeof(expirations)) > 0) {}
+      timers_due = true;
+    } else {
+      auto it = fd_callbacks_.find(fd);
+      if (it == fd_callbacks_.end()) continue;
+      // Hold a reference: the callback may remove its own registration
+      std::shared_ptr<FdCallback> callback = it->second;
+      (*callback)(events[i].events);
+      dispatched++;
+    }
+  }
+
+  dispatched += run_posted();
+  if (timers_due) {
+    dispatched += run_timers();
+  }
+  return dispatched;
+}
+
+} // namespace quicftp
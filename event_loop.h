@@ -0,0 +1,82 @@
+// event_loop.h
+// epoll-based reactor: fd readiness callbacks, timers and cross-thread wakeups
+
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <chrono>
+
+namespace quicftp {
+
+class EventLoop {
+public:
+  using FdCallback = std::function<void(uint32_t events)>;
+  using TimerCallback = std::function<void()>;
+  using TimerId = uint64_t;
+
+  EventLoop();
+  ~EventLoop();
+
+  EventLoop(const EventLoop&) = delete;
+  EventLoop& operator=(const EventLoop&) = delete;
+
+  // Create the epoll instance and the internal wakeup/timer fds
+  bool initialize();
+  bool is_initialized() const;
+
+  // Watch fd for the given EPOLL* events; callbacks run on the loop thread
+  bool add_fd(int fd, uint32_t events, FdCallback callback);
+  bool modify_fd(int fd, uint32_t events);
+  void remove_fd(int fd);
+
+  // One-shot timer after delay_ms, repeating every interval_ms if non-zero
+  TimerId add_timer(int delay_ms, TimerCallback callback, int interval_ms = 0);
+  void cancel_timer(TimerId id);
+
+  // Run task on the loop thread; safe to call from any thread
+  void post(std::function<void()> task);
+
+  // Interrupt a blocking run_once() from any thread
+  void wakeup();
+
+  // Wait at most timeout_ms (-1 forever) for work, dispatch everything that
+  // is ready and return the number of callbacks run. Returns as soon as work
+  // has been dispatched instead of sleeping out the timeout.
+  int run_once(int timeout_ms);
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  struct Timer {
+    TimerCallback callback;
+    std::chrono::milliseconds interval;
+  };
+
+  int epoll_fd_;
+  int wakeup_fd_;
+  int timer_fd_;
+
+  std::map<int, std::shared_ptr<FdCallback>> fd_callbacks_;
+
+  std::map<TimerId, Timer> timers_;
+  std::multimap<Clock::time_point, TimerId> timer_queue_;
+  Clock::time_point armed_deadline_;
+  TimerId next_timer_id_;
+
+  std::mutex posted_mutex_;
+  std::vector<std::function<void()>> posted_;
+
+  void arm_timer_fd();
+  int run_timers();
+  int run_posted();
+};
+
+} // namespace quicftp
+
+#endif
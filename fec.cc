@@ -0,0 +1,268 @@
+// fec.cc
+
+#include "fec.h"
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace quicftp {
+
+namespace {
+
+// GF(2^8) modulo x^8 + x^4 + x^3 + x^2 + 1, generated by x
+constexpr unsigned kGfPolynomial = 0x11d;
+
+// Blocks a code should leave unrecoverable, at most
+constexpr double kResidualLoss = 0.01;
+
+struct GfTables {
+  uint8_t exp[512];
+  uint8_t log[256];
+  GfTables() {
+    unsigned x = 1;
+    for (unsigned i = 0; i < 255; ++i) {
+      exp[i] = static_cast<uint8_t>(x);
+      exp[i + 255] = static_cast<uint8_t>(x);
+      log[x] = static_cast<uint8_t>(i);
+      x <<= 1;
+      if (x & 0x100) x ^= kGfPolynomial;
+    }
+    exp[510] = exp[0];
+    exp[511] = exp[1];
+    log[0] = 0;
+  }
+};
+
+const GfTables& gf() {
+  static const GfTables tables;
+  return tables;
+}
+
+uint8_t gf_mul(uint8_t a, uint8_t b) {
+  if (a == 0 || b == 0) return 0;
+  const GfTables& t = gf();
+  return t.exp[t.log[a] + t.log[b]];
+}
+
+uint8_t gf_inv(uint8_t a) {
+  const GfTables& t = gf();
+  return t.exp[255 - t.log[a]];
+}
+
+// Cauchy matrix entry 1 / (x_j + y_i), with repairs at x = 128..255 and
+// sources at y = 0..127 so no sum is zero
+uint8_t coefficient(size_t repair_index, size_t source_index) {
+  return gf_inv(static_cast<uint8_t>((kFecMaxSources + repair_index) ^ source_index));
+}
+
+// A byte's product with c is lo[byte & 15] ^ hi[byte >> 4]
+void mul_add_table(uint8_t* dst, const uint8_t* src, size_t len, const uint8_t* lo, const uint8_t* hi) {
+  for (size_t i = 0; i < len; ++i) {
+    dst[i] ^= lo[src[i] & 0x0f] ^ hi[src[i] >> 4];
+  }
+}
+
+#if defined(__x86_64__)
+// Both nibble lookups as byte shuffles, 16 bytes a step
+__attribute__((target("ssse3")))
+size_t mul_add_ssse3(uint8_t* dst, const uint8_t* src, size_t len, const uint8_t* lo, const uint8_t* hi) {
+  const __m128i table_lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(lo));
+  const __m128i table_hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(hi));
+  const __m128i mask = _mm_set1_epi8(0x0f);
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16) {
+    __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+    __m128i product = _mm_xor_si128(_mm_shuffle_epi8(table_lo, _mm_and_si128(s, mask)),
+                                    _mm_shuffle_epi8(table_hi, _mm_and_si128(_mm_srli_epi64(s, 4), mask)));
+    __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + i));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_xor_si128(d, product));
+  }
+  return i;
+}
+
+// The same, 32 bytes a step
+__attribute__((target("avx2")))
+size_t mul_add_avx2(uint8_t* dst, const uint8_t* src, size_t len, const uint8_t* lo, const uint8_t* hi) {
+  const __m256i table_lo = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(lo)));
+  const __m256i table_hi = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(hi)));
+  const __m256i mask = _mm256_set1_epi8(0x0f);
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32) {
+    __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+    __m256i product = _mm256_xor_si256(_mm256_shuffle_epi8(table_lo, _mm256_and_si256(s, mask)),
+                                       _mm256_shuffle_epi8(table_hi, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask)));
+    __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dst + i));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_xor_si256(d, product));
+  }
+  return i;
+}
+#endif
+
+} // namespace
+
+bool parse_fec_config(const std::string& text, FecConfig& config) {
+  FecConfig parsed;
+  size_t block_size, repairs;
+  char extra;
+  if (text == "off") {
+    parsed.enabled = false;
+  } else if (text == "auto") {
+    parsed.enabled = true;
+  } else if (std::sscanf(text.c_str(), "%zu:%zu%c", &block_size, &repairs, &extra) == 2) {
+    if (block_size == 0 || block_size > kFecMaxSources || repairs == 0 || repairs > kFecMaxRepairs) {
+      return false;
+    }
+    parsed.enabled = true;
+    parsed.block_size = block_size;
+    parsed.repairs = repairs;
+  } else if (std::sscanf(text.c_str(), "%zu%c", &block_size, &extra) == 1) {
+    if (block_size == 0 || block_size > kFecMaxSources) {
+      return false;
+    }
+    parsed.enabled = true;
+    parsed.block_size = block_size;
+  } else {
+    return false;
+  }
+  config = parsed;
+  return true;
+}
+
+std::string fec_config_name(const FecConfig& config) {
+  if (!config.enabled) {
+    return "off";
+  }
+  std::string name = "blocks of " + std::to_string(config.block_size) + ", ";
+  return name + (config.repairs > 0 ? std::to_string(config.repairs) + " repairs" : "repairs by loss rate");
+}
+
+void gf256_mul_add(uint8_t* dst, const uint8_t* src, uint8_t c, size_t len) {
+  if (c == 0) {
+    return;
+  }
+  alignas(16) uint8_t lo[16];
+  alignas(16) uint8_t hi[16];
+  for (uint8_t i = 0; i < 16; ++i) {
+    lo[i] = gf_mul(c, i);
+    hi[i] = gf_mul(c, static_cast<uint8_t>(i << 4));
+  }
+  size_t done = 0;
+#if defined(__x86_64__)
+  static const bool have_avx2 = __builtin_cpu_supports("avx2");
+  static const bool have_ssse3 = __builtin_cpu_supports("ssse3");
+  if (have_avx2) {
+    done = mul_add_avx2(dst, src, len, lo, hi);
+  } else if (have_ssse3) {
+    done = mul_add_ssse3(dst, src, len, lo, hi);
+  }
+#endif
+  mul_add_table(dst + done, src + done, len - done, lo, hi);
+}
+
+void fec_encode(uint8_t* repair, size_t repair_index, const uint8_t* source, size_t source_index, size_t len) {
+  gf256_mul_add(repair, source, coefficient(repair_index, source_index), len);
+}
+
+bool fec_decode(size_t k, size_t len, uint8_t* const* sources, const bool* present, const uint8_t* const* repairs,
+                const size_t* repair_indexes, size_t repair_count) {
+  std::vector<size_t> missing;
+  for (size_t i = 0; i < k; ++i) {
+    if (!present[i]) missing.push_back(i);
+  }
+  size_t m = missing.size();
+  if (m == 0) {
+    return true;
+  }
+  if (repair_count < m) {
+    return false;
+  }
+
+  // Take the present sources out of m repairs, leaving m equations in the
+  // m missing ones
+  std::vector<uint8_t> residual(m * len);
+  for (size_t a = 0; a < m; ++a) {
+    uint8_t* r = &residual[a * len];
+    std::memcpy(r, repairs[a], len);
+    for (size_t i = 0; i < k; ++i) {
+      if (present[i]) {
+        gf256_mul_add(r, sources[i], coefficient(repair_indexes[a], i), len);
+      }
+    }
+  }
+
+  // Invert their m x m Cauchy submatrix by Gauss-Jordan elimination
+  std::vector<uint8_t> matrix(m * m);
+  std::vector<uint8_t> inverse(m * m, 0);
+  for (size_t a = 0; a < m; ++a) {
+    for (size_t b = 0; b < m; ++b) {
+      matrix[a * m + b] = coefficient(repair_indexes[a], missing[b]);
+    }
+    inverse[a * m + a] = 1;
+  }
+  for (size_t col = 0; col < m; ++col) {
+    size_t pivot = col;
+    while (pivot < m && matrix[pivot * m + col] == 0) ++pivot;
+    if (pivot == m) {
+      return false; // repeated repair indexes
+    }
+    if (pivot != col) {
+      for (size_t b = 0; b < m; ++b) {
+        std::swap(matrix[pivot * m + b], matrix[col * m + b]);
+        std::swap(inverse[pivot * m + b], inverse[col * m + b]);
+      }
+    }
+    uint8_t scale = gf_inv(matrix[col * m + col]);
+    for (size_t b = 0; b < m; ++b) {
+      matrix[col * m + b] = gf_mul(matrix[col * m + b], scale);
+      inverse[col * m + b] = gf_mul(inverse[col * m + b], scale);
+    }
+    for (size_t row = 0; row < m; ++row) {
+      uint8_t factor = matrix[row * m + col];
+      if (row == col || factor == 0) continue;
+      for (size_t b = 0; b < m; ++b) {
+        matrix[row * m + b] ^= gf_mul(factor, matrix[col * m + b]);
+        inverse[row * m + b] ^= gf_mul(factor, inverse[col * m + b]);
+      }
+    }
+  }
+
+  for (size_t b = 0; b < m; ++b) {
+    uint8_t* out = sources[missing[b]];
+    std::memset(out, 0, len);
+    for (size_t a = 0; a < m; ++a) {
+      gf256_mul_add(out, &residual[a * len], inverse[b * m + a], len);
+    }
+  }
+  return true;
+}
+
+size_t fec_repairs_for(size_t k, double loss_rate, size_t max_repairs) {
+  if (loss_rate <= 0) {
+    return 0;
+  }
+  if (loss_rate >= 1) {
+    return max_repairs;
+  }
+  double q = 1 - loss_rate;
+  for (size_t r = 0; r < max_repairs; ++r) {
+    // Chance of at most r losses among k + r packets, term by term of the
+    // binomial distribution
+    size_t n = k + r;
+    double term = 1;
+    for (size_t i = 0; i < n; ++i) term *= q;
+    double covered = term;
+    for (size_t x = 0; x < r; ++x) {
+      term *= static_cast<double>(n - x) / static_cast<double>(x + 1) * loss_rate / q;
+      covered += term;
+    }
+    if (1 - covered <= kResidualLoss) {
+      return r;
+    }
+  }
+  return max_repairs;
+}
+
+} // namespace quicftp
@@ -0,0 +1,55 @@
+// fec.h
+// Forward error correction for the UDP transport
+// A systematic Reed-Solomon erasure code over GF(2^8): a block of k source
+// packets goes out as it is, followed by r repair packets, and any k of the
+// k + r rebuild the lost sources without waiting a round trip for them to be
+// sent again. Repair j is the sum of the sources weighted by row j of a
+// Cauchy matrix, every square submatrix of which is invertible, so it never
+// matters which k arrive. The multiply-accumulate over a packet that both
+// sides spend their time in runs 16 or 32 bytes a step with SSSE3 or AVX2
+// table lookups where the CPU has them.
+
+#ifndef FEC_H
+#define FEC_H
+
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+namespace quicftp {
+
+struct FecConfig {
+  bool enabled = false;
+  size_t block_size = 32; // source packets per block
+  size_t repairs = 0;     // repair packets per block; 0 follows the loss rate
+};
+
+// "off", "auto" (blocks of 32), "K" (blocks of K) or "K:R" (R repairs each)
+bool parse_fec_config(const std::string& text, FecConfig& config);
+std::string fec_config_name(const FecConfig& config);
+
+// Limits of the code: source and repair indexes are 7 bits each
+constexpr size_t kFecMaxSources = 128;
+constexpr size_t kFecMaxRepairs = 128;
+
+// dst ^= c * src over GF(2^8)
+void gf256_mul_add(uint8_t* dst, const uint8_t* src, uint8_t c, size_t len);
+
+// Fold source `source` of a block into repair `repair`, which starts zeroed.
+// Sources shorter than the repair are taken as zero-padded.
+void fec_encode(uint8_t* repair, size_t repair_index, const uint8_t* source, size_t source_index, size_t len);
+
+// Rebuild the sources of a k-packet block that are not present. sources
+// holds k buffers of len bytes: the present ones zero-padded to len, the
+// rest to be filled. Needs as many repairs, each len bytes with its index, as
+// there are sources missing; false if there are fewer.
+bool fec_decode(size_t k, size_t len, uint8_t* const* sources, const bool* present, const uint8_t* const* repairs,
+                const size_t* repair_indexes, size_t repair_count);
+
+// Fewest repairs for a block of k so that, with each packet lost at
+// loss_rate, a block loses more than it can rebuild less than 1% of the time
+size_t fec_repairs_for(size_t k, double loss_rate, size_t max_repairs);
+
+} // namespace quicftp
+
+#endif
@@ -0,0 +1,527 @@
+// file_sink.cc
+
+#include "file_sink.h"
+#include "metrics.h"
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace quicftp {
+
+namespace {
+
+// Most buffers gathered into a single writev
+constexpr size_t kMaxSegments = 64;
+
+// Writes one sink may have in the disk queue before it waits for the oldest
+constexpr size_t kMaxWritesInFlight = 8;
+
+// Distinguishes temporary files of concurrent uploads to the same target
+std::atomic<uint64_t> g_temp_counter{0};
+
+std::string make_temp_path(const std::string& target_path) {
+  std::string dir;
+  std::string name = target_path;
+  size_t slash = target_path.rfind('/');
+  if (slash != std::string::npos) {
+    dir = target_path.substr(0, slash + 1);
+    name = target_path.substr(slash + 1);
+  }
+  return dir + "." + name + ".quicftp-tmp." + std::to_string(getpid()) + "." +
+         std::to_string(g_temp_counter.fetch_add(1));
+}
+
+// From a chunk being handed to a sink to its bytes being in the file
+Histogram& write_latency() {
+  static const std::shared_ptr<Histogram> histogram = MetricsRegistry::instance().histogram(
+      "quicftp_chunk_write_seconds", "Time from receiving a chunk to its data reaching the file", 1e-6);
+  return *histogram;
+}
+
+} // namespace
+
+FileSink::FileSink(size_t window_size)
+  : fd_(-1)
+  , dir_fd_(AT_FDCWD)
+  , write_offset_(0)
+  , window_size_(window_size)
+  , pending_bytes_(0)
+  , tail_used_(0)
+  , bytes_written_(0)
+  , writes_(std::make_shared<Writes>())
+{
+  pending_.reserve(kMaxSegments);
+}
+
+FileSink::~FileSink() {
+  if (fd_ >= 0) {
+    abort();
+  }
+}
+
+bool FileSink::open(const std::string& target_path, int dir_fd) {
+  if (fd_ >= 0) {
+    abort();
+  }
+
+  dir_fd_ = dir_fd;
+  target_path_ = target_path;
+  temp_path_ = make_temp_path(target_path);
+  pending_.clear();
+  pending_bytes_ = 0;
+  bytes_written_ = 0;
+  {
+    std::lock_guard<std::mutex> lock(error_mutex_);
+    error_.clear();
+  }
+
+  write_offset_ = 0;
+  fd_ = openat(dir_fd_, temp_path_.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if (fd_ < 0) {
+    set_error("cannot create " + temp_path_, errno);
+    return false;
+  }
+  return attach_queue(temp_path_);
+}
+
+bool FileSink::open_partial(const std::string& target_path, const std::string& partial_path, bool truncate,
+                            int dir_fd) {
+  if (fd_ >= 0) {
+    abort();
+  }
+
+  dir_fd_ = dir_fd;
+  target_path_ = target_path;
+  temp_path_ = partial_path;
+  pending_.clear();
+  pending_bytes_ = 0;
+  bytes_written_ = 0;
+  {
+    std::lock_guard<std::mutex> lock(error_mutex_);
+    error_.clear();
+  }
+
+  write_offset_ = 0;
+  fd_ = openat(dir_fd_, temp_path_.c_str(), O_WRONLY | O_CREAT | O_NOFOLLOW | O_CLOEXEC | (truncate ? O_TRUNC : 0),
+               0644);
+  if (fd_ < 0) {
+    set_error("cannot open " + temp_path_, errno);
+    return false;
+  }
+  return attach_queue(temp_path_);
+}
+
+bool FileSink::write(const void* data, size_t len) {
+  if (fd_ < 0) {
+    set_error("sink is not open");
+    return false;
+  }
+
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  if (len >= window_size_) {
+    // Large chunks bypass the window, going out in pooled buffers of their own
+    if (!flush_window() || !write_copy(write_offset_, bytes, len)) {
+      return false;
+    }
+    write_offset_ += len;
+    return true;
+  }
+
+  // Copy into the tail buffer, extending the last segment if it ends there
+  if (!tail_ || tail_used_ + len > tail_.capacity()) {
+    if (tail_used_ > 0 && !flush_window()) return false;
+    if (!tail_ || len > tail_.capacity()) {
+      tail_ = BufferPool::instance().acquire(std::max(len, BufferPool::instance().buffer_size()));
+    }
+    tail_used_ = 0;
+  }
+  uint8_t* dest = tail_.data() + tail_used_;
+  std::memcpy(dest, bytes, len);
+  tail_used_ += len;
+  if (!pending_.empty() && pending_.back().data + pending_.back().len == dest) {
+    pending_.back().len += len;
+    pending_bytes_ += len;
+    return pending_bytes_ < window_size_ || flush_window();
+  }
+  return queue(tail_, dest, len);
+}
+
+bool FileSink::write(const BufferRef& owner, const void* data, size_t len) {
+  if (!owner) {
+    return write(data, len);
+  }
+  if (fd_ < 0) {
+    set_error("sink is not open");
+    return false;
+  }
+  return queue(owner, static_cast<const uint8_t*>(data), len);
+}
+
+bool FileSink::preallocate(uint64_t size) {
+  if (fd_ < 0) {
+    set_error("sink is not open");
+    return false;
+  }
+  int rc = posix_fallocate(fd_, 0, static_cast<off_t>(size));
+  if (rc == EOPNOTSUPP || rc == EINVAL) {
+    // Filesystem cannot reserve blocks; at least size the file
+    rc = (ftruncate(fd_, static_cast<off_t>(size)) == 0) ? 0 : errno;
+  }
+  if (rc != 0) {
+    set_error("cannot preallocate " + std::to_string(size) + " bytes", rc);
+    return false;
+  }
+  return true;
+}
+
+bool FileSink::write_at(uint64_t offset, const void* data, size_t len) {
+  if (fd_ < 0) {
+    set_error("sink is not open");
+    return false;
+  }
+  return write_copy(offset, static_cast<const uint8_t*>(data), len);
+}
+
+bool FileSink::write_at(const BufferRef& owner, uint64_t offset, const void* data, size_t len) {
+  if (!owner) {
+    return write_at(offset, data, len);
+  }
+  if (fd_ < 0) {
+    set_error("sink is not open");
+    return false;
+  }
+  std::vector<Segment> segments;
+  segments.push_back(Segment{owner, static_cast<const uint8_t*>(data), len, std::chrono::steady_clock::now()});
+  return submit(std::move(segments), offset);
+}
+
+bool FileSink::sync_writes() {
+  std::unique_lock<std::mutex> lock(writes_->mutex);
+  writes_->cv.wait(lock, [this]() { return writes_->in_flight.empty(); });
+  if (writes_->error != 0) {
+    set_error("write failed", writes_->error);
+    return false;
+  }
+  return true;
+}
+
+uint64_t FileSink::write_mark() const {
+  std::lock_guard<std::mutex> lock(writes_->mutex);
+  return writes_->submitted;
+}
+
+void FileSink::when_written(uint64_t mark, std::function<void(bool written)> done) {
+  bool written;
+  {
+    std::lock_guard<std::mutex> lock(writes_->mutex);
+    if (!writes_->in_flight.empty() && *writes_->in_flight.begin() <= mark) {
+      writes_->waiters.emplace(mark, std::move(done));
+      return;
+    }
+    written = writes_->error == 0;
+  }
+  done(written);
+}
+
+bool FileSink::flush_file(std::function<void(bool synced)> done) {
+  if (fd_ < 0) {
+    set_error("sink is not open");
+    return false;
+  }
+  return io_->fsync(fd_, true, [this, done](ssize_t result) {
+    if (result < 0) {
+      set_error("sync failed", static_cast<int>(-result));
+    }
+    done(result >= 0);
+  });
+}
+
+bool FileSink::sync_data() {
+  if (fd_ < 0) {
+    set_error("sink is not open");
+    return false;
+  }
+  return flush_window() && sync_writes() && sync_fd();
+}
+
+bool FileSink::sync_data(std::function<void(bool synced)> done) {
+  if (fd_ < 0) {
+    set_error("sink is not open");
+    return false;
+  }
+  return flush_window() && sync_writes() && flush_file(std::move(done));
+}
+
+bool FileSink::sync_directory() {
+  if (dir_fd_ != AT_FDCWD) {
+    if (fsync(dir_fd_) != 0) {
+      set_error("cannot sync directory", errno);
+      return false;
+    }
+    return true;
+  }
+  size_t slash = target_path_.rfind('/');
+  std::string dir = (slash == std::string::npos) ? "." : target_path_.substr(0, slash + 1);
+  int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    set_error("cannot open " + dir, errno);
+    return false;
+  }
+  bool synced = fsync(fd) == 0;
+  if (!synced) {
+    set_error("cannot sync " + dir, errno);
+  }
+  ::close(fd);
+  return synced;
+}
+
+bool FileSink::commit(bool durable) {
+  if (fd_ < 0) {
+    set_error("sink is not open");
+    return false;
+  }
+  if (!flush_window() || !sync_writes() || (durable && !sync_fd())) {
+    abort();
+    return false;
+  }
+  detach_queue();
+  if (::close(fd_) != 0) {
+    fd_ = -1;
+    set_error("close failed", errno);
+    unlinkat(dir_fd_, temp_path_.c_str(), 0);
+    return false;
+  }
+  fd_ = -1;
+  if (renameat(dir_fd_, temp_path_.c_str(), dir_fd_, target_path_.c_str()) != 0) {
+    set_error("cannot rename onto " + target_path_, errno);
+    unlinkat(dir_fd_, temp_path_.c_str(), 0);
+    return false;
+  }
+  return !durable || sync_directory();
+}
+
+void FileSink::abort() {
+  if (fd_ >= 0) {
+    // Queued writes still use the descriptor
+    sync_writes();
+    detach_queue();
+    ::close(fd_);
+    fd_ = -1;
+    unlinkat(dir_fd_, temp_path_.c_str(), 0);
+  }
+  pending_.clear();
+  pending_bytes_ = 0;
+  tail_used_ = 0;
+}
+
+bool FileSink::suspend() {
+  if (fd_ < 0) {
+    return true;
+  }
+  bool flushed = flush_window() && sync_writes();
+  if (!flushed) {
+    // Whatever was queued must be done before the descriptor goes
+    sync_writes();
+  }
+  detach_queue();
+  if (::close(fd_) != 0 && flushed) {
+    set_error("close failed", errno);
+    flushed = false;
+  }
+  fd_ = -1;
+  return flushed;
+}
+
+bool FileSink::is_open() const {
+  return fd_ >= 0;
+}
+
+size_t FileSink::bytes_written() const {
+  return bytes_written_ + pending_bytes_;
+}
+
+const std::string& FileSink::target_path() const {
+  return target_path_;
+}
+
+const std::string& FileSink::temp_path() const {
+  return temp_path_;
+}
+
+int FileSink::directory() const {
+  return dir_fd_;
+}
+
+std::string FileSink::error() const {
+  std::lock_guard<std::mutex> lock(error_mutex_);
+  return error_;
+}
+
+bool FileSink::queue(const BufferRef& owner, const uint8_t* data, size_t len) {
+  // Segments from the tail buffer need no reference; tail_ outlives them
+  pending_.push_back(Segment{owner, data, len, std::chrono::steady_clock::now()});
+  pending_bytes_ += len;
+  if (pending_bytes_ >= window_size_ || pending_.size() >= kMaxSegments) {
+    return flush_window();
+  }
+  return true;
+}
+
+bool FileSink::flush_window() {
+  if (pending_.empty()) return true;
+
+  std::vector<Segment> segments;
+  segments.swap(pending_);
+  pending_.reserve(kMaxSegments);
+  size_t bytes = pending_bytes_;
+  pending_bytes_ = 0;
+  // The queued segments hold the tail buffer now; later copies start a new one
+  tail_.reset();
+  tail_used_ = 0;
+
+  if (!submit(std::move(segments), write_offset_)) {
+    return false;
+  }
+  write_offset_ += bytes;
+  return true;
+}
+
+bool FileSink::submit(std::vector<Segment> segments, uint64_t offset) {
+  uint64_t number;
+  {
+    // Bound what one sink keeps queued; also where an earlier failure surfaces
+    std::unique_lock<std::mutex> lock(writes_->mutex);
+    writes_->cv.wait(lock, [this]() { return writes_->in_flight.size() < kMaxWritesInFlight; });
+    if (writes_->error != 0) {
+      set_error("write failed", writes_->error);
+      return false;
+    }
+    number = ++writes_->submitted;
+    writes_->in_flight.insert(number);
+  }
+
+  struct iovec iov[kMaxSegments];
+  size_t count = std::min(segments.size(), kMaxSegments);
+  size_t bytes = 0;
+  for (size_t i = 0; i < count; ++i) {
+    iov[i].iov_base = const_cast<uint8_t*>(segments[i].data);
+    iov[i].iov_len = segments[i].len;
+    bytes += segments[i].len;
+  }
+  bytes_written_ += bytes;
+
+  // The completion keeps the segments' buffers alive until the data is written
+  auto held = std::make_shared<std::vector<Segment>>(std::move(segments));
+  std::shared_ptr<Writes> writes = writes_;
+  bool queued = io_->writev(fd_, offset, iov, static_cast<int>(count), [writes, held, number](ssize_t result) {
+    if (result >= 0) {
+      auto now = std::chrono::steady_clock::now();
+      for (const Segment& segment : *held) {
+        write_latency().record(static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::microseconds>(now - segment.received).count()));
+      }
+    }
+    finish_write(*writes, number, result < 0 ? static_cast<int>(-result) : 0);
+  });
+  if (!queued) {
+    finish_write(*writes_, number, EBADF);
+    set_error("write failed", EBADF);
+    return false;
+  }
+  return true;
+}
+
+void FileSink::finish_write(Writes& writes, uint64_t number, int error) {
+  std::vector<std::function<void(bool)>> ready;
+  bool written;
+  {
+    std::lock_guard<std::mutex> lock(writes.mutex);
+    if (error != 0 && writes.error == 0) {
+      writes.error = error;
+    }
+    writes.in_flight.erase(number);
+    // Waiters whose writes are now all done, i.e. none below their mark is left
+    uint64_t done_through = writes.in_flight.empty() ? writes.submitted : *writes.in_flight.begin() - 1;
+    auto end = writes.waiters.upper_bound(done_through);
+    for (auto it = writes.waiters.begin(); it != end; ++it) {
+      ready.push_back(std::move(it->second));
+    }
+    writes.waiters.erase(writes.waiters.begin(), end);
+    written = writes.error == 0;
+    writes.cv.notify_all();
+  }
+  for (auto& done : ready) {
+    done(written);
+  }
+}
+
+bool FileSink::write_copy(uint64_t offset, const uint8_t* data, size_t len) {
+  BufferPool& pool = BufferPool::instance();
+  auto received = std::chrono::steady_clock::now();
+  std::vector<Segment> segments;
+  uint64_t segments_offset = offset;
+  size_t segments_bytes = 0;
+  for (size_t pos = 0; pos < len;) {
+    size_t piece = std::min(len - pos, pool.buffer_size());
+    BufferRef buffer = pool.acquire(piece);
+    std::memcpy(buffer.data(), data + pos, piece);
+    segments.push_back(Segment{buffer, buffer.data(), piece, received});
+    segments_bytes += piece;
+    pos += piece;
+    if (segments.size() == kMaxSegments || pos == len) {
+      if (!submit(std::move(segments), segments_offset)) {
+        return false;
+      }
+      segments.clear();
+      segments_offset += segments_bytes;
+      segments_bytes = 0;
+    }
+  }
+  return true;
+}
+
+bool FileSink::sync_fd() {
+  ssize_t result = wait_for([&](DiskQueue::Completion done) { return io_->fsync(fd_, true, std::move(done)); });
+  if (result < 0) {
+    set_error("sync failed", static_cast<int>(-result));
+    return false;
+  }
+  return true;
+}
+
+bool FileSink::attach_queue(const std::string& what) {
+  io_ = DiskIo::instance().queue_for(fd_);
+  if (!io_) {
+    set_error("cannot stat " + what, errno);
+    ::close(fd_);
+    fd_ = -1;
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(writes_->mutex);
+  writes_->error = 0;
+  io_->register_file(fd_);
+  return true;
+}
+
+void FileSink::detach_queue() {
+  if (io_) {
+    io_->unregister_file(fd_);
+    io_.reset();
+  }
+}
+
+void FileSink::set_error(const std::string& what, int err) {
+  std::string error = what;
+  if (err != 0) {
+    error += ": ";
+    error += std::strerror(err);
+  }
+  std::lock_guard<std::mutex> lock(error_mutex_);
+  error_ = std::move(error);
+}
+
+} // namespace quicftp
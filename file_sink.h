@@ -0,0 +1,170 @@
+// file_sink.h
+// Incremental file writer for streamed uploads
+// Data goes to a temporary file next to the target and is renamed into place
+// on commit, so readers never observe a partially written file. Sequential
+// writes are gathered in a window and written out with one writev; pooled
+// buffers handed in by reference are queued as they are, without a copy, and
+// other data too large for the window is copied into pooled buffers. All of
+// it goes to the device's disk queue (see disk_io.h) and completes in the
+// background; commit() and suspend() wait for it, and a failure shows up on a
+// later call. How long
+// each chunk took to reach the file is recorded in quicftp_chunk_write_seconds.
+
+#ifndef FILE_SINK_H
+#define FILE_SINK_H
+
+#include "buffer_pool.h"
+#include "disk_io.h"
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <fcntl.h>
+
+namespace quicftp {
+
+class FileSink {
+public:
+  // window_size bounds the memory buffered per sink before it is written out
+  explicit FileSink(size_t window_size = 256 * 1024);
+  ~FileSink();
+
+  FileSink(const FileSink&) = delete;
+  FileSink& operator=(const FileSink&) = delete;
+
+  // Create the temporary file for target_path; parent directory must exist.
+  // Paths are relative to dir_fd, which must stay open while the sink is.
+  bool open(const std::string& target_path, int dir_fd = AT_FDCWD);
+
+  // Like open(), but data goes to partial_path, which survives suspend() so an
+  // interrupted transfer can reopen it and carry on. Existing contents are
+  // kept unless truncate is set.
+  bool open_partial(const std::string& target_path, const std::string& partial_path, bool truncate,
+                    int dir_fd = AT_FDCWD);
+
+  bool write(const void* data, size_t len);
+
+  // Like write(), but data lies inside owner, which is kept alive until the
+  // bytes reach the file instead of copying them (owner may be empty)
+  bool write(const BufferRef& owner, const void* data, size_t len);
+
+  // Reserve size bytes up front so positioned writes never hit ENOSPC midway
+  bool preallocate(uint64_t size);
+
+  // Positioned write, bypassing the window; safe to call concurrently from
+  // threads feeding different ranges of the same file. Do not mix with write().
+  bool write_at(uint64_t offset, const void* data, size_t len);
+
+  // Like write_at(), but keeps owner alive until the write is done instead of
+  // copying data (owner may be empty)
+  bool write_at(const BufferRef& owner, uint64_t offset, const void* data, size_t len);
+
+  // Wait until every write queued so far has reached the file (which is not
+  // yet stable storage); false if any of them failed
+  bool sync_writes();
+
+  // Marks the writes handed to the disk queue so far, for when_written()
+  uint64_t write_mark() const;
+
+  // Run done once the writes up to mark have reached the file, without
+  // waiting for any queued later; false if one of the sink's writes failed.
+  // done runs on the disk queue's thread, or at once if they already have,
+  // and must not block.
+  void when_written(uint64_t mark, std::function<void(bool written)> done);
+
+  // Flush the file's data as written so far to stable storage, without
+  // writing out or waiting for anything queued; done gets the outcome on the
+  // disk queue's thread
+  bool flush_file(std::function<void(bool synced)> done);
+
+  // Write out everything so far and flush the file's data to stable storage
+  bool sync_data();
+
+  // Like sync_data(), but the flush itself runs in the disk queue alongside
+  // those of other sinks; done gets the outcome on the queue's thread
+  bool sync_data(std::function<void(bool synced)> done);
+
+  // Flush the target's directory, making a completed rename durable
+  bool sync_directory();
+
+  // Flush buffered data and atomically rename the temporary file onto the
+  // target. If durable, the data is synced before and the directory after,
+  // so the file survives a crash once this returns.
+  bool commit(bool durable = false);
+
+  // Discard everything written so far
+  void abort();
+
+  // Flush and close, leaving the temporary file in place for a later resume
+  bool suspend();
+
+  bool is_open() const;
+  size_t bytes_written() const;
+  const std::string& target_path() const;
+  const std::string& temp_path() const;
+  // Directory descriptor the paths are relative to
+  int directory() const;
+
+  // Description of the last failure; safe to call while a flush completes
+  std::string error() const;
+
+private:
+  int fd_;
+  int dir_fd_;
+  std::string target_path_;
+  std::string temp_path_;
+  std::shared_ptr<DiskQueue> io_;
+  uint64_t write_offset_; // where the next window goes
+  // Data queued for the next writev, oldest first; copied writes share the
+  // tail_ buffer
+  struct Segment {
+    BufferRef owner;
+    const uint8_t* data;
+    size_t len;
+    std::chrono::steady_clock::time_point received; // when it was handed in
+  };
+  size_t window_size_;
+  std::vector<Segment> pending_;
+  size_t pending_bytes_;
+  BufferRef tail_;
+  size_t tail_used_;
+  std::atomic<size_t> bytes_written_; // handed to the disk queue, or pending
+  mutable std::mutex error_mutex_;
+  std::string error_;
+
+  // Writes in the disk queue; completions update this from the queue's thread
+  struct Writes {
+    std::mutex mutex;
+    std::condition_variable cv;
+    uint64_t submitted = 0;             // writes numbered so far, from 1
+    std::set<uint64_t> in_flight;       // numbers of those not done
+    std::multimap<uint64_t, std::function<void(bool)>> waiters; // by mark
+    int error = 0; // errno of the first failed write
+  };
+  std::shared_ptr<Writes> writes_;
+
+  bool attach_queue(const std::string& what);
+  void detach_queue();
+  bool queue(const BufferRef& owner, const uint8_t* data, size_t len);
+  bool flush_window();
+  // Hand segments to the disk queue as one write at offset
+  bool submit(std::vector<Segment> segments, uint64_t offset);
+  // Copy data into pooled buffers and hand them to the disk queue at offset
+  bool write_copy(uint64_t offset, const uint8_t* data, size_t len);
+  // Retire a write, running the waiters it was holding up
+  static void finish_write(Writes& writes, uint64_t number, int error);
+  bool sync_fd();
+  void set_error(const std::string& what, int err = 0);
+};
+
+} // namespace quicftp
+
+#endif
@@ -0,0 +1,189 @@
+// file_source.cc
+
+#include "file_source.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace quicftp {
+
+namespace {
+
+// Readahead window bounds; a transfer gets an eighth of its length in between
+constexpr uint64_t kMinReadahead = 1024 * 1024;
+constexpr uint64_t kMaxReadahead = 16 * 1024 * 1024;
+
+uint64_t page_size() {
+  static const uint64_t size = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+  return size;
+}
+
+} // namespace
+
+FileSource::FileSource()
+  : fd_(-1)
+  , size_(0)
+  , map_(nullptr)
+  , readahead_(kMinReadahead)
+{
+}
+
+FileSource::~FileSource() {
+  close();
+}
+
+bool FileSource::open(const std::string& path) {
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    close();
+    set_error("cannot open " + path, errno);
+    return false;
+  }
+  return attach(fd);
+}
+
+bool FileSource::attach(int fd) {
+  close();
+  error_.clear();
+  fd_ = fd;
+
+  struct stat st;
+  if (fstat(fd_, &st) != 0) {
+    set_error("cannot stat file", errno);
+    close();
+    return false;
+  }
+  if (!S_ISREG(st.st_mode)) {
+    set_error("not a regular file");
+    close();
+    return false;
+  }
+  size_ = static_cast<uint64_t>(st.st_size);
+
+  // Empty files cannot be mapped, and some filesystems refuse; both are
+  // served by positioned reads instead
+  if (size_ > 0 && size_ <= SIZE_MAX) {
+    void* map = mmap(nullptr, static_cast<size_t>(size_), PROT_READ, MAP_SHARED, fd_, 0);
+    if (map != MAP_FAILED) {
+      map_ = static_cast<uint8_t*>(map);
+    }
+  }
+  if (!map_) {
+    io_ = DiskIo::instance().queue_for(fd_);
+  }
+  return true;
+}
+
+void FileSource::close() {
+  if (map_) {
+    munmap(map_, static_cast<size_t>(size_));
+    map_ = nullptr;
+  }
+  io_.reset();
+  if (fd_ >= 0) {
+    ::close(fd_);
+    fd_ = -1;
+  }
+  size_ = 0;
+}
+
+void FileSource::advise(uint64_t offset, uint64_t length) {
+  if (fd_ < 0 || offset >= size_) {
+    return;
+  }
+  length = std::min(length, size_ - offset);
+  uint64_t window = std::clamp(length / 8, kMinReadahead, kMaxReadahead);
+  readahead_ = (window + page_size() - 1) / page_size() * page_size();
+
+  if (map_) {
+    uint64_t start = offset / page_size() * page_size();
+    madvise(map_ + start, static_cast<size_t>(offset + length - start), MADV_SEQUENTIAL);
+  } else {
+    posix_fadvise(fd_, static_cast<off_t>(offset), static_cast<off_t>(length), POSIX_FADV_SEQUENTIAL);
+  }
+  prefetch(offset, 2 * readahead_);
+}
+
+bool FileSource::read(uint64_t offset, size_t len, uint8_t* scratch, const uint8_t*& data, size_t& got) {
+  if (fd_ < 0) {
+    set_error("file is not open");
+    return false;
+  }
+  if (offset >= size_) {
+    data = nullptr;
+    got = 0;
+    return true;
+  }
+  len = static_cast<size_t>(std::min<uint64_t>(len, size_ - offset));
+
+  // Entering a new readahead window: start loading the one after it
+  uint64_t window = readahead_;
+  if (offset / window != (offset + len) / window) {
+    prefetch(((offset + len) / window + 1) * window, window);
+  }
+
+  if (map_) {
+    // Like sendfile, this assumes nobody truncates the file mid-transfer;
+    // the server itself only ever replaces files by rename
+    data = map_ + offset;
+    got = len;
+    return true;
+  }
+
+  // Senders have a thread of their own, so they wait for the read; it still
+  // counts against the device's queue depth alongside the upload writes
+  ssize_t n = io_ ? wait_for([&](DiskQueue::Completion done) {
+                      return io_->read(fd_, offset, scratch, len, std::move(done));
+                    })
+                  : -EBADF;
+  if (n < 0) {
+    set_error("read failed at offset " + std::to_string(offset), static_cast<int>(-n));
+    return false;
+  }
+  data = scratch;
+  got = static_cast<size_t>(n);
+  return true;
+}
+
+bool FileSource::is_open() const {
+  return fd_ >= 0;
+}
+
+bool FileSource::mapped() const {
+  return map_ != nullptr;
+}
+
+uint64_t FileSource::size() const {
+  return size_;
+}
+
+const std::string& FileSource::error() const {
+  return error_;
+}
+
+void FileSource::prefetch(uint64_t offset, uint64_t length) {
+  if (offset >= size_) {
+    return;
+  }
+  length = std::min(length, size_ - offset);
+  if (map_) {
+    uint64_t start = offset / page_size() * page_size();
+    madvise(map_ + start, static_cast<size_t>(offset + length - start), MADV_WILLNEED);
+  } else {
+    posix_fadvise(fd_, static_cast<off_t>(offset), static_cast<off_t>(length), POSIX_FADV_WILLNEED);
+  }
+}
+
+void FileSource::set_error(const std::string& what, int err) {
+  error_ = what;
+  if (err != 0) {
+    error_ += ": ";
+    error_ += std::strerror(err);
+  }
+}
+
+} // namespace quicftp
@@ -0,0 +1,68 @@
+// file_source.h
+// Zero-copy file reader for the upload and download send paths
+// The file is memory-mapped when possible and reads return views into the
+// mapping, so data goes from the page cache to the transport without an
+// intermediate buffer. Files that cannot be mapped are read through the
+// device's disk queue (see disk_io.h).
+
+#ifndef FILE_SOURCE_H
+#define FILE_SOURCE_H
+
+#include "disk_io.h"
+#include <string>
+#include <memory>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace quicftp {
+
+class FileSource {
+public:
+  FileSource();
+  ~FileSource();
+
+  FileSource(const FileSource&) = delete;
+  FileSource& operator=(const FileSource&) = delete;
+
+  bool open(const std::string& path);
+
+  // Take ownership of fd, which must refer to a regular file
+  bool attach(int fd);
+
+  void close();
+
+  // Announce that [offset, offset + length) is about to be read front to
+  // back. Sets up sequential access and a readahead window sized for the
+  // transfer; safe to call from threads sending different ranges.
+  void advise(uint64_t offset, uint64_t length);
+
+  // Return a view of up to len bytes at offset in data/got. The view points
+  // into the mapping, or into scratch (len bytes, only touched when the file
+  // is not mapped) after a positioned read, and stays valid until scratch is
+  // reused or the source closed. got is 0 at end of file. Safe to call
+  // concurrently with separate scratch buffers.
+  bool read(uint64_t offset, size_t len, uint8_t* scratch, const uint8_t*& data, size_t& got);
+
+  bool is_open() const;
+  bool mapped() const;
+  uint64_t size() const;
+
+  // Description of the last failure
+  const std::string& error() const;
+
+private:
+  int fd_;
+  uint64_t size_;
+  uint8_t* map_;
+  std::shared_ptr<DiskQueue> io_; // unmapped files only
+  std::atomic<uint64_t> readahead_;
+  std::string error_;
+
+  void prefetch(uint64_t offset, uint64_t length);
+  void set_error(const std::string& what, int err = 0);
+};
+
+} // namespace quicftp
+
+#endif
@@ -0,0 +1,207 @@
+// group_commit.cc
+
+#include "group_commit.h"
+#include <algorithm>
+#include <set>
+#include <string>
+#include <utility>
+
+namespace quicftp {
+
+namespace {
+
+// The directory a sink's file lands in, as the key its sync is shared under
+std::pair<int, std::string> parent_of(const FileSink& sink) {
+  const std::string& path = sink.target_path();
+  size_t slash = path.rfind('/');
+  return {sink.directory(), (slash == std::string::npos) ? "." : path.substr(0, slash + 1)};
+}
+
+} // namespace
+
+GroupCommit::GroupCommit(int window_ms, size_t max_batch, bool durable)
+  : window_(std::max(window_ms, 0))
+  , max_batch_(std::max<size_t>(max_batch, 1))
+  , durable_(durable)
+  , committing_(0)
+  , syncing_(0)
+  , stopping_(false)
+{
+  thread_ = std::thread([this]() { run(); });
+}
+
+GroupCommit::~GroupCommit() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  cv_.notify_all();
+  thread_.join();
+}
+
+void GroupCommit::add(FileSink& sink, Done done) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (queued_.empty()) {
+      first_queued_ = std::chrono::steady_clock::now();
+    }
+    queued_.push_back(Entry{&sink, std::move(done)});
+  }
+  cv_.notify_all();
+}
+
+void GroupCommit::sync(FileSink& sink, uint64_t mark, Done done) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    syncing_++;
+  }
+  FileSink* target = &sink;
+  sink.when_written(mark, [this, target, done](bool written) {
+    resume_sync(Sync{target, done, written, !written || !durable_});
+  });
+}
+
+void GroupCommit::drain() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  cv_.wait(lock, [this]() { return queued_.empty() && committing_ == 0 && syncing_ == 0; });
+}
+
+void GroupCommit::resume_sync(Sync sync) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    synced_.push_back(std::move(sync));
+  }
+  cv_.notify_all();
+}
+
+void GroupCommit::carry_on(Sync& sync) {
+  if (!sync.flushed) {
+    // The writes are in; the flush runs in the disk queue, not on this thread
+    FileSink* sink = sync.sink;
+    Done done = sync.done;
+    if (sink->flush_file([this, sink, done](bool synced) { resume_sync(Sync{sink, done, synced, true}); })) {
+      return;
+    }
+    sync.ok = false;
+  }
+  sync.done(sync.ok);
+  std::lock_guard<std::mutex> lock(mutex_);
+  syncing_--;
+  cv_.notify_all();
+}
+
+GroupCommit::Stats GroupCommit::stats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
+
+void GroupCommit::run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    cv_.wait(lock, [this]() {
+      return !queued_.empty() || !synced_.empty() || (stopping_ && syncing_ == 0);
+    });
+    if (!synced_.empty()) {
+      // Syncs are carried on as soon as they can be, between batches
+      std::vector<Sync> ready;
+      ready.swap(synced_);
+      lock.unlock();
+      for (Sync& sync : ready) {
+        carry_on(sync);
+      }
+      lock.lock();
+      continue;
+    }
+    if (queued_.empty()) {
+      return;
+    }
+    // Give other uploads finishing about now the chance to share the sync
+    cv_.wait_until(lock, first_queued_ + window_, [this]() {
+      return stopping_ || queued_.size() >= max_batch_ || !synced_.empty();
+    });
+    if (!synced_.empty()) {
+      continue;
+    }
+
+    size_t count = std::min(queued_.size(), max_batch_);
+    std::vector<Entry> batch(std::make_move_iterator(queued_.begin()),
+                             std::make_move_iterator(queued_.begin() + count));
+    queued_.erase(queued_.begin(), queued_.begin() + count);
+    first_queued_ = std::chrono::steady_clock::now();
+    committing_ = count;
+    lock.unlock();
+
+    commit_batch(batch);
+
+    lock.lock();
+    committing_ = 0;
+    cv_.notify_all();
+  }
+}
+
+void GroupCommit::commit_batch(std::vector<Entry>& batch) {
+  // Data first, every file's flush in flight at once
+  std::vector<char> stored(batch.size(), 1);
+  std::mutex synced_mutex;
+  std::condition_variable synced_cv;
+  size_t syncing = durable_ ? batch.size() : 0;
+  for (size_t i = 0; durable_ && i < batch.size(); ++i) {
+    bool queued = batch[i].sink->sync_data([&, i](bool synced) {
+      std::lock_guard<std::mutex> lock(synced_mutex);
+      stored[i] = synced;
+      if (--syncing == 0) {
+        synced_cv.notify_one();
+      }
+    });
+    if (!queued) {
+      std::lock_guard<std::mutex> lock(synced_mutex);
+      stored[i] = 0;
+      --syncing;
+    }
+  }
+  {
+    std::unique_lock<std::mutex> lock(synced_mutex);
+    synced_cv.wait(lock, [&]() { return syncing == 0; });
+  }
+
+  // Then the names: renames become durable with their directory, which is
+  // synced once however many files landed in it
+  std::set<std::pair<int, std::string>> synced_dirs;
+  std::set<std::pair<int, std::string>> failed_dirs;
+  for (size_t i = 0; i < batch.size(); ++i) {
+    FileSink& sink = *batch[i].sink;
+    if (!stored[i]) {
+      sink.abort();
+      continue;
+    }
+    if (!sink.commit()) {
+      stored[i] = 0;
+      continue;
+    }
+    std::pair<int, std::string> dir = parent_of(sink);
+    if (durable_ && synced_dirs.count(dir) == 0 && failed_dirs.count(dir) == 0) {
+      (sink.sync_directory() ? synced_dirs : failed_dirs).insert(dir);
+    }
+  }
+
+  size_t failures = 0;
+  for (size_t i = 0; i < batch.size(); ++i) {
+    if (stored[i] && failed_dirs.count(parent_of(*batch[i].sink)) > 0) {
+      stored[i] = 0;
+    }
+    failures += stored[i] ? 0 : 1;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_.batches++;
+    stats_.files += batch.size();
+    stats_.failures += failures;
+    stats_.largest_batch = std::max(stats_.largest_batch, batch.size());
+  }
+
+  for (size_t i = 0; i < batch.size(); ++i) {
+    batch[i].done(stored[i] != 0);
+  }
+}
+
+} // namespace quicftp
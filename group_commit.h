@@ -0,0 +1,103 @@
+// group_commit.h
+// Batched durability for completed uploads
+// Files finishing within a short window are made durable together: their
+// data is flushed by fdatasyncs running side by side in the disk queue, they
+// are renamed into place, and each directory involved is synced once. Only
+// then are they reported stored, so a burst of small files costs about one
+// sync round trip rather than one per file. Without durability it only takes
+// the waiting for writes, closing and renaming off the caller's thread.
+// Syncs of files kept open wait for their writes and flushes in the disk
+// queue instead, so they never hold up a batch.
+
+#ifndef GROUP_COMMIT_H
+#define GROUP_COMMIT_H
+
+#include "file_sink.h"
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace quicftp {
+
+class GroupCommit {
+public:
+  using Done = std::function<void(bool stored)>;
+
+  struct Stats {
+    uint64_t batches = 0;
+    uint64_t files = 0;
+    uint64_t failures = 0;
+    size_t largest_batch = 0;
+  };
+
+  // The first file of a batch waits up to window_ms for others to join;
+  // max_batch caps a batch (1 commits every file on its own). Unless
+  // durable, files are renamed into place without any syncs.
+  GroupCommit(int window_ms, size_t max_batch, bool durable = true);
+
+  // Commits whatever is still queued
+  ~GroupCommit();
+
+  GroupCommit(const GroupCommit&) = delete;
+  GroupCommit& operator=(const GroupCommit&) = delete;
+
+  // Commit sink, which has been handed all its data, as part of the next
+  // batch. done runs on the committer's thread; sink must live until then.
+  void add(FileSink& sink, Done done);
+
+  // Make the writes sink had queued by mark (see FileSink::write_mark) reach
+  // the file, and stable storage if durable, leaving it open. Later writes
+  // are not waited for. done runs on the committer's thread once they are
+  // there, in no particular order with other callbacks; sink must live
+  // until then.
+  void sync(FileSink& sink, uint64_t mark, Done done);
+
+  // Wait until everything added or synced so far is done
+  void drain();
+
+  Stats stats() const;
+
+private:
+  struct Entry {
+    FileSink* sink;
+    Done done;
+  };
+
+  // A sync whose writes are done; flushed is set once nothing is left
+  // before done but to run it
+  struct Sync {
+    FileSink* sink;
+    Done done;
+    bool ok;
+    bool flushed;
+  };
+
+  std::chrono::milliseconds window_;
+  size_t max_batch_;
+  bool durable_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  std::vector<Entry> queued_;
+  std::chrono::steady_clock::time_point first_queued_;
+  size_t committing_;
+  std::vector<Sync> synced_;  // for the committer's thread to carry on
+  size_t syncing_;            // syncs not done yet
+  bool stopping_;
+  Stats stats_;
+  std::thread thread_;
+
+  void resume_sync(Sync sync);
+  void carry_on(Sync& sync);
+  void run();
+  void commit_batch(std::vector<Entry>& batch);
+};
+
+} // namespace quicftp
+
+#endif
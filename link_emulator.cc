@@ -0,0 +1,253 @@
+// link_emulator.cc
+
+#include "link_emulator.h"
+#include "rate_limiter.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+namespace quicftp {
+
+namespace {
+
+constexpr double kDelayBucketGrowth = 1.125;
+
+bool parse_duration(const std::string& text, std::chrono::steady_clock::duration& value) {
+  char* end = nullptr;
+  double number = std::strtod(text.c_str(), &end);
+  if (end == text.c_str() || number < 0) {
+    return false;
+  }
+  std::string unit(end);
+  double seconds;
+  if (unit == "us") {
+    seconds = number / 1e6;
+  } else if (unit == "ms" || unit.empty()) {
+    seconds = number / 1e3;
+  } else if (unit == "s") {
+    seconds = number;
+  } else {
+    return false;
+  }
+  value = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds));
+  return true;
+}
+
+bool parse_chance(const std::string& text, double& value) {
+  char* end = nullptr;
+  double number = std::strtod(text.c_str(), &end);
+  if (end == text.c_str()) {
+    return false;
+  }
+  std::string unit(end);
+  if (unit == "%") {
+    number /= 100;
+  } else if (!unit.empty()) {
+    return false;
+  }
+  if (number < 0 || number > 1) {
+    return false;
+  }
+  value = number;
+  return true;
+}
+
+// Sizes and rates share the rate limiter's syntax, less its burst
+bool parse_amount(const std::string& text, uint64_t& value) {
+  RateLimit limit;
+  if (text.find(':') != std::string::npos || !parse_rate_limit(text, limit)) {
+    return false;
+  }
+  value = limit.bytes_per_second;
+  return true;
+}
+
+std::string format_ms(std::chrono::steady_clock::duration duration) {
+  char text[32];
+  std::snprintf(text, sizeof(text), "%gms", std::chrono::duration<double, std::milli>(duration).count());
+  return text;
+}
+
+std::string format_percent(double chance) {
+  char text[32];
+  std::snprintf(text, sizeof(text), "%g%%", chance * 100);
+  return text;
+}
+
+} // namespace
+
+bool parse_link_conditions(const std::string& text, LinkConditions& conditions) {
+  LinkConditions parsed;
+  size_t start = 0;
+  while (start < text.size()) {
+    size_t comma = text.find(',', start);
+    std::string item = text.substr(start, comma == std::string::npos ? std::string::npos : comma - start);
+    size_t equals = item.find('=');
+    if (equals == std::string::npos) {
+      return false;
+    }
+    std::string key = item.substr(0, equals);
+    std::string value = item.substr(equals + 1);
+    uint64_t amount;
+    bool ok;
+    if (key == "rate") {
+      ok = parse_amount(value, parsed.rate);
+    } else if (key == "queue") {
+      ok = parse_amount(value, amount);
+      parsed.queue = static_cast<size_t>(amount);
+    } else if (key == "delay") {
+      ok = parse_duration(value, parsed.delay);
+    } else if (key == "jitter") {
+      ok = parse_duration(value, parsed.jitter);
+    } else if (key == "loss") {
+      ok = parse_chance(value, parsed.loss);
+    } else if (key == "duplicate") {
+      ok = parse_chance(value, parsed.duplicate);
+    } else if (key == "reorder") {
+      ok = parse_chance(value, parsed.reorder);
+    } else {
+      ok = false;
+    }
+    if (!ok) {
+      return false;
+    }
+    if (comma == std::string::npos) break;
+    start = comma + 1;
+  }
+  conditions = parsed;
+  return true;
+}
+
+std::string link_conditions_name(const LinkConditions& conditions) {
+  std::string name;
+  auto add = [&](const std::string& item) { name += (name.empty() ? "" : ", ") + item; };
+  if (conditions.rate > 0) add(std::to_string(conditions.rate) + " B/s");
+  if (conditions.queue > 0) add("queue " + std::to_string(conditions.queue) + " B");
+  if (conditions.delay.count() > 0) add("delay " + format_ms(conditions.delay));
+  if (conditions.jitter.count() > 0) add("jitter " + format_ms(conditions.jitter));
+  if (conditions.loss > 0) add("loss " + format_percent(conditions.loss));
+  if (conditions.duplicate > 0) add("duplicate " + format_percent(conditions.duplicate));
+  if (conditions.reorder > 0) add("reorder " + format_percent(conditions.reorder));
+  return name.empty() ? "perfect" : name;
+}
+
+LinkEmulator::LinkEmulator(const LinkConditions& conditions)
+  : conditions_(conditions)
+  , random_(std::random_device()())
+  , next_order_(0)
+  , delays_(kDelayBuckets, 0)
+{
+}
+
+void LinkEmulator::set_conditions(const LinkConditions& conditions) {
+  conditions_ = conditions;
+}
+
+bool LinkEmulator::chance(double probability) {
+  return probability > 0 && std::uniform_real_distribution<double>(0, 1)(random_) < probability;
+}
+
+void LinkEmulator::submit(Clock::time_point now, Packet packet) {
+  stats_.packets_in++;
+  packet.sent_at = now;
+  if (chance(conditions_.loss)) {
+    stats_.lost++;
+    return;
+  }
+
+  // Wait behind what the bottleneck already holds, then take its turn
+  Clock::time_point departs = now;
+  if (conditions_.rate > 0) {
+    link_free_ = std::max(link_free_, now);
+    double backlog = std::chrono::duration<double>(link_free_ - now).count() * static_cast<double>(conditions_.rate);
+    if (conditions_.queue > 0 && backlog + static_cast<double>(packet.data.size()) > static_cast<double>(conditions_.queue)) {
+      stats_.overflowed++;
+      return;
+    }
+    link_free_ += std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(static_cast<double>(packet.data.size()) / static_cast<double>(conditions_.rate)));
+    departs = link_free_;
+  }
+
+  Clock::time_point due;
+  if (chance(conditions_.reorder)) {
+    stats_.reordered++;
+    due = departs;
+  } else {
+    due = departs + conditions_.delay;
+    if (conditions_.jitter.count() > 0) {
+      due += std::chrono::duration_cast<Clock::duration>(
+          conditions_.jitter * std::uniform_real_distribution<double>(0, 1)(random_));
+    }
+    // Jitter spreads packets out without passing one another
+    due = std::max(due, last_due_);
+    last_due_ = due;
+  }
+  if (chance(conditions_.duplicate)) {
+    stats_.duplicated++;
+    enqueue(due, packet);
+  }
+  enqueue(due, std::move(packet));
+}
+
+void LinkEmulator::enqueue(Clock::time_point due, Packet packet) {
+  pending_.push(Pending{due, next_order_++, std::move(packet)});
+}
+
+void LinkEmulator::release(Clock::time_point now, std::vector<Packet>& out) {
+  out.clear();
+  while (!pending_.empty() && pending_.top().due <= now) {
+    // The queue hands out const references; the packet is done with there
+    Pending& next = const_cast<Pending&>(pending_.top());
+    Clock::duration delay = now - next.packet.sent_at;
+    stats_.packets_out++;
+    stats_.bytes_out += next.packet.data.size();
+    window_.packets++;
+    window_.bytes += next.packet.data.size();
+    window_.max = std::max(window_.max, delay);
+    delays_[delay_bucket(delay)]++;
+    out.push_back(std::move(next.packet));
+    pending_.pop();
+  }
+}
+
+LinkEmulator::Clock::time_point LinkEmulator::next_due() const {
+  return pending_.empty() ? Clock::time_point::max() : pending_.top().due;
+}
+
+LinkEmulator::Window LinkEmulator::window() {
+  Window window = window_;
+  uint64_t seen = 0;
+  for (size_t i = 0; i < kDelayBuckets; ++i) {
+    if (delays_[i] == 0) continue;
+    seen += delays_[i];
+    if (window.p50 == Clock::duration::zero() && seen * 2 >= window.packets) {
+      window.p50 = std::min(bucket_delay(i), window.max);
+    }
+    if (seen * 100 >= window.packets * 99) {
+      window.p99 = std::min(bucket_delay(i), window.max);
+      break;
+    }
+  }
+  window_ = Window();
+  std::fill(delays_.begin(), delays_.end(), 0);
+  return window;
+}
+
+size_t LinkEmulator::delay_bucket(Clock::duration delay) {
+  double us = std::chrono::duration<double, std::micro>(delay).count();
+  if (us < 1) {
+    return 0;
+  }
+  size_t bucket = 1 + static_cast<size_t>(std::log(us) / std::log(kDelayBucketGrowth));
+  return std::min(bucket, kDelayBuckets - 1);
+}
+
+LinkEmulator::Clock::duration LinkEmulator::bucket_delay(size_t bucket) {
+  // The top of the bucket, so percentiles never flatter the link
+  return std::chrono::duration_cast<Clock::duration>(
+      std::chrono::duration<double, std::micro>(std::pow(kDelayBucketGrowth, static_cast<double>(bucket))));
+}
+
+} // namespace quicftp
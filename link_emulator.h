@@ -0,0 +1,127 @@
+// link_emulator.h
+// One direction of a network link, in software
+// Packets handed in come out later, as a path with the given conditions
+// would deliver them: queued behind a bottleneck of fixed rate (and dropped
+// once its buffer is full), delayed by the propagation delay plus random
+// jitter, and at random lost, duplicated or let jump the queue. The UDP
+// transport puts one in front of its socket when QUICFTP_LINK is set, and
+// quicftprelay runs one each way between clients and a server, so transport
+// and congestion control changes can be judged on a known, repeatable path.
+
+#ifndef LINK_EMULATOR_H
+#define LINK_EMULATOR_H
+
+#include <chrono>
+#include <queue>
+#include <random>
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <sys/socket.h>
+
+namespace quicftp {
+
+struct LinkConditions {
+  uint64_t rate = 0;                             // bottleneck bytes per second; 0 for unlimited
+  size_t queue = 0;                              // bytes queued at the bottleneck before drops; 0 for unlimited
+  std::chrono::steady_clock::duration delay{};   // one way
+  std::chrono::steady_clock::duration jitter{};  // up to this much more delay, uniformly
+  double loss = 0;                               // chance each packet is dropped
+  double duplicate = 0;                          // chance each packet arrives twice
+  double reorder = 0;                            // chance each packet skips the delay, overtaking others
+};
+
+// Comma-separated key=value settings, e.g. "rate=12M,queue=256K,delay=20ms,
+// jitter=2ms,loss=1%,duplicate=0.1%,reorder=0.5%"; keys not given are off.
+// Sizes and rates take K/M/G suffixes, durations us/ms/s (ms if bare), and
+// chances a % sign or a fraction.
+bool parse_link_conditions(const std::string& text, LinkConditions& conditions);
+std::string link_conditions_name(const LinkConditions& conditions);
+
+class LinkEmulator {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  struct Packet {
+    std::vector<uint8_t> data;
+    sockaddr_storage addr; // where it is headed
+    socklen_t addr_len = 0;
+    uint64_t tag = 0;      // the user's, e.g. which socket it goes out of
+    Clock::time_point sent_at;
+  };
+
+  // Counters since construction
+  struct Stats {
+    uint64_t packets_in = 0;
+    uint64_t packets_out = 0;
+    uint64_t bytes_out = 0;
+    uint64_t lost = 0;       // at random
+    uint64_t overflowed = 0; // the bottleneck queue was full
+    uint64_t duplicated = 0;
+    uint64_t reordered = 0;
+  };
+
+  // What came out since the last window() call
+  struct Window {
+    uint64_t packets = 0;
+    uint64_t bytes = 0;
+    Clock::duration p50{}; // one-way delay, queueing included
+    Clock::duration p99{};
+    Clock::duration max{};
+  };
+
+  explicit LinkEmulator(const LinkConditions& conditions = LinkConditions());
+
+  LinkEmulator(const LinkEmulator&) = delete;
+  LinkEmulator& operator=(const LinkEmulator&) = delete;
+
+  // Applies to packets submitted from now on
+  void set_conditions(const LinkConditions& conditions);
+  const LinkConditions& conditions() const { return conditions_; }
+
+  void submit(Clock::time_point now, Packet packet);
+
+  // Move the packets due by now, in order of arrival, to out (cleared first)
+  void release(Clock::time_point now, std::vector<Packet>& out);
+
+  // When the next packet is due; time_point::max() if none waits
+  Clock::time_point next_due() const;
+
+  Stats stats() const { return stats_; }
+  Window window();
+
+private:
+  struct Pending {
+    Clock::time_point due;
+    uint64_t order;
+    Packet packet;
+  };
+  struct Later {
+    bool operator()(const Pending& a, const Pending& b) const {
+      return a.due != b.due ? a.due > b.due : a.order > b.order;
+    }
+  };
+
+  // One-way delays in buckets growing by an eighth, from 1us
+  static constexpr size_t kDelayBuckets = 192;
+
+  LinkConditions conditions_;
+  std::mt19937_64 random_;
+  std::priority_queue<Pending, std::vector<Pending>, Later> pending_;
+  uint64_t next_order_;
+  Clock::time_point link_free_;  // when the bottleneck has sent all it holds
+  Clock::time_point last_due_;   // packets not reordered keep their order
+  Stats stats_;
+  Window window_;
+  std::vector<uint64_t> delays_;
+
+  bool chance(double probability);
+  void enqueue(Clock::time_point due, Packet packet);
+  static size_t delay_bucket(Clock::duration delay);
+  static Clock::duration bucket_delay(size_t bucket);
+};
+
+} // namespace quicftp
+
+#endif
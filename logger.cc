@@ -0,0 +1,192 @@
+// logger.cc
+
+#include "logger.h"
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+
+namespace quicftp {
+
+namespace {
+
+// The flusher sleeps this long at most when it may have missed a wakeup
+constexpr int kIdleWaitMs = 10;
+
+const char* tag(LogLevel level, LogCategory category) {
+  if (level == LogLevel::Error) return "ERROR";
+  if (level == LogLevel::Debug) return "DEBUG";
+  switch (category) {
+    case LogCategory::Connection: return "CONNECTION";
+    case LogCategory::Auth: return "AUTH";
+    case LogCategory::Transfer: return "TRANSFER";
+    case LogCategory::Transport: return "TRANSPORT";
+    default: return "INFO";
+  }
+}
+
+} // namespace
+
+Logger& Logger::instance() {
+  static Logger logger;
+  return logger;
+}
+
+Logger::Logger()
+  : slots_(new Slot[kSlots])
+  , tail_(0)
+  , head_(0)
+  , written_(0)
+  , dropped_(0)
+  , sleeping_(false)
+  , stopping_(false)
+  , cached_ms_(-1)
+  , cached_second_(-1)
+{
+  cached_text_[0] = '\0';
+  for (size_t i = 0; i < kSlots; ++i) {
+    slots_[i].sequence.store(i, std::memory_order_relaxed);
+  }
+  thread_ = std::thread([this]() { run(); });
+}
+
+Logger::~Logger() {
+  stopping_ = true;
+  wake_.notify_one();
+  thread_.join();
+}
+
+void Logger::write(LogLevel level, LogCategory category, std::string message) {
+  int64_t time_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+
+  // Claim a slot: its sequence equals the position once the flusher has
+  // emptied it for this lap of the ring
+  uint64_t pos = tail_.load(std::memory_order_relaxed);
+  Slot* slot;
+  for (;;) {
+    slot = &slots_[pos % kSlots];
+    uint64_t sequence = slot->sequence.load(std::memory_order_acquire);
+    int64_t lag = static_cast<int64_t>(sequence - pos);
+    if (lag == 0) {
+      if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (lag < 0) {
+      // Full
+      if (level != LogLevel::Error) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return;
+      }
+      wake_.notify_one();
+      std::this_thread::yield();
+      pos = tail_.load(std::memory_order_relaxed);
+    } else {
+      pos = tail_.load(std::memory_order_relaxed);
+    }
+  }
+
+  slot->level = level;
+  slot->category = category;
+  slot->time_ms = time_ms;
+  slot->text = std::move(message);
+  slot->sequence.store(pos + 1, std::memory_order_release);
+
+  if (sleeping_.load()) {
+    wake_.notify_one();
+  }
+}
+
+void Logger::flush() {
+  uint64_t target = tail_.load(std::memory_order_acquire);
+  std::unique_lock<std::mutex> lock(mutex_);
+  wake_.notify_one();
+  flushed_.wait(lock, [&]() { return written_.load(std::memory_order_acquire) >= target; });
+}
+
+void Logger::run() {
+  std::string out;
+  std::string err;
+  uint64_t reported_drops = 0;
+  for (;;) {
+    if (drain(out, err)) {
+      uint64_t drops = dropped_.load(std::memory_order_relaxed);
+      if (drops != reported_drops) {
+        err += "[" + std::string(timestamp(cached_ms_)) + "] [ERROR] Log full, " +
+               std::to_string(drops - reported_drops) + " messages dropped\n";
+        reported_drops = drops;
+      }
+      if (!err.empty()) {
+        std::fwrite(err.data(), 1, err.size(), stderr);
+        std::fflush(stderr);
+        err.clear();
+      }
+      if (!out.empty()) {
+        std::fwrite(out.data(), 1, out.size(), stdout);
+        std::fflush(stdout);
+        out.clear();
+      }
+      std::lock_guard<std::mutex> lock(mutex_);
+      written_.store(head_, std::memory_order_release);
+      flushed_.notify_all();
+      continue;
+    }
+    if (stopping_ && tail_.load() == head_) {
+      return;
+    }
+
+    // Writers only notify while this is set, so look again after setting it
+    std::unique_lock<std::mutex> lock(mutex_);
+    sleeping_.store(true);
+    if (slots_[head_ % kSlots].sequence.load(std::memory_order_acquire) != head_ + 1 && !stopping_) {
+      wake_.wait_for(lock, std::chrono::milliseconds(kIdleWaitMs));
+    }
+    sleeping_.store(false);
+  }
+}
+
+bool Logger::drain(std::string& out, std::string& err) {
+  bool any = false;
+  for (;;) {
+    Slot& slot = slots_[head_ % kSlots];
+    if (slot.sequence.load(std::memory_order_acquire) != head_ + 1) {
+      return any;
+    }
+    std::string& line = slot.level == LogLevel::Error ? err : out;
+    line += '[';
+    line += timestamp(slot.time_ms);
+    line += "] [";
+    line += tag(slot.level, slot.category);
+    line += "] ";
+    line += slot.text;
+    line += '\n';
+    // Released here rather than by the next writer of the slot
+    std::string().swap(slot.text);
+    slot.sequence.store(head_ + kSlots, std::memory_order_release);
+    ++head_;
+    any = true;
+  }
+}
+
+const char* Logger::timestamp(int64_t time_ms) {
+  if (time_ms == cached_ms_) {
+    return cached_text_;
+  }
+  int64_t second = time_ms / 1000;
+  if (second != cached_second_) {
+    std::time_t now = static_cast<std::time_t>(second);
+    std::tm tm;
+    localtime_r(&now, &tm);
+    std::strftime(cached_text_, sizeof(cached_text_), "%Y-%m-%d %H:%M:%S.000", &tm);
+    cached_second_ = second;
+  }
+  // Only the milliseconds change within a second
+  size_t length = std::char_traits<char>::length(cached_text_);
+  int ms = static_cast<int>(time_ms % 1000);
+  cached_text_[length - 3] = static_cast<char>('0' + ms / 100);
+  cached_text_[length - 2] = static_cast<char>('0' + ms / 10 % 10);
+  cached_text_[length - 1] = static_cast<char>('0' + ms % 10);
+  cached_ms_ = time_ms;
+  return cached_text_;
+}
+
+} // namespace quicftp
@@ -0,0 +1,120 @@
+// logger.h
+// Asynchronous logging for the server's threads
+// A message is handed to a bounded lock-free ring in a single claim and
+// publish; a background thread formats the lines, batching them into one
+// write and flush per wakeup. Timestamps are taken when a message is logged
+// and formatted by the flusher, which reuses the text until the millisecond
+// changes. Levels and categories left out at build time (QUICFTP_LOG_LEVEL,
+// QUICFTP_LOG_CATEGORIES) compile to nothing: QUICFTP_LOG never evaluates
+// their messages.
+
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <cstddef>
+#include <cstdint>
+
+// Most detailed level built in: 0 errors only, 1 info (default), 2 debug
+#ifndef QUICFTP_LOG_LEVEL
+#define QUICFTP_LOG_LEVEL 1
+#endif
+
+// Categories built in, as a mask of LogCategory values (default all)
+#ifndef QUICFTP_LOG_CATEGORIES
+#define QUICFTP_LOG_CATEGORIES 0xff
+#endif
+
+namespace quicftp {
+
+enum class LogLevel { Error = 0, Info = 1, Debug = 2 };
+
+enum class LogCategory : unsigned {
+  General = 1 << 0,
+  Connection = 1 << 1,
+  Auth = 1 << 2,
+  Transfer = 1 << 3,
+  Transport = 1 << 4
+};
+
+// Whether messages of level and category are built in; errors always are
+constexpr bool log_compiled(LogLevel level, LogCategory category) {
+  return level == LogLevel::Error ||
+         (static_cast<int>(level) <= QUICFTP_LOG_LEVEL &&
+          (static_cast<unsigned>(category) & static_cast<unsigned>(QUICFTP_LOG_CATEGORIES)) != 0);
+}
+
+class Logger {
+public:
+  static Logger& instance();
+
+  Logger();
+  ~Logger();
+
+  Logger(const Logger&) = delete;
+  Logger& operator=(const Logger&) = delete;
+
+  // Queue a line: errors go to stderr, the rest to stdout. Below errors, a
+  // message that finds the ring full is dropped and counted; errors wait.
+  void write(LogLevel level, LogCategory category, std::string message);
+
+  // Wait until everything queued before the call has been written
+  void flush();
+
+  // Messages dropped because the ring was full
+  uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+private:
+  static constexpr size_t kSlots = 4096;
+
+  struct Slot {
+    std::atomic<uint64_t> sequence{0};
+    LogLevel level = LogLevel::Info;
+    LogCategory category = LogCategory::General;
+    int64_t time_ms = 0;
+    std::string text;
+  };
+
+  std::unique_ptr<Slot[]> slots_;
+  alignas(64) std::atomic<uint64_t> tail_;   // next position to claim
+  alignas(64) uint64_t head_;                // next to write; flusher only
+  std::atomic<uint64_t> written_;
+  std::atomic<uint64_t> dropped_;
+  std::atomic<bool> sleeping_;
+  std::atomic<bool> stopping_;
+
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::condition_variable flushed_;
+  std::thread thread_;
+
+  // Flusher only: the last timestamp formatted and its second
+  int64_t cached_ms_;
+  int64_t cached_second_;
+  char cached_text_[32];
+
+  void run();
+  // Format what is ready into out and err; false if nothing was
+  bool drain(std::string& out, std::string& err);
+  const char* timestamp(int64_t time_ms);
+};
+
+} // namespace quicftp
+
+// Log message when level and category are built in and enabled holds;
+// otherwise neither is evaluated
+#define QUICFTP_LOG(level, category, enabled, message)                 \
+  do {                                                                 \
+    if constexpr (::quicftp::log_compiled(level, category)) {          \
+      if (enabled) {                                                   \
+        ::quicftp::Logger::instance().write(level, category, message); \
+      }                                                                \
+    }                                                                  \
+  } while (0)
+
+#endif
@@ -0,0 +1,468 @@
+// metrics.cc
+
+#include "metrics.h"
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace quicftp {
+
+namespace {
+
+// Bucket bounds exported for every histogram: powers of four of its unit,
+// the same for every scrape so rates over them add up
+constexpr unsigned kExportedBoundBits = 2;
+
+constexpr double kExportedQuantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+// Largest request a scraper may send
+constexpr size_t kMaxRequestSize = 8192;
+
+// A scraper that stops talking is dropped after this long
+constexpr int kScrapeTimeoutMs = 2000;
+
+std::string escape_label(const std::string& value) {
+  std::string out;
+  out.reserve(value.size());
+  for (char c : value) {
+    if (c == '\\' || c == '"') {
+      out += '\\';
+      out += c;
+    } else if (c == '\n') {
+      out += "\\n";
+    } else {
+      out += c;
+    }
+  }
+  return out;
+}
+
+// {a="x",b="y"} plus an extra label if given; empty if there are none
+std::string render_labels(const MetricLabels& labels, const std::string& extra_name = std::string(),
+                          const std::string& extra_value = std::string()) {
+  std::string out;
+  for (const auto& [name, value] : labels) {
+    out += (out.empty() ? "{" : ",") + name + "=\"" + escape_label(value) + "\"";
+  }
+  if (!extra_name.empty()) {
+    out += (out.empty() ? "{" : ",") + extra_name + "=\"" + extra_value + "\"";
+  }
+  return out.empty() ? out : out + "}";
+}
+
+std::string format_number(double value) {
+  if (std::isinf(value)) {
+    return value > 0 ? "+Inf" : "-Inf";
+  }
+  char text[32];
+  std::snprintf(text, sizeof(text), "%.10g", value);
+  return text;
+}
+
+// Gives up on a scraper that stops reading for kScrapeTimeoutMs
+bool write_all(int fd, const char* data, size_t len) {
+  while (len > 0) {
+    pollfd pfd = {fd, POLLOUT, 0};
+    int ready = poll(&pfd, 1, kScrapeTimeoutMs);
+    if (ready < 0 && errno == EINTR) continue;
+    if (ready <= 0) return false;
+    ssize_t n = send(fd, data, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    data += n;
+    len -= static_cast<size_t>(n);
+  }
+  return true;
+}
+
+} // namespace
+
+Histogram::Histogram(double unit_seconds)
+  : unit_seconds_(unit_seconds)
+  , buckets_(new std::atomic<uint64_t>[kBuckets])
+{
+  for (size_t i = 0; i < kBuckets; ++i) {
+    buckets_[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+size_t Histogram::bucket_of(uint64_t value) {
+  constexpr uint64_t kExact = uint64_t(2) << kSubBucketBits;
+  if (value < kExact) {
+    return static_cast<size_t>(value);
+  }
+  unsigned top_bit = 63 - static_cast<unsigned>(__builtin_clzll(value));
+  if (top_bit >= kMaxValueBits) {
+    return kBuckets - 1;
+  }
+  // The top kSubBucketBits + 1 bits pick the sub-bucket within the power of two
+  unsigned shift = top_bit - kSubBucketBits;
+  return (static_cast<size_t>(shift) << kSubBucketBits) + static_cast<size_t>(value >> shift);
+}
+
+uint64_t Histogram::bucket_top(size_t bucket) {
+  constexpr size_t kExact = size_t(2) << kSubBucketBits;
+  if (bucket < kExact) {
+    return bucket;
+  }
+  size_t shift = (bucket >> kSubBucketBits) - 1;
+  uint64_t mantissa = bucket - (shift << kSubBucketBits);
+  return ((mantissa + 1) << shift) - 1;
+}
+
+void Histogram::record(uint64_t value) {
+  buckets_[bucket_of(value)].fetch_add(1, std::memory_order_relaxed);
+  sum_.fetch_add(value, std::memory_order_relaxed);
+}
+
+Histogram::Snapshot Histogram::snapshot() const {
+  Snapshot snapshot;
+  snapshot.buckets.resize(kBuckets);
+  // Counted from the buckets, so the total matches them even with records
+  // landing during the copy
+  for (size_t i = 0; i < kBuckets; ++i) {
+    snapshot.buckets[i] = buckets_[i].load(std::memory_order_relaxed);
+    snapshot.count += snapshot.buckets[i];
+  }
+  snapshot.sum = sum_.load(std::memory_order_relaxed);
+  return snapshot;
+}
+
+uint64_t Histogram::Snapshot::value_at(double quantile) const {
+  if (count == 0) {
+    return 0;
+  }
+  uint64_t rank = static_cast<uint64_t>(std::ceil(quantile * static_cast<double>(count)));
+  rank = std::max<uint64_t>(rank, 1);
+  uint64_t seen = 0;
+  for (size_t i = 0; i < buckets.size(); ++i) {
+    seen += buckets[i];
+    if (seen >= rank) {
+      return bucket_top(i);
+    }
+  }
+  return bucket_top(buckets.size() - 1);
+}
+
+uint64_t Histogram::Snapshot::count_at_most(uint64_t limit) const {
+  uint64_t at_most = 0;
+  size_t last = std::min(bucket_of(limit), buckets.size() - 1);
+  for (size_t i = 0; i <= last; ++i) {
+    at_most += buckets[i];
+  }
+  return at_most;
+}
+
+const char* MetricsRegistry::type_name(Type type) {
+  switch (type) {
+    case Type::Counter: return "counter";
+    case Type::Gauge: return "gauge";
+    default: return "histogram";
+  }
+}
+
+MetricsRegistry& MetricsRegistry::instance() {
+  static MetricsRegistry registry;
+  return registry;
+}
+
+MetricsRegistry::Series* MetricsRegistry::find_or_add(const std::string& name, const std::string& help, Type type,
+                                                      const MetricLabels& labels) {
+  auto family = families_.find(name);
+  if (family == families_.end()) {
+    family = families_.emplace(name, Family{type, help, {}}).first;
+  } else if (family->second.type != type) {
+    return nullptr;
+  }
+  Series& series = family->second.series[render_labels(labels)];
+  series.labels = labels;
+  return &series;
+}
+
+std::shared_ptr<Counter> MetricsRegistry::counter(const std::string& name, const std::string& help,
+                                                  const MetricLabels& labels) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Series* series = find_or_add(name, help, Type::Counter, labels);
+  if (!series) {
+    return nullptr;
+  }
+  if (!series->counter) {
+    series->counter = std::make_shared<Counter>();
+  }
+  return series->counter;
+}
+
+std::shared_ptr<Gauge> MetricsRegistry::gauge(const std::string& name, const std::string& help,
+                                              const MetricLabels& labels) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Series* series = find_or_add(name, help, Type::Gauge, labels);
+  if (!series) {
+    return nullptr;
+  }
+  if (!series->gauge) {
+    series->gauge = std::make_shared<Gauge>();
+  }
+  return series->gauge;
+}
+
+std::shared_ptr<Histogram> MetricsRegistry::histogram(const std::string& name, const std::string& help,
+                                                      double unit_seconds, const MetricLabels& labels) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Series* series = find_or_add(name, help, Type::Histogram, labels);
+  if (!series) {
+    return nullptr;
+  }
+  if (!series->histogram) {
+    series->histogram = std::make_shared<Histogram>(unit_seconds);
+  }
+  return series->histogram;
+}
+
+void MetricsRegistry::gauge_function(const std::string& name, const std::string& help, std::function<double()> read,
+                                     const MetricLabels& labels) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (Series* series = find_or_add(name, help, Type::Gauge, labels)) {
+    series->read = std::make_shared<std::function<double()>>(std::move(read));
+  }
+}
+
+void MetricsRegistry::remove(const std::string& name, const MetricLabels& labels) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto family = families_.find(name);
+  if (family == families_.end()) {
+    return;
+  }
+  family->second.series.erase(render_labels(labels));
+  if (family->second.series.empty()) {
+    families_.erase(family);
+  }
+}
+
+std::string MetricsRegistry::render() const {
+  // Copy the series out, then read them without holding up registrations
+  std::vector<std::pair<std::string, Family>> families;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    families.assign(families_.begin(), families_.end());
+  }
+
+  std::string out;
+  for (const auto& [name, family] : families) {
+    out += "# HELP " + name + " " + family.help + "\n";
+    out += "# TYPE " + name + " " + type_name(family.type) + "\n";
+    for (const auto& [key, series] : family.series) {
+      if (series.counter) {
+        out += name + key + " " + std::to_string(series.counter->value()) + "\n";
+      } else if (series.read) {
+        out += name + key + " " + format_number((*series.read)()) + "\n";
+      } else if (series.gauge) {
+        out += name + key + " " + std::to_string(series.gauge->value()) + "\n";
+      } else if (series.histogram) {
+        Histogram::Snapshot snapshot = series.histogram->snapshot();
+        double unit = series.histogram->unit_seconds();
+        for (unsigned bits = 0; bits <= Histogram::kMaxValueBits; bits += kExportedBoundBits) {
+          uint64_t bound = uint64_t(1) << bits;
+          out += name + "_bucket" + render_labels(series.labels, "le", format_number(static_cast<double>(bound) * unit)) +
+                 " " + std::to_string(snapshot.count_at_most(bound)) + "\n";
+        }
+        out += name + "_bucket" + render_labels(series.labels, "le", "+Inf") + " " +
+               std::to_string(snapshot.count) + "\n";
+        out += name + "_sum" + key + " " + format_number(static_cast<double>(snapshot.sum) * unit) + "\n";
+        out += name + "_count" + key + " " + std::to_string(snapshot.count) + "\n";
+      }
+    }
+
+    // The histograms' own precision, which fixed buckets lose
+    if (family.type == Type::Histogram) {
+      std::string quantiles = name + "_quantiles";
+      out += "# HELP " + quantiles + " " + family.help + " (quantiles to within 3%)\n";
+      out += "# TYPE " + quantiles + " summary\n";
+      for (const auto& [key, series] : family.series) {
+        if (!series.histogram) continue;
+        Histogram::Snapshot snapshot = series.histogram->snapshot();
+        double unit = series.histogram->unit_seconds();
+        for (double q : kExportedQuantiles) {
+          out += quantiles + render_labels(series.labels, "quantile", format_number(q)) + " " +
+                 format_number(static_cast<double>(snapshot.value_at(q)) * unit) + "\n";
+        }
+        out += quantiles + "_sum" + key + " " + format_number(static_cast<double>(snapshot.sum) * unit) + "\n";
+        out += quantiles + "_count" + key + " " + std::to_string(snapshot.count) + "\n";
+      }
+    }
+  }
+  return out;
+}
+
+MetricsExporter::MetricsExporter()
+  : listen_fd_(-1)
+  , wake_fd_(-1)
+{
+}
+
+MetricsExporter::~MetricsExporter() {
+  stop();
+}
+
+bool MetricsExporter::start(const std::string& endpoint) {
+  stop();
+  if (endpoint.compare(0, 5, "unix:") == 0) {
+    std::string path = endpoint.substr(5);
+    sockaddr_un addr = {};
+    if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+      error_ = "bad socket path: " + path;
+      return false;
+    }
+    addr.sun_family = AF_UNIX;
+    std::memcpy(addr.sun_path, path.c_str(), path.size());
+    // A socket left behind by an earlier run would make bind fail
+    struct stat st;
+    if (lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+      unlink(path.c_str());
+    }
+    listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd_ < 0 || bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+      error_ = "cannot bind " + path + ": " + std::strerror(errno);
+      stop();
+      return false;
+    }
+    unix_path_ = path;
+  } else {
+    std::string host = "127.0.0.1";
+    std::string port = endpoint;
+    size_t colon = endpoint.rfind(':');
+    if (colon != std::string::npos) {
+      host = endpoint.substr(0, colon);
+      port = endpoint.substr(colon + 1);
+      if (host.size() >= 2 && host.front() == '[' && host.back() == ']') {
+        host = host.substr(1, host.size() - 2);
+      }
+    }
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    addrinfo* result = nullptr;
+    if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &result) != 0 || !result) {
+      error_ = "cannot resolve " + endpoint;
+      return false;
+    }
+    listen_fd_ = socket(result->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int one = 1;
+    if (listen_fd_ >= 0) {
+      setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    }
+    bool bound = listen_fd_ >= 0 && bind(listen_fd_, result->ai_addr, result->ai_addrlen) == 0;
+    freeaddrinfo(result);
+    if (!bound) {
+      error_ = "cannot bind " + endpoint + ": " + std::strerror(errno);
+      stop();
+      return false;
+    }
+  }
+
+  wake_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (listen(listen_fd_, 16) < 0 || wake_fd_ < 0) {
+    error_ = std::string("cannot listen: ") + std::strerror(errno);
+    stop();
+    return false;
+  }
+  thread_ = std::thread([this]() { serve(); });
+  return true;
+}
+
+void MetricsExporter::stop() {
+  if (thread_.joinable()) {
+    uint64_t one = 1;
+    ssize_t written = write(wake_fd_, &one, sizeof(one));
+    (void)written;
+    thread_.join();
+  }
+  if (listen_fd_ >= 0) {
+    close(listen_fd_);
+    listen_fd_ = -1;
+  }
+  if (wake_fd_ >= 0) {
+    close(wake_fd_);
+    wake_fd_ = -1;
+  }
+  if (!unix_path_.empty()) {
+    unlink(unix_path_.c_str());
+    unix_path_.clear();
+  }
+}
+
+void MetricsExporter::serve() {
+  // One scrape at a time: scrapers are few and each is quick
+  while (true) {
+    pollfd fds[2] = {{listen_fd_, POLLIN, 0}, {wake_fd_, POLLIN, 0}};
+    if (poll(fds, 2, -1) < 0 && errno != EINTR) {
+      return;
+    }
+    if (fds[1].revents & POLLIN) {
+      return;
+    }
+    if (fds[0].revents & POLLIN) {
+      int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+      if (fd >= 0) {
+        answer(fd);
+        close(fd);
+      }
+    }
+  }
+}
+
+void MetricsExporter::answer(int fd) {
+  std::string request;
+  char buffer[1024];
+  while (request.find("\r\n\r\n") == std::string::npos && request.find("\n\n") == std::string::npos) {
+    pollfd pfd = {fd, POLLIN, 0};
+    if (request.size() >= kMaxRequestSize || poll(&pfd, 1, kScrapeTimeoutMs) <= 0) {
+      return;
+    }
+    ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+    if (n <= 0) {
+      return;
+    }
+    request.append(buffer, static_cast<size_t>(n));
+  }
+
+  // "GET /metrics HTTP/1.1", query string allowed
+  std::string line = request.substr(0, request.find_first_of("\r\n"));
+  size_t path_start = line.find(' ');
+  size_t path_end = line.find(' ', path_start + 1);
+  std::string method = line.substr(0, path_start);
+  std::string path = path_start == std::string::npos ? "" : line.substr(path_start + 1, path_end - path_start - 1);
+  path = path.substr(0, path.find('?'));
+
+  std::string status;
+  std::string body;
+  std::string type = "text/plain; charset=utf-8";
+  if (method != "GET" && method != "HEAD") {
+    status = "405 Method Not Allowed";
+    body = "Only GET is supported\n";
+  } else if (path != "/metrics") {
+    status = "404 Not Found";
+    body = "Metrics are at /metrics\n";
+  } else {
+    status = "200 OK";
+    body = MetricsRegistry::instance().render();
+    type = "text/plain; version=0.0.4; charset=utf-8";
+  }
+  std::string head = "HTTP/1.1 " + status + "\r\nContent-Type: " + type +
+                     "\r\nContent-Length: " + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n";
+  if (write_all(fd, head.data(), head.size()) && method != "HEAD") {
+    write_all(fd, body.data(), body.size());
+  }
+}
+
+} // namespace quicftp
@@ -0,0 +1,178 @@
+// metrics.h
+// Counters, gauges and latency histograms for monitoring a running server
+// Metrics live in a process-wide registry and are handed out as shared
+// pointers, so the data path updates them with a relaxed atomic add and never
+// looks anything up. Histograms are HDR-style: every power of two is split
+// into 32 linear sub-buckets, so any recorded value is counted to within about
+// 3% of itself from 1 to 2^40 units. MetricsExporter serves the registry in
+// Prometheus text format over HTTP, on a local TCP port or a Unix socket; a
+// scrape copies the list of series under the registry's lock and reads their
+// values after letting it go.
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+namespace quicftp {
+
+// Label names and values of one series, e.g. {{"client", "10.0.0.2:4433"}}
+using MetricLabels = std::vector<std::pair<std::string, std::string>>;
+
+class Counter {
+public:
+  void add(uint64_t n = 1) { value_.fetch_add(n, std::memory_order_relaxed); }
+  uint64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+  std::atomic<uint64_t> value_{0};
+};
+
+class Gauge {
+public:
+  void set(int64_t value) { value_.store(value, std::memory_order_relaxed); }
+  void add(int64_t n) { value_.fetch_add(n, std::memory_order_relaxed); }
+  int64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+  std::atomic<int64_t> value_{0};
+};
+
+class Histogram {
+public:
+  // Values are recorded in units of unit_seconds each (1e-6 for microseconds)
+  // and exported in seconds, as Prometheus expects
+  explicit Histogram(double unit_seconds);
+
+  Histogram(const Histogram&) = delete;
+  Histogram& operator=(const Histogram&) = delete;
+
+  // Values past the top of the range count in the last bucket
+  void record(uint64_t value);
+
+  struct Snapshot {
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    std::vector<uint64_t> buckets;
+    // Smallest value at or above the given fraction of those recorded,
+    // rounded up to the top of its bucket; 0 if none were
+    uint64_t value_at(double quantile) const;
+    // How many values were at most limit, as a Prometheus "le" bucket counts.
+    // The bucket holding limit counts whole, so values just above it (within
+    // the histogram's precision) are included too.
+    uint64_t count_at_most(uint64_t limit) const;
+  };
+  Snapshot snapshot() const;
+
+  double unit_seconds() const { return unit_seconds_; }
+
+  static constexpr unsigned kSubBucketBits = 5;
+  static constexpr unsigned kMaxValueBits = 40;
+  static constexpr size_t kBuckets = (kMaxValueBits - kSubBucketBits + 1) << kSubBucketBits;
+
+  static size_t bucket_of(uint64_t value);
+  // Largest value counted in bucket
+  static uint64_t bucket_top(size_t bucket);
+
+private:
+  double unit_seconds_;
+  std::unique_ptr<std::atomic<uint64_t>[]> buckets_;
+  std::atomic<uint64_t> sum_{0};
+};
+
+class MetricsRegistry {
+public:
+  static MetricsRegistry& instance();
+
+  MetricsRegistry() = default;
+  MetricsRegistry(const MetricsRegistry&) = delete;
+  MetricsRegistry& operator=(const MetricsRegistry&) = delete;
+
+  // The series of name with labels, created on first use. Names follow
+  // Prometheus conventions (counters end in _total, histograms of time in
+  // _seconds); asking for a name registered as another type returns null.
+  std::shared_ptr<Counter> counter(const std::string& name, const std::string& help,
+                                   const MetricLabels& labels = MetricLabels());
+  std::shared_ptr<Gauge> gauge(const std::string& name, const std::string& help,
+                               const MetricLabels& labels = MetricLabels());
+  std::shared_ptr<Histogram> histogram(const std::string& name, const std::string& help, double unit_seconds,
+                                       const MetricLabels& labels = MetricLabels());
+
+  // A gauge read at scrape time from state kept elsewhere; read must not
+  // block, and replaces any read registered before for the same series
+  void gauge_function(const std::string& name, const std::string& help, std::function<double()> read,
+                      const MetricLabels& labels = MetricLabels());
+
+  // Stop exporting a series, e.g. one labelled with a client that has gone.
+  // Holders of its pointer may keep updating it.
+  void remove(const std::string& name, const MetricLabels& labels);
+
+  // Everything registered, in Prometheus text exposition format 0.0.4
+  std::string render() const;
+
+private:
+  enum class Type { Counter, Gauge, Histogram };
+
+  struct Series {
+    MetricLabels labels;
+    std::shared_ptr<Counter> counter;
+    std::shared_ptr<Gauge> gauge;
+    std::shared_ptr<Histogram> histogram;
+    std::shared_ptr<std::function<double()>> read;
+  };
+
+  struct Family {
+    Type type;
+    std::string help;
+    std::map<std::string, Series> series; // by rendered labels
+  };
+
+  mutable std::mutex mutex_;
+  std::map<std::string, Family> families_;
+
+  static const char* type_name(Type type);
+  // The series of name with labels (caller holds mutex_); null on a type clash
+  Series* find_or_add(const std::string& name, const std::string& help, Type type, const MetricLabels& labels);
+};
+
+// Serves MetricsRegistry::instance() to scrapers from a thread of its own
+class MetricsExporter {
+public:
+  MetricsExporter();
+  ~MetricsExporter();
+
+  MetricsExporter(const MetricsExporter&) = delete;
+  MetricsExporter& operator=(const MetricsExporter&) = delete;
+
+  // Listen on endpoint: "PORT" or "HOST:PORT" (HOST defaults to 127.0.0.1),
+  // or "unix:PATH" for a Unix socket, and answer GET /metrics over HTTP
+  bool start(const std::string& endpoint);
+  void stop();
+
+  // Description of the last failure
+  const std::string& error() const { return error_; }
+
+private:
+  int listen_fd_;
+  int wake_fd_;
+  std::string unix_path_;
+  std::thread thread_;
+  std::string error_;
+
+  void serve();
+  void answer(int fd);
+};
+
+} // namespace quicftp
+
+#endif
@@ -0,0 +1,261 @@
+// packet_io.cc
+
+#include "packet_io.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+
+// Older headers lack the offload options the running kernel may still have
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+namespace quicftp {
+
+namespace {
+
+// Messages per sendmmsg/recvmmsg
+constexpr size_t kSendMessages = 64;
+constexpr size_t kReceiveMessages = 64;
+// Fewer when each needs room for a GRO run
+constexpr size_t kGroMessages = 16;
+
+// What one UDP_SEGMENT send may carry: the kernel's segment limit, and a
+// UDP payload that fits one IP packet before it is cut up
+constexpr size_t kMaxGsoSegments = 64;
+constexpr size_t kMaxGsoBytes = 65000;
+constexpr size_t kGroBufferSize = 65536;
+
+bool same_address(const PacketIo::Outgoing& a, const PacketIo::Outgoing& b) {
+  return a.addr == b.addr || (a.addr_len == b.addr_len && std::memcmp(a.addr, b.addr, a.addr_len) == 0);
+}
+
+} // namespace
+
+PacketIo::Config PacketIo::config_from_env() {
+  Config config;
+  if (const char* env = std::getenv("QUICFTP_UDP_IO")) {
+    if (std::strcmp(env, "plain") == 0) {
+      config.batch = false;
+      config.offload = false;
+    } else if (std::strcmp(env, "mmsg") == 0) {
+      config.offload = false;
+    }
+  }
+  return config;
+}
+
+PacketIo::PacketIo(int fd, size_t max_datagram_size, const Config& config)
+  : fd_(fd)
+  , max_datagram_size_(max_datagram_size)
+  , batch_(config.batch)
+  , gso_(false)
+  , gro_(false)
+{
+  if (config.offload) {
+    // Reading the option back is how the kernel says it knows UDP_SEGMENT;
+    // whether the route's device copes shows at the first send
+    int value = 0;
+    socklen_t value_len = sizeof(value);
+    gso_ = getsockopt(fd_, SOL_UDP, UDP_SEGMENT, &value, &value_len) == 0;
+    int one = 1;
+    gro_ = setsockopt(fd_, SOL_UDP, UDP_GRO, &one, sizeof(one)) == 0;
+  }
+
+  send_msgs_.resize(kSendMessages);
+  send_iov_.resize(kSendMessages * kMaxGsoSegments);
+  send_counts_.resize(kSendMessages);
+  send_control_.resize(kSendMessages * CMSG_SPACE(sizeof(uint16_t)));
+
+  // A GRO run can be read into nothing smaller, and one byte past the
+  // largest datagram shows the caller one that is too long
+  receive_size_ = gro_ ? kGroBufferSize : max_datagram_size_ + 1;
+  size_t messages = gro_ ? kGroMessages : kReceiveMessages;
+  receive_buffers_.resize(messages * receive_size_);
+  receive_msgs_.resize(messages);
+  receive_iov_.resize(messages);
+  receive_addrs_.resize(messages);
+  receive_control_.resize(messages * CMSG_SPACE(sizeof(int)));
+  update_backend();
+}
+
+size_t PacketIo::gso_run(const Outgoing* datagrams, size_t first, size_t count) const {
+  // Segments of one size to one peer; only the last may be shorter
+  size_t segment = datagrams[first].len;
+  size_t total = segment;
+  size_t n = 1;
+  while (first + n < count && n < kMaxGsoSegments) {
+    const Outgoing& next = datagrams[first + n];
+    if (next.len == 0 || next.len > segment || total + next.len > kMaxGsoBytes ||
+        !same_address(datagrams[first], next)) {
+      break;
+    }
+    total += next.len;
+    ++n;
+    if (next.len < segment) break;
+  }
+  return n;
+}
+
+size_t PacketIo::send(const Outgoing* datagrams, size_t count) {
+  size_t done = 0;
+  while (done < count) {
+    // Lay the next datagrams out as messages, a GSO run in each if possible
+    size_t messages = 0;
+    size_t iov_used = 0;
+    size_t next = done;
+    size_t max_messages = batch_ ? kSendMessages : 1;
+    while (next < count && messages < max_messages) {
+      size_t run = gso_ ? gso_run(datagrams, next, count) : 1;
+      mmsghdr& m = send_msgs_[messages];
+      std::memset(&m, 0, sizeof(m));
+      m.msg_hdr.msg_name = const_cast<sockaddr_storage*>(datagrams[next].addr);
+      m.msg_hdr.msg_namelen = datagrams[next].addr_len;
+      m.msg_hdr.msg_iov = &send_iov_[iov_used];
+      m.msg_hdr.msg_iovlen = run;
+      for (size_t i = 0; i < run; ++i) {
+        send_iov_[iov_used].iov_base = const_cast<uint8_t*>(datagrams[next + i].data);
+        send_iov_[iov_used].iov_len = datagrams[next + i].len;
+        ++iov_used;
+      }
+      if (run > 1) {
+        uint8_t* control = &send_control_[messages * CMSG_SPACE(sizeof(uint16_t))];
+        std::memset(control, 0, CMSG_SPACE(sizeof(uint16_t)));
+        m.msg_hdr.msg_control = control;
+        m.msg_hdr.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&m.msg_hdr);
+        cmsg->cmsg_level = SOL_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        uint16_t segment = static_cast<uint16_t>(datagrams[next].len);
+        std::memcpy(CMSG_DATA(cmsg), &segment, sizeof(segment));
+      }
+      send_counts_[messages] = run;
+      next += run;
+      ++messages;
+    }
+
+    int sent;
+    if (batch_) {
+      sent = sendmmsg(fd_, send_msgs_.data(), static_cast<unsigned int>(messages), 0);
+    } else {
+      sent = sendmsg(fd_, &send_msgs_[0].msg_hdr, 0) < 0 ? -1 : 1;
+    }
+    if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+        break; // socket buffer full: the caller keeps the rest
+      }
+      if (batch_ && errno == ENOSYS) {
+        batch_ = false;
+        update_backend();
+        continue;
+      }
+      if (gso_ && send_counts_[0] > 1 && (errno == EIO || errno == EINVAL)) {
+        // The device or path cannot segment; send them one by one from now on
+        gso_ = false;
+        update_backend();
+        continue;
+      }
+      done += send_counts_[0]; // refused outright, e.g. an unreachable peer
+      continue;
+    }
+    stats_.send_calls++;
+    for (int i = 0; i < sent; ++i) {
+      done += send_counts_[i];
+      stats_.datagrams_sent += send_counts_[i];
+    }
+  }
+  return done;
+}
+
+bool PacketIo::receive(std::vector<Incoming>& datagrams) {
+  datagrams.clear();
+  size_t messages = batch_ ? receive_msgs_.size() : 1;
+  for (size_t i = 0; i < messages; ++i) {
+    receive_iov_[i].iov_base = &receive_buffers_[i * receive_size_];
+    receive_iov_[i].iov_len = receive_size_;
+    mmsghdr& m = receive_msgs_[i];
+    std::memset(&m, 0, sizeof(m));
+    m.msg_hdr.msg_name = &receive_addrs_[i];
+    m.msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+    m.msg_hdr.msg_iov = &receive_iov_[i];
+    m.msg_hdr.msg_iovlen = 1;
+    if (gro_) {
+      // Without room for the segment size a GRO run could not be split
+      m.msg_hdr.msg_control = &receive_control_[i * CMSG_SPACE(sizeof(int))];
+      m.msg_hdr.msg_controllen = CMSG_SPACE(sizeof(int));
+    }
+  }
+
+  int got;
+  while (true) {
+    if (batch_) {
+      got = recvmmsg(fd_, receive_msgs_.data(), static_cast<unsigned int>(messages), MSG_DONTWAIT, nullptr);
+    } else {
+      ssize_t n = recvmsg(fd_, &receive_msgs_[0].msg_hdr, MSG_DONTWAIT);
+      got = n < 0 ? -1 : 1;
+      receive_msgs_[0].msg_len = n < 0 ? 0 : static_cast<unsigned int>(n);
+    }
+    if (got >= 0 || errno != EINTR) break;
+  }
+  if (got < 0) {
+    if (batch_ && errno == ENOSYS) {
+      batch_ = false;
+      update_backend();
+      return receive(datagrams);
+    }
+    return false; // EAGAIN: drained
+  }
+
+  stats_.receive_calls++;
+  for (int i = 0; i < got; ++i) {
+    mmsghdr& m = receive_msgs_[i];
+    const uint8_t* data = &receive_buffers_[i * receive_size_];
+    size_t len = m.msg_len;
+    size_t segment = len;
+    if (gro_) {
+      for (cmsghdr* cmsg = CMSG_FIRSTHDR(&m.msg_hdr); cmsg; cmsg = CMSG_NXTHDR(&m.msg_hdr, cmsg)) {
+        if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+          int size;
+          std::memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+          if (size > 0) {
+            segment = static_cast<size_t>(size);
+          }
+        }
+      }
+    }
+    // Zero-length datagrams are passed on too, as one empty segment
+    size_t offset = 0;
+    do {
+      size_t n = std::min(segment, len - offset);
+      datagrams.push_back(Incoming{&receive_addrs_[i], m.msg_hdr.msg_namelen, data + offset, n});
+      offset += n;
+    } while (offset < len);
+  }
+  stats_.datagrams_received += datagrams.size();
+  return true;
+}
+
+PacketIo::Stats PacketIo::stats() const {
+  return stats_;
+}
+
+void PacketIo::update_backend() {
+  stats_.backend = batch_ ? "mmsg" : "plain";
+  if (gso_) stats_.backend += "+gso";
+  if (gro_) stats_.backend += "+gro";
+}
+
+} // namespace quicftp
@@ -0,0 +1,105 @@
+// packet_io.h
+// Batched datagram I/O on a UDP socket
+// Datagrams go out many per system call with sendmmsg, and runs of
+// equal-sized datagrams to one peer go as a single UDP_SEGMENT (GSO) send
+// that the kernel, or the NIC, cuts up. Receiving works the same way in
+// reverse: recvmmsg fills a batch of buffers, and with UDP_GRO the kernel
+// hands over several datagrams of a flow glued together, split here by the
+// segment size it reports. Each feature is probed on the socket and dropped
+// at the first sign the kernel or device does not support it, falling back
+// to one datagram per sendmsg/recvmsg.
+
+#ifndef PACKET_IO_H
+#define PACKET_IO_H
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <sys/socket.h>
+
+namespace quicftp {
+
+class PacketIo {
+public:
+  struct Config {
+    bool batch = true;   // sendmmsg/recvmmsg
+    bool offload = true; // UDP_SEGMENT and UDP_GRO
+  };
+
+  // A datagram to send; the memory stays the caller's
+  struct Outgoing {
+    const sockaddr_storage* addr;
+    socklen_t addr_len;
+    const uint8_t* data;
+    size_t len;
+  };
+
+  // A datagram received, valid until the next receive()
+  struct Incoming {
+    const sockaddr_storage* addr;
+    socklen_t addr_len;
+    const uint8_t* data;
+    size_t len;
+  };
+
+  struct Stats {
+    std::string backend;        // "mmsg+gso+gro" down to "plain", as features hold up
+    uint64_t send_calls = 0;
+    uint64_t datagrams_sent = 0;
+    uint64_t receive_calls = 0; // that returned data
+    uint64_t datagrams_received = 0;
+  };
+
+  // From QUICFTP_UDP_IO: "plain" (one datagram per call), "mmsg" (batched,
+  // no offload) or "gso" (everything available, the default)
+  static Config config_from_env();
+
+  // Uses fd, a non-blocking UDP socket, for datagrams of at most
+  // max_datagram_size bytes. Does not own it.
+  PacketIo(int fd, size_t max_datagram_size, const Config& config = config_from_env());
+
+  PacketIo(const PacketIo&) = delete;
+  PacketIo& operator=(const PacketIo&) = delete;
+
+  // Send datagrams in order; how many were dealt with, fewer than count once
+  // the socket buffer is full, when the rest should be offered again after
+  // the socket polls writable. A datagram the kernel refuses outright, e.g.
+  // to an unreachable peer, is skipped and counts as dealt with.
+  size_t send(const Outgoing* datagrams, size_t count);
+
+  // Receive what is waiting, up to a batch; false once nothing is
+  bool receive(std::vector<Incoming>& datagrams);
+
+  Stats stats() const;
+
+private:
+  int fd_;
+  size_t max_datagram_size_;
+  bool batch_;
+  bool gso_;
+  bool gro_;
+  Stats stats_;
+
+  // Send side: one message per datagram or GSO run
+  std::vector<mmsghdr> send_msgs_;
+  std::vector<iovec> send_iov_;
+  std::vector<size_t> send_counts_; // datagrams in each message
+  std::vector<uint8_t> send_control_;
+
+  // Receive side: a buffer per message, big enough for a GRO run if enabled
+  size_t receive_size_;
+  std::vector<uint8_t> receive_buffers_;
+  std::vector<mmsghdr> receive_msgs_;
+  std::vector<iovec> receive_iov_;
+  std::vector<sockaddr_storage> receive_addrs_;
+  std::vector<uint8_t> receive_control_;
+
+  // Number of datagrams from first that fit one GSO send
+  size_t gso_run(const Outgoing* datagrams, size_t first, size_t count) const;
+  void update_backend();
+};
+
+} // namespace quicftp
+
+#endif
@@ -0,0 +1,284 @@
+// path_resolver.cc
+
+#include "path_resolver.h"
+#include <atomic>
+#include <cerrno>
+#include <vector>
+#include <fcntl.h>
+#include <linux/openat2.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace quicftp {
+
+namespace {
+
+// Cleared once the kernel turns out not to have openat2
+std::atomic<bool> g_have_openat2{true};
+
+// Split path into its components, dropping empty ones and "."; false for
+// absolute paths and any "..", which could only climb out of the root
+bool split_path(const std::string& path, std::vector<std::string>& parts) {
+  if (!path.empty() && path[0] == '/') {
+    return false;
+  }
+  size_t start = 0;
+  while (start <= path.size()) {
+    size_t end = path.find('/', start);
+    if (end == std::string::npos) {
+      end = path.size();
+    }
+    std::string part = path.substr(start, end - start);
+    if (part == "..") {
+      return false;
+    }
+    if (!part.empty() && part != ".") {
+      parts.push_back(std::move(part));
+    }
+    start = end + 1;
+  }
+  return true;
+}
+
+std::string join(const std::vector<std::string>& parts, size_t count) {
+  std::string path;
+  for (size_t i = 0; i < count; ++i) {
+    if (i > 0) path += '/';
+    path += parts[i];
+  }
+  return path;
+}
+
+// Open path relative to dir_fd without leaving dir_fd's tree
+int open_beneath(int dir_fd, const std::string& path, int flags) {
+  if (g_have_openat2.load(std::memory_order_relaxed)) {
+    struct open_how how = {};
+    how.flags = static_cast<uint64_t>(flags | O_CLOEXEC);
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+    int fd = static_cast<int>(syscall(SYS_openat2, dir_fd, path.c_str(), &how, sizeof(how)));
+    if (fd >= 0 || errno != ENOSYS) {
+      return fd;
+    }
+    g_have_openat2.store(false, std::memory_order_relaxed);
+  }
+
+  // Older kernels: walk one component at a time refusing symlinks, which is
+  // stricter than RESOLVE_BENEATH but equally unable to escape
+  std::vector<std::string> parts;
+  if (!split_path(path, parts)) {
+    errno = EXDEV;
+    return -1;
+  }
+  if (parts.empty()) {
+    return openat(dir_fd, ".", flags | O_CLOEXEC);
+  }
+  int fd = dir_fd;
+  for (size_t i = 0; i + 1 < parts.size(); ++i) {
+    int next = openat(fd, parts[i].c_str(), O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    int err = errno;
+    if (fd != dir_fd) ::close(fd);
+    if (next < 0) {
+      errno = err;
+      return -1;
+    }
+    fd = next;
+  }
+  int result = openat(fd, parts.back().c_str(), flags | O_NOFOLLOW | O_CLOEXEC);
+  int err = errno;
+  if (fd != dir_fd) ::close(fd);
+  errno = err;
+  return result;
+}
+
+} // namespace
+
+PathResolver::Directory::Directory(int fd)
+  : fd_(fd)
+{
+}
+
+PathResolver::Directory::~Directory() {
+  if (fd_ >= 0) {
+    ::close(fd_);
+  }
+}
+
+int PathResolver::Directory::fd() const {
+  return fd_;
+}
+
+PathResolver::PathResolver(size_t cache_size)
+  : cache_size_(cache_size > 0 ? cache_size : 1)
+{
+}
+
+PathResolver::~PathResolver() {
+  close();
+}
+
+bool PathResolver::open_root(const std::string& root_dir) {
+  close();
+  // Readable rather than O_PATH, so it can be fsynced like any other
+  int fd = ::open(root_dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  root_ = std::make_shared<Directory>(fd);
+  existing_.insert("");
+  return true;
+}
+
+void PathResolver::close() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  root_.reset();
+  lru_.clear();
+  cached_.clear();
+  existing_.clear();
+}
+
+bool PathResolver::locate(const std::string& path, bool create, Location& location) {
+  std::vector<std::string> parts;
+  if (!split_path(path, parts)) {
+    errno = EXDEV;
+    return false;
+  }
+  if (parts.empty()) {
+    errno = EISDIR;
+    return false;
+  }
+
+  std::string dir = join(parts, parts.size() - 1);
+  std::shared_ptr<const Directory> handle = open_directory(dir, create);
+  if (!handle) {
+    return false;
+  }
+  location.dir = std::move(handle);
+  location.name = parts.back();
+  location.path = dir.empty() ? location.name : dir + "/" + location.name;
+  return true;
+}
+
+int PathResolver::open_file(const std::string& path, int flags) {
+  std::shared_ptr<const Directory> root;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    root = root_;
+  }
+  if (!root) {
+    errno = EBADF;
+    return -1;
+  }
+  return open_beneath(root->fd(), path, flags);
+}
+
+void PathResolver::forget(const Location& location) {
+  size_t slash = location.path.rfind('/');
+  std::string dir = (slash == std::string::npos) ? "" : location.path.substr(0, slash);
+  if (dir.empty()) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = cached_.find(dir);
+  if (it != cached_.end()) {
+    lru_.erase(it->second);
+    cached_.erase(it);
+  }
+  existing_.erase(dir);
+}
+
+PathResolver::Stats PathResolver::stats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Stats stats = stats_;
+  stats.cached = lru_.size();
+  return stats;
+}
+
+std::shared_ptr<const PathResolver::Directory> PathResolver::open_directory(const std::string& dir, bool create) {
+  std::shared_ptr<const Directory> root;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_.lookups++;
+    if (!root_) {
+      errno = EBADF;
+      return nullptr;
+    }
+    if (dir.empty()) {
+      stats_.cache_hits++;
+      return root_;
+    }
+    auto it = cached_.find(dir);
+    if (it != cached_.end()) {
+      lru_.splice(lru_.begin(), lru_, it->second);
+      stats_.cache_hits++;
+      return it->second->second;
+    }
+    root = root_;
+  }
+
+  int fd = open_beneath(root->fd(), dir, O_RDONLY | O_DIRECTORY);
+  if (fd < 0 && errno == ENOENT && create) {
+    // Make each missing level inside its already-resolved parent, so a
+    // symlink swapped in along the way is never followed out of the root.
+    // Levels known to exist are skipped.
+    std::vector<std::string> parts;
+    split_path(dir, parts);
+    size_t first = 0;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      existing_.erase(dir);
+      while (first + 1 < parts.size() && existing_.count(join(parts, first + 1)) > 0) {
+        first++;
+      }
+    }
+    for (size_t i = first; i < parts.size(); ++i) {
+      std::string parent = join(parts, i);
+      int parent_fd = parent.empty() ? root->fd() : open_beneath(root->fd(), parent, O_PATH | O_DIRECTORY);
+      bool made = parent_fd >= 0 && mkdirat(parent_fd, parts[i].c_str(), 0755) == 0;
+      int err = errno;
+      if (parent_fd >= 0 && parent_fd != root->fd()) ::close(parent_fd);
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!made && (parent_fd < 0 || err != EEXIST)) {
+        // What was known about the levels above may be stale too
+        for (size_t j = 1; j <= i; ++j) {
+          existing_.erase(join(parts, j));
+        }
+        errno = err;
+        return nullptr;
+      }
+      if (made) {
+        stats_.directories_created++;
+      }
+      existing_.insert(join(parts, i + 1));
+    }
+    fd = open_beneath(root->fd(), dir, O_RDONLY | O_DIRECTORY);
+  }
+  if (fd < 0) {
+    return nullptr;
+  }
+
+  auto handle = std::make_shared<const Directory>(fd);
+  remember(dir, handle);
+  return handle;
+}
+
+void PathResolver::remember(const std::string& dir, const std::shared_ptr<const Directory>& handle) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  stats_.directories_opened++;
+  existing_.insert(dir);
+  // Another thread may have opened it meanwhile; the newest handle wins
+  auto it = cached_.find(dir);
+  if (it != cached_.end()) {
+    lru_.erase(it->second);
+    cached_.erase(it);
+  }
+  lru_.emplace_front(dir, handle);
+  cached_[dir] = lru_.begin();
+  while (lru_.size() > cache_size_) {
+    cached_.erase(lru_.back().first);
+    lru_.pop_back();
+  }
+}
+
+} // namespace quicftp
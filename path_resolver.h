@@ -0,0 +1,100 @@
+// path_resolver.h
+// Client paths resolved beneath the server root
+// Everything is opened relative to a descriptor for the root with
+// openat2(RESOLVE_BENEATH), so neither ".." nor a symlink can lead outside
+// it. Directories that uploads land in are kept open in a small LRU cache and
+// the ones known to exist are remembered, so a stream of small files in the
+// same few directories costs no path walks or mkdir calls after the first.
+
+#ifndef PATH_RESOLVER_H
+#define PATH_RESOLVER_H
+
+#include <string>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <cstddef>
+#include <cstdint>
+
+namespace quicftp {
+
+class PathResolver {
+public:
+  // An open directory beneath the root; the descriptor stays valid for as
+  // long as anyone holds the handle, cached or not
+  class Directory {
+  public:
+    explicit Directory(int fd);
+    ~Directory();
+
+    Directory(const Directory&) = delete;
+    Directory& operator=(const Directory&) = delete;
+
+    int fd() const;
+
+  private:
+    int fd_;
+  };
+
+  // Where a path lands: the name of its last component inside dir
+  struct Location {
+    std::shared_ptr<const Directory> dir;
+    std::string name;
+    std::string path; // normalized and relative to the root, for keys and logs
+  };
+
+  struct Stats {
+    uint64_t lookups = 0;
+    uint64_t cache_hits = 0;
+    uint64_t directories_opened = 0;
+    uint64_t directories_created = 0;
+    size_t cached = 0;
+  };
+
+  // Up to cache_size directories are kept open
+  explicit PathResolver(size_t cache_size = 256);
+  ~PathResolver();
+
+  PathResolver(const PathResolver&) = delete;
+  PathResolver& operator=(const PathResolver&) = delete;
+
+  // Anchor resolution at root_dir, which must exist
+  bool open_root(const std::string& root_dir);
+  void close();
+
+  // Find the directory path lives in, creating it and its parents if create
+  // is set. On failure errno says why: EXDEV if path leads outside the root.
+  // Safe to call from several threads.
+  bool locate(const std::string& path, bool create, Location& location);
+
+  // Open path beneath the root as open(2) would; -1 with errno on failure
+  int open_file(const std::string& path, int flags);
+
+  // Drop what is known about location's directory, after finding it gone
+  void forget(const Location& location);
+
+  Stats stats() const;
+
+private:
+  size_t cache_size_;
+  std::shared_ptr<const Directory> root_;
+
+  mutable std::mutex mutex_;
+  // Most recently used first
+  std::list<std::pair<std::string, std::shared_ptr<const Directory>>> lru_;
+  std::unordered_map<std::string, decltype(lru_)::iterator> cached_;
+  std::unordered_set<std::string> existing_; // directories known to exist
+  Stats stats_;
+
+  // Open dir (relative to the root, "" for the root itself), making it if
+  // create is set; null with errno on failure
+  std::shared_ptr<const Directory> open_directory(const std::string& dir, bool create);
+  void remember(const std::string& dir, const std::shared_ptr<const Directory>& handle);
+};
+
+} // namespace quicftp
+
+#endif
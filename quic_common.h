@@ -8,6 +8,7 @@
 #include <functional>
 #include <memory>
 #include <cstdint>
+#include "buffer_pool.h"
 
 namespace quicftp {
 
@@ -38,12 +39,65 @@ enum class ConnectionState {
   Closed
 };
 
+// Transfer priorities (StreamInfo::priority), deciding whose frames a
+// connection sends next (see send_scheduler.h). Interactive priorities are
+// served strictly before all others, background ones only when nothing else
+// is waiting; in between, transfers share in proportion to their priority.
+constexpr int kPriorityBackground = 0;
+constexpr int kPriorityNormal = 8;
+constexpr int kPriorityInteractive = 64;
+constexpr int kPriorityMax = 255;
+
 // Transfer progress callback
 using ProgressCallback = std::function<void(StreamId stream_id, size_t bytes_transferred, size_t total_bytes)>;
 
 // Stream data callback (for receiving data)
 using StreamDataCallback = std::function<bool(const uint8_t* data, size_t len)>;
 
+// Upload opened on a stream. A ranged upload carries one byte range of a
+// file of total_size bytes; several streams may feed ranges of the same file.
+struct UploadRequest {
+  std::string remote_path;
+  bool ranged = false;
+  uint64_t offset = 0;
+  uint64_t total_size = 0;
+  std::string client; // address of the connection sending
+};
+
+// Streamed upload callbacks: start may reject the stream by returning false,
+// data returning false aborts it, end reports whether the client finished the
+// stream (false if it was abandoned or aborted). The end handler then calls
+// stored, exactly once and possibly later from another thread, with whether
+// the data is safely stored, which is what the client's acknowledgement says.
+// Data lies inside owner when it came straight from a pooled receive buffer
+// (owner is empty otherwise), so it can be kept without copying.
+using UploadStartCallback = std::function<bool(StreamId stream_id, const UploadRequest& request)>;
+using UploadDataCallback =
+    std::function<bool(StreamId stream_id, const BufferRef& owner, const uint8_t* data, size_t len)>;
+using UploadStoredCallback = std::function<void(bool stored)>;
+using UploadEndCallback = std::function<void(StreamId stream_id, bool completed, UploadStoredCallback stored)>;
+
+// Resume query for an upload of request.total_size bytes: the handler replies
+// on the stream with the byte ranges it still needs
+using UploadStatusCallback = std::function<void(StreamId stream_id, const UploadRequest& request)>;
+
+// Download requested on a stream. A ranged download asks for length bytes
+// starting at offset (clamped to the end of the file); stat_only asks for
+// the reply header alone, which carries the file size.
+struct DownloadRequest {
+  std::string remote_path;
+  bool ranged = false;
+  uint64_t offset = 0;
+  uint64_t length = 0;
+  bool stat_only = false;
+  std::string client; // address of the connection asking
+};
+
+// The handler owns the stream from here on: it replies with
+// QuicServerWrapper::send_reply() and send_stream_data() and ends with
+// finish_stream(), or refuses with reject_stream()
+using DownloadCallback = std::function<void(StreamId stream_id, const DownloadRequest& request)>;
+
 // Connection event callbacks
 using ConnectionCallback = std::function<void(const std::string& address)>;
 using AuthCallback = std::function<void(const std::string& address, const std::string& cert_info, bool success)>;
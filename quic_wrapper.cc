@@ -2,33 +2,139 @@
 // Stub implementation - will be replaced with actual QUIC library integration
 
 #include "quic_wrapper.h"
-#include "test_bridge.h"
+#include "transport.h"
+#include "event_loop.h"
+#include "send_scheduler.h"
+#include "wire_protocol.h"
 #include <iostream>
 #include <thread>
 #include <chrono>
 #include <vector>
-#include <fstream>
 #include <sstream>
 #include <map>
+#include <set>
 #include <algorithm>
+#include <limits>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
 
 namespace quicftp {
 
+namespace {
+
+// Upper bound on bridge messages handled per loop dispatch
+constexpr int kMaxMessagesPerDrain = 1024;
+
+// Streams that see no traffic for this long are abandoned
+constexpr int kStreamIdleTimeoutMs = 30000;
+constexpr int kIdleSweepIntervalMs = 1000;
+
+// How long the bridge watcher sleeps before rechecking for shutdown
+constexpr int kWatcherWaitMs = 1000;
+
+// How long a worker's loop sleeps before rechecking for shutdown
+constexpr int kWorkerWaitMs = 1000;
+
+} // namespace
+
 // Stub implementations - these will be replaced with actual QUIC library calls
 struct QuicServerImpl {
   int port_;
   bool listening_;
   std::string cert_path_;
   std::string key_path_;
+  Transport* transport_ = &Transport::get(Transport::default_kind());
   
   ConnectionCallback on_connect_;
   ConnectionCallback on_disconnect_;
   AuthCallback on_auth_;
   std::function<void(StreamId, const std::string&, StreamDataCallback)> on_stream_;
   
-  // Test mode: track received data
-  std::map<StreamId, std::vector<uint8_t>> stream_data_;
+  UploadStartCallback on_upload_start_;
+  UploadDataCallback on_upload_data_;
+  UploadEndCallback on_upload_end_;
+  DownloadCallback on_download_;
+  UploadStatusCallback on_upload_status_;
+  
+  // Test mode: track open requests; upload data is passed straight through
   std::map<StreamId, std::string> stream_commands_;
+  std::map<StreamId, uint64_t> upload_streams_; // file offset the next Data frame must carry
+  std::set<StreamId> reply_streams_; // requests the server answers
+  std::map<StreamId, std::chrono::steady_clock::time_point> stream_last_activity_;
+
+  // Frames split across messages, per client stream
+  std::map<std::pair<std::string, StreamId>, FrameDecoder> decoders_;
+
+  // Clients number their requests (see wire_protocol.h); each (client,
+  // request) pair gets a server-wide StreamId when the request arrives, and
+  // that is what the upload and download callbacks see. Routes are read by
+  // threads sending replies, hence the mutex.
+  struct StreamRoute {
+    std::string client_addr;
+    StreamId client_stream_id = 0; // stream the request came in on
+    uint64_t request_id = 0;
+    bool checksum = false;         // the request was checksummed, so the reply is too
+    uint64_t reply_offset = 0;     // offset of the next reply Data frame
+    bool windowed = false;         // reply Data waits for the client's Window frames
+    uint64_t reply_sent = 0;       // reply Data bytes sent so far
+    uint64_t reply_window = kReplyWindow; // reply Data bytes the client has room for
+    std::shared_ptr<SendScheduler> scheduler; // the client's; reply Data takes turns there
+  };
+  std::map<std::pair<std::string, uint64_t>, StreamId> stream_ids_;
+  std::map<StreamId, StreamRoute> stream_routes_;
+  std::map<std::string, std::shared_ptr<SendScheduler>> schedulers_; // per client
+  std::mutex routes_mutex_;
+  std::set<std::string> clients_;
+
+  // Position among the server's shards. Each shard reads its own bridge ring
+  // and numbers streams shard_ + 1, shard_ + 1 + shard_count_, ... so a
+  // stream id alone tells which shard owns it.
+  size_t shard_ = 0;
+  size_t shard_count_ = 1;
+  StreamId next_stream_id_ = 1;
+
+  // Reactor driving process_events()
+  EventLoop loop_;
+  EventLoop::TimerId idle_timer_ = 0;
+
+  // The bridge signals readiness through a cross-process futex, which epoll
+  // cannot watch directly. A watcher thread sleeps on it and raises
+  // bridge_event_fd_, then waits until the loop has drained the ring.
+  int bridge_event_fd_ = -1;
+  std::thread watcher_;
+  std::atomic<bool> watcher_running_{false};
+  std::mutex watcher_mutex_;
+  std::condition_variable watcher_cv_;
+  bool bridge_drained_ = true;
+
+  bool start_reactor();
+  void stop_reactor();
+  void watch_bridge();
+  void signal_bridge_ready();
+  void drain_bridge();
+  // owner holds frame's payload, or is empty for a frame reassembled by the decoder
+  void handle_frame(const std::string& client_addr, StreamId client_stream_id, const Frame& frame,
+                    const BufferRef& owner, std::chrono::steady_clock::time_point now);
+  void expire_idle_streams();
+  bool deliver_upload_data(StreamId stream_id, const BufferRef& owner, const uint8_t* data, size_t len);
+  void end_stream(StreamId stream_id, bool completed);
+  StreamId open_stream(const std::string& client_addr, StreamId client_stream_id, uint64_t request_id,
+                       uint32_t flags);
+  bool find_stream(const std::string& client_addr, uint64_t request_id, StreamId& stream_id);
+  // Copy a request's route, then move its reply offset on by advance_reply
+  bool find_route(StreamId stream_id, StreamRoute& route, uint64_t advance_reply = 0);
+  // End the requests that came in on one client stream
+  void end_requests(const std::string& client_addr, StreamId client_stream_id, bool uploads_only);
+  void disconnect_client(const std::string& client_addr);
+  void reply_error(StreamId stream_id, const std::string& message);
+  bool send_frame(const StreamRoute& route, FrameType type, uint32_t flags, uint64_t offset,
+                  const uint8_t* payload, size_t len);
 };
 
 struct QuicConnectionImpl {
@@ -41,9 +147,10 @@ struct QuicStreamImpl {
   StreamState state_;
 };
 
-QuicServerWrapper::QuicServerWrapper() : impl_(std::make_unique<QuicServerImpl>()) {
-  impl_->listening_ = false;
-  impl_->port_ = 0;
+QuicServerWrapper::QuicServerWrapper() {
+  shards_.push_back(std::make_unique<QuicServerImpl>());
+  shards_[0]->listening_ = false;
+  shards_[0]->port_ = 0;
 }
 
 QuicServerWrapper::~QuicServerWrapper() {
@@ -51,202 +158,756 @@ QuicServerWrapper::~QuicServerWrapper() {
 }
 
 bool QuicServerWrapper::initialize(int port, const std::string& cert_path, const std::string& key_path) {
-  impl_->port_ = port;
-  impl_->cert_path_ = cert_path;
-  impl_->key_path_ = key_path;
+  for (auto& shard : shards_) {
+    shard->port_ = port;
+    shard->cert_path_ = cert_path;
+    shard->key_path_ = key_path;
+  }
   // TODO: Initialize actual QUIC server library here
   return true;
 }
 
+void QuicServerWrapper::set_worker_count(size_t count) {
+  if (shards_[0]->listening_) return;
+  count = std::max<size_t>(count, 1);
+  shards_.resize(std::min(shards_.size(), count));
+  while (shards_.size() < count) {
+    // New shards start out configured like the first
+    const QuicServerImpl& first = *shards_[0];
+    auto shard = std::make_unique<QuicServerImpl>();
+    shard->port_ = first.port_;
+    shard->listening_ = false;
+    shard->cert_path_ = first.cert_path_;
+    shard->key_path_ = first.key_path_;
+    shard->transport_ = first.transport_;
+    shard->on_connect_ = first.on_connect_;
+    shard->on_disconnect_ = first.on_disconnect_;
+    shard->on_auth_ = first.on_auth_;
+    shard->on_stream_ = first.on_stream_;
+    shard->on_upload_start_ = first.on_upload_start_;
+    shard->on_upload_data_ = first.on_upload_data_;
+    shard->on_upload_end_ = first.on_upload_end_;
+    shard->on_download_ = first.on_download_;
+    shard->on_upload_status_ = first.on_upload_status_;
+    shards_.push_back(std::move(shard));
+  }
+  for (size_t i = 0; i < shards_.size(); ++i) {
+    shards_[i]->shard_ = i;
+    shards_[i]->shard_count_ = shards_.size();
+    shards_[i]->next_stream_id_ = i + 1;
+  }
+}
+
+size_t QuicServerWrapper::worker_count() const {
+  return shards_.size();
+}
+
+void QuicServerWrapper::set_transport(TransportKind kind) {
+  if (shards_[0]->listening_) return;
+  for (auto& shard : shards_) {
+    shard->transport_ = &Transport::get(kind);
+  }
+}
+
+void QuicServerWrapper::set_congestion_control(CongestionAlgorithm algorithm) {
+  shards_[0]->transport_->set_congestion_control(algorithm);
+}
+
+void QuicServerWrapper::set_fec(const FecConfig& config) {
+  shards_[0]->transport_->set_fec(config);
+}
+
+bool QuicServerWrapper::transport_stats(TransportStats& stats) const {
+  return shards_[0]->transport_->stats(stats);
+}
+
 bool QuicServerWrapper::start_listening() {
+  if (shards_[0]->listening_) return true;
   // TODO: Start actual QUIC server listening on port
-  impl_->listening_ = true;
+  if (!shards_[0]->transport_->listen(shards_.size(), shards_[0]->port_)) {
+    return false;
+  }
+  for (size_t i = 0; i < shards_.size(); ++i) {
+    if (!shards_[i]->start_reactor()) {
+      for (size_t started = 0; started < i; ++started) {
+        shards_[started]->stop_reactor();
+      }
+      return false;
+    }
+  }
+  for (auto& shard : shards_) {
+    shard->listening_ = true;
+  }
+
+  if (shards_.size() > 1) {
+    workers_running_ = true;
+    for (size_t i = 0; i < shards_.size(); ++i) {
+      workers_.emplace_back([this, i]() { run_worker(i); });
+    }
+  }
   return true;
 }
 
 void QuicServerWrapper::stop() {
-  impl_->listening_ = false;
+  for (auto& shard : shards_) {
+    shard->listening_ = false;
+  }
+  if (workers_running_.exchange(false)) {
+    for (auto& shard : shards_) {
+      shard->loop_.wakeup();
+    }
+    signal_activity();
+    for (std::thread& worker : workers_) {
+      worker.join();
+    }
+    workers_.clear();
+  }
+  for (auto& shard : shards_) {
+    shard->stop_reactor();
+  }
+  shards_[0]->transport_->stop_listening();
   // TODO: Stop QUIC server and close connections
 }
 
 bool QuicServerWrapper::is_listening() const {
-  return impl_->listening_;
+  return shards_[0]->listening_;
 }
 
-void QuicServerWrapper::process_events(int timeout_ms) {
-  if (!impl_->listening_) return;
-  
-  // #region agent log
-  {
-    std::ofstream log_file("/home/tprettol/repo/Quicftp/.cursor/debug.log", std::ios::app);
-    if (log_file.is_open()) {
-      bool has_data = TestBridge::instance().has_data();
-      log_file << "{\"sessionId\":\"debug-session\",\"runId\":\"run1\",\"hypothesisId\":\"L\",\"location\":\"quic_wrapper.cc:74\",\"message\":\"QuicServerWrapper::process_events() called\",\"data\":{\"timeout_ms\":" << timeout_ms << ",\"listening\":" << (impl_->listening_ ? "true" : "false") << ",\"bridge_has_data\":" << (has_data ? "true" : "false") << "},\"timestamp\":" << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() << "}\n";
-      log_file.close();
+QuicServerImpl& QuicServerWrapper::shard_for(StreamId stream_id) const {
+  return *shards_[(stream_id - 1) % shards_.size()];
+}
+
+void QuicServerWrapper::run_worker(size_t shard) {
+  // One core per shard keeps its connection state in that core's caches;
+  // with more shards than cores they double up
+  unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(shard % cores, &cpus);
+  pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+  while (workers_running_) {
+    if (shards_[shard]->loop_.run_once(kWorkerWaitMs) > 0) {
+      signal_activity();
     }
   }
-  // #endregion
-  
+}
+
+void QuicServerWrapper::signal_activity() {
+  // One notification per wait of the caller, however many workers are busy
+  if (!activity_.exchange(true)) {
+    std::lock_guard<std::mutex> lock(activity_mutex_);
+    activity_cv_.notify_one();
+  }
+}
+
+bool QuicServerImpl::start_reactor() {
+  if (!loop_.initialize()) {
+    return false;
+  }
+
+  bridge_event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (bridge_event_fd_ < 0) {
+    return false;
+  }
+  loop_.add_fd(bridge_event_fd_, EPOLLIN, [this](uint32_t) {
+    uint64_t count;
+    while (read(bridge_event_fd_, &count, sizeof(count)) > 0) {}
+    drain_bridge();
+  });
+
+  idle_timer_ = loop_.add_timer(kIdleSweepIntervalMs, [this]() { expire_idle_streams(); },
+                                kIdleSweepIntervalMs);
+
+  bridge_drained_ = true;
+  watcher_running_ = true;
+  watcher_ = std::thread([this]() { watch_bridge(); });
+  return true;
+}
+
+void QuicServerImpl::stop_reactor() {
+  if (watcher_running_.exchange(false)) {
+    {
+      std::lock_guard<std::mutex> lock(watcher_mutex_);
+      watcher_cv_.notify_one();
+    }
+    transport_->interrupt_wait(shard_);
+    watcher_.join();
+  }
+  if (bridge_event_fd_ >= 0) {
+    loop_.remove_fd(bridge_event_fd_);
+    close(bridge_event_fd_);
+    bridge_event_fd_ = -1;
+  }
+  if (idle_timer_) {
+    loop_.cancel_timer(idle_timer_);
+    idle_timer_ = 0;
+  }
+}
+
+void QuicServerImpl::watch_bridge() {
+  while (watcher_running_) {
+    if (!transport_->wait_for_data(shard_, kWatcherWaitMs)) {
+      continue;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(watcher_mutex_);
+      bridge_drained_ = false;
+    }
+    signal_bridge_ready();
+
+    // Data stays in the ring until the loop consumes it, so waiting on the
+    // ring again now would spin
+    std::unique_lock<std::mutex> lock(watcher_mutex_);
+    watcher_cv_.wait(lock, [this]() { return bridge_drained_ || !watcher_running_; });
+  }
+}
+
+void QuicServerImpl::signal_bridge_ready() {
+  uint64_t one = 1;
+  ssize_t rc = write(bridge_event_fd_, &one, sizeof(one));
+  (void)rc; // counter saturation still leaves the fd readable
+}
+
+void QuicServerImpl::drain_bridge() {
   // Test mode: Process messages from test bridge
   std::string client_addr;
-  StreamId stream_id;
-  std::vector<uint8_t> data;
+  StreamId client_stream_id;
+  BufferRef data;
+  BufferRef reassembled; // stays empty
   
+  uint32_t flags = 0;
+  auto now = std::chrono::steady_clock::now();
+
   int messages_processed = 0;
-  while (TestBridge::instance().receive_from_client(client_addr, stream_id, data)) {
+  while (messages_processed < kMaxMessagesPerDrain &&
+         transport_->receive_from_client(shard_, client_addr, client_stream_id, data, &flags)) {
     messages_processed++;
-    // Parse command (first line should be "UPLOAD path" or "DOWNLOAD path")
-    std::string message(reinterpret_cast<const char*>(data.data()), data.size());
-    
-    // #region agent log
-    {
-      std::ofstream log_file("/home/tprettol/repo/Quicftp/.cursor/debug.log", std::ios::app);
-      if (log_file.is_open()) {
-        log_file << "{\"sessionId\":\"debug-session\",\"runId\":\"run1\",\"hypothesisId\":\"I\",\"location\":\"quic_wrapper.cc:69\",\"message\":\"Received data from client\",\"data\":{\"stream_id\":" << stream_id << ",\"data_size\":" << data.size() << ",\"message_preview\":\"" << message.substr(0, 50) << "\"},\"timestamp\":" << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() << "}\n";
-        log_file.close();
-      }
+
+    if (flags & Transport::kDisconnect) {
+      disconnect_client(client_addr);
+      continue;
+    }
+    if (clients_.insert(client_addr).second && on_connect_) {
+      on_connect_(client_addr);
+    }
+
+    auto stream_key = std::make_pair(client_addr, client_stream_id);
+    if (flags & Transport::kResetStream) {
+      // Client abandoned the stream and every request on it
+      decoders_.erase(stream_key);
+      end_requests(client_addr, client_stream_id, false);
+      continue;
     }
-    // #endregion
-    
-    // Check if this is a command (starts with UPLOAD or DOWNLOAD)
-    if (message.find("UPLOAD ") == 0) {
-      // Extract path
-      size_t path_start = 7; // "UPLOAD "
-      size_t path_end = message.find('\n', path_start);
-      if (path_end == std::string::npos) {
-        // #region agent log
-        {
-          std::ofstream log_file("/home/tprettol/repo/Quicftp/.cursor/debug.log", std::ios::app);
-          if (log_file.is_open()) {
-            log_file << "{\"sessionId\":\"debug-session\",\"runId\":\"run1\",\"hypothesisId\":\"M\",\"location\":\"quic_wrapper.cc:100\",\"message\":\"UPLOAD command missing newline\",\"data\":{\"stream_id\":" << stream_id << "},\"timestamp\":" << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() << "}\n";
-            log_file.close();
-          }
-        }
-        // #endregion
+
+    // Frames are handled in place in the received buffer, which upload data
+    // can then be queued from without a copy
+    if (!data.empty()) {
+      const uint8_t* begin = data.data();
+      const uint8_t* end = begin + data.size();
+      bool well_formed = decoders_[stream_key].feed(data.data(), data.size(), [&](const Frame& frame) {
+        bool in_place = frame.payload >= begin && frame.payload + frame.length <= end;
+        handle_frame(client_addr, client_stream_id, frame, in_place ? data : reassembled, now);
+        return true;
+      });
+      if (!well_formed) {
+        // Nothing after a malformed frame can be trusted
+        decoders_.erase(stream_key);
+        end_requests(client_addr, client_stream_id, false);
         continue;
       }
-      std::string remote_path = message.substr(path_start, path_end - path_start);
-      
-      // Store command for this stream
-      impl_->stream_commands_[stream_id] = remote_path;
-      impl_->stream_data_[stream_id].clear();
-      
-      // #region agent log
-      {
-        std::ofstream log_file("/home/tprettol/repo/Quicftp/.cursor/debug.log", std::ios::app);
-        if (log_file.is_open()) {
-          log_file << "{\"sessionId\":\"debug-session\",\"runId\":\"run1\",\"hypothesisId\":\"I\",\"location\":\"quic_wrapper.cc:115\",\"message\":\"Parsed UPLOAD command\",\"data\":{\"stream_id\":" << stream_id << ",\"remote_path\":\"" << remote_path << "\"},\"timestamp\":" << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() << "}\n";
-          log_file.close();
-        }
+    }
+
+    if (flags & Transport::kEndOfStream) {
+      // No more frames follow: uploads still waiting for data never complete,
+      // replies keep streaming
+      decoders_.erase(stream_key);
+      end_requests(client_addr, client_stream_id, true);
+    }
+  }
+
+  if (transport_->has_data(shard_)) {
+    // Hit the per-dispatch cap: come back on the next loop iteration so
+    // timers are not starved by a fast sender
+    signal_bridge_ready();
+  } else {
+    std::lock_guard<std::mutex> lock(watcher_mutex_);
+    bridge_drained_ = true;
+    watcher_cv_.notify_one();
+  }
+}
+
+void QuicServerImpl::handle_frame(const std::string& client_addr, StreamId client_stream_id, const Frame& frame,
+                                  const BufferRef& owner, std::chrono::steady_clock::time_point now) {
+  StreamId stream_id = 0;
+  bool known_request = find_stream(client_addr, frame.request_id, stream_id);
+  if (known_request) {
+    auto activity = stream_last_activity_.find(stream_id);
+    if (activity != stream_last_activity_.end()) {
+      activity->second = now;
+    }
+  }
+
+  if (frame.type == FrameType::Data) {
+    // File data for an upload; frames of a request that already ended are dropped
+    auto upload = known_request ? upload_streams_.find(stream_id) : upload_streams_.end();
+    if (upload == upload_streams_.end()) {
+      return;
+    }
+    if (!frame.intact) {
+      reply_error(stream_id, "checksum mismatch");
+      return;
+    }
+    if (frame.offset != upload->second) {
+      reply_error(stream_id, "data out of order");
+      return;
+    }
+    upload->second += frame.length;
+    if (frame.length > 0 && !deliver_upload_data(stream_id, owner, frame.payload, frame.length)) {
+      return;
+    }
+    if (frame.flags & kFrameFin) {
+      // The upload is complete; end_stream acknowledges it
+      end_stream(stream_id, true);
+    }
+    return;
+  }
+
+  if (frame.type == FrameType::Cancel) {
+    if (known_request) {
+      end_stream(stream_id, false);
+    }
+    return;
+  }
+
+  if (frame.type == FrameType::Window) {
+    // The client consumed some of the reply; windows only ever grow
+    if (known_request) {
+      std::lock_guard<std::mutex> lock(routes_mutex_);
+      auto route = stream_routes_.find(stream_id);
+      if (route != stream_routes_.end()) {
+        route->second.reply_window = std::max(route->second.reply_window, frame.offset);
       }
-      // #endregion
-      
-      // Extract file data (everything after the newline) - if any in this message
-      if (path_end + 1 < message.length()) {
-        std::string file_data = message.substr(path_end + 1);
-        impl_->stream_data_[stream_id].insert(impl_->stream_data_[stream_id].end(), file_data.begin(), file_data.end());
+    }
+    return;
+  }
+
+  if (frame.type < FrameType::Upload || frame.type > FrameType::Stat) {
+    return; // not something a client sends
+  }
+
+  // A new request under a live request id replaces whatever it was doing
+  if (known_request) {
+    end_stream(stream_id, false);
+  }
+  stream_id = open_stream(client_addr, client_stream_id, frame.request_id, frame.flags);
+  stream_last_activity_[stream_id] = now;
+  if (!frame.intact) {
+    reply_error(stream_id, "checksum mismatch");
+    return;
+  }
+
+  PayloadReader args(frame.payload, frame.length);
+  // An optional priority leads the arguments; it orders this request's reply
+  // data among the client's other requests
+  uint64_t priority = kPriorityNormal;
+  if ((frame.flags & kFramePriority) && !args.varint(priority)) {
+    reply_error(stream_id, "malformed request");
+    return;
+  }
+  StreamRoute route;
+  if (find_route(stream_id, route)) {
+    route.scheduler->open_flow(stream_id, static_cast<int>(std::min<uint64_t>(priority, kPriorityMax)));
+  }
+
+  switch (frame.type) {
+  case FrameType::Upload:
+  case FrameType::UploadRange: {
+    // A ranged upload carries one stripe of a file: offset, total size, path
+    UploadRequest request;
+    request.ranged = frame.type == FrameType::UploadRange;
+    if (request.ranged) {
+      request.offset = frame.offset;
+      if (!args.varint(request.total_size)) {
+        reply_error(stream_id, "malformed request");
+        return;
       }
-    } else if (message.find("DOWNLOAD ") == 0) {
-      // Handle download request
-      size_t path_start = 9; // "DOWNLOAD "
-      size_t path_end = message.find('\n', path_start);
-      if (path_end == std::string::npos) {
-        continue;
+    }
+    request.remote_path = args.rest();
+    request.client = client_addr;
+    if (request.remote_path.empty() || request.offset > request.total_size) {
+      reply_error(stream_id, "malformed request");
+      return;
+    }
+    const std::string& remote_path = request.remote_path;
+    if (on_upload_start_ && !on_upload_start_(stream_id, request)) {
+      reply_error(stream_id, "upload rejected");
+      return;
+    }
+    stream_commands_[stream_id] = remote_path;
+    upload_streams_[stream_id] = request.offset;
+
+    return;
+  }
+
+  case FrameType::UploadStatus: {
+    // Which ranges of an interrupted upload of total_size bytes are missing
+    UploadRequest request;
+    request.ranged = true;
+    if (!args.varint(request.total_size)) {
+      reply_error(stream_id, "malformed request");
+      return;
+    }
+    request.remote_path = args.rest();
+    request.client = client_addr;
+    if (request.remote_path.empty()) {
+      reply_error(stream_id, "malformed request");
+      return;
+    }
+    stream_commands_[stream_id] = request.remote_path;
+    reply_streams_.insert(stream_id);
+    if (on_upload_status_) {
+      on_upload_status_(stream_id, request);
+    } else {
+      reply_error(stream_id, "resume not supported");
+    }
+    return;
+  }
+
+  default: {
+    // Whole download, ranged download (offset, length) or STAT (reply header only)
+    DownloadRequest request;
+    request.ranged = frame.type == FrameType::DownloadRange;
+    request.stat_only = frame.type == FrameType::Stat;
+    if (request.ranged) {
+      request.offset = frame.offset;
+      if (!args.varint(request.length)) {
+        reply_error(stream_id, "malformed request");
+        return;
       }
-      std::string remote_path = message.substr(path_start, path_end - path_start);
-      impl_->stream_commands_[stream_id] = remote_path;
-      
-      // #region agent log
-      {
-        std::ofstream log_file("/home/tprettol/repo/Quicftp/.cursor/debug.log", std::ios::app);
-        if (log_file.is_open()) {
-          log_file << "{\"sessionId\":\"debug-session\",\"runId\":\"run1\",\"hypothesisId\":\"I\",\"location\":\"quic_wrapper.cc:145\",\"message\":\"Parsed DOWNLOAD command\",\"data\":{\"stream_id\":" << stream_id << ",\"remote_path\":\"" << remote_path << "\"},\"timestamp\":" << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() << "}\n";
-          log_file.close();
-        }
+    }
+    request.remote_path = args.rest();
+    request.client = client_addr;
+    if (request.remote_path.empty()) {
+      reply_error(stream_id, "malformed request");
+      return;
+    }
+    const std::string& remote_path = request.remote_path;
+    stream_commands_[stream_id] = remote_path;
+    reply_streams_.insert(stream_id);
+
+    if (on_download_) {
+      on_download_(stream_id, request);
+    } else {
+      reply_error(stream_id, "downloads not supported");
+    }
+    return;
+  }
+  }
+}
+
+void QuicServerImpl::expire_idle_streams() {
+  auto cutoff = std::chrono::steady_clock::now() - std::chrono::milliseconds(kStreamIdleTimeoutMs);
+  std::vector<StreamId> expired;
+  for (const auto& [sid, last_activity] : stream_last_activity_) {
+    // Downloads are paced by the sender, not by client traffic
+    if (last_activity < cutoff && reply_streams_.count(sid) == 0) {
+      expired.push_back(sid);
+    }
+  }
+  for (StreamId sid : expired) {
+    end_stream(sid, false);
+  }
+}
+
+bool QuicServerImpl::deliver_upload_data(StreamId stream_id, const BufferRef& owner, const uint8_t* data,
+                                         size_t len) {
+  if (on_upload_data_ && !on_upload_data_(stream_id, owner, data, len)) {
+    // Sink failed (e.g. disk full): tell the client, later frames are dropped
+    reply_error(stream_id, "write failed");
+    return false;
+  }
+  return true;
+}
+
+void QuicServerImpl::end_stream(StreamId stream_id, bool completed) {
+  StreamRoute route;
+  bool routed = false;
+  {
+    std::lock_guard<std::mutex> lock(routes_mutex_);
+    auto it = stream_routes_.find(stream_id);
+    if (it != stream_routes_.end()) {
+      route = it->second;
+      routed = true;
+      auto key = std::make_pair(route.client_addr, route.request_id);
+      auto id = stream_ids_.find(key);
+      if (id != stream_ids_.end() && id->second == stream_id) {
+        stream_ids_.erase(id);
       }
-      // #endregion
+      stream_routes_.erase(it);
+    }
+  }
+  if (routed) {
+    route.scheduler->close_flow(stream_id);
+  }
+  stream_last_activity_.erase(stream_id);
+  if (stream_commands_.erase(stream_id) == 0) {
+    return;
+  }
+  reply_streams_.erase(stream_id);
+  auto upload = upload_streams_.find(stream_id);
+  if (upload == upload_streams_.end()) {
+    return;
+  }
+  uint64_t end_offset = upload->second;
+  upload_streams_.erase(upload);
+
+  // The client counts the upload as done only once it sees the Ack, which
+  // may wait for the data to be made durable. Replies need only the route.
+  UploadStoredCallback reply = [this, route, routed, completed, end_offset](bool stored) {
+    if (!completed || !routed) {
+      return;
+    }
+    if (stored) {
+      send_frame(route, FrameType::Ack, kFrameFin, end_offset, nullptr, 0);
     } else {
-      // This is file data (continuation of upload) - accumulate it
-      if (impl_->stream_commands_.find(stream_id) != impl_->stream_commands_.end()) {
-        // #region agent log
-        {
-          std::ofstream log_file("/home/tprettol/repo/Quicftp/.cursor/debug.log", std::ios::app);
-          if (log_file.is_open()) {
-            log_file << "{\"sessionId\":\"debug-session\",\"runId\":\"run1\",\"hypothesisId\":\"M\",\"location\":\"quic_wrapper.cc:158\",\"message\":\"Accumulating file data chunk\",\"data\":{\"stream_id\":" << stream_id << ",\"chunk_size\":" << data.size() << ",\"total_size\":" << impl_->stream_data_[stream_id].size() << "},\"timestamp\":" << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() << "}\n";
-            log_file.close();
-          }
-        }
-        // #endregion
-        impl_->stream_data_[stream_id].insert(impl_->stream_data_[stream_id].end(), data.begin(), data.end());
-      } else {
-        // #region agent log
-        {
-          std::ofstream log_file("/home/tprettol/repo/Quicftp/.cursor/debug.log", std::ios::app);
-          if (log_file.is_open()) {
-            log_file << "{\"sessionId\":\"debug-session\",\"runId\":\"run1\",\"hypothesisId\":\"M\",\"location\":\"quic_wrapper.cc:168\",\"message\":\"Received data for unknown stream\",\"data\":{\"stream_id\":" << stream_id << ",\"data_size\":" << data.size() << "},\"timestamp\":" << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() << "}\n";
-            log_file.close();
-          }
-        }
-        // #endregion
+      std::string reason = "upload failed";
+      send_frame(route, FrameType::Error, kFrameFin, 0, reinterpret_cast<const uint8_t*>(reason.data()),
+                 reason.size());
+    }
+  };
+  if (on_upload_end_) {
+    on_upload_end_(stream_id, completed, reply);
+  } else {
+    reply(completed);
+  }
+}
+
+StreamId QuicServerImpl::open_stream(const std::string& client_addr, StreamId client_stream_id,
+                                     uint64_t request_id, uint32_t flags) {
+  std::lock_guard<std::mutex> lock(routes_mutex_);
+  StreamId stream_id = next_stream_id_;
+  next_stream_id_ += shard_count_;
+  stream_ids_[std::make_pair(client_addr, request_id)] = stream_id;
+  StreamRoute& route = stream_routes_[stream_id];
+  route.client_addr = client_addr;
+  route.client_stream_id = client_stream_id;
+  route.request_id = request_id;
+  route.checksum = (flags & kFrameChecksum) != 0;
+  route.windowed = (flags & kFrameWindow) != 0;
+  std::shared_ptr<SendScheduler>& scheduler = schedulers_[client_addr];
+  if (!scheduler) {
+    scheduler = std::make_shared<SendScheduler>();
+  }
+  route.scheduler = scheduler;
+  return stream_id;
+}
+
+bool QuicServerImpl::find_stream(const std::string& client_addr, uint64_t request_id, StreamId& stream_id) {
+  std::lock_guard<std::mutex> lock(routes_mutex_);
+  auto it = stream_ids_.find(std::make_pair(client_addr, request_id));
+  if (it == stream_ids_.end()) {
+    return false;
+  }
+  stream_id = it->second;
+  return true;
+}
+
+bool QuicServerImpl::find_route(StreamId stream_id, StreamRoute& route, uint64_t advance_reply) {
+  std::lock_guard<std::mutex> lock(routes_mutex_);
+  auto it = stream_routes_.find(stream_id);
+  if (it == stream_routes_.end()) {
+    return false;
+  }
+  route = it->second;
+  it->second.reply_offset += advance_reply;
+  it->second.reply_sent += advance_reply;
+  return true;
+}
+
+void QuicServerImpl::end_requests(const std::string& client_addr, StreamId client_stream_id, bool uploads_only) {
+  std::vector<StreamId> ended;
+  {
+    std::lock_guard<std::mutex> lock(routes_mutex_);
+    for (const auto& [sid, route] : stream_routes_) {
+      if (route.client_addr == client_addr && route.client_stream_id == client_stream_id) {
+        ended.push_back(sid);
       }
     }
   }
-  
-  // #region agent log
-  if (messages_processed > 0) {
-    std::ofstream log_file("/home/tprettol/repo/Quicftp/.cursor/debug.log", std::ios::app);
-    if (log_file.is_open()) {
-      log_file << "{\"sessionId\":\"debug-session\",\"runId\":\"run1\",\"hypothesisId\":\"L\",\"location\":\"quic_wrapper.cc:195\",\"message\":\"Processed messages from bridge\",\"data\":{\"messages_processed\":" << messages_processed << "},\"timestamp\":" << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() << "}\n";
-      log_file.close();
+  for (StreamId sid : ended) {
+    if (!uploads_only || upload_streams_.count(sid) > 0) {
+      end_stream(sid, false);
     }
   }
-  // #endregion
-  
-  // Completed uploads will be retrieved via get_pending_uploads()
+}
+
+void QuicServerImpl::disconnect_client(const std::string& client_addr) {
+  std::vector<StreamId> orphaned;
+  {
+    std::lock_guard<std::mutex> lock(routes_mutex_);
+    for (const auto& [sid, route] : stream_routes_) {
+      if (route.client_addr == client_addr) {
+        orphaned.push_back(sid);
+      }
+    }
+  }
+  for (StreamId sid : orphaned) {
+    end_stream(sid, false);
+  }
+  for (auto it = decoders_.begin(); it != decoders_.end();) {
+    it = (it->first.first == client_addr) ? decoders_.erase(it) : std::next(it);
+  }
+  {
+    std::lock_guard<std::mutex> lock(routes_mutex_);
+    schedulers_.erase(client_addr);
+  }
+  transport_->forget_client(client_addr);
+  if (clients_.erase(client_addr) > 0 && on_disconnect_) {
+    on_disconnect_(client_addr);
+  }
+}
+
+void QuicServerImpl::reply_error(StreamId stream_id, const std::string& message) {
+  StreamRoute route;
+  if (find_route(stream_id, route)) {
+    send_frame(route, FrameType::Error, kFrameFin, 0, reinterpret_cast<const uint8_t*>(message.data()),
+               message.size());
+  }
+  end_stream(stream_id, false);
+}
+
+bool QuicServerImpl::send_frame(const StreamRoute& route, FrameType type, uint32_t flags, uint64_t offset,
+                                const uint8_t* payload, size_t len) {
+  // Replies carry checksums if the request did
+  if (route.checksum) {
+    flags |= kFrameChecksum;
+  }
+  uint8_t head[kMaxFrameHeaderSize];
+  size_t head_len = encode_frame_header(head, type, flags, route.request_id, offset, payload, len);
+  return transport_->send_to_client(route.client_addr, route.client_stream_id, head, head_len, payload, len);
+}
+
+void QuicServerWrapper::process_events(int timeout_ms) {
+  if (!shards_[0]->listening_) return;
+
+  if (shards_.size() > 1) {
+    // The workers run the loops; the caller's housekeeping follows their
+    // work, as it follows the loop's with a single shard
+    std::unique_lock<std::mutex> lock(activity_mutex_);
+    activity_cv_.wait_for(lock, std::chrono::milliseconds(timeout_ms),
+                          [this]() { return activity_.load() || !workers_running_; });
+    activity_ = false;
+    return;
+  }
+
+  // Sleeps in epoll only while there is nothing to do; bridge data, timers
+  // and stop() all wake it immediately
+  shards_[0]->loop_.run_once(timeout_ms);
   
-  // TODO: Process QUIC events from library
-  // For now, just sleep to prevent busy waiting
-  std::this_thread::sleep_for(std::chrono::milliseconds(timeout_ms));
 }
 
 void QuicServerWrapper::set_connection_callback(ConnectionCallback on_connect, ConnectionCallback on_disconnect) {
-  impl_->on_connect_ = on_connect;
-  impl_->on_disconnect_ = on_disconnect;
+  for (auto& shard : shards_) {
+    shard->on_connect_ = on_connect;
+    shard->on_disconnect_ = on_disconnect;
+  }
 }
 
 void QuicServerWrapper::set_auth_callback(AuthCallback on_auth) {
-  impl_->on_auth_ = on_auth;
+  for (auto& shard : shards_) {
+    shard->on_auth_ = on_auth;
+  }
 }
 
 void QuicServerWrapper::set_stream_callback(std::function<void(StreamId, const std::string&, StreamDataCallback)> on_stream) {
-  impl_->on_stream_ = on_stream;
+  for (auto& shard : shards_) {
+    shard->on_stream_ = on_stream;
+  }
 }
 
-std::vector<QuicServerWrapper::PendingUpload> QuicServerWrapper::get_pending_uploads() {
-  std::vector<PendingUpload> uploads;
-  
-  for (auto it = impl_->stream_commands_.begin(); it != impl_->stream_commands_.end();) {
-    StreamId sid = it->first;
-    std::string remote_path = it->second;
-    
-    // Check if we have data for this stream (upload complete)
-    if (impl_->stream_data_.find(sid) != impl_->stream_data_.end() && 
-        !impl_->stream_data_[sid].empty()) {
-      PendingUpload upload;
-      upload.stream_id = sid;
-      upload.remote_path = remote_path;
-      upload.data = std::move(impl_->stream_data_[sid]);
-      uploads.push_back(upload);
-      
-      // Remove from tracking
-      impl_->stream_commands_.erase(it++);
-      impl_->stream_data_.erase(sid);
-    } else {
-      it++;
+void QuicServerWrapper::set_upload_callbacks(UploadStartCallback on_start, UploadDataCallback on_data,
+                                             UploadEndCallback on_end) {
+  for (auto& shard : shards_) {
+    shard->on_upload_start_ = on_start;
+    shard->on_upload_data_ = on_data;
+    shard->on_upload_end_ = on_end;
+  }
+}
+
+void QuicServerWrapper::set_upload_status_callback(UploadStatusCallback on_status) {
+  for (auto& shard : shards_) {
+    shard->on_upload_status_ = on_status;
+  }
+}
+
+void QuicServerWrapper::set_download_callback(DownloadCallback on_download) {
+  for (auto& shard : shards_) {
+    shard->on_download_ = on_download;
+  }
+}
+
+bool QuicServerWrapper::send_reply(StreamId stream_id, uint64_t file_size, uint64_t offset, uint64_t length) {
+  QuicServerImpl& impl = shard_for(stream_id);
+  QuicServerImpl::StreamRoute route;
+  {
+    std::lock_guard<std::mutex> lock(impl.routes_mutex_);
+    auto it = impl.stream_routes_.find(stream_id);
+    if (it == impl.stream_routes_.end()) {
+      return false;
     }
+    // Body frames are numbered from the start of the range they carry
+    it->second.reply_offset = offset;
+    route = it->second;
   }
-  
-  return uploads;
+  PayloadWriter payload;
+  payload.varint(file_size).varint(length);
+  return impl.send_frame(route, FrameType::Reply, 0, offset, payload.data().data(), payload.data().size());
+}
+
+bool QuicServerWrapper::send_stream_data(StreamId stream_id, const uint8_t* data, size_t len) {
+  QuicServerImpl& impl = shard_for(stream_id);
+  QuicServerImpl::StreamRoute route;
+  if (!impl.find_route(stream_id, route, len)) {
+    return false;
+  }
+  // A client's downloads take turns by priority
+  route.scheduler->wait_turn(stream_id, len);
+  bool sent = impl.send_frame(route, FrameType::Data, 0, route.reply_offset, data, len);
+  route.scheduler->done(stream_id);
+  return sent;
+}
+
+uint64_t QuicServerWrapper::reply_credit(StreamId stream_id) {
+  QuicServerImpl& impl = shard_for(stream_id);
+  std::lock_guard<std::mutex> lock(impl.routes_mutex_);
+  auto it = impl.stream_routes_.find(stream_id);
+  if (it == impl.stream_routes_.end() || !it->second.windowed) {
+    return std::numeric_limits<uint64_t>::max();
+  }
+  const QuicServerImpl::StreamRoute& route = it->second;
+  return route.reply_window > route.reply_sent ? route.reply_window - route.reply_sent : 0;
+}
+
+void QuicServerWrapper::finish_stream(StreamId stream_id) {
+  QuicServerImpl* impl = &shard_for(stream_id);
+  QuicServerImpl::StreamRoute route;
+  if (impl->find_route(stream_id, route)) {
+    impl->send_frame(route, FrameType::Data, kFrameFin, route.reply_offset, nullptr, 0);
+  }
+  // Stream bookkeeping belongs to the owning shard's loop thread
+  impl->loop_.post([impl, stream_id]() { impl->end_stream(stream_id, true); });
+}
+
+void QuicServerWrapper::reject_stream(StreamId stream_id, const std::string& reason) {
+  QuicServerImpl* impl = &shard_for(stream_id);
+  QuicServerImpl::StreamRoute route;
+  if (impl->find_route(stream_id, route)) {
+    impl->send_frame(route, FrameType::Error, kFrameFin, 0, reinterpret_cast<const uint8_t*>(reason.data()),
+                     reason.size());
+  }
+  impl->loop_.post([impl, stream_id]() { impl->end_stream(stream_id, false); });
 }
 
 QuicConnectionWrapper::QuicConnectionWrapper() : impl_(std::make_unique<QuicConnectionImpl>()) {
@@ -294,4 +955,3 @@ void QuicStreamWrapper::close() {
 }
 
 } // namespace quicftp
-
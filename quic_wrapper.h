@@ -6,9 +6,15 @@
 #define QUIC_WRAPPER_H
 
 #include "quic_common.h"
+#include "transport.h"
 #include <string>
 #include <functional>
 #include <memory>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 
 namespace quicftp {
 
@@ -24,28 +30,78 @@ public:
   ~QuicServerWrapper();
 
   bool initialize(int port, const std::string& cert_path, const std::string& key_path);
+
+  // Serve connections on count shards, each with its own event loop, bridge
+  // ring and connection table, run by worker threads pinned to separate
+  // cores. Call before start_listening(). With 1 (the default) the loop runs
+  // on the thread calling process_events().
+  void set_worker_count(size_t count);
+  size_t worker_count() const;
+
+  // Carry client streams over kind instead of the QUICFTP_TRANSPORT default.
+  // Call before start_listening(), which listens on the initialized port.
+  void set_transport(TransportKind kind);
+
+  // Congestion control for UDP connections accepted from now on
+  void set_congestion_control(CongestionAlgorithm algorithm);
+
+  // Forward error correction for what UDP clients are sent from now on
+  void set_fec(const FecConfig& config);
+
+  // Packet counters of the transport, where it keeps them
+  bool transport_stats(TransportStats& stats) const;
+
   bool start_listening();
   void stop();
   bool is_listening() const;
 
-  // Event loop
+  // Event loop; with several workers this only waits, as they do the work,
+  // returning once one of them has dispatched any or stop() is called
   void process_events(int timeout_ms = 100);
-  
-  // Get completed uploads (for test mode)
-  struct PendingUpload {
-    StreamId stream_id;
-    std::string remote_path;
-    std::vector<uint8_t> data;
-  };
-  std::vector<PendingUpload> get_pending_uploads();
 
   // Callback setters
   void set_connection_callback(ConnectionCallback on_connect, ConnectionCallback on_disconnect);
   void set_auth_callback(AuthCallback on_auth);
   void set_stream_callback(std::function<void(StreamId, const std::string&, StreamDataCallback)> on_stream);
 
+  // Uploads are handed over chunk by chunk as they arrive
+  void set_upload_callbacks(UploadStartCallback on_start, UploadDataCallback on_data, UploadEndCallback on_end);
+
+  // Upload status queries from clients resuming an upload
+  void set_upload_status_callback(UploadStatusCallback on_status);
+
+  // Downloads, ranged downloads and STAT requests are handed to on_download
+  void set_download_callback(DownloadCallback on_download);
+
+  // Reply to a client request; all are safe to call from any thread.
+  // send_reply opens a successful reply with the file size and the byte range
+  // the body covers, which send_stream_data then carries. Both fail once the
+  // request is gone (cancelled, expired or the client disconnected).
+  // finish_stream ends the reply and releases the request; reject_stream
+  // replies with an error instead.
+  bool send_reply(StreamId stream_id, uint64_t file_size, uint64_t offset, uint64_t length);
+  bool send_stream_data(StreamId stream_id, const uint8_t* data, size_t len);
+  // Reply Data stream_id may send before the client makes room for more.
+  // Unlimited for clients that do not window their replies, and once the
+  // request is gone, so that the next send finds out.
+  uint64_t reply_credit(StreamId stream_id);
+  void finish_stream(StreamId stream_id);
+  void reject_stream(StreamId stream_id, const std::string& reason);
+
 private:
-  std::unique_ptr<QuicServerImpl> impl_;
+  std::vector<std::unique_ptr<QuicServerImpl>> shards_;
+  std::vector<std::thread> workers_;
+  std::atomic<bool> workers_running_{false};
+
+  // Workers tell a caller waiting in process_events() that they did work
+  std::mutex activity_mutex_;
+  std::condition_variable activity_cv_;
+  std::atomic<bool> activity_{false};
+  void signal_activity();
+
+  // The shard whose loop owns a stream
+  QuicServerImpl& shard_for(StreamId stream_id) const;
+  void run_worker(size_t shard);
 };
 
 // QUIC Connection wrapper
@@ -0,0 +1,761 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <filesystem>
+#include <functional>
+#include <new>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <sys/resource.h>
+
+#include "quicftp_client.h"
+#include "quicftp_server.h"
+#include "stream_manager.h"
+#include "wire_protocol.h"
+#include "path_resolver.h"
+#include "buffer_pool.h"
+
+// Benchmarks of the pieces a transfer runs through and of whole transfers,
+// reported as JSON so runs can be compared for regressions. The end-to-end
+// scenarios run a server and its clients in this process, over the bridge
+// or UDP on the loopback, so CPU time and allocations cover both sides.
+
+// Every allocation in the process is counted, to report allocations per
+// operation; freeing is left alone. All of them stay out of line, where the
+// compiler cannot pair their malloc() and free() with new and delete.
+static std::atomic<uint64_t> g_allocations{0};
+
+__attribute__((noinline)) void* operator new(std::size_t size) {
+  g_allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void* p = std::malloc(size ? size : 1)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void* operator new(std::size_t size, std::align_val_t align) {
+  g_allocations.fetch_add(1, std::memory_order_relaxed);
+  size_t alignment = std::max(static_cast<size_t>(align), sizeof(void*));
+  if (void* p = std::aligned_alloc(alignment, (std::max<size_t>(size, 1) + alignment - 1) / alignment * alignment)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+  std::free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, std::size_t) noexcept {
+  std::free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, std::align_val_t) noexcept {
+  std::free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, std::size_t, std::align_val_t) noexcept {
+  std::free(p);
+}
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+namespace fs = std::filesystem;
+
+constexpr size_t kMiB = 1024 * 1024;
+constexpr size_t kSmallFileSize = 4096;
+constexpr size_t kMediumFileSize = 4 * kMiB;
+
+struct Options {
+  std::string cert_path;
+  std::string key_path;
+  std::string work_dir = "quicftp_bench.work";
+  std::string filter; // run benchmarks whose name contains this
+  std::string output; // JSON file; stdout if empty
+  quicftp::TransportKind transport = quicftp::TransportKind::Bridge;
+  int port = 4533;
+  double scale = 1;
+  bool micro = true;
+  bool e2e = true;
+  bool verbose = false;
+};
+
+// One benchmark's measurements
+struct Result {
+  std::string name;
+  bool ok = true;
+  uint64_t operations = 0;
+  uint64_t bytes = 0;
+  double seconds = 0;
+  double cpu_seconds = 0; // user and system, whole process
+  uint64_t allocations = 0;
+  std::vector<double> latencies_us; // per operation, or per batch of them averaged
+};
+
+double cpu_seconds() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return static_cast<double>(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) +
+         static_cast<double>(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+double microseconds_since(Clock::time_point start) {
+  return std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+}
+
+// Wall time, CPU time and allocations from construction to finish()
+class Measurement {
+public:
+  Measurement()
+    : start_(Clock::now())
+    , cpu_start_(cpu_seconds())
+    , allocations_start_(g_allocations.load(std::memory_order_relaxed))
+  {
+  }
+
+  void finish(Result& result) const {
+    result.seconds = std::chrono::duration<double>(Clock::now() - start_).count();
+    result.cpu_seconds = cpu_seconds() - cpu_start_;
+    result.allocations = g_allocations.load(std::memory_order_relaxed) - allocations_start_;
+  }
+
+private:
+  Clock::time_point start_;
+  double cpu_start_;
+  uint64_t allocations_start_;
+};
+
+double percentile(std::vector<double> values, double p) {
+  if (values.empty()) {
+    return 0;
+  }
+  std::sort(values.begin(), values.end());
+  size_t rank = static_cast<size_t>(std::ceil(p * static_cast<double>(values.size())));
+  return values[std::min(values.size(), std::max<size_t>(rank, 1)) - 1];
+}
+
+std::string json_number(double value, int precision = 3) {
+  if (!std::isfinite(value)) {
+    return "null";
+  }
+  std::ostringstream out;
+  out << std::fixed << std::setprecision(precision) << value;
+  return out.str();
+}
+
+void write_json(std::ostream& out, const Options& options, const std::vector<Result>& results) {
+  out << "{\n  \"transport\": \"" << (options.transport == quicftp::TransportKind::Udp ? "udp" : "bridge")
+      << "\",\n  \"scale\": " << json_number(options.scale)
+      << ",\n  \"hardware_threads\": " << std::thread::hardware_concurrency() << ",\n  \"benchmarks\": [";
+  for (size_t i = 0; i < results.size(); ++i) {
+    const Result& r = results[i];
+    double gigabytes = static_cast<double>(r.bytes) / 1e9;
+    double operations = static_cast<double>(std::max<uint64_t>(r.operations, 1));
+    out << (i ? "," : "") << "\n    {\"name\": \"" << r.name << "\", \"ok\": " << (r.ok ? "true" : "false")
+        << ", \"operations\": " << r.operations << ", \"bytes\": " << r.bytes
+        << ", \"seconds\": " << json_number(r.seconds, 6)
+        << ", \"throughput_mb_per_s\": "
+        << (r.bytes ? json_number(static_cast<double>(r.bytes) / 1e6 / r.seconds) : "null")
+        << ", \"operations_per_s\": " << json_number(static_cast<double>(r.operations) / r.seconds)
+        << ", \"p50_us\": " << json_number(percentile(r.latencies_us, 0.50))
+        << ", \"p99_us\": " << json_number(percentile(r.latencies_us, 0.99))
+        << ", \"cpu_seconds_per_gb\": " << (r.bytes ? json_number(r.cpu_seconds / gigabytes) : "null")
+        << ", \"allocations_per_operation\": " << json_number(static_cast<double>(r.allocations) / operations)
+        << "}";
+  }
+  out << "\n  ]\n}" << std::endl;
+}
+
+// Random bytes, so nothing along the way gets to take a shortcut
+bool write_file(const fs::path& path, size_t size, uint64_t seed) {
+  fs::create_directories(path.parent_path());
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  std::mt19937_64 random(seed);
+  std::vector<uint64_t> block(kMiB / sizeof(uint64_t));
+  for (size_t written = 0; written < size && out;) {
+    for (uint64_t& word : block) word = random();
+    size_t n = std::min(size - written, kMiB);
+    out.write(reinterpret_cast<const char*>(block.data()), static_cast<std::streamsize>(n));
+    written += n;
+  }
+  return static_cast<bool>(out);
+}
+
+// Run body(i) for i in [0, count) in batches, timing each batch
+void run_batched(Result& result, uint64_t count, uint64_t batch, const std::function<void(uint64_t)>& body) {
+  result.latencies_us.reserve(result.latencies_us.size() + count / batch + 1);
+  for (uint64_t i = 0; i < count;) {
+    uint64_t first = i;
+    uint64_t end = std::min(count, i + batch);
+    Clock::time_point start = Clock::now();
+    for (; i < end; ++i) {
+      body(i);
+    }
+    result.latencies_us.push_back(microseconds_since(start) / static_cast<double>(end - first));
+  }
+  result.operations += count;
+}
+
+// ---- Microbenchmarks ----
+
+Result bench_stream_updates(const Options& options) {
+  Result result;
+  result.name = "stream_manager/update_stream";
+  quicftp::StreamManager manager;
+  std::vector<quicftp::StreamId> ids;
+  for (int i = 0; i < 64; ++i) {
+    ids.push_back(manager.create_stream("file" + std::to_string(i), 1ull << 40, quicftp::kPriorityNormal, true));
+  }
+  uint64_t count = static_cast<uint64_t>(4e6 * options.scale) + 1;
+  Measurement measurement;
+  run_batched(result, count, 1024, [&](uint64_t i) {
+    manager.update_stream(ids[i % ids.size()], static_cast<size_t>(i) * 16384);
+  });
+  measurement.finish(result);
+  return result;
+}
+
+Result bench_stream_lifecycle(const Options& options) {
+  Result result;
+  result.name = "stream_manager/lifecycle";
+  quicftp::StreamManager manager;
+  std::string path = "bench/some/file.bin";
+  uint64_t count = static_cast<uint64_t>(2e5 * options.scale) + 1;
+  Measurement measurement;
+  run_batched(result, count, 256, [&](uint64_t) {
+    quicftp::StreamId id = manager.create_stream(path, 65536, quicftp::kPriorityNormal, false);
+    manager.update_stream(id, 65536);
+    manager.complete_stream(id);
+    manager.remove_stream(id);
+  });
+  measurement.finish(result);
+  return result;
+}
+
+// A stream of Data frames as a client or server would send them
+std::vector<uint8_t> build_frames(size_t frames, size_t payload_size, uint32_t flags) {
+  std::vector<uint8_t> payload(payload_size);
+  std::mt19937 random(7);
+  for (uint8_t& b : payload) b = static_cast<uint8_t>(random());
+  std::vector<uint8_t> stream;
+  uint8_t header[quicftp::kMaxFrameHeaderSize];
+  for (size_t i = 0; i < frames; ++i) {
+    size_t n = quicftp::encode_frame_header(header, quicftp::FrameType::Data, flags, 1 + i % 8, i * payload_size,
+                                            payload.data(), payload.size());
+    stream.insert(stream.end(), header, header + n);
+    stream.insert(stream.end(), payload.begin(), payload.end());
+  }
+  return stream;
+}
+
+Result bench_decode_frames(const Options& options, const std::string& name, uint32_t flags) {
+  Result result;
+  result.name = name;
+  constexpr size_t kFrames = 256;
+  constexpr size_t kPayload = 16384;
+  std::vector<uint8_t> stream = build_frames(kFrames, kPayload, flags);
+  uint64_t rounds = static_cast<uint64_t>(400 * options.scale) + 1;
+  bool ok = true;
+  Measurement measurement;
+  for (uint64_t round = 0; round < rounds; ++round) {
+    Clock::time_point start = Clock::now();
+    const uint8_t* at = stream.data();
+    const uint8_t* end = at + stream.size();
+    while (at < end) {
+      quicftp::Frame frame;
+      size_t consumed;
+      if (quicftp::decode_frame(at, static_cast<size_t>(end - at), frame, consumed) != quicftp::DecodeStatus::Ok ||
+          !frame.intact) {
+        ok = false;
+        break;
+      }
+      at += consumed;
+    }
+    result.latencies_us.push_back(microseconds_since(start) / kFrames);
+  }
+  measurement.finish(result);
+  result.ok = ok;
+  result.operations = rounds * kFrames;
+  result.bytes = rounds * kFrames * kPayload;
+  return result;
+}
+
+// Frames cut into datagram-sized reads, so some are reassembled
+Result bench_frame_decoder(const Options& options) {
+  Result result;
+  result.name = "wire_protocol/frame_decoder_split";
+  constexpr size_t kFrames = 1024;
+  constexpr size_t kPayload = 1200;
+  constexpr size_t kReadSize = 1400;
+  std::vector<uint8_t> stream = build_frames(kFrames, kPayload, 0);
+  uint64_t rounds = static_cast<uint64_t>(400 * options.scale) + 1;
+  uint64_t frames = 0;
+  Measurement measurement;
+  for (uint64_t round = 0; round < rounds; ++round) {
+    quicftp::FrameDecoder decoder;
+    Clock::time_point start = Clock::now();
+    for (size_t at = 0; at < stream.size(); at += kReadSize) {
+      decoder.feed(stream.data() + at, std::min(kReadSize, stream.size() - at), [&](const quicftp::Frame&) {
+        frames++;
+        return true;
+      });
+    }
+    result.latencies_us.push_back(microseconds_since(start) / kFrames);
+  }
+  measurement.finish(result);
+  result.ok = frames == rounds * kFrames;
+  result.operations = frames;
+  result.bytes = frames * kPayload;
+  return result;
+}
+
+Result bench_path_resolution(const Options& options) {
+  Result result;
+  result.name = "path_resolver/locate";
+  fs::path root = fs::path(options.work_dir) / "paths";
+  fs::remove_all(root);
+  fs::create_directories(root);
+  quicftp::PathResolver resolver;
+  if (!resolver.open_root(root.string())) {
+    result.ok = false;
+    return result;
+  }
+  // A few hundred directories, more than the resolver keeps open, visited
+  // the way batches of small files land
+  std::vector<std::string> paths;
+  for (int i = 0; i < 4096; ++i) {
+    paths.push_back("project" + std::to_string(i % 8) + "/dir" + std::to_string(i % 384) + "/file" +
+                    std::to_string(i) + ".dat");
+  }
+  uint64_t count = static_cast<uint64_t>(5e5 * options.scale) + 1;
+  bool ok = true;
+  Measurement measurement;
+  run_batched(result, count, 256, [&](uint64_t i) {
+    quicftp::PathResolver::Location location;
+    ok &= resolver.locate(paths[(i * 7) % paths.size()], true, location);
+  });
+  measurement.finish(result);
+  result.ok = ok;
+  return result;
+}
+
+Result bench_buffer_pool(const Options& options, size_t threads) {
+  Result result;
+  result.name = "buffer_pool/acquire_release_" + std::to_string(threads) + "_threads";
+  quicftp::BufferPool::Config config;
+  quicftp::BufferPool pool(config);
+  uint64_t per_thread = static_cast<uint64_t>(2e6 * options.scale / static_cast<double>(threads)) + 1;
+  std::vector<Result> partial(threads);
+  Measurement measurement;
+  std::vector<std::thread> workers;
+  for (size_t t = 0; t < threads; ++t) {
+    workers.emplace_back([&, t]() {
+      // Hold a few at a time, as a connection with frames in flight does
+      quicftp::BufferRef held[4];
+      run_batched(partial[t], per_thread, 1024, [&](uint64_t i) {
+        held[i % 4] = pool.acquire();
+      });
+    });
+  }
+  for (std::thread& worker : workers) {
+    worker.join();
+  }
+  measurement.finish(result);
+  for (const Result& r : partial) {
+    result.operations += r.operations;
+    result.latencies_us.insert(result.latencies_us.end(), r.latencies_us.begin(), r.latencies_us.end());
+  }
+  result.ok = pool.stats().fallback_allocations == 0;
+  return result;
+}
+
+// ---- End-to-end scenarios ----
+
+// A server on a thread of its own, serving root
+class BenchServer {
+public:
+  bool start(const Options& options, const fs::path& root) {
+    server_.set_transport(options.transport);
+    server_.set_worker_count(std::max(1u, std::thread::hardware_concurrency() / 2));
+    if (!server_.start(options.port, options.cert_path, options.key_path, root.string())) {
+      return false;
+    }
+    thread_ = std::thread([this]() {
+      while (!stopping_) {
+        server_.process_events(50);
+      }
+    });
+    return true;
+  }
+
+  ~BenchServer() {
+    stopping_ = true;
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+    server_.stop();
+  }
+
+private:
+  quicftp::Server server_;
+  std::thread thread_;
+  std::atomic<bool> stopping_{false};
+};
+
+std::unique_ptr<quicftp::Client> connect_client(const Options& options) {
+  auto client = std::make_unique<quicftp::Client>();
+  client->set_transport(options.transport);
+  if (!client->connect("localhost:" + std::to_string(options.port)) || !client->authenticate(options.cert_path)) {
+    return nullptr;
+  }
+  return client;
+}
+
+Result bench_large_file(const Options& options, const fs::path& local, bool upload) {
+  Result result;
+  result.name = upload ? "e2e/large_file_upload" : "e2e/large_file_download";
+  auto client = connect_client(options);
+  if (!client) {
+    result.ok = false;
+    return result;
+  }
+  fs::path target = local.parent_path() / "large.download";
+  fs::remove(target);
+  Measurement measurement;
+  Clock::time_point start = Clock::now();
+  result.ok = upload ? client->upload_file(local.string(), "bench/upload/large.bin")
+                     : client->download_file("bench/large.bin", target.string());
+  result.latencies_us.push_back(microseconds_since(start));
+  measurement.finish(result);
+  result.operations = 1;
+  result.bytes = fs::file_size(local);
+  client->disconnect();
+  fs::remove(target);
+  return result;
+}
+
+// count files of kSmallFileSize uploaded over `connections` clients, each
+// sending its share one after another
+Result bench_small_files(const Options& options, const std::vector<fs::path>& files, size_t connections) {
+  Result result;
+  result.name = "e2e/small_files_upload";
+  std::vector<std::unique_ptr<quicftp::Client>> clients;
+  for (size_t c = 0; c < connections; ++c) {
+    clients.push_back(connect_client(options));
+    if (!clients.back()) {
+      result.ok = false;
+      return result;
+    }
+  }
+  std::vector<std::vector<double>> latencies(connections);
+  std::atomic<bool> ok{true};
+  Measurement measurement;
+  std::vector<std::thread> workers;
+  for (size_t c = 0; c < connections; ++c) {
+    workers.emplace_back([&, c]() {
+      for (size_t i = c; i < files.size(); i += connections) {
+        Clock::time_point start = Clock::now();
+        if (!clients[c]->upload_file(files[i].string(), "bench/upload/small/" + files[i].filename().string())) {
+          ok = false;
+        }
+        latencies[c].push_back(microseconds_since(start));
+      }
+    });
+  }
+  for (std::thread& worker : workers) {
+    worker.join();
+  }
+  measurement.finish(result);
+  for (const auto& l : latencies) {
+    result.latencies_us.insert(result.latencies_us.end(), l.begin(), l.end());
+  }
+  result.ok = ok;
+  result.operations = files.size();
+  result.bytes = files.size() * kSmallFileSize;
+  for (auto& client : clients) {
+    client->disconnect();
+  }
+  return result;
+}
+
+// Small interactive downloads on a connection busy with a background one:
+// their latency shows whether priorities hold under load
+std::vector<Result> bench_mixed_priorities(const Options& options, const fs::path& local_dir, size_t interactive) {
+  Result background;
+  background.name = "e2e/mixed_priorities_background";
+  Result foreground;
+  foreground.name = "e2e/mixed_priorities_interactive";
+  auto client = connect_client(options);
+  if (!client) {
+    background.ok = foreground.ok = false;
+    return {background, foreground};
+  }
+  fs::create_directories(local_dir);
+  std::atomic<size_t> received{0};
+  client->set_progress_callback([&](quicftp::StreamId, size_t done, size_t) { received = done; });
+
+  Measurement measurement;
+  Clock::time_point start = Clock::now();
+  client->set_transfer_priority(quicftp::kPriorityBackground);
+  std::thread bulk([&]() {
+    background.ok = client->download_file("bench/large.bin", (local_dir / "large.bin").string());
+  });
+  // Start once the bulk transfer is under way
+  while (received == 0 && microseconds_since(start) < 5e6) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  client->set_transfer_priority(quicftp::kPriorityInteractive);
+  for (size_t i = 0; i < interactive; ++i) {
+    std::string name = "f" + std::to_string(i);
+    Clock::time_point begin = Clock::now();
+    foreground.ok &= client->download_file("bench/small/" + name, (local_dir / name).string());
+    foreground.latencies_us.push_back(microseconds_since(begin));
+  }
+  measurement.finish(foreground);
+  foreground.operations = interactive;
+  foreground.bytes = interactive * kSmallFileSize;
+  bulk.join();
+  measurement.finish(background);
+  background.latencies_us.push_back(microseconds_since(start));
+  background.operations = 1;
+  background.bytes = fs::file_size(local_dir / "large.bin");
+  client->disconnect();
+  fs::remove_all(local_dir);
+  return {background, foreground};
+}
+
+Result bench_many_clients(const Options& options, const fs::path& local_dir, size_t count) {
+  Result result;
+  result.name = "e2e/many_clients_download";
+  fs::create_directories(local_dir);
+  std::vector<std::unique_ptr<quicftp::Client>> clients;
+  for (size_t c = 0; c < count; ++c) {
+    clients.push_back(connect_client(options));
+    if (!clients.back()) {
+      result.ok = false;
+      return result;
+    }
+  }
+  std::vector<double> latencies(count);
+  std::atomic<bool> ok{true};
+  Measurement measurement;
+  std::vector<std::thread> workers;
+  for (size_t c = 0; c < count; ++c) {
+    workers.emplace_back([&, c]() {
+      Clock::time_point start = Clock::now();
+      if (!clients[c]->download_file("bench/medium.bin", (local_dir / ("medium" + std::to_string(c))).string())) {
+        ok = false;
+      }
+      latencies[c] = microseconds_since(start);
+    });
+  }
+  for (std::thread& worker : workers) {
+    worker.join();
+  }
+  measurement.finish(result);
+  result.latencies_us = latencies;
+  result.ok = ok;
+  result.operations = count;
+  result.bytes = count * kMediumFileSize;
+  for (auto& client : clients) {
+    client->disconnect();
+  }
+  fs::remove_all(local_dir);
+  return result;
+}
+
+bool selected(const Options& options, const std::string& name) {
+  return options.filter.empty() || name.find(options.filter) != std::string::npos;
+}
+
+void run_micro(const Options& options, std::vector<Result>& results) {
+  auto run = [&](const std::string& name, const std::function<Result()>& bench) {
+    if (!selected(options, name)) return;
+    std::cerr << "Running " << name << std::endl;
+    results.push_back(bench());
+  };
+  run("stream_manager/update_stream", [&]() { return bench_stream_updates(options); });
+  run("stream_manager/lifecycle", [&]() { return bench_stream_lifecycle(options); });
+  run("wire_protocol/decode_frame", [&]() { return bench_decode_frames(options, "wire_protocol/decode_frame", 0); });
+  run("wire_protocol/decode_frame_checksum", [&]() {
+    return bench_decode_frames(options, "wire_protocol/decode_frame_checksum", quicftp::kFrameChecksum);
+  });
+  run("wire_protocol/frame_decoder_split", [&]() { return bench_frame_decoder(options); });
+  run("path_resolver/locate", [&]() { return bench_path_resolution(options); });
+  run("buffer_pool/acquire_release_1_threads", [&]() { return bench_buffer_pool(options, 1); });
+  run("buffer_pool/acquire_release_4_threads", [&]() { return bench_buffer_pool(options, 4); });
+}
+
+bool run_e2e(const Options& options, std::vector<Result>& results) {
+  fs::path work = fs::path(options.work_dir);
+  fs::path root = work / "root";
+  fs::path local = work / "client";
+  fs::remove_all(root);
+  fs::remove_all(local);
+
+  size_t large_size = std::max<size_t>(kMiB, static_cast<size_t>(256 * kMiB * options.scale));
+  size_t small_count = std::max<size_t>(16, static_cast<size_t>(10000 * options.scale));
+  size_t client_count = std::max<size_t>(4, static_cast<size_t>(32 * options.scale));
+  size_t interactive_count = std::min<size_t>(small_count, 200);
+
+  std::cerr << "Preparing files in " << work.string() << std::endl;
+  std::vector<fs::path> small_files;
+  bool ok = write_file(local / "large.bin", large_size, 1) && write_file(root / "bench/large.bin", large_size, 2) &&
+            write_file(root / "bench/medium.bin", kMediumFileSize, 3);
+  for (size_t i = 0; ok && i < small_count; ++i) {
+    small_files.push_back(local / "small" / ("f" + std::to_string(i)));
+    ok = write_file(small_files.back(), kSmallFileSize, 100 + i);
+  }
+  for (size_t i = 0; ok && i < interactive_count; ++i) {
+    ok = write_file(root / "bench/small" / ("f" + std::to_string(i)), kSmallFileSize, 100 + i);
+  }
+  if (!ok) {
+    std::cerr << "Error: cannot write benchmark files under " << work.string() << std::endl;
+    return false;
+  }
+
+  BenchServer server;
+  if (!server.start(options, root)) {
+    std::cerr << "Error: cannot start the server" << std::endl;
+    return false;
+  }
+  auto run = [&](const std::string& name, const std::function<void()>& bench) {
+    if (!selected(options, name)) return;
+    std::cerr << "Running " << name << std::endl;
+    bench();
+  };
+  run("e2e/large_file_upload", [&]() { results.push_back(bench_large_file(options, local / "large.bin", true)); });
+  run("e2e/large_file_download", [&]() {
+    results.push_back(bench_large_file(options, root / "bench/large.bin", false));
+  });
+  run("e2e/small_files_upload", [&]() { results.push_back(bench_small_files(options, small_files, 8)); });
+  run("e2e/mixed_priorities", [&]() {
+    for (Result& r : bench_mixed_priorities(options, local / "mixed", interactive_count)) {
+      results.push_back(std::move(r));
+    }
+  });
+  run("e2e/many_clients_download", [&]() {
+    results.push_back(bench_many_clients(options, local / "many", client_count));
+  });
+  return true;
+}
+
+void print_usage(const char* program_name) {
+  std::cerr << "Usage: " << program_name << " [<cert_path> <key_path>] [--suite micro|e2e|all] [--filter NAME]"
+            << " [--transport bridge|udp] [--port N] [--scale F] [--work-dir DIR] [--output FILE] [--verbose]"
+            << std::endl;
+  std::cerr << std::endl;
+  std::cerr << "Arguments:" << std::endl;
+  std::cerr << "  cert_path   - Certificate for the in-process server and its clients (e2e suite only)" << std::endl;
+  std::cerr << "  key_path    - Server private key (e2e suite only)" << std::endl;
+  std::cerr << "  --suite     - Microbenchmarks, end-to-end scenarios or both (default: all)" << std::endl;
+  std::cerr << "  --filter    - Only benchmarks whose name contains NAME" << std::endl;
+  std::cerr << "  --transport - What the scenarios run over (default: QUICFTP_TRANSPORT, else bridge)" << std::endl;
+  std::cerr << "  --port      - Port of the in-process server (default: 4533)" << std::endl;
+  std::cerr << "  --scale     - Multiplies iterations, file sizes and counts (default: 1)" << std::endl;
+  std::cerr << "  --work-dir  - Scratch directory, emptied as needed (default: quicftp_bench.work)" << std::endl;
+  std::cerr << "  --output    - Write the JSON report here instead of stdout" << std::endl;
+  std::cerr << "  --verbose   - Show client progress output" << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+  Options options;
+  options.transport = quicftp::Transport::default_kind();
+  std::vector<std::string> paths;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg.compare(0, 2, "--") != 0) {
+      paths.push_back(arg);
+    } else if (arg == "--suite" && i + 1 < argc) {
+      std::string suite = argv[++i];
+      options.micro = suite == "micro" || suite == "all";
+      options.e2e = suite == "e2e" || suite == "all";
+      if (!options.micro && !options.e2e) {
+        std::cerr << "Error: --suite must be micro, e2e or all" << std::endl;
+        return 1;
+      }
+    } else if (arg == "--filter" && i + 1 < argc) {
+      options.filter = argv[++i];
+    } else if (arg == "--transport" && i + 1 < argc) {
+      if (!quicftp::parse_transport_kind(argv[++i], options.transport)) {
+        std::cerr << "Error: --transport must be bridge or udp" << std::endl;
+        return 1;
+      }
+    } else if (arg == "--port" && i + 1 < argc) {
+      options.port = std::atoi(argv[++i]);
+    } else if (arg == "--scale" && i + 1 < argc) {
+      options.scale = std::atof(argv[++i]);
+    } else if (arg == "--work-dir" && i + 1 < argc) {
+      options.work_dir = argv[++i];
+    } else if (arg == "--output" && i + 1 < argc) {
+      options.output = argv[++i];
+    } else if (arg == "--verbose") {
+      options.verbose = true;
+    } else {
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+  // Only the end-to-end scenarios run a server, which needs the certificate
+  if (paths.size() == 2) {
+    options.cert_path = paths[0];
+    options.key_path = paths[1];
+  } else if (!paths.empty() || options.e2e) {
+    print_usage(argv[0]);
+    return 1;
+  }
+  if (options.scale <= 0) {
+    std::cerr << "Error: --scale must be positive" << std::endl;
+    return 1;
+  }
+  if (options.port < 1 || options.port > 65535) {
+    std::cerr << "Error: Port must be between 1 and 65535" << std::endl;
+    return 1;
+  }
+
+  // The client library reports progress on stdout; keep it out of the JSON
+  std::ostream report(std::cout.rdbuf());
+  std::ofstream discard;
+  std::cout.rdbuf(options.verbose ? std::cerr.rdbuf() : discard.rdbuf());
+
+  std::vector<Result> results;
+  if (options.micro) {
+    run_micro(options, results);
+  }
+  bool ok = true;
+  if (options.e2e) {
+    ok = run_e2e(options, results);
+  }
+  for (const Result& r : results) {
+    if (!r.ok) {
+      std::cerr << "Failed: " << r.name << std::endl;
+      ok = false;
+    }
+  }
+
+  if (options.output.empty()) {
+    write_json(report, options, results);
+  } else {
+    std::ofstream out(options.output);
+    write_json(out, options, results);
+    if (!out) {
+      std::cerr << "Error: cannot write " << options.output << std::endl;
+      ok = false;
+    }
+  }
+  std::cout.rdbuf(report.rdbuf());
+  return ok ? 0 : 1;
+}
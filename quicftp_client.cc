@@ -4,49 +4,195 @@
 #include "quic_common.h"
 #include "quic_wrapper.h"
 #include "stream_manager.h"
-#include "test_bridge.h"
+#include "transport.h"
+#include "file_sink.h"
+#include "file_source.h"
+#include "range_journal.h"
+#include "wire_protocol.h"
+#include "send_scheduler.h"
 #include <iostream>
-#include <fstream>
 #include <filesystem>
 #include <mutex>
 #include <map>
 #include <vector>
 #include <functional>
+#include <memory>
 #include <chrono>
+#include <atomic>
+#include <thread>
+#include <algorithm>
+#include <deque>
+#include <condition_variable>
+#include <sstream>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
 
 namespace quicftp {
 
+namespace {
+
+constexpr size_t kChunkSize = 64 * 1024; // 64KB chunks
+
+// Files smaller than this are not worth striping by default
+constexpr size_t kDefaultStripeMinSize = 64 * 1024 * 1024;
+
+// Files smaller than this are not worth segmenting by default
+constexpr size_t kDefaultSegmentMinSize = 64 * 1024 * 1024;
+
+// Smaller files are cheaper to resend whole than to track for resuming
+constexpr uint64_t kResumableMinSize = 1024 * 1024;
+
+// Ranged downloads journal their progress at least this often
+constexpr uint64_t kJournalIntervalBytes = 4 * 1024 * 1024;
+
+// A download stream that receives nothing for this long is given up
+constexpr int kReceiveIdleTimeoutMs = 30000;
+
+// How long the receiver sleeps before rechecking for shutdown
+constexpr int kReceiverWaitMs = 200;
+
+// Makes client addresses unique among connections of one process
+std::atomic<uint64_t> g_connection_counter{0};
+
+// First frame of every reply to a download, STAT or upload status request:
+// the file size and the byte range the body covers, or the server's reason
+// for refusing
+struct ReplyHeader {
+  bool ok = false;
+  uint64_t file_size = 0;
+  uint64_t offset = 0;
+  uint64_t length = 0;
+  std::string error;
+};
+
+// Cut ranges into pieces of at most piece_len bytes to spread over streams
+std::vector<std::pair<uint64_t, uint64_t>> split_ranges(const std::vector<std::pair<uint64_t, uint64_t>>& ranges,
+                                                        uint64_t piece_len) {
+  std::vector<std::pair<uint64_t, uint64_t>> pieces;
+  for (const auto& [offset, length] : ranges) {
+    for (uint64_t done = 0; done < length; done += piece_len) {
+      pieces.emplace_back(offset + done, std::min(piece_len, length - done));
+    }
+  }
+  return pieces;
+}
+
+// Per-stream share of a file split `ways` ways, rounded up to whole chunks
+uint64_t piece_length(uint64_t file_size, size_t ways) {
+  uint64_t len = (file_size + ways - 1) / ways;
+  return std::max<uint64_t>(kChunkSize, ((len + kChunkSize - 1) / kChunkSize) * kChunkSize);
+}
+
+} // namespace
+
 // Forward declaration for QUIC client wrapper
 class QuicClientWrapper {
 public:
   QuicClientWrapper();
   ~QuicClientWrapper();
 
+  // Carry streams over kind instead of the QUICFTP_TRANSPORT default; takes
+  // effect on the next connect()
+  void set_transport(TransportKind kind) { transport_ = &Transport::get(kind); }
+  void set_congestion_control(CongestionAlgorithm algorithm) { congestion_ = algorithm; }
+  void set_fec(const FecConfig& config) { fec_ = config; }
+
   bool connect(const std::string& server_address);
   bool authenticate(const std::string& cert_path);
   void disconnect();
   bool is_connected() const;
 
-  // Stream operations
+  // Stream operations. Streams carry frames (see wire_protocol.h).
   bool create_stream(StreamId& stream_id);
-  bool send_data(StreamId stream_id, const uint8_t* data, size_t len);
-  bool receive_data(StreamId stream_id, std::function<bool(const uint8_t*, size_t)> callback);
   void close_stream(StreamId stream_id);
 
+  // Requests are frames tagged with a connection-unique id; any number may
+  // share a stream. open_request registers the id for replies before the
+  // request goes out, so none can be missed. The request's Data frames take
+  // turns with other requests' by priority. Requests ask for windowed
+  // replies, so a reader falling behind holds back only its own.
+  uint64_t open_request(int priority = kPriorityNormal);
+  bool send_frame(StreamId stream_id, FrameType type, uint64_t request_id, uint64_t offset, uint32_t flags,
+                  const uint8_t* payload, size_t len);
+  // True once the server has said something about request_id, e.g. refused
+  // an upload that is still being sent
+  bool has_reply(uint64_t request_id);
+  // Feed the frames the server sends for request_id to callback, along with
+  // the pooled buffer holding each payload, until one ends the request (Fin,
+  // Error or Ack); false if the callback gave up, the server went quiet or
+  // the connection closed. Releases the request either way.
+  bool receive_frames(uint64_t request_id,
+                      const std::function<bool(const Frame&, const BufferRef& owner)>& callback);
+  // Tell the server to drop request_id and stop listening for its replies
+  void cancel_request(StreamId stream_id, uint64_t request_id);
+
 private:
   bool connected_;
   std::string server_address_;
+  std::string client_id_;
   std::string cert_path_;
+  Transport* transport_;
+  CongestionAlgorithm congestion_;
+  FecConfig fec_;
+  std::atomic<StreamId> next_stream_id_;
+  std::atomic<uint64_t> next_request_id_;
   // TODO: Add actual QUIC client connection
+
+  // Orders the Data frames of concurrent requests, each a flow by request id
+  SendScheduler scheduler_;
+
+  // Reply frames waiting to be consumed, per open request. Payloads stay in
+  // the pooled buffer they were received into; only a frame reassembled from
+  // several messages is copied out, into a buffer of its own.
+  struct InboundFrame {
+    FrameType type;
+    uint32_t flags;
+    uint64_t offset;
+    bool intact;
+    BufferRef buffer;
+    size_t payload_offset;
+    size_t length;
+  };
+  struct InboundRequest {
+    std::deque<InboundFrame> frames;
+    StreamId stream = 0;           // stream the request went out on
+    uint64_t received = 0;         // reply Data bytes queued so far
+    uint64_t consumed = 0;         // reply Data bytes handed to the reader
+    uint64_t window = kReplyWindow; // reply Data bytes the server may send
+  };
+  std::map<uint64_t, InboundRequest> inbound_;
+  std::mutex inbound_mutex_;
+  std::condition_variable inbound_cv_;
+  std::thread receiver_;
+  std::atomic<bool> receiving_{false};
+  std::map<StreamId, FrameDecoder> decoders_; // receiver thread only
+
+  void receive_loop();
+  void queue_frame(const Frame& frame, const BufferRef& buffer, size_t payload_offset);
 };
 
 // Stub implementation
-QuicClientWrapper::QuicClientWrapper() : connected_(false) {}
+QuicClientWrapper::QuicClientWrapper()
+  : connected_(false), transport_(&Transport::get(Transport::default_kind())),
+    congestion_(CongestionAlgorithm::Cubic), next_stream_id_(1), next_request_id_(1) {}
 QuicClientWrapper::~QuicClientWrapper() { disconnect(); }
 
 bool QuicClientWrapper::connect(const std::string& server_address) {
   server_address_ = server_address;
   // TODO: Establish QUIC connection
+  // The transport knows the connection by this name; over the bridge the
+  // server tells clients apart by it and replies on a ring named after it
+  client_id_ = "client-" + std::to_string(getpid()) + "-" + std::to_string(g_connection_counter.fetch_add(1));
+  transport_->set_congestion_control(congestion_);
+  transport_->set_fec(fec_);
+  if (!transport_->open_client_channel(client_id_, server_address)) {
+    std::cerr << "Failed to open channel to " << server_address << std::endl;
+    return false;
+  }
+  receiving_ = true;
+  receiver_ = std::thread([this]() { receive_loop(); });
   connected_ = true;
   return true;
 }
@@ -61,9 +207,77 @@ void QuicClientWrapper::disconnect() {
   if (connected_) {
     // TODO: Close QUIC connection
     connected_ = false;
+    {
+      std::lock_guard<std::mutex> lock(inbound_mutex_);
+      receiving_ = false;
+      inbound_.clear();
+    }
+    inbound_cv_.notify_all();
+    receiver_.join();
+    decoders_.clear();
+    transport_->disconnect(client_id_);
+    transport_->close_client_channel(client_id_);
   }
 }
 
+void QuicClientWrapper::receive_loop() {
+  StreamId stream_id;
+  BufferRef data;
+  uint32_t flags = 0;
+  while (receiving_) {
+    if (!transport_->receive_from_server(client_id_, stream_id, data, &flags, kReceiverWaitMs)) {
+      continue;
+    }
+    if (data.empty()) {
+      continue;
+    }
+
+    // Frames are queued by reference to the message buffer they arrived in
+    const uint8_t* begin = data.data();
+    const uint8_t* end = begin + data.size();
+    bool well_formed = decoders_[stream_id].feed(data.data(), data.size(), [&](const Frame& frame) {
+      if (frame.payload >= begin && frame.payload + frame.length <= end) {
+        queue_frame(frame, data, static_cast<size_t>(frame.payload - begin));
+      } else {
+        BufferRef copy = BufferPool::instance().acquire(std::max<size_t>(frame.length, 1));
+        std::memcpy(copy.data(), frame.payload, frame.length);
+        queue_frame(frame, copy, 0);
+      }
+      return true;
+    });
+    if (!well_formed) {
+      // Requests waiting on this stream time out
+      std::cerr << "Malformed reply on stream " << stream_id << std::endl;
+      decoders_.erase(stream_id);
+    }
+  }
+}
+
+void QuicClientWrapper::queue_frame(const Frame& frame, const BufferRef& buffer, size_t payload_offset) {
+  std::unique_lock<std::mutex> lock(inbound_mutex_);
+  auto it = inbound_.find(frame.request_id);
+  if (it == inbound_.end()) {
+    return; // nobody is listening for this request any more
+  }
+  InboundRequest& request = it->second;
+  if (frame.type == FrameType::Data) {
+    // The window bounds what a slow reader can pile up; a server sending
+    // past it loses the request rather than growing the queue
+    request.received += frame.length;
+    if (request.received > request.window) {
+      std::cerr << "Reply overran its window for request " << frame.request_id << std::endl;
+      inbound_.erase(it);
+      lock.unlock();
+      inbound_cv_.notify_all();
+      return;
+    }
+  }
+  request.frames.push_back(InboundFrame{frame.type, frame.flags, frame.offset, frame.intact, buffer, payload_offset,
+                                        frame.length});
+  lock.unlock();
+  inbound_cv_.notify_all();
+}
+
 bool QuicClientWrapper::is_connected() const {
   return connected_;
 }
@@ -71,25 +285,130 @@ bool QuicClientWrapper::is_connected() const {
 bool QuicClientWrapper::create_stream(StreamId& stream_id) {
   if (!connected_) return false;
   // TODO: Create QUIC stream
-  static StreamId next_id = 1;
-  stream_id = next_id++;
+  stream_id = next_stream_id_.fetch_add(1);
   return true;
 }
 
-bool QuicClientWrapper::send_data(StreamId stream_id, const uint8_t* data, size_t len) {
+uint64_t QuicClientWrapper::open_request(int priority) {
+  uint64_t request_id = next_request_id_.fetch_add(1);
+  scheduler_.open_flow(request_id, priority);
+  std::lock_guard<std::mutex> lock(inbound_mutex_);
+  inbound_[request_id];
+  return request_id;
+}
+
+bool QuicClientWrapper::send_frame(StreamId stream_id, FrameType type, uint64_t request_id, uint64_t offset,
+                                   uint32_t flags, const uint8_t* payload, size_t len) {
   if (!connected_) return false;
-  // Test mode: Send data via test bridge
-  return TestBridge::instance().send_to_server(server_address_, stream_id, data, len);
+  if (type >= FrameType::Upload && type <= FrameType::Stat) {
+    // Window frames for the reply go where the request went
+    flags |= kFrameWindow;
+    std::lock_guard<std::mutex> lock(inbound_mutex_);
+    auto it = inbound_.find(request_id);
+    if (it != inbound_.end()) {
+      it->second.stream = stream_id;
+    }
+  }
+  uint8_t head[kMaxFrameHeaderSize];
+  size_t head_len = encode_frame_header(head, type, flags, request_id, offset, payload, len);
+  if (type != FrameType::Data) {
+    return transport_->send_to_server(client_id_, stream_id, head, head_len, payload, len);
+  }
+  scheduler_.wait_turn(request_id, len);
+  bool sent = transport_->send_to_server(client_id_, stream_id, head, head_len, payload, len);
+  scheduler_.done(request_id);
+  if (flags & kFrameFin) {
+    scheduler_.close_flow(request_id);
+  }
+  return sent;
+}
+
+bool QuicClientWrapper::has_reply(uint64_t request_id) {
+  std::lock_guard<std::mutex> lock(inbound_mutex_);
+  auto it = inbound_.find(request_id);
+  return it != inbound_.end() && !it->second.frames.empty();
 }
 
-bool QuicClientWrapper::receive_data(StreamId stream_id, std::function<bool(const uint8_t*, size_t)> callback) {
+bool QuicClientWrapper::receive_frames(uint64_t request_id,
+                                       const std::function<bool(const Frame&, const BufferRef& owner)>& callback) {
   if (!connected_) return false;
-  // TODO: Receive data from QUIC stream
-  return true;
+
+  std::unique_lock<std::mutex> lock(inbound_mutex_);
+  bool success = false;
+  while (true) {
+    auto it = inbound_.find(request_id);
+    if (it == inbound_.end()) {
+      break; // disconnected meanwhile
+    }
+    InboundRequest& request = it->second;
+    if (request.frames.empty()) {
+      if (!inbound_cv_.wait_for(lock, std::chrono::milliseconds(kReceiveIdleTimeoutMs), [&]() {
+            auto current = inbound_.find(request_id);
+            return current == inbound_.end() || !current->second.frames.empty();
+          })) {
+        break; // server went quiet
+      }
+      continue;
+    }
+
+    InboundFrame inbound = std::move(request.frames.front());
+    request.frames.pop_front();
+    // Make room for more once half the window has been read
+    uint64_t grant = 0;
+    if (inbound.type == FrameType::Data) {
+      request.consumed += inbound.length;
+      if (request.window - request.consumed <= kReplyWindow / 2 && !(inbound.flags & kFrameFin)) {
+        request.window = request.consumed + kReplyWindow;
+        grant = request.window;
+      }
+    }
+    StreamId stream_id = request.stream;
+    lock.unlock();
+    if (grant > 0) {
+      send_frame(stream_id, FrameType::Window, request_id, grant, 0, nullptr, 0);
+    }
+
+    Frame frame;
+    frame.type = inbound.type;
+    frame.flags = inbound.flags;
+    frame.request_id = request_id;
+    frame.offset = inbound.offset;
+    frame.payload = inbound.buffer.data() + inbound.payload_offset;
+    frame.length = inbound.length;
+    frame.intact = inbound.intact;
+    bool last = frame.type == FrameType::Error || frame.type == FrameType::Ack || (frame.flags & kFrameFin);
+    bool keep_going = callback(frame, inbound.buffer);
+    lock.lock();
+    if (!keep_going) {
+      break;
+    }
+    if (last) {
+      success = true;
+      break;
+    }
+  }
+  inbound_.erase(request_id);
+  lock.unlock();
+  inbound_cv_.notify_all();
+  scheduler_.close_flow(request_id);
+  return success;
+}
+
+void QuicClientWrapper::cancel_request(StreamId stream_id, uint64_t request_id) {
+  if (!connected_) return;
+  {
+    std::lock_guard<std::mutex> lock(inbound_mutex_);
+    inbound_.erase(request_id);
+  }
+  inbound_cv_.notify_all();
+  scheduler_.close_flow(request_id);
+  send_frame(stream_id, FrameType::Cancel, request_id, 0, 0, nullptr, 0);
 }
 
 void QuicClientWrapper::close_stream(StreamId stream_id) {
-  // TODO: Close QUIC stream
+  if (!connected_) return;
+  // Test mode: tell the server no more data follows on this stream
+  transport_->finish_stream(client_id_, stream_id);
 }
 
 // Client implementation
@@ -98,15 +417,140 @@ public:
   std::unique_ptr<QuicClientWrapper> quic_client_;
   std::unique_ptr<StreamManager> stream_manager_;
   bool authenticated_;
+  size_t parallel_transfers_;
+  size_t stripes_;
+  size_t stripe_min_size_;
+  size_t segments_;
+  size_t segment_min_size_;
+  bool resume_;
+  bool checksums_;
+  int priority_;          // of transfers started from now on
+  TokenBucket connection_limiter_; // paces all uploads on the connection
+  StreamId request_stream_; // shared by pipelined requests
   std::mutex mutex_;
-  std::function<void(StreamId, size_t, size_t)> progress_callback_;
-
-  Impl() : authenticated_(false) {
+  // Read on every chunk by every worker, so swapped atomically, not locked
+  using ProgressCallback = std::function<void(StreamId, size_t, size_t)>;
+  std::shared_ptr<const ProgressCallback> progress_callback_;
+
+  Impl()
+    : authenticated_(false), stripes_(1), stripe_min_size_(kDefaultStripeMinSize), segments_(1),
+      segment_min_size_(kDefaultSegmentMinSize), resume_(true),
+      checksums_(false), priority_(kPriorityNormal), request_stream_(0) {
     quic_client_ = std::make_unique<QuicClientWrapper>();
     stream_manager_ = std::make_unique<StreamManager>();
+    parallel_transfers_ = std::max(1u, std::thread::hardware_concurrency());
   }
+
+  // Transfer bodies, tracked in stream_manager_ under transfer_id. They run
+  // without mutex_ held so several can be in flight at once.
+  // upload_file/download_file pick plain, ranged or resumed transfer.
+  bool upload_file(const std::string& local_path, const std::string& remote_path, StreamId transfer_id,
+                   uint64_t file_size);
+  bool download_file(const std::string& remote_path, const std::string& local_path, StreamId transfer_id);
+  bool upload(const std::string& local_path, const std::string& remote_path, StreamId transfer_id);
+  // Whole file, or the byte range [offset, offset + length) clamped to its end
+  bool download(const std::string& remote_path, const std::string& local_path, StreamId transfer_id,
+                uint64_t offset = 0, uint64_t length = UINT64_MAX);
+
+  // Upload the ranges of one file the server is missing (all of it unless
+  // resuming), spread over up to `stripes` concurrent streams
+  bool upload_ranges(const std::string& local_path, const std::string& remote_path, StreamId transfer_id,
+                     uint64_t file_size, size_t stripes, bool resume);
+  bool query_missing(const std::string& remote_path, uint64_t file_size,
+                     std::vector<std::pair<uint64_t, uint64_t>>& missing);
+  bool upload_range(FileSource& source, const std::string& remote_path, StreamId transfer_id, uint64_t offset,
+                    uint64_t length, uint64_t file_size, std::atomic<uint64_t>& sent,
+                    std::atomic<bool>& failed);
+
+  // Download one file as byte ranges on up to `segments` concurrent streams,
+  // each written in place into "<local_path>.partial". Arrived ranges are
+  // journaled beside it, so a resumed download fetches only the gaps.
+  bool download_ranges(const std::string& remote_path, const std::string& local_path, StreamId transfer_id,
+                       uint64_t file_size, size_t segments, bool resume);
+  bool download_segment(const std::string& remote_path, FileSink& sink, RangeJournal& journal,
+                        std::mutex& journal_mutex, StreamId transfer_id, uint64_t offset, uint64_t length,
+                        uint64_t file_size, std::atomic<uint64_t>& received, std::atomic<bool>& failed);
+
+  // Size of a remote file, from a STAT request
+  bool stat(const std::string& remote_path, uint64_t& file_size);
+
+  // Send a request frame on stream_id, then pass the reply header to
+  // on_header and the body after it to on_body (either may be empty). False
+  // on a refusal, a callback giving up, or a body shorter than announced.
+  // The server sends the body at priority.
+  bool fetch(StreamId stream_id, FrameType type, uint64_t offset, const PayloadWriter& args, ReplyHeader& header,
+             const std::function<bool(const ReplyHeader&)>& on_header,
+             const std::function<bool(const BufferRef&, const uint8_t*, size_t)>& on_body,
+             int priority = kPriorityNormal);
+
+  // Wait until the server acknowledges an upload request up to end_offset
+  bool await_ack(StreamId stream_id, uint64_t request_id, uint64_t end_offset);
+
+  // Flags for outgoing frames
+  uint32_t frame_flags();
+
+  // Priority for transfers started now
+  int transfer_priority();
+
+  // Run job(0) .. job(count - 1) on up to `workers` threads; true if all succeed
+  bool run_parallel(size_t count, size_t workers, const std::function<bool(size_t)>& job);
+
+  void report_progress(StreamId transfer_id, size_t done, size_t total);
+
+  // Wait until len more bytes of transfer_id's upload may be sent, under its
+  // own bandwidth limit, the connection's and the process-wide one
+  void pace(TokenBucket* transfer_limiter, size_t len);
+
+  // Record the outcome of a transfer in the stream manager
+  void finish_transfer(StreamId transfer_id, bool success, const std::string& error);
 };
 
+bool Client::Impl::run_parallel(size_t count, size_t workers, const std::function<bool(size_t)>& job) {
+  workers = std::max<size_t>(1, std::min(workers, count));
+  std::atomic<size_t> next_index(0);
+  std::atomic<bool> all_success(true);
+
+  auto worker = [&]() {
+    for (size_t i = next_index.fetch_add(1); i < count; i = next_index.fetch_add(1)) {
+      if (!job(i)) {
+        all_success = false;
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t w = 1; w < workers; ++w) {
+    threads.emplace_back(worker);
+  }
+  worker(); // the calling thread takes a share too
+  for (auto& t : threads) {
+    t.join();
+  }
+  return all_success;
+}
+
+void Client::Impl::report_progress(StreamId transfer_id, size_t done, size_t total) {
+  stream_manager_->update_stream(transfer_id, done);
+
+  std::shared_ptr<const ProgressCallback> callback = std::atomic_load(&progress_callback_);
+  if (callback && *callback) {
+    (*callback)(transfer_id, done, total);
+  }
+}
+
+void Client::Impl::pace(TokenBucket* transfer_limiter, size_t len) {
+  throttle(len, transfer_limiter, &connection_limiter_);
+}
+
+void Client::Impl::finish_transfer(StreamId transfer_id, bool success, const std::string& error) {
+  if (success) {
+    stream_manager_->complete_stream(transfer_id);
+  } else if (stream_manager_->is_stream_open(transfer_id)) {
+    // A cancelled transfer has already been marked
+    stream_manager_->error_stream(transfer_id, error);
+  }
+}
+
 Client::Client() : impl_(std::make_unique<Impl>()) {
 }
 
@@ -127,19 +571,17 @@ bool Client::connect(const std::string& server) {
     return false;
   }
 
+  // Requests are pipelined on one stream; byte ranges of striped and
+  // segmented transfers get their own
+  if (!impl_->quic_client_->create_stream(impl_->request_stream_)) {
+    std::cerr << "Failed to create request stream" << std::endl;
+    return false;
+  }
+
   return true;
 }
 
 bool Client::authenticate(const std::string& cert_path) {
-  // #region agent log
-  {
-    std::ofstream log_file("/home/tprettol/repo/Quicftp/.cursor/debug.log", std::ios::app);
-    if (log_file.is_open()) {
-      log_file << "{\"sessionId\":\"debug-session\",\"runId\":\"run1\",\"hypothesisId\":\"A\",\"location\":\"quicftp_client.cc:131\",\"message\":\"authenticate() called\",\"data\":{\"cert_path\":\"" << cert_path << "\"},\"timestamp\":" << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() << "}\n";
-      log_file.close();
-    }
-  }
-  // #endregion
   std::lock_guard<std::mutex> lock(impl_->mutex_);
 
   if (!impl_->quic_client_->is_connected()) {
@@ -147,65 +589,16 @@ bool Client::authenticate(const std::string& cert_path) {
     return false;
   }
 
-  // #region agent log
-  {
-    std::ofstream log_file("/home/tprettol/repo/Quicftp/.cursor/debug.log", std::ios::app);
-    if (log_file.is_open()) {
-      bool exists = std::filesystem::exists(cert_path);
-      log_file << "{\"sessionId\":\"debug-session\",\"runId\":\"run1\",\"hypothesisId\":\"D\",\"location\":\"quicftp_client.cc:143\",\"message\":\"filesystem::exists() check\",\"data\":{\"cert_path\":\"" << cert_path << "\",\"exists\":" << (exists ? "true" : "false") << "},\"timestamp\":" << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() << "}\n";
-      log_file.close();
-    }
-  }
-  // #endregion
-
   if (!std::filesystem::exists(cert_path)) {
-    // #region agent log
-    {
-      std::ofstream log_file("/home/tprettol/repo/Quicftp/.cursor/debug.log", std::ios::app);
-      if (log_file.is_open()) {
-        log_file << "{\"sessionId\":\"debug-session\",\"runId\":\"run1\",\"hypothesisId\":\"A\",\"location\":\"quicftp_client.cc:150\",\"message\":\"Certificate file not found error\",\"data\":{\"cert_path\":\"" << cert_path << "\"},\"timestamp\":" << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() << "}\n";
-        log_file.close();
-      }
-    }
-    // #endregion
     std::cerr << "Certificate file not found: " << cert_path << std::endl;
     return false;
   }
 
-  // #region agent log
-  {
-    std::ofstream log_file("/home/tprettol/repo/Quicftp/.cursor/debug.log", std::ios::app);
-    if (log_file.is_open()) {
-      log_file << "{\"sessionId\":\"debug-session\",\"runId\":\"run1\",\"hypothesisId\":\"C\",\"location\":\"quicftp_client.cc:155\",\"message\":\"About to call quic_client_->authenticate()\",\"data\":{\"cert_path\":\"" << cert_path << "\",\"is_connected\":" << (impl_->quic_client_->is_connected() ? "true" : "false") << "},\"timestamp\":" << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() << "}\n";
-      log_file.close();
-    }
-  }
-  // #endregion
-
   if (!impl_->quic_client_->authenticate(cert_path)) {
-    // #region agent log
-    {
-      std::ofstream log_file("/home/tprettol/repo/Quicftp/.cursor/debug.log", std::ios::app);
-      if (log_file.is_open()) {
-        log_file << "{\"sessionId\":\"debug-session\",\"runId\":\"run1\",\"hypothesisId\":\"C\",\"location\":\"quicftp_client.cc:162\",\"message\":\"quic_client_->authenticate() returned false\",\"data\":{\"cert_path\":\"" << cert_path << "\"},\"timestamp\":" << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() << "}\n";
-        log_file.close();
-      }
-    }
-    // #endregion
     std::cerr << "Authentication failed" << std::endl;
     return false;
   }
 
-  // #region agent log
-  {
-    std::ofstream log_file("/home/tprettol/repo/Quicftp/.cursor/debug.log", std::ios::app);
-    if (log_file.is_open()) {
-      log_file << "{\"sessionId\":\"debug-session\",\"runId\":\"run1\",\"hypothesisId\":\"C\",\"location\":\"quicftp_client.cc:175\",\"message\":\"Authentication successful\",\"data\":{\"cert_path\":\"" << cert_path << "\"},\"timestamp\":" << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() << "}\n";
-      log_file.close();
-    }
-  }
-  // #endregion
-
   impl_->authenticated_ = true;
   return true;
 }
@@ -225,11 +618,12 @@ bool Client::login(const std::string& username, const std::string& password) {
 }
 
 bool Client::upload_file(const std::string& local_path, const std::string& remote_path) {
-  std::lock_guard<std::mutex> lock(impl_->mutex_);
-
-  if (!impl_->authenticated_) {
-    std::cerr << "Not authenticated" << std::endl;
-    return false;
+  {
+    std::lock_guard<std::mutex> lock(impl_->mutex_);
+    if (!impl_->authenticated_) {
+      std::cerr << "Not authenticated" << std::endl;
+      return false;
+    }
   }
 
   if (!std::filesystem::exists(local_path)) {
@@ -237,74 +631,222 @@ bool Client::upload_file(const std::string& local_path, const std::string& remot
     return false;
   }
 
-  // Create stream for file transfer
-  StreamId stream_id;
-  if (!impl_->quic_client_->create_stream(stream_id)) {
-    std::cerr << "Failed to create stream for upload" << std::endl;
+  size_t file_size = std::filesystem::file_size(local_path);
+  StreamId transfer_id = impl_->stream_manager_->create_stream(remote_path, file_size, impl_->transfer_priority(), true);
+  bool success = impl_->upload_file(local_path, remote_path, transfer_id, file_size);
+  impl_->finish_transfer(transfer_id, success, "Upload failed");
+  return success;
+}
+
+bool Client::Impl::upload_file(const std::string& local_path, const std::string& remote_path,
+                               StreamId transfer_id, uint64_t file_size) {
+  size_t stripes;
+  size_t stripe_min_size;
+  bool resume;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stripes = stripes_;
+    stripe_min_size = stripe_min_size_;
+    resume = resume_;
+  }
+
+  bool striped = stripes > 1 && file_size >= stripe_min_size;
+  if (file_size > 0 && (striped || (resume && file_size >= kResumableMinSize))) {
+    return upload_ranges(local_path, remote_path, transfer_id, file_size, striped ? stripes : 1, resume);
+  }
+  return upload(local_path, remote_path, transfer_id);
+}
+
+bool Client::Impl::query_missing(const std::string& remote_path, uint64_t file_size,
+                                 std::vector<std::pair<uint64_t, uint64_t>>& missing) {
+  // Reply body is a varint (offset, length) pair per range the server lacks
+  std::vector<uint8_t> body;
+  ReplyHeader header;
+  PayloadWriter args;
+  args.varint(file_size).bytes(remote_path);
+  if (!fetch(request_stream_, FrameType::UploadStatus, 0, args, header, nullptr,
+             [&body](const BufferRef&, const uint8_t* data, size_t len) {
+               body.insert(body.end(), data, data + len);
+               return true;
+             })) {
     return false;
   }
 
-  // Send remote path first
-  std::string path_msg = "UPLOAD " + remote_path + "\n";
-  // #region agent log
-  {
-    std::ofstream log_file("/home/tprettol/repo/Quicftp/.cursor/debug.log", std::ios::app);
-    if (log_file.is_open()) {
-      log_file << "{\"sessionId\":\"debug-session\",\"runId\":\"run1\",\"hypothesisId\":\"K\",\"location\":\"quicftp_client.cc:247\",\"message\":\"Sending UPLOAD command\",\"data\":{\"stream_id\":" << stream_id << ",\"remote_path\":\"" << remote_path << "\",\"path_msg_length\":" << path_msg.length() << "},\"timestamp\":" << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() << "}\n";
-      log_file.close();
+  missing.clear();
+  PayloadReader ranges(body.data(), body.size());
+  uint64_t offset;
+  uint64_t length;
+  while (ranges.varint(offset)) {
+    if (!ranges.varint(length) || offset > file_size || length > file_size - offset) {
+      return false;
     }
+    missing.emplace_back(offset, length);
   }
-  // #endregion
-  if (!impl_->quic_client_->send_data(stream_id, 
-                                      reinterpret_cast<const uint8_t*>(path_msg.c_str()),
-                                      path_msg.length())) {
+  return true;
+}
+
+bool Client::Impl::upload_ranges(const std::string& local_path, const std::string& remote_path,
+                                 StreamId transfer_id, uint64_t file_size, size_t stripes, bool resume) {
+  std::vector<std::pair<uint64_t, uint64_t>> missing;
+  if (!resume || !query_missing(remote_path, file_size, missing)) {
+    missing.assign(1, std::make_pair(uint64_t(0), file_size));
+  }
+  uint64_t missing_bytes = 0;
+  for (const auto& range : missing) {
+    missing_bytes += range.second;
+  }
+  if (missing_bytes < file_size) {
+    std::cout << "Resuming upload: " << (file_size - missing_bytes) << " of " << file_size
+              << " bytes already on server" << std::endl;
+  }
+
+  // One mapping shared by every stripe
+  FileSource source;
+  if (!source.open(local_path)) {
+    std::cerr << "Failed to open file: " << local_path << " (" << source.error() << ")" << std::endl;
+    return false;
+  }
+
+  // Stripe boundaries fall on chunk multiples so every read is chunk-aligned
+  std::vector<std::pair<uint64_t, uint64_t>> pieces = split_ranges(missing, piece_length(file_size, stripes));
+
+  std::atomic<uint64_t> sent(file_size - missing_bytes);
+  std::atomic<bool> failed(false);
+  bool success = run_parallel(pieces.size(), stripes, [&](size_t i) {
+    return upload_range(source, remote_path, transfer_id, pieces[i].first, pieces[i].second, file_size, sent,
+                        failed);
+  });
+
+  if (success) {
+    std::cout << "Upload completed: " << file_size << " bytes (" << pieces.size() << " ranges)" << std::endl;
+  }
+  return success;
+}
+
+bool Client::Impl::upload_range(FileSource& source, const std::string& remote_path, StreamId transfer_id, uint64_t offset,
+                                uint64_t length, uint64_t file_size, std::atomic<uint64_t>& sent,
+                                std::atomic<bool>& failed) {
+  StreamId stream_id;
+  if (!quic_client_->create_stream(stream_id)) {
+    std::cerr << "Failed to create stream for upload" << std::endl;
+    failed = true;
+    return false;
+  }
+
+  uint32_t flags = frame_flags();
+  uint64_t request_id = quic_client_->open_request(stream_manager_->get_priority(transfer_id));
+  PayloadWriter args;
+  args.varint(file_size).bytes(remote_path);
+  if (!quic_client_->send_frame(stream_id, FrameType::UploadRange, request_id, offset, flags, args.data().data(),
+                                args.data().size())) {
     std::cerr << "Failed to send upload command" << std::endl;
+    quic_client_->cancel_request(stream_id, request_id);
+    failed = true;
     return false;
   }
-  
-  // #region agent log
-  {
-    std::ofstream log_file("/home/tprettol/repo/Quicftp/.cursor/debug.log", std::ios::app);
-    if (log_file.is_open()) {
-      log_file << "{\"sessionId\":\"debug-session\",\"runId\":\"run1\",\"hypothesisId\":\"K\",\"location\":\"quicftp_client.cc:256\",\"message\":\"UPLOAD command sent successfully\",\"data\":{\"stream_id\":" << stream_id << "},\"timestamp\":" << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() << "}\n";
-      log_file.close();
+
+  // Only needed when the file could not be mapped
+  BufferRef scratch = source.mapped() ? BufferRef() : BufferPool::instance().acquire(kChunkSize);
+  std::shared_ptr<TokenBucket> limiter = stream_manager_->get_rate_limiter(transfer_id);
+  source.advise(offset, length);
+  uint64_t end = offset + length;
+  for (uint64_t pos = offset; pos < end;) {
+    // A sibling stripe failing dooms the whole file, and a reply this early
+    // can only be a refusal; stop early either way
+    if (failed || !stream_manager_->is_stream_open(transfer_id) || quic_client_->has_reply(request_id)) {
+      break;
+    }
+
+    size_t want = static_cast<size_t>(std::min<uint64_t>(kChunkSize, end - pos));
+    const uint8_t* data;
+    size_t n;
+    if (!source.read(pos, want, scratch.data(), data, n) || n == 0) {
+      std::cerr << "Error reading file at offset " << pos << std::endl;
+      quic_client_->cancel_request(stream_id, request_id);
+      failed = true;
+      return false;
     }
+    bool last = pos + n == end;
+    pace(limiter.get(), n);
+    if (!quic_client_->send_frame(stream_id, FrameType::Data, request_id, pos, flags | (last ? kFrameFin : 0),
+                                  data, n)) {
+      std::cerr << "Failed to send file data at offset " << pos << std::endl;
+      quic_client_->cancel_request(stream_id, request_id);
+      failed = true;
+      return false;
+    }
+    pos += n;
+    report_progress(transfer_id, sent.fetch_add(n) + n, file_size);
+  }
+
+  bool success = !failed && stream_manager_->is_stream_open(transfer_id) && await_ack(stream_id, request_id, end);
+  if (!success) {
+    quic_client_->cancel_request(stream_id, request_id);
+    failed = true;
+  }
+  quic_client_->close_stream(stream_id);
+  return success;
+}
+
+bool Client::Impl::upload(const std::string& local_path, const std::string& remote_path, StreamId transfer_id) {
+  // Whole-file uploads share the request stream
+  StreamId stream_id = request_stream_;
+  uint32_t flags = frame_flags();
+  uint64_t request_id = quic_client_->open_request(stream_manager_->get_priority(transfer_id));
+
+  // Send remote path first
+  PayloadWriter args;
+  args.bytes(remote_path);
+  if (!quic_client_->send_frame(stream_id, FrameType::Upload, request_id, 0, flags, args.data().data(),
+                                args.data().size())) {
+    std::cerr << "Failed to send upload command" << std::endl;
+    quic_client_->cancel_request(stream_id, request_id);
+    return false;
   }
-  // #endregion
 
-  // Read and send file
-  std::ifstream file(local_path, std::ios::binary);
-  if (!file.is_open()) {
-    std::cerr << "Failed to open file: " << local_path << std::endl;
+  // Read and send file, straight from the mapping when it can be mapped
+  FileSource file;
+  if (!file.open(local_path)) {
+    std::cerr << "Failed to open file: " << local_path << " (" << file.error() << ")" << std::endl;
+    quic_client_->cancel_request(stream_id, request_id);
     return false;
   }
 
-  // Get file size for progress tracking
-  file.seekg(0, std::ios::end);
-  size_t file_size = file.tellg();
-  file.seekg(0, std::ios::beg);
+  size_t file_size = file.size();
+  file.advise(0, file_size);
 
-  const size_t chunk_size = 64 * 1024; // 64KB chunks
-  std::vector<uint8_t> buffer(chunk_size);
+  const size_t chunk_size = kChunkSize;
+  BufferRef scratch = file.mapped() ? BufferRef() : BufferPool::instance().acquire(chunk_size);
+  std::shared_ptr<TokenBucket> limiter = stream_manager_->get_rate_limiter(transfer_id);
   size_t total_sent = 0;
 
-  while (file.read(reinterpret_cast<char*>(buffer.data()), chunk_size) || file.gcount() > 0) {
-    size_t bytes_read = file.gcount();
-    // #region agent log
-    {
-      std::ofstream log_file("/home/tprettol/repo/Quicftp/.cursor/debug.log", std::ios::app);
-      if (log_file.is_open()) {
-        log_file << "{\"sessionId\":\"debug-session\",\"runId\":\"run1\",\"hypothesisId\":\"K\",\"location\":\"quicftp_client.cc:275\",\"message\":\"Sending file chunk\",\"data\":{\"stream_id\":" << stream_id << ",\"bytes_read\":" << bytes_read << ",\"total_sent\":" << total_sent << "},\"timestamp\":" << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() << "}\n";
-        log_file.close();
-      }
+  while (true) {
+    const uint8_t* data;
+    size_t bytes_read;
+    if (!file.read(total_sent, chunk_size, scratch.data(), data, bytes_read)) {
+      std::cerr << "Error reading file: " << local_path << " (" << file.error() << ")" << std::endl;
+      quic_client_->cancel_request(stream_id, request_id);
+      return false;
     }
-    // #endregion
-    if (!impl_->quic_client_->send_data(stream_id, buffer.data(), bytes_read)) {
+    if (bytes_read == 0) {
+      break;
+    }
+    if (!stream_manager_->is_stream_open(transfer_id)) {
+      std::cerr << "Upload cancelled: " << local_path << std::endl;
+      quic_client_->cancel_request(stream_id, request_id);
+      return false;
+    }
+    if (quic_client_->has_reply(request_id)) {
+      break; // refused midway; await_ack reports why
+    }
+    pace(limiter.get(), bytes_read);
+    if (!quic_client_->send_frame(stream_id, FrameType::Data, request_id, total_sent, flags, data, bytes_read)) {
       std::cerr << "Failed to send file data at " << total_sent << " bytes" << std::endl;
-      file.close();
+      quic_client_->cancel_request(stream_id, request_id);
       return false;
     }
     total_sent += bytes_read;
+    report_progress(transfer_id, total_sent, file_size);
     
     // Progress tracking (could be enhanced with callbacks)
     if (file_size > 0 && total_sent % (1024 * 1024) == 0) { // Log every MB
@@ -314,79 +856,370 @@ bool Client::upload_file(const std::string& local_path, const std::string& remot
     }
   }
 
-  if (!file.eof() && file.fail()) {
-    std::cerr << "Error reading file: " << local_path << std::endl;
-    file.close();
+  file.close();
+  // An empty final frame marks the end of the file
+  if (!quic_client_->send_frame(stream_id, FrameType::Data, request_id, total_sent, flags | kFrameFin, nullptr, 0) ||
+      !await_ack(stream_id, request_id, total_sent)) {
+    quic_client_->cancel_request(stream_id, request_id);
     return false;
   }
-
-  file.close();
-  impl_->quic_client_->close_stream(stream_id);
   std::cout << "Upload completed: " << total_sent << " bytes" << std::endl;
   return true;
 }
 
+uint32_t Client::Impl::frame_flags() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return checksums_ ? kFrameChecksum : 0;
+}
+
+int Client::Impl::transfer_priority() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return priority_;
+}
+
+bool Client::Impl::await_ack(StreamId stream_id, uint64_t request_id, uint64_t end_offset) {
+  bool acked = false;
+  std::string error;
+  bool ended = quic_client_->receive_frames(request_id, [&](const Frame& frame, const BufferRef&) -> bool {
+    if (frame.type == FrameType::Error) {
+      error.assign(reinterpret_cast<const char*>(frame.payload), frame.length);
+    } else if (frame.type == FrameType::Ack) {
+      acked = frame.offset == end_offset;
+    }
+    return true;
+  });
+  if (!error.empty()) {
+    std::cerr << "Server refused upload: " << error << std::endl;
+  } else if (!ended) {
+    std::cerr << "No acknowledgement for upload on stream " << stream_id << std::endl;
+  } else if (!acked) {
+    std::cerr << "Server acknowledged the wrong amount of data" << std::endl;
+  }
+  return ended && acked;
+}
+
 bool Client::download_file(const std::string& remote_path, const std::string& local_path) {
-  std::lock_guard<std::mutex> lock(impl_->mutex_);
+  {
+    std::lock_guard<std::mutex> lock(impl_->mutex_);
+    if (!impl_->authenticated_) {
+      std::cerr << "Not authenticated" << std::endl;
+      return false;
+    }
+  }
 
-  if (!impl_->authenticated_) {
-    std::cerr << "Not authenticated" << std::endl;
-    return false;
+  StreamId transfer_id = impl_->stream_manager_->create_stream(remote_path, 0, impl_->transfer_priority(), false);
+  bool success = impl_->download_file(remote_path, local_path, transfer_id);
+  impl_->finish_transfer(transfer_id, success, "Download failed");
+  return success;
+}
+
+bool Client::Impl::download_file(const std::string& remote_path, const std::string& local_path,
+                                 StreamId transfer_id) {
+  size_t segments;
+  size_t segment_min_size;
+  bool resume;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    segments = segments_;
+    segment_min_size = segment_min_size_;
+    resume = resume_;
   }
 
-  // Create stream for file transfer
-  StreamId stream_id;
-  if (!impl_->quic_client_->create_stream(stream_id)) {
-    std::cerr << "Failed to create stream for download" << std::endl;
-    return false;
+  // Ranged modes need the size up front; plain downloads learn it from the reply
+  uint64_t file_size = 0;
+  if ((segments > 1 || resume) && stat(remote_path, file_size) && file_size > 0) {
+    bool segmented = segments > 1 && file_size >= segment_min_size;
+    if (segmented || (resume && file_size >= kResumableMinSize)) {
+      return download_ranges(remote_path, local_path, transfer_id, file_size, segmented ? segments : 1, resume);
+    }
+  }
+  return download(remote_path, local_path, transfer_id);
+}
+
+bool Client::download_range(const std::string& remote_path, const std::string& local_path, uint64_t offset,
+                            uint64_t length) {
+  {
+    std::lock_guard<std::mutex> lock(impl_->mutex_);
+    if (!impl_->authenticated_) {
+      std::cerr << "Not authenticated" << std::endl;
+      return false;
+    }
+  }
+
+  StreamId transfer_id = impl_->stream_manager_->create_stream(remote_path, length, impl_->transfer_priority(), false);
+  bool success = impl_->download(remote_path, local_path, transfer_id, offset, length);
+  impl_->finish_transfer(transfer_id, success, "Download failed");
+  return success;
+}
+
+bool Client::Impl::fetch(StreamId stream_id, FrameType type, uint64_t offset, const PayloadWriter& args,
+                         ReplyHeader& header, const std::function<bool(const ReplyHeader&)>& on_header,
+                         const std::function<bool(const BufferRef&, const uint8_t*, size_t)>& on_body,
+                         int priority) {
+  // A priority other than the default leads the arguments
+  std::vector<uint8_t> payload;
+  uint32_t flags = frame_flags();
+  if (priority != kPriorityNormal) {
+    uint8_t prefix[8];
+    payload.assign(prefix, put_varint(prefix, static_cast<uint64_t>(priority)));
+    flags |= kFramePriority;
   }
+  payload.insert(payload.end(), args.data().begin(), args.data().end());
 
-  // Send download request
-  std::string path_msg = "DOWNLOAD " + remote_path + "\n";
-  if (!impl_->quic_client_->send_data(stream_id,
-                                      reinterpret_cast<const uint8_t*>(path_msg.c_str()),
-                                      path_msg.length())) {
+  uint64_t request_id = quic_client_->open_request();
+  if (!quic_client_->send_frame(stream_id, type, request_id, offset, flags, payload.data(), payload.size())) {
     std::cerr << "Failed to send download command" << std::endl;
+    quic_client_->cancel_request(stream_id, request_id);
+    return false;
+  }
+
+  bool have_header = false;
+  bool refused = false;
+  uint64_t body_received = 0;
+  bool success = quic_client_->receive_frames(request_id, [&](const Frame& frame, const BufferRef& owner) -> bool {
+    if (!frame.intact) {
+      std::cerr << "Checksum mismatch in reply" << std::endl;
+      return false;
+    }
+    if (frame.type == FrameType::Error) {
+      refused = true;
+      header.ok = false;
+      header.error.assign(reinterpret_cast<const char*>(frame.payload), frame.length);
+      return false;
+    }
+    if (frame.type == FrameType::Reply) {
+      PayloadReader reply(frame.payload, frame.length);
+      if (have_header || !reply.varint(header.file_size) || !reply.varint(header.length)) {
+        return false;
+      }
+      header.ok = true;
+      header.offset = frame.offset;
+      have_header = true;
+      return !on_header || on_header(header);
+    }
+    if (frame.type != FrameType::Data || !have_header) {
+      return false;
+    }
+    if (frame.offset != header.offset + body_received || frame.length > header.length - body_received) {
+      return false; // out of order, or more than the server announced
+    }
+    if (frame.length == 0) {
+      return true;
+    }
+    body_received += frame.length;
+    return on_body ? on_body(owner, frame.payload, frame.length) : true;
+  });
+
+  if (!success) {
+    if (refused) {
+      std::cerr << "Server refused request: " << header.error << std::endl;
+    } else {
+      // Stop the server sending the rest if we gave up midway
+      quic_client_->cancel_request(stream_id, request_id);
+    }
+    return false;
+  }
+  if (!have_header || body_received != header.length) {
+    std::cerr << "Download truncated: received " << body_received << " of " << header.length << " bytes"
+              << std::endl;
     return false;
   }
+  return true;
+}
 
-  // Create local file
-  std::ofstream file(local_path, std::ios::binary);
-  if (!file.is_open()) {
-    std::cerr << "Failed to create file: " << local_path << std::endl;
+bool Client::Impl::stat(const std::string& remote_path, uint64_t& file_size) {
+  ReplyHeader header;
+  PayloadWriter args;
+  args.bytes(remote_path);
+  if (!fetch(request_stream_, FrameType::Stat, 0, args, header, nullptr, nullptr)) {
     return false;
   }
+  file_size = header.file_size;
+  return true;
+}
+
+bool Client::Impl::download(const std::string& remote_path, const std::string& local_path, StreamId transfer_id,
+                            uint64_t offset, uint64_t length) {
+  FrameType type = FrameType::Download;
+  PayloadWriter args;
+  if (offset != 0 || length != UINT64_MAX) {
+    type = FrameType::DownloadRange;
+    args.varint(length);
+  }
+  args.bytes(remote_path);
 
-  // Receive file data with progress tracking
+  // Written to a temporary file and renamed into place once complete
+  FileSink sink;
+  ReplyHeader header;
   size_t total_received = 0;
-  bool success = impl_->quic_client_->receive_data(stream_id,
-    [&file, &total_received](const uint8_t* data, size_t len) -> bool {
-      file.write(reinterpret_cast<const char*>(data), len);
-      if (!file.good()) {
+  bool success = fetch(request_stream_, type, offset, args, header,
+    [&sink, &local_path](const ReplyHeader&) -> bool {
+      if (!sink.open(local_path)) {
+        std::cerr << "Failed to create file: " << local_path << " (" << sink.error() << ")" << std::endl;
+        return false;
+      }
+      return true;
+    },
+    [this, &sink, &header, &total_received, transfer_id](const BufferRef& owner, const uint8_t* data,
+                                                         size_t len) -> bool {
+      if (!stream_manager_->is_stream_open(transfer_id)) {
+        return false; // cancelled
+      }
+      // Queued in the sink by reference to the receive buffer
+      if (!sink.write(owner, data, len)) {
+        std::cerr << "Failed to write file: " << sink.error() << std::endl;
         return false;
       }
       total_received += len;
+      report_progress(transfer_id, total_received, header.length);
       
       // Progress tracking (could be enhanced with callbacks)
       if (total_received % (1024 * 1024) == 0) { // Log every MB
         std::cout << "Download progress: " << total_received << " bytes" << std::endl;
       }
       return true;
-    }
+    },
+    stream_manager_->get_priority(transfer_id)
   );
 
-  file.close();
-  impl_->quic_client_->close_stream(stream_id);
+  if (success && !sink.commit()) {
+    std::cerr << "Failed to save file: " << sink.error() << std::endl;
+    success = false;
+  }
   
   if (success) {
     std::cout << "Download completed: " << total_received << " bytes" << std::endl;
   } else {
+    sink.abort();
     std::cerr << "Download failed after receiving " << total_received << " bytes" << std::endl;
   }
   
   return success;
 }
 
+bool Client::Impl::download_ranges(const std::string& remote_path, const std::string& local_path,
+                                   StreamId transfer_id, uint64_t file_size, size_t segments, bool resume) {
+  std::string partial_path = local_path + ".partial";
+  RangeJournal journal;
+  bool have_partial = resume && std::filesystem::exists(partial_path);
+  if (!journal.open(partial_path + ".journal", file_size, have_partial)) {
+    std::cerr << "Failed to create journal: " << journal.error() << std::endl;
+    return false;
+  }
+  uint64_t already = journal.bytes_covered();
+
+  // Reserve the whole file up front; segments land in it in any order
+  FileSink sink;
+  if (!sink.open_partial(local_path, partial_path, already == 0) || (already == 0 && !sink.preallocate(file_size))) {
+    std::cerr << "Failed to create file: " << local_path << " (" << sink.error() << ")" << std::endl;
+    sink.abort();
+    journal.remove();
+    return false;
+  }
+  if (already > 0) {
+    std::cout << "Resuming download: " << already << " of " << file_size << " bytes already in " << partial_path
+              << std::endl;
+  }
+
+  // Segment boundaries fall on chunk multiples, like upload stripes
+  std::vector<std::pair<uint64_t, uint64_t>> pieces = split_ranges(journal.missing(),
+                                                                   piece_length(file_size, segments));
+
+  std::mutex journal_mutex;
+  std::atomic<uint64_t> received(already);
+  std::atomic<bool> failed(false);
+  bool success = run_parallel(pieces.size(), segments, [&](size_t i) {
+    return download_segment(remote_path, sink, journal, journal_mutex, transfer_id, pieces[i].first,
+                            pieces[i].second, file_size, received, failed);
+  });
+
+  if (success && journal.complete()) {
+    if (sink.commit()) {
+      journal.remove();
+      std::cout << "Download completed: " << file_size << " bytes (" << pieces.size() << " ranges)" << std::endl;
+      return true;
+    }
+    std::cerr << "Failed to save file: " << sink.error() << std::endl;
+    journal.remove();
+    return false;
+  }
+
+  if (resume) {
+    // Keep the partial file; the next attempt fetches only what is missing
+    sink.suspend();
+    journal.close();
+    std::cerr << "Download interrupted: " << journal.bytes_covered() << " of " << file_size
+              << " bytes kept in " << partial_path << std::endl;
+  } else {
+    sink.abort();
+    journal.remove();
+    std::cerr << "Download failed after receiving " << received << " bytes" << std::endl;
+  }
+  return false;
+}
+
+bool Client::Impl::download_segment(const std::string& remote_path, FileSink& sink, RangeJournal& journal,
+                                    std::mutex& journal_mutex, StreamId transfer_id, uint64_t offset,
+                                    uint64_t length, uint64_t file_size, std::atomic<uint64_t>& received,
+                                    std::atomic<bool>& failed) {
+  StreamId stream_id;
+  if (!quic_client_->create_stream(stream_id)) {
+    std::cerr << "Failed to create stream for download" << std::endl;
+    failed = true;
+    return false;
+  }
+  PayloadWriter args;
+  args.varint(length).bytes(remote_path);
+
+  uint64_t pos = offset;
+  uint64_t journaled = offset;
+  auto record_progress = [&]() -> bool {
+    if (pos == journaled) return true;
+    std::lock_guard<std::mutex> lock(journal_mutex);
+    if (!journal.add(journaled, pos - journaled)) {
+      std::cerr << "Failed to update journal: " << journal.error() << std::endl;
+      return false;
+    }
+    journaled = pos;
+    return true;
+  };
+
+  ReplyHeader header;
+  bool success = fetch(stream_id, FrameType::DownloadRange, offset, args, header,
+    [&](const ReplyHeader& reply) -> bool {
+      // Segments of a file that changed size since the STAT would not fit together
+      if (reply.file_size != file_size || reply.offset != offset || reply.length != length) {
+        std::cerr << "Remote file changed during download: " << remote_path << std::endl;
+        return false;
+      }
+      return true;
+    },
+    [&](const BufferRef&, const uint8_t* data, size_t len) -> bool {
+      // A sibling segment failing dooms the whole file; stop early
+      if (failed || !stream_manager_->is_stream_open(transfer_id)) {
+        return false;
+      }
+      if (!sink.write_at(pos, data, len)) {
+        std::cerr << "Failed to write file at offset " << pos << ": " << sink.error() << std::endl;
+        return false;
+      }
+      pos += len;
+      report_progress(transfer_id, received.fetch_add(len) + len, file_size);
+      return pos - journaled < kJournalIntervalBytes || record_progress();
+    },
+    stream_manager_->get_priority(transfer_id)
+  );
+  quic_client_->close_stream(stream_id);
+  // Data written before a failure is still good for a later resume
+  if (!record_progress()) {
+    success = false;
+  }
+  if (!success) {
+    failed = true;
+  }
+  return success;
+}
+
 bool Client::logout() {
   std::lock_guard<std::mutex> lock(impl_->mutex_);
   impl_->authenticated_ = false;
@@ -395,89 +1228,148 @@ bool Client::logout() {
 }
 
 bool Client::upload_files(const std::vector<std::pair<std::string, std::string>>& files) {
-  std::lock_guard<std::mutex> lock(impl_->mutex_);
-
-  if (!impl_->authenticated_) {
-    std::cerr << "Not authenticated" << std::endl;
-    return false;
+  size_t workers;
+  {
+    std::lock_guard<std::mutex> lock(impl_->mutex_);
+    if (!impl_->authenticated_) {
+      std::cerr << "Not authenticated" << std::endl;
+      return false;
+    }
+    workers = impl_->parallel_transfers_;
   }
 
-  // Create streams for all files
-  std::vector<StreamId> stream_ids;
-  for (const auto& [local_path, remote_path] : files) {
+  // Register every file up front so progress covers the whole batch
+  std::vector<StreamId> transfer_ids(files.size(), 0);
+  std::vector<uint64_t> file_sizes(files.size(), 0);
+  for (size_t i = 0; i < files.size(); ++i) {
+    const auto& [local_path, remote_path] = files[i];
     if (!std::filesystem::exists(local_path)) {
       std::cerr << "Local file not found: " << local_path << std::endl;
       continue;
     }
-    
-    size_t file_size = std::filesystem::file_size(local_path);
-    StreamId stream_id = impl_->stream_manager_->create_stream(remote_path, file_size, 0, true);
-    stream_ids.push_back(stream_id);
+    file_sizes[i] = std::filesystem::file_size(local_path);
+    transfer_ids[i] = impl_->stream_manager_->create_stream(remote_path, file_sizes[i], impl_->transfer_priority(), true);
   }
 
-  // Upload files in parallel (simplified - would use actual parallel streams)
-  bool all_success = true;
-  for (size_t i = 0; i < files.size() && i < stream_ids.size(); ++i) {
-    const auto& [local_path, remote_path] = files[i];
-    StreamId stream_id = stream_ids[i];
-    
-    if (!upload_file(local_path, remote_path)) {
-      all_success = false;
-      impl_->stream_manager_->error_stream(stream_id, "Upload failed");
-    } else {
-      impl_->stream_manager_->complete_stream(stream_id);
+  // Each worker owns one file, and so one stream, at a time
+  return impl_->run_parallel(files.size(), workers, [this, &files, &transfer_ids, &file_sizes](size_t i) {
+    if (transfer_ids[i] == 0) {
+      return false;
     }
-  }
-
-  return all_success;
+    const auto& [local_path, remote_path] = files[i];
+    bool success = impl_->upload_file(local_path, remote_path, transfer_ids[i], file_sizes[i]);
+    impl_->finish_transfer(transfer_ids[i], success, "Upload failed");
+    return success;
+  });
 }
 
 bool Client::download_files(const std::vector<std::pair<std::string, std::string>>& files) {
-  std::lock_guard<std::mutex> lock(impl_->mutex_);
-
-  if (!impl_->authenticated_) {
-    std::cerr << "Not authenticated" << std::endl;
-    return false;
+  size_t workers;
+  {
+    std::lock_guard<std::mutex> lock(impl_->mutex_);
+    if (!impl_->authenticated_) {
+      std::cerr << "Not authenticated" << std::endl;
+      return false;
+    }
+    workers = impl_->parallel_transfers_;
   }
 
-  // Create streams for all files
-  std::vector<StreamId> stream_ids;
+  std::vector<StreamId> transfer_ids;
   for (const auto& [remote_path, local_path] : files) {
-    StreamId stream_id = impl_->stream_manager_->create_stream(remote_path, 0, 0, false);
-    stream_ids.push_back(stream_id);
+    transfer_ids.push_back(impl_->stream_manager_->create_stream(remote_path, 0, impl_->transfer_priority(), false));
   }
 
-  // Download files in parallel (simplified - would use actual parallel streams)
-  bool all_success = true;
-  for (size_t i = 0; i < files.size() && i < stream_ids.size(); ++i) {
+  return impl_->run_parallel(files.size(), workers, [this, &files, &transfer_ids](size_t i) {
     const auto& [remote_path, local_path] = files[i];
-    StreamId stream_id = stream_ids[i];
-    
-    if (!download_file(remote_path, local_path)) {
-      all_success = false;
-      impl_->stream_manager_->error_stream(stream_id, "Download failed");
-    } else {
-      impl_->stream_manager_->complete_stream(stream_id);
-    }
-  }
+    bool success = impl_->download_file(remote_path, local_path, transfer_ids[i]);
+    impl_->finish_transfer(transfer_ids[i], success, "Download failed");
+    return success;
+  });
+}
 
-  return all_success;
+void Client::set_striping(size_t stripes, size_t min_file_size) {
+  std::lock_guard<std::mutex> lock(impl_->mutex_);
+  impl_->stripes_ = std::max<size_t>(1, stripes);
+  impl_->stripe_min_size_ = min_file_size;
 }
 
-void Client::set_progress_callback(std::function<void(StreamId, size_t, size_t)> callback) {
+void Client::set_download_segments(size_t segments, size_t min_file_size) {
   std::lock_guard<std::mutex> lock(impl_->mutex_);
-  impl_->progress_callback_ = callback;
+  impl_->segments_ = std::max<size_t>(1, segments);
+  impl_->segment_min_size_ = min_file_size;
 }
 
-bool Client::cancel_transfer(StreamId stream_id) {
+void Client::set_resume(bool enabled) {
   std::lock_guard<std::mutex> lock(impl_->mutex_);
-  
-  auto* stream_info = impl_->stream_manager_->get_stream(stream_id);
-  if (!stream_info || stream_info->state != StreamState::Open) {
+  impl_->resume_ = enabled;
+}
+
+void Client::set_checksums(bool enabled) {
+  std::lock_guard<std::mutex> lock(impl_->mutex_);
+  impl_->checksums_ = enabled;
+}
+
+void Client::set_transfer_priority(int priority) {
+  std::lock_guard<std::mutex> lock(impl_->mutex_);
+  impl_->priority_ = std::clamp(priority, kPriorityBackground, kPriorityMax);
+}
+
+int Client::get_transfer_priority() const {
+  std::lock_guard<std::mutex> lock(impl_->mutex_);
+  return impl_->priority_;
+}
+
+void Client::set_rate_limits(const RateLimits& limits) {
+  impl_->stream_manager_->set_stream_rate_limit(limits.stream);
+  impl_->connection_limiter_.set_limit(limits.connection);
+  TokenBucket::global().set_limit(limits.global);
+}
+
+RateLimits Client::get_rate_limits() const {
+  RateLimits limits;
+  limits.stream = impl_->stream_manager_->get_stream_rate_limit();
+  limits.connection = impl_->connection_limiter_.limit();
+  limits.global = TokenBucket::global().limit();
+  return limits;
+}
+
+void Client::set_transport(TransportKind kind) {
+  std::lock_guard<std::mutex> lock(impl_->mutex_);
+  impl_->quic_client_->set_transport(kind);
+}
+
+void Client::set_congestion_control(CongestionAlgorithm algorithm) {
+  std::lock_guard<std::mutex> lock(impl_->mutex_);
+  impl_->quic_client_->set_congestion_control(algorithm);
+}
+
+void Client::set_fec(const FecConfig& config) {
+  std::lock_guard<std::mutex> lock(impl_->mutex_);
+  impl_->quic_client_->set_fec(config);
+}
+
+void Client::set_parallel_transfers(size_t count) {
+  std::lock_guard<std::mutex> lock(impl_->mutex_);
+  impl_->parallel_transfers_ = std::max<size_t>(1, count);
+}
+
+size_t Client::get_parallel_transfers() const {
+  std::lock_guard<std::mutex> lock(impl_->mutex_);
+  return impl_->parallel_transfers_;
+}
+
+void Client::set_progress_callback(std::function<void(StreamId, size_t, size_t)> callback) {
+  std::atomic_store(&impl_->progress_callback_,
+                    std::make_shared<const Impl::ProgressCallback>(std::move(callback)));
+}
+
+bool Client::cancel_transfer(StreamId stream_id) {
+  if (!impl_->stream_manager_->is_stream_open(stream_id)) {
     return false;
   }
-  
-  impl_->quic_client_->close_stream(stream_id);
+
+  // The worker running the transfer notices on its next chunk and resets
+  // the underlying stream
   impl_->stream_manager_->error_stream(stream_id, "Cancelled by user");
   return true;
 }
@@ -489,4 +1381,3 @@ void Client::disconnect() {
 }
 
 } // namespace quicftp
-
@@ -9,6 +9,8 @@
 #include <utility>
 #include <functional>
 #include "quic_common.h"
+#include "rate_limiter.h"
+#include "transport.h"
 
 namespace quicftp {
 
@@ -29,10 +31,66 @@ public:
 
   bool download_file(const std::string& remote_path, const std::string& local_path);
 
+  // Fetch only bytes [offset, offset + length) of a remote file into local_path
+  // (clamped to the end of the remote file)
+  bool download_range(const std::string& remote_path, const std::string& local_path, uint64_t offset,
+                      uint64_t length);
+
   // Parallel transfer methods
   bool upload_files(const std::vector<std::pair<std::string, std::string>>& files); // (local, remote) pairs
   bool download_files(const std::vector<std::pair<std::string, std::string>>& files); // (remote, local) pairs
 
+  // Number of files transferred concurrently by the batch methods
+  // (default: hardware concurrency)
+  void set_parallel_transfers(size_t count);
+  size_t get_parallel_transfers() const;
+
+  // Striped mode for upload_file: files of at least min_file_size bytes are
+  // split into `stripes` byte ranges sent on concurrent streams and
+  // reassembled by the server (stripes <= 1 disables striping)
+  void set_striping(size_t stripes, size_t min_file_size = 64 * 1024 * 1024);
+
+  // Segmented mode for download_file: files of at least min_file_size bytes
+  // are fetched as `segments` byte ranges on concurrent streams, written in
+  // place into a preallocated local file (segments <= 1 disables it)
+  void set_download_segments(size_t segments, size_t min_file_size = 64 * 1024 * 1024);
+
+  // Resumable transfers (default on): files of 1 MiB and up move as byte
+  // ranges whose arrival is journaled by the receiver. Retrying a failed
+  // upload sends only the ranges the server lacks; a failed download leaves
+  // "<local_path>.partial" behind and the retry fetches only the gaps.
+  void set_resume(bool enabled);
+
+  // End-to-end integrity (default off): every frame this client sends carries
+  // a CRC32C of its payload, and the server checksums its replies in turn
+  void set_checksums(bool enabled);
+
+  // Priority of transfers started from now on (default kPriorityNormal; see
+  // quic_common.h). Interactive transfers are sent ahead of everything else
+  // on the connection, background ones only when it is otherwise idle, and
+  // the rest share it in proportion to their priority. Downloads ask the
+  // server to order its replies the same way.
+  void set_transfer_priority(int priority);
+  int get_transfer_priority() const;
+
+  // Bandwidth limits on uploads (default none): per transfer, for the whole
+  // connection, and process-wide. Uploads are paced to the tightest one and
+  // adjust within a frame when the limits change mid-transfer. Downloads are
+  // paced by the server's limits.
+  void set_rate_limits(const RateLimits& limits);
+  RateLimits get_rate_limits() const;
+
+  // How streams reach the server: the shared-memory bridge (same host) or
+  // UDP. Defaults to QUICFTP_TRANSPORT; call before connect().
+  void set_transport(TransportKind kind);
+
+  // How a UDP connection shares the path (default cubic); call before connect()
+  void set_congestion_control(CongestionAlgorithm algorithm);
+
+  // Forward error correction on what a UDP connection uploads (default off);
+  // call before connect()
+  void set_fec(const FecConfig& config);
+
   // Progress and cancellation
   void set_progress_callback(std::function<void(StreamId, size_t, size_t)> callback);
   bool cancel_transfer(StreamId stream_id);
@@ -1,6 +1,12 @@
 // quicftp_server.cc
 
 #include "quicftp_server.h"
+#include "disk_io.h"
+#include "file_sink.h"
+#include "file_source.h"
+#include "logger.h"
+#include "range_journal.h"
+#include "wire_protocol.h"
 #include <iostream>
 #include <fstream>
 #include <sstream>
@@ -8,16 +14,162 @@
 #include <ctime>
 #include <filesystem>
 #include <vector>
+#include <algorithm>
 #include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Messages are only built when their level and category are compiled in and,
+// below errors, the server is verbose
+#define SERVER_LOG_INFO(message) QUICFTP_LOG(LogLevel::Info, LogCategory::General, verbose_, message)
+#define SERVER_LOG_ERROR(message) QUICFTP_LOG(LogLevel::Error, LogCategory::General, true, message)
+#define SERVER_LOG_CONNECTION(event, client_info) \
+  QUICFTP_LOG(LogLevel::Info, LogCategory::Connection, verbose_, std::string(event) + " - Client: " + (client_info))
+#define SERVER_LOG_AUTH(event, details) \
+  QUICFTP_LOG(LogLevel::Info, LogCategory::Auth, verbose_, std::string(event) + " - " + (details))
+#define SERVER_LOG_TRANSFER(operation, file_path, file_size, status)           \
+  QUICFTP_LOG(LogLevel::Info, LogCategory::Transfer, verbose_,                  \
+              transfer_message(operation, file_path, file_size, status))
 
 namespace quicftp {
 
+namespace {
+
+// Striped uploads missing ranges are dropped after this long without a stream
+constexpr int kStripedUploadTimeoutMs = 30000;
+
+constexpr size_t kDownloadChunkSize = 64 * 1024; // 64KB chunks
+
+// Threads streaming downloads, however many are in progress
+constexpr size_t kDownloadSenders = 8;
+
+// A download sends this much before letting others on the senders go
+constexpr uint64_t kDownloadSliceBytes = 512 * 1024;
+
+// How often a download the client has no room for checks for a Window frame
+constexpr int kReplyWindowRecheckMs = 2;
+
+// Ranged uploads journal their progress at least this often
+constexpr uint64_t kJournalIntervalBytes = 4 * 1024 * 1024;
+
+// Most uploads committed together, outside File durability mode
+constexpr size_t kMaxGroupCommitBatch = 64;
+
+// Request latencies are recorded in microseconds
+constexpr double kLatencyUnitSeconds = 1e-6;
+
+const char* durability_name(Durability mode) {
+  switch (mode) {
+    case Durability::File: return "file";
+    case Durability::Group: return "group";
+    default: return "none";
+  }
+}
+
+// Whether name exists in the directory, without following a final symlink
+bool exists_in(const PathResolver::Directory& dir, const std::string& name) {
+  struct stat st;
+  return fstatat(dir.fd(), name.c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0;
+}
+
+// Hidden file next to target: ".<name>.quicftp-<kind>"
+std::string sidecar_path(const std::string& target_path, const std::string& kind) {
+  size_t slash = target_path.rfind('/');
+  size_t name_start = (slash == std::string::npos) ? 0 : slash + 1;
+  return target_path.substr(0, name_start) + "." + target_path.substr(name_start) + ".quicftp-" + kind;
+}
+
+uint64_t microseconds_since(std::chrono::steady_clock::time_point start) {
+  return static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+}
+
+} // namespace
+
+// A file assembled from byte ranges arriving on several streams
+struct Server::StripedUpload {
+  std::string remote_path;
+  std::string path;                       // beneath the root; keys striped_uploads_
+  std::shared_ptr<const PathResolver::Directory> dir; // holds the files below
+  uint64_t total_size = 0;
+  std::chrono::steady_clock::time_point start_time;
+  std::mutex mutex;                       // guards the rest
+  FileSink sink;                          // writes the partial file in place
+  RangeJournal journal;                   // ranges safely in the partial file
+  uint64_t bytes_received = 0;            // this session only
+  int open_streams = 0;
+  bool failed = false;
+  bool closed = false;                    // committed or suspended; stragglers drop their data
+  std::chrono::steady_clock::time_point last_activity;
+};
+
+struct Server::ActiveUpload {
+  std::string remote_path;
+  std::shared_ptr<const PathResolver::Directory> dir; // holds sink's file
+  FileSink sink;                          // sequential uploads
+  std::shared_ptr<StripedUpload> striped; // ranged uploads write here instead
+  std::shared_ptr<Counter> received;      // the connection's byte count, if still known
+  uint64_t next_offset = 0;               // ranged: where the next chunk lands
+  uint64_t journaled_offset = 0;          // ranged: start of data not yet handed to journal_stripe
+  // Ranged, guarded by the striped mutex: an entry was lost; one is being
+  // made; the last one, waiting for it
+  bool journal_failed = false;
+  bool journaling = false;
+  GroupCommit::Done journal_last;
+  std::chrono::steady_clock::time_point start_time;
+};
+
+// A file range being streamed to a client by senders_
+struct Server::ActiveDownload {
+  StreamId stream_id = 0;
+  std::string remote_path;
+  std::shared_ptr<FileSource> source;
+  uint64_t offset = 0;
+  uint64_t length = 0;
+  uint64_t position = 0;                  // next byte to send
+  BufferRef scratch;                      // only needed when the file could not be mapped
+  const uint8_t* chunk = nullptr;         // read, but held back by the rate limits
+  size_t chunk_size = 0;
+  std::unique_ptr<Reservation> reservation;
+  std::shared_ptr<TokenBucket> connection_limiter;
+  std::shared_ptr<Counter> sent;
+  std::chrono::steady_clock::time_point requested_at;
+  std::chrono::steady_clock::time_point start_time;
+  std::atomic<bool> done{false};
+  std::atomic<bool> cancelled{false};
+  TokenBucket limiter;
+};
+
 Server::Server() 
   : running_(false)
   , verbose_(true)
   , port_(0)
+  , worker_count_(1)
+  , transport_(Transport::default_kind())
+  , congestion_(CongestionAlgorithm::Cubic)
+  , durability_(Durability::None)
+  , group_window_ms_(5)
   , quic_server_(nullptr)
 {
+  MetricsRegistry& metrics = MetricsRegistry::instance();
+  const char* request_help = "Time from a request arriving to its transfer completing";
+  upload_seconds_ = metrics.histogram("quicftp_request_seconds", request_help, kLatencyUnitSeconds,
+                                      {{"operation", "upload"}});
+  download_seconds_ = metrics.histogram("quicftp_request_seconds", request_help, kLatencyUnitSeconds,
+                                        {{"operation", "download"}});
+  upload_streams_ = metrics.gauge("quicftp_active_streams", "Transfers in progress", {{"direction", "upload"}});
+  download_streams_ = metrics.gauge("quicftp_active_streams", "Transfers in progress", {{"direction", "download"}});
+  connection_count_ = metrics.gauge("quicftp_connections", "Clients connected");
+  metrics.gauge_function("quicftp_buffer_pool_buffers_in_use", "Pooled buffers handed out",
+                         [] { return static_cast<double>(BufferPool::instance().usage().buffers_in_use); });
+  metrics.gauge_function("quicftp_buffer_pool_buffers", "Buffers carved from the pool's slabs",
+                         [] { return static_cast<double>(BufferPool::instance().usage().buffers_total); });
+  metrics.gauge_function("quicftp_buffer_pool_bytes", "Bytes of slab memory held by the buffer pool",
+                         [] { return static_cast<double>(BufferPool::instance().usage().slab_bytes); });
+  metrics.gauge_function("quicftp_buffer_pool_heap_allocations", "Buffers too large for the pool, taken from the heap",
+                         [] { return static_cast<double>(BufferPool::instance().usage().fallback_allocations); });
 }
 
 Server::~Server() {
@@ -29,7 +181,7 @@ Server::~Server() {
 bool Server::start(int port, const std::string& cert_path, const std::string& key_path,
                    const std::string& root_dir) {
   if (running_) {
-    log_error("Server is already running");
+    SERVER_LOG_ERROR("Server is already running");
     return false;
   }
 
@@ -41,14 +193,14 @@ bool Server::start(int port, const std::string& cert_path, const std::string& ke
   // Validate certificate and key files exist
   std::ifstream cert_file(cert_path);
   if (!cert_file.good()) {
-    log_error("Certificate file not found: " + cert_path);
+    SERVER_LOG_ERROR("Certificate file not found: " + cert_path);
     return false;
   }
   cert_file.close();
 
   std::ifstream key_file(key_path);
   if (!key_file.good()) {
-    log_error("Key file not found: " + key_path);
+    SERVER_LOG_ERROR("Key file not found: " + key_path);
     return false;
   }
   key_file.close();
@@ -57,16 +209,32 @@ bool Server::start(int port, const std::string& cert_path, const std::string& ke
   try {
     std::filesystem::create_directories(root_dir_);
   } catch (const std::exception& e) {
-    log_error("Failed to create root directory: " + std::string(e.what()));
+    SERVER_LOG_ERROR("Failed to create root directory: " + std::string(e.what()));
+    return false;
+  }
+  if (!paths_.open_root(root_dir_)) {
+    SERVER_LOG_ERROR("Failed to open root directory: " + root_dir_ + " (" + std::strerror(errno) + ")");
     return false;
   }
 
   // Initialize QUIC server
   quic_server_ = std::make_unique<QuicServerWrapper>();
   if (!quic_server_->initialize(port_, cert_path_, key_path_)) {
-    log_error("Failed to initialize QUIC server");
+    SERVER_LOG_ERROR("Failed to initialize QUIC server");
     return false;
   }
+  quic_server_->set_worker_count(worker_count_);
+  quic_server_->set_transport(transport_);
+  quic_server_->set_congestion_control(congestion_);
+  quic_server_->set_fec(fec_);
+  if (durability_ == Durability::File) {
+    committer_ = std::make_unique<GroupCommit>(0, 1);
+  } else if (durability_ == Durability::Group) {
+    committer_ = std::make_unique<GroupCommit>(group_window_ms_, kMaxGroupCommitBatch);
+  } else {
+    committer_ = std::make_unique<GroupCommit>(0, kMaxGroupCommitBatch, false);
+  }
+  senders_ = std::make_unique<SendPool>(kDownloadSenders);
 
   // Set up callbacks
   quic_server_->set_connection_callback(
@@ -78,29 +246,49 @@ bool Server::start(int port, const std::string& cert_path, const std::string& ke
       this->on_auth_attempt(addr, cert, success);
     }
   );
-
-  // #region agent log
-  {
-    std::ofstream log_file("/home/tprettol/repo/Quicftp/.cursor/debug.log", std::ios::app);
-    if (log_file.is_open()) {
-      log_file << "{\"sessionId\":\"debug-session\",\"runId\":\"run1\",\"hypothesisId\":\"H\",\"location\":\"quicftp_server.cc:81\",\"message\":\"Server callbacks configured\",\"data\":{\"root_dir\":\"" << root_dir_ << "\"},\"timestamp\":" << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() << "}\n";
-      log_file.close();
+  quic_server_->set_upload_callbacks(
+    [this](StreamId sid, const UploadRequest& request) { return this->begin_upload(sid, request); },
+    [this](StreamId sid, const BufferRef& owner, const uint8_t* data, size_t len) {
+      return this->continue_upload(sid, owner, data, len);
+    },
+    [this](StreamId sid, bool completed, UploadStoredCallback stored) {
+      this->finish_upload(sid, completed, stored);
     }
-  }
-  // #endregion
+  );
+  quic_server_->set_upload_status_callback(
+    [this](StreamId sid, const UploadRequest& request) { this->report_upload_status(sid, request); }
+  );
+  quic_server_->set_download_callback(
+    [this](StreamId sid, const DownloadRequest& request) { this->handle_download(sid, request); }
+  );
 
   running_ = true;
 
-  log_info("Server starting on port " + std::to_string(port_));
-  log_info("Certificate: " + cert_path_);
-  log_info("Key: " + key_path_);
-  log_info("Root directory: " + root_dir_);
-  log_info("Server is listening for QUIC connections...");
+  SERVER_LOG_INFO("Server starting on port " + std::to_string(port_));
+  SERVER_LOG_INFO("Certificate: " + cert_path_);
+  SERVER_LOG_INFO("Key: " + key_path_);
+  SERVER_LOG_INFO("Root directory: " + root_dir_);
+  SERVER_LOG_INFO("Workers: " + std::to_string(worker_count_));
+  SERVER_LOG_INFO(std::string("Durability: ") + durability_name(durability_) +
+                  (durability_ == Durability::Group ? " (" + std::to_string(group_window_ms_) + " ms window)" : ""));
+  if (!metrics_endpoint_.empty()) {
+    metrics_exporter_ = std::make_unique<MetricsExporter>();
+    if (metrics_exporter_->start(metrics_endpoint_)) {
+      SERVER_LOG_INFO("Metrics: " + metrics_endpoint_);
+    } else {
+      SERVER_LOG_ERROR("Metrics unavailable: " + metrics_exporter_->error());
+      metrics_exporter_.reset();
+    }
+  }
+  SERVER_LOG_INFO("Server is listening for QUIC connections...");
 
   // Start QUIC server listening
   if (!quic_server_->start_listening()) {
-    log_error("Failed to start QUIC server listening");
+    SERVER_LOG_ERROR("Failed to start QUIC server listening");
     quic_server_.reset();
+    committer_.reset();
+    senders_.reset();
+    metrics_exporter_.reset();
     return false;
   }
 
@@ -112,26 +300,97 @@ void Server::stop() {
     return;
   }
 
-  log_info("Server stopping...");
+  SERVER_LOG_INFO("Server stopping...");
 
   // Stop QUIC server and close all connections
   {
     std::lock_guard<std::mutex> lock(connections_mutex_);
     for (auto& [addr, conn] : connections_) {
-      if (conn) {
-        conn->close();
+      if (conn.wrapper) {
+        conn.wrapper->close();
       }
     }
     connections_.clear();
   }
 
+  // Stop the event loops first so no new transfers start, then the downloads
+  // and pending commits, which send through quic_server_, before it goes
   if (quic_server_) {
+    TransportStats stats;
+    if (quic_server_->transport_stats(stats)) {
+      SERVER_LOG_INFO("Transport: " + std::to_string(stats.packets_sent) + " packets sent, " +
+                      std::to_string(stats.packets_received) + " received, " + std::to_string(stats.packets_lost) +
+                      " lost, " + std::to_string(stats.bytes_retransmitted) + " bytes retransmitted, " +
+                      congestion_algorithm_name(congestion_) + " window " + std::to_string(stats.congestion_window) +
+                      " bytes");
+      if (!stats.io_backend.empty()) {
+        std::ostringstream io;
+        io << std::fixed << std::setprecision(1) << "Packet I/O: " << stats.io_backend << ", "
+           << (stats.send_calls ? static_cast<double>(stats.packets_sent) / stats.send_calls : 0.0)
+           << " packets per send call, "
+           << (stats.receive_calls ? static_cast<double>(stats.packets_received) / stats.receive_calls : 0.0)
+           << " per receive call";
+        SERVER_LOG_INFO(io.str());
+      }
+      if (fec_.enabled || stats.fec_recovered > 0) {
+        SERVER_LOG_INFO("FEC: " + fec_config_name(fec_) + ", " + std::to_string(stats.fec_repairs_sent) +
+                        " repair packets sent, " + std::to_string(stats.fec_recovered) + " packets recovered");
+      }
+    }
     quic_server_->stop();
-    quic_server_.reset();
+  }
+  reap_downloads(true);
+  senders_.reset();
+  if (committer_) {
+    committer_->drain();
+    GroupCommit::Stats commits = committer_->stats();
+    SERVER_LOG_INFO("Commits: " + std::to_string(commits.files) + " files in " + std::to_string(commits.batches) +
+                    " batches, largest " + std::to_string(commits.largest_batch) + ", " +
+                    std::to_string(commits.failures) + " failed");
+    committer_.reset();
+  }
+  quic_server_.reset();
+
+  // Anything still in flight never finished; sinks discard their temp files
+  std::lock_guard<std::mutex> lock(uploads_mutex_);
+  for (auto& [sid, upload] : active_uploads_) {
+    if (!upload->striped) {
+      upload->sink.abort();
+      SERVER_LOG_TRANSFER("Upload", upload->remote_path, upload->sink.bytes_written(), "Aborted");
+    }
+  }
+  upload_streams_->add(-static_cast<int64_t>(active_uploads_.size()));
+  active_uploads_.clear();
+  for (auto& [path, striped] : striped_uploads_) {
+    suspend_striped_upload(*striped, "Interrupted");
+  }
+  striped_uploads_.clear();
+
+  BufferPool::Stats pool = BufferPool::instance().stats();
+  SERVER_LOG_INFO("Buffer pool: " + std::to_string(pool.buffers_total) + " buffers of " +
+                  format_size(pool.buffer_size) + " in " + std::to_string(pool.slabs) + " slabs (" +
+                  format_size(pool.slab_bytes) + ", " + format_size(pool.huge_page_bytes) + " on huge pages), peak " +
+                  std::to_string(pool.peak_in_use) + " in use, " + std::to_string(pool.acquired) + " handed out, " +
+                  std::to_string(pool.fallback_allocations) + " from the heap");
+  for (const auto& [device, io] : DiskIo::instance().stats()) {
+    SERVER_LOG_INFO("Disk queue " + device + ": " + io.backend + ", depth " + std::to_string(io.queue_depth) +
+                    ", peak " + std::to_string(io.peak_in_flight) + " in flight, " + std::to_string(io.completed) +
+                    " operations (" + std::to_string(io.fixed_buffer_ops) + " from fixed buffers, " +
+                    std::to_string(io.fixed_file_ops) + " on fixed files)");
+  }
+  PathResolver::Stats paths = paths_.stats();
+  SERVER_LOG_INFO("Paths: " + std::to_string(paths.lookups) + " directory lookups, " +
+                  std::to_string(paths.cache_hits) + " cached, " + std::to_string(paths.directories_opened) +
+                  " opened, " + std::to_string(paths.directories_created) + " created");
+  paths_.close();
+  if (metrics_exporter_) {
+    metrics_exporter_->stop();
+    metrics_exporter_.reset();
   }
 
   running_ = false;
-  log_info("Server stopped");
+  SERVER_LOG_INFO("Server stopped");
+  Logger::instance().flush();
 }
 
 bool Server::is_running() const {
@@ -156,252 +415,744 @@ std::string Server::get_root_directory() const {
   return root_dir_;
 }
 
-void Server::process_events(int timeout_ms) {
-  // #region agent log
-  {
-    std::ofstream log_file("/home/tprettol/repo/Quicftp/.cursor/debug.log", std::ios::app);
-    if (log_file.is_open()) {
-      log_file << "{\"sessionId\":\"debug-session\",\"runId\":\"run1\",\"hypothesisId\":\"L\",\"location\":\"quicftp_server.cc:155\",\"message\":\"process_events() called\",\"data\":{\"timeout_ms\":" << timeout_ms << ",\"running\":" << (running_ ? "true" : "false") << ",\"quic_server_exists\":" << (quic_server_ ? "true" : "false") << "},\"timestamp\":" << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() << "}\n";
-      log_file.close();
-    }
+void Server::set_worker_count(size_t workers) {
+  if (!running_) {
+    worker_count_ = std::max<size_t>(workers, 1);
   }
-  // #endregion
-  
-  if (quic_server_ && running_) {
-    quic_server_->process_events(timeout_ms);
-    
-    // Process completed uploads (test mode)
-    auto uploads = quic_server_->get_pending_uploads();
-    
-    // #region agent log
-    {
-      std::ofstream log_file("/home/tprettol/repo/Quicftp/.cursor/debug.log", std::ios::app);
-      if (log_file.is_open()) {
-        log_file << "{\"sessionId\":\"debug-session\",\"runId\":\"run1\",\"hypothesisId\":\"L\",\"location\":\"quicftp_server.cc:168\",\"message\":\"Checking for pending uploads\",\"data\":{\"upload_count\":" << uploads.size() << "},\"timestamp\":" << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() << "}\n";
-        log_file.close();
-      }
-    }
-    // #endregion
-    
-    for (const auto& upload : uploads) {
-      // #region agent log
-      {
-        std::ofstream log_file("/home/tprettol/repo/Quicftp/.cursor/debug.log", std::ios::app);
-        if (log_file.is_open()) {
-          log_file << "{\"sessionId\":\"debug-session\",\"runId\":\"run1\",\"hypothesisId\":\"J\",\"location\":\"quicftp_server.cc:157\",\"message\":\"Processing pending upload\",\"data\":{\"stream_id\":" << upload.stream_id << ",\"remote_path\":\"" << upload.remote_path << "\",\"data_size\":" << upload.data.size() << "},\"timestamp\":" << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() << "}\n";
-          log_file.close();
-        }
-      }
-      // #endregion
-      
-      handle_upload(upload.remote_path, upload.data.data(), upload.data.size());
-    }
+}
+
+size_t Server::get_worker_count() const {
+  return worker_count_;
+}
+
+void Server::set_transport(TransportKind kind) {
+  if (!running_) {
+    transport_ = kind;
   }
 }
 
-void Server::log_info(const std::string& message) const {
-  if (verbose_) {
-    std::cout << "[" << get_timestamp() << "] [INFO] " << message << std::endl;
+TransportKind Server::get_transport() const {
+  return transport_;
+}
+
+void Server::set_congestion_control(CongestionAlgorithm algorithm) {
+  if (!running_) {
+    congestion_ = algorithm;
   }
 }
 
-void Server::log_error(const std::string& message) const {
-  std::cerr << "[" << get_timestamp() << "] [ERROR] " << message << std::endl;
+CongestionAlgorithm Server::get_congestion_control() const {
+  return congestion_;
 }
 
-void Server::log_connection(const std::string& event, const std::string& client_info) const {
-  if (verbose_) {
-    std::cout << "[" << get_timestamp() << "] [CONNECTION] " << event 
-              << " - Client: " << client_info << std::endl;
+void Server::set_fec(const FecConfig& config) {
+  if (!running_) {
+    fec_ = config;
   }
 }
 
-void Server::log_auth(const std::string& event, const std::string& details) const {
-  if (verbose_) {
-    std::cout << "[" << get_timestamp() << "] [AUTH] " << event 
-              << " - " << details << std::endl;
+FecConfig Server::get_fec() const {
+  return fec_;
+}
+
+void Server::set_durability(Durability mode, int group_window_ms) {
+  if (!running_) {
+    durability_ = mode;
+    group_window_ms_ = std::max(group_window_ms, 0);
   }
 }
 
-void Server::log_transfer(const std::string& operation, const std::string& file_path,
-                          size_t file_size, const std::string& status) const {
-  if (verbose_) {
-    std::cout << "[" << get_timestamp() << "] [TRANSFER] " << operation 
-              << " - File: " << file_path 
-              << " (" << format_size(file_size) << ") - " << status << std::endl;
+Durability Server::get_durability() const {
+  return durability_;
+}
+
+void Server::set_rate_limits(const RateLimits& limits) {
+  std::lock_guard<std::mutex> limits_lock(limits_mutex_);
+  rate_limits_ = limits;
+  TokenBucket::global().set_limit(limits.global);
+  {
+    std::lock_guard<std::mutex> lock(connections_mutex_);
+    for (auto& [addr, conn] : connections_) {
+      conn.limiter->set_limit(limits.connection);
+    }
+  }
+  std::lock_guard<std::mutex> lock(downloads_mutex_);
+  for (auto& [stream_id, download] : active_downloads_) {
+    download->limiter.set_limit(limits.stream);
+  }
+}
+
+RateLimits Server::get_rate_limits() const {
+  std::lock_guard<std::mutex> lock(limits_mutex_);
+  return rate_limits_;
+}
+
+void Server::set_metrics_endpoint(const std::string& endpoint) {
+  if (!running_) {
+    metrics_endpoint_ = endpoint;
+  }
+}
+
+std::string Server::get_metrics_endpoint() const {
+  return metrics_endpoint_;
+}
+
+void Server::process_events(int timeout_ms) {
+  if (quic_server_ && running_) {
+    // Upload data is written by the callbacks as each chunk is dispatched
+    quic_server_->process_events(timeout_ms);
+    expire_striped_uploads();
+    reap_downloads(false);
   }
 }
 
+std::string Server::transfer_message(const std::string& operation, const std::string& file_path,
+                                     size_t file_size, const std::string& status) const {
+  return operation + " - File: " + file_path + " (" + format_size(file_size) + ") - " + status;
+}
+
 void Server::on_client_connect(const std::string& client_address) {
-  log_connection("Client connected", client_address);
+  SERVER_LOG_CONNECTION("Client connected", client_address);
+  std::lock_guard<std::mutex> limits_lock(limits_mutex_);
   std::lock_guard<std::mutex> lock(connections_mutex_);
-  connections_[client_address] = std::make_unique<QuicConnectionWrapper>();
+  Connection& conn = connections_[client_address];
+  conn.wrapper = std::make_unique<QuicConnectionWrapper>();
+  conn.limiter = std::make_shared<TokenBucket>(rate_limits_.connection);
+  MetricsRegistry& metrics = MetricsRegistry::instance();
+  conn.received = metrics.counter("quicftp_connection_received_bytes_total", "Upload data received from a client",
+                                  {{"client", client_address}});
+  conn.sent = metrics.counter("quicftp_connection_sent_bytes_total", "Download data sent to a client",
+                              {{"client", client_address}});
+  connection_count_->set(static_cast<int64_t>(connections_.size()));
 }
 
 void Server::on_client_disconnect(const std::string& client_address) {
-  log_connection("Client disconnected", client_address);
+  SERVER_LOG_CONNECTION("Client disconnected", client_address);
   std::lock_guard<std::mutex> lock(connections_mutex_);
   connections_.erase(client_address);
+  connection_count_->set(static_cast<int64_t>(connections_.size()));
+  // Transfers still running keep counting into their own references
+  MetricsRegistry& metrics = MetricsRegistry::instance();
+  metrics.remove("quicftp_connection_received_bytes_total", {{"client", client_address}});
+  metrics.remove("quicftp_connection_sent_bytes_total", {{"client", client_address}});
 }
 
 void Server::on_auth_attempt(const std::string& client_address, const std::string& cert_info, bool success) {
   if (success) {
-    log_auth("Authentication successful", "Client: " + client_address + ", Cert: " + cert_info);
+    SERVER_LOG_AUTH("Authentication successful", "Client: " + client_address + ", Cert: " + cert_info);
   } else {
-    log_auth("Authentication failed", "Client: " + client_address + ", Cert: " + cert_info);
+    SERVER_LOG_AUTH("Authentication failed", "Client: " + client_address + ", Cert: " + cert_info);
   }
 }
 
-bool Server::handle_upload(const std::string& remote_path, const void* data, size_t size) {
-  // #region agent log
+bool Server::begin_upload(StreamId stream_id, const UploadRequest& request) {
+  const std::string& remote_path = request.remote_path;
+  std::string full_path = root_dir_ + "/" + remote_path;
+
+  // Security: resolution never leaves the root; parent directories are
+  // created as needed
+  PathResolver::Location location;
+  if (!paths_.locate(remote_path, true, location)) {
+    if (errno == EXDEV) {
+      SERVER_LOG_ERROR("Upload rejected: Path traversal attempt - " + remote_path);
+    } else {
+      SERVER_LOG_ERROR("Upload failed: Cannot create directory - " + full_path + " (" + std::strerror(errno) + ")");
+    }
+    return false;
+  }
+  int dir_fd = location.dir->fd();
+
+  auto upload = std::make_unique<ActiveUpload>();
+  upload->remote_path = remote_path;
+  upload->dir = location.dir;
+  upload->start_time = std::chrono::steady_clock::now();
   {
-    std::ofstream log_file("/home/tprettol/repo/Quicftp/.cursor/debug.log", std::ios::app);
-    if (log_file.is_open()) {
-      log_file << "{\"sessionId\":\"debug-session\",\"runId\":\"run1\",\"hypothesisId\":\"G\",\"location\":\"quicftp_server.cc:208\",\"message\":\"handle_upload() called\",\"data\":{\"remote_path\":\"" << remote_path << "\",\"size\":" << size << ",\"root_dir\":\"" << root_dir_ << "\"},\"timestamp\":" << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() << "}\n";
-      log_file.close();
+    std::lock_guard<std::mutex> lock(connections_mutex_);
+    auto it = connections_.find(request.client);
+    if (it != connections_.end()) {
+      upload->received = it->second.received;
     }
   }
-  // #endregion
-  std::string full_path = root_dir_ + "/" + remote_path;
-  
-  // Security: Prevent directory traversal
-  std::filesystem::path safe_path = std::filesystem::canonical(root_dir_) / remote_path;
-  std::filesystem::path root_canonical = std::filesystem::canonical(root_dir_);
-  
-  if (safe_path.string().find(root_canonical.string()) != 0) {
-    log_error("Upload rejected: Path traversal attempt - " + remote_path);
+
+  if (request.ranged) {
+    // Stripes of one file share a single preallocated partial file, which
+    // outlives this server run if the upload is interrupted. A new entry is
+    // locked before it is published, so other stripes wait until it is open.
+    const std::string& target = location.name;
+    std::shared_ptr<StripedUpload> striped;
+    std::unique_lock<std::mutex> striped_lock;
+    bool created = false;
+    {
+      std::lock_guard<std::mutex> lock(uploads_mutex_);
+      std::shared_ptr<StripedUpload>& entry = striped_uploads_[location.path];
+      if (!entry) {
+        entry = std::make_shared<StripedUpload>();
+        entry->remote_path = remote_path;
+        entry->path = location.path;
+        entry->dir = location.dir;
+        entry->total_size = request.total_size;
+        entry->start_time = upload->start_time;
+        striped_lock = std::unique_lock<std::mutex>(entry->mutex);
+        created = true;
+      }
+      striped = entry;
+    }
+    if (created) {
+      std::string partial_path = sidecar_path(target, "partial");
+      bool have_partial = exists_in(*location.dir, partial_path);
+      bool opened = striped->journal.open(sidecar_path(target, "journal"), request.total_size, have_partial, dir_fd);
+      if (!opened) {
+        SERVER_LOG_ERROR("Upload failed: Cannot open journal - " + full_path + " (" + striped->journal.error() + ")");
+        paths_.forget(location);
+      } else {
+        uint64_t already = striped->journal.bytes_covered();
+        bool resuming = already > 0;
+        opened = striped->sink.open_partial(target, partial_path, !resuming, dir_fd) &&
+                 (resuming || striped->sink.preallocate(request.total_size));
+        if (!opened) {
+          SERVER_LOG_ERROR("Upload failed: Cannot open file for writing - " + full_path + " (" +
+                           striped->sink.error() + ")");
+          striped->sink.abort();
+          striped->journal.remove();
+        } else {
+          SERVER_LOG_TRANSFER("Upload", remote_path, request.total_size,
+                              resuming ? "Resuming (" + format_size(already) + " already received)"
+                                       : "Starting (ranged)");
+        }
+      }
+      if (!opened) {
+        striped->failed = true;
+        striped->closed = true;
+        striped_lock.unlock();
+        forget_striped_upload(striped);
+        return false;
+      }
+    } else {
+      striped_lock = std::unique_lock<std::mutex>(striped->mutex);
+      if (striped->total_size != request.total_size || striped->failed || striped->closed) {
+        SERVER_LOG_ERROR("Upload rejected: Range does not match upload in progress - " + remote_path);
+        return false;
+      }
+    }
+    striped->open_streams++;
+    striped->last_activity = upload->start_time;
+    striped_lock.unlock();
+    upload->striped = striped;
+    upload->next_offset = request.offset;
+    upload->journaled_offset = request.offset;
+    std::lock_guard<std::mutex> lock(uploads_mutex_);
+    active_uploads_[stream_id] = std::move(upload);
+    upload_streams_->add(1);
+    return true;
+  }
+
+  if (!upload->sink.open(location.name, dir_fd)) {
+    SERVER_LOG_ERROR("Upload failed: Cannot open file for writing - " + full_path + " (" + upload->sink.error() + ")");
+    // The cached directory may have been removed behind our back
+    paths_.forget(location);
     return false;
   }
 
-  auto start_time = std::chrono::steady_clock::now();
-  
-  try {
-    // Create parent directories if needed
-    std::filesystem::create_directories(safe_path.parent_path());
+  SERVER_LOG_TRANSFER("Upload", remote_path, 0, "Starting");
+  std::lock_guard<std::mutex> lock(uploads_mutex_);
+  active_uploads_[stream_id] = std::move(upload);
+  upload_streams_->add(1);
+  return true;
+}
+
+bool Server::continue_upload(StreamId stream_id, const BufferRef& owner, const uint8_t* data, size_t size) {
+  std::unique_lock<std::mutex> lock(uploads_mutex_);
+  auto it = active_uploads_.find(stream_id);
+  if (it == active_uploads_.end()) {
+    return false;
+  }
+  const std::shared_ptr<ActiveUpload>& entry = it->second;
+  ActiveUpload& upload = *entry;
+  // Only this stream's loop thread touches the upload, and only it can
+  // remove the entry
+  lock.unlock();
 
-    std::ofstream file(safe_path, std::ios::binary);
-    if (!file.is_open()) {
-      log_error("Upload failed: Cannot open file for writing - " + full_path);
+  if (upload.striped) {
+    // Stripes may arrive on several workers. Queuing their writes is cheap,
+    // so it stays under the upload's lock: the sink must not be committed
+    // under a straggler's write.
+    StripedUpload& striped = *upload.striped;
+    std::unique_lock<std::mutex> striped_lock(striped.mutex);
+    if (striped.failed || striped.closed) {
+      return false;
+    }
+    if (upload.next_offset + size > striped.total_size) {
+      SERVER_LOG_ERROR("Upload failed: Range exceeds file size - " + upload.remote_path);
+      striped.failed = true;
       return false;
     }
+    if (!striped.sink.write_at(owner, upload.next_offset, data, size)) {
+      SERVER_LOG_ERROR("Upload failed: Write error - " + upload.remote_path + " (" + striped.sink.error() + ")");
+      striped.failed = true;
+      return false;
+    }
+    upload.next_offset += size;
+    striped.bytes_received += size;
+    if (upload.received) {
+      upload.received->add(size);
+    }
+    striped.last_activity = std::chrono::steady_clock::now();
+    striped_lock.unlock();
+    if (upload.next_offset - upload.journaled_offset >= kJournalIntervalBytes) {
+      journal_stripe(entry, nullptr);
+    }
+    return true;
+  }
 
-    log_transfer("Upload", remote_path, size, "Starting");
+  if (!upload.sink.write(owner, data, size)) {
+    SERVER_LOG_ERROR("Upload failed: Write error - " + upload.remote_path + " (" + upload.sink.error() + ")");
+    return false;
+  }
+  if (upload.received) {
+    upload.received->add(size);
+  }
+  return true;
+}
 
-    // #region agent log
+void Server::finish_upload(StreamId stream_id, bool completed, UploadStoredCallback stored) {
+  std::unique_lock<std::mutex> lock(uploads_mutex_);
+  auto it = active_uploads_.find(stream_id);
+  if (it == active_uploads_.end()) {
+    stored(false);
+    return;
+  }
+  std::shared_ptr<ActiveUpload> upload = std::move(it->second);
+  active_uploads_.erase(it);
+  upload_streams_->add(-1);
+  lock.unlock();
+
+  if (upload->striped) {
+    // Whatever reached the partial file counts, even from an aborted stream.
+    // This stripe's range is acknowledged once journaled; the file itself
+    // appears when the last range lands.
+    journal_stripe(upload, [this, upload, completed, stored](bool journaled) {
+      const std::shared_ptr<StripedUpload>& striped = upload->striped;
+      std::unique_lock<std::mutex> striped_lock(striped->mutex);
+      striped->open_streams--;
+      if (striped->closed) {
+        striped_lock.unlock();
+        stored(false);
+        return;
+      }
+      if (!journaled || !completed) {
+        striped->failed = true;
+      }
+      bool suspended = settle_striped_upload(striped);
+      striped_lock.unlock();
+      if (suspended) {
+        forget_striped_upload(striped);
+      }
+      stored(journaled);
+    });
+    return;
+  }
+
+  size_t size = upload->sink.bytes_written();
+  if (!completed) {
+    upload->sink.abort();
+    SERVER_LOG_TRANSFER("Upload", upload->remote_path, size, "Aborted");
+    stored(false);
+    return;
+  }
+
+  // Acknowledged once the file is in place (and durable, if required),
+  // together with others finishing now
+  std::shared_ptr<ActiveUpload> pending = std::move(upload);
+  committer_->add(pending->sink, [this, pending, size, stored](bool committed) {
+    if (committed) {
+      upload_seconds_->record(microseconds_since(pending->start_time));
+      SERVER_LOG_TRANSFER("Upload", pending->remote_path, size, completion_status(size, pending->start_time));
+    } else {
+      SERVER_LOG_ERROR("Upload failed: " + pending->sink.error() + " - " + pending->remote_path);
+    }
+    stored(committed);
+  });
+}
+
+void Server::journal_stripe(const std::shared_ptr<ActiveUpload>& upload, GroupCommit::Done done) {
+  std::shared_ptr<StripedUpload> striped = upload->striped;
+  uint64_t offset;
+  uint64_t length;
+  uint64_t mark;
+  {
+    // A stripe's entries are made one at a time, so they land in order. A
+    // periodic one is left to the next; the last follows the current one.
+    std::lock_guard<std::mutex> lock(striped->mutex);
+    if (upload->journaling) {
+      if (done) {
+        upload->journal_last = std::move(done);
+      }
+      return;
+    }
+    upload->journaling = true;
+    offset = upload->journaled_offset;
+    length = upload->next_offset - offset;
+    upload->journaled_offset = upload->next_offset;
+    // The range is journaled once this stripe's writes so far are in, not
+    // when other stripes' are
+    mark = striped->sink.write_mark();
+  }
+  committer_->sync(striped->sink, mark, [this, upload, striped, offset, length, done](bool synced) {
+    bool journaled;
+    GroupCommit::Done last;
     {
-      std::ofstream log_file("/home/tprettol/repo/Quicftp/.cursor/debug.log", std::ios::app);
-      if (log_file.is_open()) {
-        log_file << "{\"sessionId\":\"debug-session\",\"runId\":\"run1\",\"hypothesisId\":\"G\",\"location\":\"quicftp_server.cc:234\",\"message\":\"About to write file\",\"data\":{\"safe_path\":\"" << safe_path.string() << "\",\"size\":" << size << "},\"timestamp\":" << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() << "}\n";
-        log_file.close();
+      std::lock_guard<std::mutex> lock(striped->mutex);
+      if (!striped->closed && !upload->journal_failed) {
+        if (!synced) {
+          SERVER_LOG_ERROR("Upload failed: Write error - " + upload->remote_path + " (" + striped->sink.error() +
+                           ")");
+          upload->journal_failed = true;
+        } else if (length > 0 && (!striped->journal.add(offset, length) ||
+                                  (durability_ != Durability::None && !striped->journal.sync()))) {
+          SERVER_LOG_ERROR("Upload failed: Journal error - " + upload->remote_path + " (" +
+                           striped->journal.error() + ")");
+          upload->journal_failed = true;
+        }
+        if (upload->journal_failed) {
+          striped->failed = true;
+        }
       }
+      journaled = !striped->closed && !upload->journal_failed;
+      upload->journaling = false;
+      last = std::move(upload->journal_last);
+      upload->journal_last = nullptr;
+    }
+    if (last) {
+      journal_stripe(upload, std::move(last));
     }
-    // #endregion
+    if (done) {
+      done(journaled);
+    }
+  });
+}
 
-    file.write(static_cast<const char*>(data), size);
-    if (!file.good()) {
-      log_error("Upload failed: Write error - " + full_path);
+bool Server::settle_striped_upload(const std::shared_ptr<StripedUpload>& striped) {
+  if (!striped->journal.complete()) {
+    // Other stripes are still streaming into the file
+    if (striped->open_streams > 0) {
       return false;
     }
+    if (striped->failed) {
+      // Keep what arrived; the client resumes after an upload status query
+      suspend_striped_upload(*striped, "Interrupted");
+      return true;
+    }
+    // Otherwise stripes may start after earlier ones finished; wait for the rest
+    return false;
+  }
+
+  // Every byte is in place. Streams still open belong to a client that went
+  // away before a resumed upload filled in their ranges; they are ignored.
+  striped->closed = true;
 
-    file.close();
-    
-    // #region agent log
+  committer_->add(striped->sink, [this, striped](bool committed) {
     {
-      std::ofstream log_file("/home/tprettol/repo/Quicftp/.cursor/debug.log", std::ios::app);
-      if (log_file.is_open()) {
-        bool file_exists = std::filesystem::exists(safe_path);
-        log_file << "{\"sessionId\":\"debug-session\",\"runId\":\"run1\",\"hypothesisId\":\"G\",\"location\":\"quicftp_server.cc:242\",\"message\":\"File write completed\",\"data\":{\"safe_path\":\"" << safe_path.string() << "\",\"file_exists\":" << (file_exists ? "true" : "false") << "},\"timestamp\":" << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() << "}\n";
-        log_file.close();
+      std::lock_guard<std::mutex> lock(striped->mutex);
+      if (!committed) {
+        SERVER_LOG_ERROR("Upload failed: " + striped->sink.error() + " - " + striped->remote_path);
+      } else {
+        upload_seconds_->record(microseconds_since(striped->start_time));
+        SERVER_LOG_TRANSFER("Upload", striped->remote_path, striped->total_size,
+                            completion_status(striped->bytes_received, striped->start_time));
       }
+      striped->journal.remove();
     }
-    // #endregion
-    
-    // Calculate transfer speed
-    auto end_time = std::chrono::steady_clock::now();
-    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time).count();
-    double speed = (duration > 0) ? (static_cast<double>(size) / duration) * 1000.0 : 0.0; // bytes per second
-    
-    std::ostringstream status;
-    status << "Completed - Speed: " << format_size(static_cast<size_t>(speed)) << "/s";
-    log_transfer("Upload", remote_path, size, status.str());
-    
-    return true;
+    forget_striped_upload(striped);
+  });
+  return false;
+}
 
-  } catch (const std::exception& e) {
-    log_error("Upload failed: " + std::string(e.what()) + " - " + full_path);
-    return false;
+void Server::forget_striped_upload(const std::shared_ptr<StripedUpload>& striped) {
+  std::lock_guard<std::mutex> lock(uploads_mutex_);
+  auto it = striped_uploads_.find(striped->path);
+  if (it != striped_uploads_.end() && it->second == striped) {
+    striped_uploads_.erase(it);
   }
 }
 
-bool Server::handle_download(const std::string& remote_path, 
-                            std::function<bool(const void*, size_t)> send_callback) {
-  std::filesystem::path safe_path = std::filesystem::canonical(root_dir_) / remote_path;
-  std::filesystem::path root_canonical = std::filesystem::canonical(root_dir_);
+void Server::suspend_striped_upload(StripedUpload& striped, const std::string& reason) {
+  striped.closed = true;
+  striped.sink.suspend();
+  striped.journal.close();
+  SERVER_LOG_TRANSFER("Upload", striped.remote_path, striped.total_size,
+                      reason + " - " + format_size(striped.journal.bytes_covered()) + " kept for resume");
+}
+
+void Server::expire_striped_uploads() {
+  // Closed under the map lock, but suspended once it is released
+  std::vector<std::shared_ptr<StripedUpload>> expired;
+  {
+    std::lock_guard<std::mutex> lock(uploads_mutex_);
+    auto cutoff = std::chrono::steady_clock::now() - std::chrono::milliseconds(kStripedUploadTimeoutMs);
+    for (auto it = striped_uploads_.begin(); it != striped_uploads_.end();) {
+      StripedUpload& striped = *it->second;
+      std::lock_guard<std::mutex> striped_lock(striped.mutex);
+      if (striped.open_streams == 0 && !striped.closed && striped.last_activity < cutoff) {
+        striped.closed = true;
+        expired.push_back(it->second);
+        it = striped_uploads_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+  for (const std::shared_ptr<StripedUpload>& striped : expired) {
+    std::lock_guard<std::mutex> striped_lock(striped->mutex);
+    suspend_striped_upload(*striped, "Incomplete");
+  }
+}
+
+std::string Server::completion_status(size_t size, std::chrono::steady_clock::time_point start_time) const {
+  // Calculate transfer speed
+  auto end_time = std::chrono::steady_clock::now();
+  auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time).count();
+  double speed = (duration > 0) ? (static_cast<double>(size) / duration) * 1000.0 : 0.0; // bytes per second
   
-  // Security: Prevent directory traversal
-  if (safe_path.string().find(root_canonical.string()) != 0) {
-    log_error("Download rejected: Path traversal attempt - " + remote_path);
-    return false;
+  std::ostringstream status;
+  status << "Completed - Speed: " << format_size(static_cast<size_t>(speed)) << "/s";
+  return status.str();
+}
+
+void Server::handle_download(StreamId stream_id, const DownloadRequest& request) {
+  const std::string& remote_path = request.remote_path;
+  auto requested_at = std::chrono::steady_clock::now();
+
+  // Security: resolution never leaves the root
+  int fd = paths_.open_file(remote_path, O_RDONLY);
+  if (fd < 0 && errno == EXDEV) {
+    SERVER_LOG_ERROR("Download rejected: Path traversal attempt - " + remote_path);
+    reject_request(stream_id, "access denied");
+    return;
+  }
+  if (fd < 0) {
+    SERVER_LOG_ERROR("Download failed: Cannot open file for reading - " + remote_path + " (" +
+                     std::strerror(errno) + ")");
+    reject_request(stream_id, errno == ENOENT ? "file not found" : "cannot open file");
+    return;
   }
 
-  if (!std::filesystem::exists(safe_path)) {
-    log_error("Download failed: File not found - " + remote_path);
-    return false;
+  // Mapped, so the send path hands the transport views of the page cache
+  auto source = std::make_shared<FileSource>();
+  if (!source->attach(fd)) {
+    SERVER_LOG_ERROR("Download failed: " + source->error() + " - " + remote_path);
+    reject_request(stream_id, "not a regular file");
+    return;
   }
 
-  if (!std::filesystem::is_regular_file(safe_path)) {
-    log_error("Download failed: Not a regular file - " + remote_path);
-    return false;
+  uint64_t file_size = source->size();
+  uint64_t offset = request.ranged ? request.offset : 0;
+  if (offset > file_size) {
+    SERVER_LOG_ERROR("Download rejected: Range starts past end of file - " + remote_path);
+    reject_request(stream_id, "range not satisfiable");
+    return;
+  }
+  uint64_t length = file_size - offset;
+  if (request.ranged) {
+    length = std::min(length, request.length);
+  }
+  if (request.stat_only) {
+    length = 0;
   }
 
-  try {
-    std::ifstream file(safe_path, std::ios::binary);
-    if (!file.is_open()) {
-      log_error("Download failed: Cannot open file for reading - " + remote_path);
+  if (!quic_server_->send_reply(stream_id, file_size, offset, length)) {
+    SERVER_LOG_ERROR("Download failed: Client went away - " + remote_path);
+    quic_server_->finish_stream(stream_id);
+    return;
+  }
+  if (length == 0) {
+    quic_server_->finish_stream(stream_id);
+    return;
+  }
+
+  SERVER_LOG_TRANSFER("Download", remote_path, length,
+                      request.ranged ? "Starting (range at " + std::to_string(offset) + ")" : "Starting");
+
+  // Registered before it starts, so a change of limits cannot miss it
+  std::lock_guard<std::mutex> limits_lock(limits_mutex_);
+  std::shared_ptr<TokenBucket> connection_limiter;
+  std::shared_ptr<Counter> sent;
+  {
+    std::lock_guard<std::mutex> lock(connections_mutex_);
+    auto it = connections_.find(request.client);
+    if (it != connections_.end()) {
+      connection_limiter = it->second.limiter;
+      sent = it->second.sent;
+    }
+  }
+  auto download = std::make_shared<ActiveDownload>();
+  download->stream_id = stream_id;
+  download->remote_path = remote_path;
+  download->source = source;
+  download->offset = offset;
+  download->length = length;
+  download->position = offset;
+  if (!source->mapped()) {
+    download->scratch = BufferPool::instance().acquire(kDownloadChunkSize);
+  }
+  download->connection_limiter = connection_limiter;
+  download->sent = sent;
+  download->requested_at = requested_at;
+  download->start_time = std::chrono::steady_clock::now();
+  download->limiter.set_limit(rate_limits_.stream);
+  source->advise(offset, length);
+  std::lock_guard<std::mutex> lock(downloads_mutex_);
+  download_streams_->add(1);
+  active_downloads_[stream_id] = download;
+  senders_->add([this, download](SendPool::Clock::time_point& not_before) {
+    return send_download_slice(*download, not_before);
+  });
+}
+
+bool Server::send_download_slice(ActiveDownload& download, SendPool::Clock::time_point& not_before) {
+  uint64_t end = download.offset + download.length;
+  uint64_t slice_end = std::min(end, download.position + kDownloadSliceBytes);
+  while (download.position < end) {
+    uint64_t sent_bytes = download.position - download.offset;
+    if (download.cancelled) {
+      SERVER_LOG_TRANSFER("Download", download.remote_path, sent_bytes, "Aborted");
+      finish_download(download, false);
       return false;
     }
+    if (download.position >= slice_end) {
+      return true; // others' turn
+    }
+    if (!download.chunk) {
+      size_t want = static_cast<size_t>(std::min<uint64_t>(kDownloadChunkSize, end - download.position));
+      if (!download.source->read(download.position, want, download.scratch.data(), download.chunk,
+                                 download.chunk_size) ||
+          download.chunk_size == 0) {
+        // File shrank underneath us or the read failed
+        SERVER_LOG_ERROR("Download failed: Read error - " + download.remote_path);
+        finish_download(download, false);
+        return false;
+      }
+      download.reservation = std::make_unique<Reservation>(download.chunk_size, &download.limiter,
+                                                           download.connection_limiter.get(),
+                                                           SendPool::Clock::now());
+    }
+    // Held back by the client's window or the rate limits, the chunk waits
+    // aside rather than a sender
+    SendPool::Clock::time_point now = SendPool::Clock::now();
+    if (quic_server_->reply_credit(download.stream_id) < download.chunk_size) {
+      not_before = now + std::chrono::milliseconds(kReplyWindowRecheckMs);
+      return true;
+    }
+    if (!download.reservation->ready(now)) {
+      not_before = download.reservation->recheck_at(now);
+      return true;
+    }
+    download.reservation.reset();
+    if (!quic_server_->send_stream_data(download.stream_id, download.chunk, download.chunk_size)) {
+      SERVER_LOG_TRANSFER("Download", download.remote_path, sent_bytes, "Aborted - client went away");
+      finish_download(download, false);
+      return false;
+    }
+    if (download.sent) {
+      download.sent->add(download.chunk_size);
+    }
+    download.position += download.chunk_size;
+    download.chunk = nullptr;
+  }
+  finish_download(download, true);
+  return false;
+}
 
-    // Get file size
-    file.seekg(0, std::ios::end);
-    size_t file_size = file.tellg();
-    file.seekg(0, std::ios::beg);
+void Server::finish_download(ActiveDownload& download, bool success) {
+  download.source->close();
+  // A short body tells the client the range did not arrive in full
+  quic_server_->finish_stream(download.stream_id);
+  if (success) {
+    download_seconds_->record(microseconds_since(download.requested_at));
+    SERVER_LOG_TRANSFER("Download", download.remote_path, download.length,
+                        completion_status(download.length, download.start_time));
+  }
+  download_streams_->add(-1);
+  download.done = true;
+}
 
-    auto start_time = std::chrono::steady_clock::now();
-    log_transfer("Download", remote_path, file_size, "Starting");
+void Server::report_upload_status(StreamId stream_id, const UploadRequest& request) {
+  const std::string& remote_path = request.remote_path;
 
-    // Read and send file in chunks
-    const size_t chunk_size = 64 * 1024; // 64KB chunks
-    std::vector<char> buffer(chunk_size);
-    size_t total_sent = 0;
+  // Security: resolution never leaves the root. A directory that does not
+  // exist yet simply holds nothing of the upload.
+  PathResolver::Location location;
+  bool located = paths_.locate(remote_path, false, location);
+  if (!located && errno == EXDEV) {
+    SERVER_LOG_ERROR("Upload rejected: Path traversal attempt - " + remote_path);
+    reject_request(stream_id, "access denied");
+    return;
+  }
 
-    while (file.read(buffer.data(), chunk_size) || file.gcount() > 0) {
-      size_t bytes_read = file.gcount();
-      if (!send_callback(buffer.data(), bytes_read)) {
-        log_error("Download failed: Send callback returned false - " + remote_path);
-        return false;
+  // Missing ranges of a live upload, else of an interrupted one, else all of it
+  std::vector<std::pair<uint64_t, uint64_t>> missing;
+  bool live = false;
+  if (located) {
+    std::shared_ptr<StripedUpload> striped;
+    {
+      std::lock_guard<std::mutex> lock(uploads_mutex_);
+      auto it = striped_uploads_.find(location.path);
+      if (it != striped_uploads_.end() && it->second->total_size == request.total_size) {
+        striped = it->second;
       }
-      total_sent += bytes_read;
     }
-
-    if (!file.eof() && file.fail()) {
-      log_error("Download failed: Read error - " + remote_path);
-      return false;
+    if (striped) {
+      std::lock_guard<std::mutex> striped_lock(striped->mutex);
+      missing = striped->journal.missing();
+      live = true;
+    }
+  }
+  RangeJournal saved;
+  if (!live) {
+    if (located && exists_in(*location.dir, sidecar_path(location.name, "partial")) &&
+        saved.load(sidecar_path(location.name, "journal"), location.dir->fd()) &&
+        saved.total_size() == request.total_size) {
+      missing = saved.missing();
+    } else if (request.total_size > 0) {
+      missing.emplace_back(0, request.total_size);
     }
+  }
 
-    // Calculate transfer speed
-    auto end_time = std::chrono::steady_clock::now();
-    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time).count();
-    double speed = (duration > 0) ? (static_cast<double>(file_size) / duration) * 1000.0 : 0.0; // bytes per second
-    
-    std::ostringstream status;
-    status << "Completed - Speed: " << format_size(static_cast<size_t>(speed)) << "/s";
-    log_transfer("Download", remote_path, file_size, status.str());
-    
-    return true;
+  // The body is a varint (offset, length) pair per gap
+  PayloadWriter body;
+  for (const auto& [offset, length] : missing) {
+    body.varint(offset).varint(length);
+  }
+  const std::vector<uint8_t>& bytes = body.data();
+  bool sent = quic_server_->send_reply(stream_id, request.total_size, 0, bytes.size());
+  for (size_t pos = 0; sent && pos < bytes.size(); pos += kDownloadChunkSize) {
+    size_t len = std::min(kDownloadChunkSize, bytes.size() - pos);
+    sent = quic_server_->send_stream_data(stream_id, bytes.data() + pos, len);
+  }
+  quic_server_->finish_stream(stream_id);
+}
 
-  } catch (const std::exception& e) {
-    log_error("Download failed: " + std::string(e.what()) + " - " + remote_path);
-    return false;
+void Server::reject_request(StreamId stream_id, const std::string& reason) {
+  quic_server_->reject_stream(stream_id, reason);
+}
+
+void Server::reap_downloads(bool cancel) {
+  if (cancel) {
+    {
+      std::lock_guard<std::mutex> lock(downloads_mutex_);
+      for (auto& [stream_id, download] : active_downloads_) {
+        download->cancelled = true;
+      }
+    }
+    // Each send notices on its next slice
+    senders_->drain();
+  }
+  std::lock_guard<std::mutex> lock(downloads_mutex_);
+  for (auto it = active_downloads_.begin(); it != active_downloads_.end();) {
+    if (it->second->done) {
+      it = active_downloads_.erase(it);
+    } else {
+      ++it;
+    }
   }
 }
 
@@ -409,11 +1160,11 @@ bool Server::verify_certificate(const std::string& cert_info) {
   // TODO: Implement actual certificate verification using OpenSSL
   // This should verify the client's certificate against the server's trust store
   // For now, we'll do a basic placeholder that logs the attempt
-  log_auth("Certificate verification", "Cert info: " + cert_info);
+  SERVER_LOG_AUTH("Certificate verification", "Cert info: " + cert_info);
   
   // Basic validation: check if cert_info is not empty
   if (cert_info.empty()) {
-    log_auth("Certificate verification failed", "Empty certificate");
+    SERVER_LOG_AUTH("Certificate verification failed", "Empty certificate");
     return false;
   }
   
@@ -421,14 +1172,6 @@ bool Server::verify_certificate(const std::string& cert_info) {
   return true; // Placeholder - will be replaced with actual verification
 }
 
-std::string Server::get_timestamp() const {
-  auto now = std::time(nullptr);
-  auto tm = *std::localtime(&now);
-  std::ostringstream oss;
-  oss << std::put_time(&tm, "%Y-%m-%d %H:%M:%S");
-  return oss.str();
-}
-
 std::string Server::format_size(size_t bytes) const {
   const char* units[] = {"B", "KB", "MB", "GB", "TB"};
   size_t unit_index = 0;
@@ -445,4 +1188,3 @@ std::string Server::format_size(size_t bytes) const {
 }
 
 } // namespace quicftp
-
@@ -8,11 +8,27 @@
 #include <functional>
 #include <map>
 #include <mutex>
+#include <chrono>
+#include <atomic>
 #include "quic_common.h"
 #include "quic_wrapper.h"
+#include "group_commit.h"
+#include "metrics.h"
+#include "path_resolver.h"
+#include "rate_limiter.h"
+#include "send_pool.h"
 
 namespace quicftp {
 
+class FileSource;
+
+// When a finished upload is acknowledged
+enum class Durability {
+  None,   // once renamed into place; the kernel writes it back in its own time
+  File,   // once its data and name are on stable storage, file by file
+  Group   // likewise, with files finishing together sharing the syncs
+};
+
 class Server {
 
 public:
@@ -36,6 +52,46 @@ public:
   void set_root_directory(const std::string& root_dir);
   std::string get_root_directory() const;
 
+  // Number of event loop threads serving connections (default 1); takes
+  // effect on the next start()
+  void set_worker_count(size_t workers);
+  size_t get_worker_count() const;
+
+  // How clients reach the server: the shared-memory bridge (same host) or
+  // UDP on the port. Defaults to QUICFTP_TRANSPORT; takes effect on the next
+  // start().
+  void set_transport(TransportKind kind);
+  TransportKind get_transport() const;
+
+  // How UDP connections share the path (default cubic); takes effect on the
+  // next start()
+  void set_congestion_control(CongestionAlgorithm algorithm);
+  CongestionAlgorithm get_congestion_control() const;
+
+  // Forward error correction on what UDP clients download (default off);
+  // takes effect on the next start()
+  void set_fec(const FecConfig& config);
+  FecConfig get_fec() const;
+
+  // How finished uploads are made durable before the client hears they are
+  // stored (default None). In Group mode an upload waits up to
+  // group_window_ms for others to commit with. Takes effect on the next start().
+  void set_durability(Durability mode, int group_window_ms = 5);
+  Durability get_durability() const;
+
+  // Bandwidth limits on downloads (default none): per download, per client
+  // connection, and process-wide. Replies are paced to the tightest one.
+  // Safe to change while running; transfers in flight adjust within a frame.
+  void set_rate_limits(const RateLimits& limits);
+  RateLimits get_rate_limits() const;
+
+  // Serve metrics in Prometheus text format at endpoint: "PORT" or
+  // "HOST:PORT" for HTTP (on 127.0.0.1 unless HOST says otherwise), or
+  // "unix:PATH" (default none, which still keeps the counts); takes effect
+  // on the next start()
+  void set_metrics_endpoint(const std::string& endpoint);
+  std::string get_metrics_endpoint() const;
+
   // Event processing (call from main loop)
   void process_events(int timeout_ms = 100);
 
@@ -48,21 +104,50 @@ private:
   std::string cert_path_;
   std::string key_path_;
   std::string root_dir_;
+  size_t worker_count_;
+  TransportKind transport_;
+  CongestionAlgorithm congestion_;
+  FecConfig fec_;
+
+  // Resolves client paths beneath root_dir_ while running
+  PathResolver paths_;
+  Durability durability_;
+  int group_window_ms_;
+
+  // Commits finished uploads off the event loops, syncing in the durable modes
+  std::unique_ptr<GroupCommit> committer_;
+
+  // Monitoring; the transfer paths only touch these through atomics
+  std::string metrics_endpoint_;
+  std::unique_ptr<MetricsExporter> metrics_exporter_;
+  std::shared_ptr<Histogram> upload_seconds_;
+  std::shared_ptr<Histogram> download_seconds_;
+  std::shared_ptr<Gauge> upload_streams_;
+  std::shared_ptr<Gauge> download_streams_;
+  std::shared_ptr<Gauge> connection_count_;
 
   // QUIC server wrapper
   std::unique_ptr<QuicServerWrapper> quic_server_;
   
-  // Active connections tracking
-  std::map<std::string, std::unique_ptr<QuicConnectionWrapper>> connections_;
+  // Active connections tracking, each with the bucket pacing its downloads
+  // and its byte counts
+  struct Connection {
+    std::unique_ptr<QuicConnectionWrapper> wrapper;
+    std::shared_ptr<TokenBucket> limiter;
+    std::shared_ptr<Counter> received;
+    std::shared_ptr<Counter> sent;
+  };
+  std::map<std::string, Connection> connections_;
   std::mutex connections_mutex_;
 
-  // Verbose logging helpers
-  void log_info(const std::string& message) const;
-  void log_error(const std::string& message) const;
-  void log_connection(const std::string& event, const std::string& client_info) const;
-  void log_auth(const std::string& event, const std::string& details) const;
-  void log_transfer(const std::string& operation, const std::string& file_path, 
-                    size_t file_size, const std::string& status) const;
+  // Taken before connections_mutex_ and downloads_mutex_
+  mutable std::mutex limits_mutex_;
+  RateLimits rate_limits_;
+
+  // Logged through the asynchronous Logger (see the SERVER_LOG_* macros),
+  // so callable from any worker thread without blocking it
+  std::string transfer_message(const std::string& operation, const std::string& file_path,
+                               size_t file_size, const std::string& status) const;
 
   // Connection handlers (to be called by QUIC library callbacks)
   void on_client_connect(const std::string& client_address);
@@ -70,8 +155,21 @@ private:
   void on_auth_attempt(const std::string& client_address, const std::string& cert_info, bool success);
   
   // File transfer handlers
-  bool handle_upload(const std::string& remote_path, const void* data, size_t size);
-  bool handle_download(const std::string& remote_path, std::function<bool(const void*, size_t)> send_callback);
+  // Uploads stream straight to disk through a per-stream FileSink;
+  // finish_upload reports whether the data is stored, for the client's Ack,
+  // once the durability mode is satisfied
+  bool begin_upload(StreamId stream_id, const UploadRequest& request);
+  bool continue_upload(StreamId stream_id, const BufferRef& owner, const uint8_t* data, size_t size);
+  void finish_upload(StreamId stream_id, bool completed, UploadStoredCallback stored);
+  // Downloads reply with the file size and range, or an error, then stream
+  // the range a slice at a time on senders_ so the event loop stays free
+  void handle_download(StreamId stream_id, const DownloadRequest& request);
+  struct ActiveDownload;
+  // Send the next slice of download; false once it is over
+  bool send_download_slice(ActiveDownload& download, SendPool::Clock::time_point& not_before);
+  void finish_download(ActiveDownload& download, bool success);
+  void reject_request(StreamId stream_id, const std::string& reason);
+  void reap_downloads(bool cancel);
   
   // Transfer statistics
   struct TransferStats {
@@ -84,12 +182,45 @@ private:
   mutable std::map<std::string, TransferStats> active_transfers_;
   mutable std::mutex transfers_mutex_;
 
+  // In-flight uploads keyed by stream. With several workers, upload
+  // callbacks for different connections run concurrently; uploads_mutex_
+  // guards both maps, and each striped upload's own mutex its state. The
+  // map lock is taken first when both are held.
+  struct ActiveUpload;
+  std::map<StreamId, std::shared_ptr<ActiveUpload>> active_uploads_;
+  std::mutex uploads_mutex_;
+
+  // Files being assembled from ranges on several streams, keyed by target path.
+  // Received ranges are journaled next to the target, so an interrupted
+  // upload keeps its data and a later status query reports only the gaps.
+  struct StripedUpload;
+  std::map<std::string, std::shared_ptr<StripedUpload>> striped_uploads_;
+  // Commit or suspend striped once no more ranges can come, with its mutex
+  // held. True if it was suspended and is to be forgotten; a commit runs on
+  // the committer, which forgets it when done.
+  bool settle_striped_upload(const std::shared_ptr<StripedUpload>& striped);
+  // Drop striped from the map unless another upload has taken its place
+  void forget_striped_upload(const std::shared_ptr<StripedUpload>& striped);
+  // Journal what a stripe has written since its last entry once its own
+  // writes are in the file (on stable storage, if durable). The entry is
+  // made on the committer's thread, after the stripe's earlier ones; done, if
+  // set, then learns whether all of the stripe's entries were made.
+  void journal_stripe(const std::shared_ptr<ActiveUpload>& upload, GroupCommit::Done done);
+  void suspend_striped_upload(StripedUpload& striped, const std::string& reason);
+  void expire_striped_uploads();
+  void report_upload_status(StreamId stream_id, const UploadRequest& request);
+
+  // Downloads being streamed, keyed by stream, and the threads streaming them
+  std::map<StreamId, std::shared_ptr<ActiveDownload>> active_downloads_;
+  std::mutex downloads_mutex_;
+  std::unique_ptr<SendPool> senders_;
+
+  // Helper: "Completed - Speed: ..." status line for transfer_message
+  std::string completion_status(size_t size, std::chrono::steady_clock::time_point start_time) const;
+
   // Certificate verification
   bool verify_certificate(const std::string& cert_info);
 
-  // Helper: Get current timestamp for logging
-  std::string get_timestamp() const;
-
   // Helper: Format file size for display
   std::string format_size(size_t bytes) const;
 };
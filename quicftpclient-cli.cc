@@ -2,16 +2,29 @@
 #include <string>
 #include <vector>
 #include <utility>
-#include <fstream>
-#include <chrono>
 
 #include "quicftp_client.h"
 
 int main(int argc, char *argv[]) {
 
  if(argc < 4) {
-   std::cerr << "Usage: " << argv[0] << " <server> <upload|download> <file1> [file2 ...] [cert_path]" << std::endl;
+   std::cerr << "Usage: " << argv[0] << " <server> <upload|download> <file1> [file2 ...] [cert_path] [--parallel N] [--stripes N] [--segments N] [--range OFFSET:LENGTH] [--no-resume] [--checksum] [--priority N] [--limit-stream|--limit-connection|--limit-global RATE[:BURST]] [--transport bridge|udp] [--congestion newreno|cubic|bbr] [--fec off|auto|K|K:R]" << std::endl;
    std::cerr << "  cert_path is optional (if ends with .pem/.crt or contains 'cert'), defaults to certs/client-cert.pem" << std::endl;
+   std::cerr << "  --parallel N transfers up to N files at once (default: number of CPU cores)" << std::endl;
+   std::cerr << "  --stripes N  splits a single large upload into N ranges sent in parallel" << std::endl;
+   std::cerr << "  --segments N fetches a single large download as N ranges in parallel" << std::endl;
+   std::cerr << "  --range OFFSET:LENGTH downloads only that byte range of a single file" << std::endl;
+   std::cerr << "  --no-resume  always transfers whole files instead of resuming interrupted ones" << std::endl;
+   std::cerr << "  --checksum   protects every frame with a CRC32C checksum" << std::endl;
+   std::cerr << "  --priority N sends ahead of the connection's other transfers from 64 up, only when idle at 0, else shares by N (default: 8)" << std::endl;
+   std::cerr << "  --limit-stream, --limit-connection, --limit-global RATE[:BURST]" << std::endl;
+   std::cerr << "               caps uploads per file, in total, or for the whole process, in bytes per second" << std::endl;
+   std::cerr << "               with optional K/M/G suffix (e.g. 10M:256K)" << std::endl;
+   std::cerr << "  --transport  reaches a server on this host over shared memory (bridge), or server[:port] over UDP (udp)" << std::endl;
+   std::cerr << "               (default: $QUICFTP_TRANSPORT or bridge)" << std::endl;
+   std::cerr << "  --congestion newreno|cubic|bbr controls how a UDP connection shares the path (default: cubic)" << std::endl;
+   std::cerr << "  --fec        follows every K packets uploaded over UDP with R repair packets, or as many as" << std::endl;
+   std::cerr << "               the loss seen calls for (auto: K = 32) (default: off)" << std::endl;
    return 1;
  }
 
@@ -19,12 +32,91 @@ int main(int argc, char *argv[]) {
  std::string mode = argv[2];
  std::vector<std::string> files;
  std::string cert_path = "certs/client-cert.pem"; // Default
+ size_t parallel = 0; // 0 = library default
+ size_t stripes = 1;
+ size_t segments = 1;
+ bool ranged = false;
+ uint64_t range_offset = 0;
+ uint64_t range_length = 0;
+ bool resume = true;
+ bool checksums = false;
+ int priority = quicftp::kPriorityNormal;
+ quicftp::RateLimits limits;
+ quicftp::TransportKind transport = quicftp::Transport::default_kind();
+ quicftp::CongestionAlgorithm congestion = quicftp::CongestionAlgorithm::Cubic;
+ quicftp::FecConfig fec;
 
  // Parse arguments: files and optional cert path
  // If last arg looks like a cert path (ends with .pem or contains "cert"), use it as cert_path
  // Otherwise, all args from index 3 are files
  for(int i=3; i<argc; i++) {
    std::string arg = argv[i];
+   if (arg == "--parallel" && i + 1 < argc) {
+     parallel = std::stoul(argv[++i]);
+     continue;
+   }
+   if (arg == "--stripes" && i + 1 < argc) {
+     stripes = std::stoul(argv[++i]);
+     continue;
+   }
+   if (arg == "--segments" && i + 1 < argc) {
+     segments = std::stoul(argv[++i]);
+     continue;
+   }
+   if (arg == "--priority" && i + 1 < argc) {
+     priority = std::stoi(argv[++i]);
+     continue;
+   }
+   if ((arg == "--limit-stream" || arg == "--limit-connection" || arg == "--limit-global") && i + 1 < argc) {
+     quicftp::RateLimit& limit = (arg == "--limit-stream") ? limits.stream
+                               : (arg == "--limit-connection") ? limits.connection : limits.global;
+     if (!quicftp::parse_rate_limit(argv[++i], limit)) {
+       std::cerr << "Invalid rate limit (expected RATE[:BURST]): " << argv[i] << std::endl;
+       return 1;
+     }
+     continue;
+   }
+   if (arg == "--transport" && i + 1 < argc) {
+     if (!quicftp::parse_transport_kind(argv[++i], transport)) {
+       std::cerr << "Invalid transport (expected bridge or udp): " << argv[i] << std::endl;
+       return 1;
+     }
+     continue;
+   }
+   if (arg == "--congestion" && i + 1 < argc) {
+     if (!quicftp::parse_congestion_algorithm(argv[++i], congestion)) {
+       std::cerr << "Invalid congestion control (expected newreno, cubic or bbr): " << argv[i] << std::endl;
+       return 1;
+     }
+     continue;
+   }
+   if (arg == "--fec" && i + 1 < argc) {
+     if (!quicftp::parse_fec_config(argv[++i], fec)) {
+       std::cerr << "Invalid FEC setting (expected off, auto, K or K:R, K and R from 1 to 128): " << argv[i] << std::endl;
+       return 1;
+     }
+     continue;
+   }
+   if (arg == "--checksum") {
+     checksums = true;
+     continue;
+   }
+   if (arg == "--no-resume") {
+     resume = false;
+     continue;
+   }
+   if (arg == "--range" && i + 1 < argc) {
+     std::string range = argv[++i];
+     size_t colon = range.find(':');
+     if (colon == std::string::npos) {
+       std::cerr << "Invalid range (expected OFFSET:LENGTH): " << range << std::endl;
+       return 1;
+     }
+     range_offset = std::stoull(range.substr(0, colon));
+     range_length = std::stoull(range.substr(colon + 1));
+     ranged = true;
+     continue;
+   }
    // Check if this looks like a certificate path
    bool is_cert = (arg.find("cert") != std::string::npos) ||
                   (arg.length() >= 4 && arg.substr(arg.length() - 4) == ".pem") ||
@@ -36,17 +128,23 @@ int main(int argc, char *argv[]) {
    }
  }
 
- // #region agent log
- {
-   std::ofstream log_file("/home/tprettol/repo/Quicftp/.cursor/debug.log", std::ios::app);
-   if (log_file.is_open()) {
-     log_file << "{\"sessionId\":\"debug-session\",\"runId\":\"run1\",\"hypothesisId\":\"A\",\"location\":\"quicftpclient-cli.cc:33\",\"message\":\"Parsed certificate path\",\"data\":{\"cert_path\":\"" << cert_path << "\",\"argc\":" << argc << "},\"timestamp\":" << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() << "}\n";
-     log_file.close();
-   }
- }
- // #endregion
-
  quicftp::Client client;
+ if(parallel > 0) {
+   client.set_parallel_transfers(parallel);
+ }
+ if(stripes > 1) {
+   client.set_striping(stripes);
+ }
+ if(segments > 1) {
+   client.set_download_segments(segments);
+ }
+ client.set_resume(resume);
+ client.set_checksums(checksums);
+ client.set_transfer_priority(priority);
+ client.set_rate_limits(limits);
+ client.set_transport(transport);
+ client.set_congestion_control(congestion);
+ client.set_fec(fec);
 
  if(!client.connect(server)) {
    std::cerr << "Connection failed" << std::endl;
@@ -54,15 +152,6 @@ int main(int argc, char *argv[]) {
  }
 
  // Use certificate based auth
- // #region agent log
- {
-   std::ofstream log_file("/home/tprettol/repo/Quicftp/.cursor/debug.log", std::ios::app);
-   if (log_file.is_open()) {
-     log_file << "{\"sessionId\":\"debug-session\",\"runId\":\"run1\",\"hypothesisId\":\"A\",\"location\":\"quicftpclient-cli.cc:50\",\"message\":\"About to call authenticate()\",\"data\":{\"cert_path\":\"" << cert_path << "\"},\"timestamp\":" << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() << "}\n";
-     log_file.close();
-   }
- }
- // #endregion
  if(!client.authenticate(cert_path)) {
    std::cerr << "Authentication failed" << std::endl;
    return 1;
@@ -88,7 +177,16 @@ int main(int argc, char *argv[]) {
    }
 
  } else if (mode == "download") {
-   if(files.size() == 1) {
+   if(ranged) {
+     if(files.size() != 1) {
+       std::cerr << "--range needs exactly one file" << std::endl;
+       return 1;
+     }
+     if(!client.download_range(files[0], files[0], range_offset, range_length)) {
+       std::cerr << "Download failed: " << files[0] << std::endl;
+       return 1;
+     }
+   } else if(files.size() == 1) {
      // Single file download
      if(!client.download_file(files[0], files[0])) {
        std::cerr << "Download failed: " << files[0] << std::endl;
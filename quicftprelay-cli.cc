@@ -0,0 +1,403 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <algorithm>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "link_emulator.h"
+
+// Relays UDP between clients and a server through an emulated link: clients
+// dial the relay's port, each gets its own socket towards the server, and
+// every datagram crosses a LinkEmulator, one each way.
+
+using Clock = std::chrono::steady_clock;
+
+static volatile std::sig_atomic_t g_stop = 0;
+
+void signal_handler(int) {
+  g_stop = 1;
+}
+
+namespace {
+
+constexpr size_t kMaxDatagramSize = 65536;
+constexpr int kSocketBufferSize = 8 * 1024 * 1024;
+constexpr int kDefaultServerPort = 4433;
+
+// A change of conditions at a point in the run, or its end
+struct ScriptStep {
+  double at = 0; // seconds from the start
+  bool up = false;
+  bool down = false;
+  bool end = false;
+  quicftp::LinkConditions conditions;
+};
+
+struct RelayClient {
+  sockaddr_storage addr;
+  socklen_t addr_len;
+  int fd; // connected to the server
+};
+
+} // namespace
+
+void print_usage(const char* program_name) {
+  std::cerr << "Usage: " << program_name << " <port> <server[:port]> [--link CONDITIONS] [--up CONDITIONS]"
+            << " [--down CONDITIONS] [--script FILE] [--report SECONDS] [--json]" << std::endl;
+  std::cerr << std::endl;
+  std::cerr << "Arguments:" << std::endl;
+  std::cerr << "  port       - UDP port clients dial instead of the server's" << std::endl;
+  std::cerr << "  server     - Where the server listens (default port: " << kDefaultServerPort << ")" << std::endl;
+  std::cerr << "  --link     - Conditions both ways, e.g. rate=12M,queue=256K,delay=20ms,jitter=2ms," << std::endl;
+  std::cerr << "                 loss=1%,duplicate=0.1%,reorder=0.5% (default: a perfect link)" << std::endl;
+  std::cerr << "  --up       - Conditions from clients to the server only" << std::endl;
+  std::cerr << "  --down     - Conditions from the server to clients only" << std::endl;
+  std::cerr << "  --script   - Lines of \"SECONDS up|down|both CONDITIONS\" changing the link as the run" << std::endl;
+  std::cerr << "                 goes, and \"SECONDS end\" to stop; # starts a comment" << std::endl;
+  std::cerr << "  --report   - Seconds between throughput and delay reports (default: 1; 0 for a summary only)" << std::endl;
+  std::cerr << "  --json     - Report as JSON lines" << std::endl;
+  std::cerr << std::endl;
+  std::cerr << "Example:" << std::endl;
+  std::cerr << "  " << program_name << " 4434 localhost:4433 --down rate=12M,delay=40ms,loss=0.5%" << std::endl;
+}
+
+bool resolve(const std::string& address, sockaddr_storage& out, socklen_t& out_len) {
+  std::string host = address;
+  std::string port = std::to_string(kDefaultServerPort);
+  size_t colon = address.rfind(':');
+  if (!address.empty() && address[0] == '[') {
+    size_t close = address.find(']');
+    if (close == std::string::npos) return false;
+    host = address.substr(1, close - 1);
+    if (close + 1 < address.size() && address[close + 1] == ':') {
+      port = address.substr(close + 2);
+    }
+  } else if (colon != std::string::npos && address.find(':') == colon) {
+    host = address.substr(0, colon);
+    port = address.substr(colon + 1);
+  }
+  addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+  addrinfo* result = nullptr;
+  if (getaddrinfo(host.c_str(), port.c_str(), &hints, &result) != 0 || !result) {
+    return false;
+  }
+  addrinfo* chosen = result;
+  for (addrinfo* ai = result; ai; ai = ai->ai_next) {
+    if (ai->ai_family == AF_INET) {
+      chosen = ai;
+      break;
+    }
+  }
+  std::memcpy(&out, chosen->ai_addr, chosen->ai_addrlen);
+  out_len = chosen->ai_addrlen;
+  freeaddrinfo(result);
+  return true;
+}
+
+bool load_script(const std::string& path, std::vector<ScriptStep>& steps) {
+  std::ifstream in(path);
+  if (!in) {
+    std::cerr << "Error: cannot open script " << path << std::endl;
+    return false;
+  }
+  std::string line;
+  int number = 0;
+  while (std::getline(in, line)) {
+    ++number;
+    line = line.substr(0, line.find('#'));
+    std::istringstream fields(line);
+    ScriptStep step;
+    std::string direction, conditions;
+    if (!(fields >> step.at)) {
+      if (fields.eof()) continue; // blank
+      std::cerr << "Error: " << path << ":" << number << ": expected seconds" << std::endl;
+      return false;
+    }
+    fields >> direction >> conditions;
+    if (direction == "end") {
+      step.end = true;
+    } else if ((direction == "up" || direction == "down" || direction == "both") &&
+               quicftp::parse_link_conditions(conditions, step.conditions)) {
+      step.up = direction != "down";
+      step.down = direction != "up";
+    } else {
+      std::cerr << "Error: " << path << ":" << number << ": expected up|down|both CONDITIONS or end" << std::endl;
+      return false;
+    }
+    steps.push_back(step);
+  }
+  std::stable_sort(steps.begin(), steps.end(),
+                   [](const ScriptStep& a, const ScriptStep& b) { return a.at < b.at; });
+  return true;
+}
+
+void report(double elapsed, const char* direction, quicftp::LinkEmulator& link, double seconds, bool json) {
+  quicftp::LinkEmulator::Window window = link.window();
+  quicftp::LinkEmulator::Stats stats = link.stats();
+  auto ms = [](Clock::duration d) { return std::chrono::duration<double, std::milli>(d).count(); };
+  double mbit = seconds > 0 ? static_cast<double>(window.bytes) * 8 / seconds / 1e6 : 0;
+  std::ostringstream line;
+  line << std::fixed << std::setprecision(2);
+  if (json) {
+    line << "{\"time\":" << elapsed << ",\"direction\":\"" << direction << "\",\"mbit_per_s\":" << mbit
+         << ",\"packets\":" << window.packets << ",\"p50_ms\":" << ms(window.p50) << ",\"p99_ms\":" << ms(window.p99)
+         << ",\"max_ms\":" << ms(window.max) << ",\"lost\":" << stats.lost << ",\"overflowed\":" << stats.overflowed
+         << ",\"duplicated\":" << stats.duplicated << ",\"reordered\":" << stats.reordered << "}";
+  } else {
+    line << "[" << std::setw(7) << elapsed << "s] " << std::setw(4) << direction << ": " << mbit << " Mbit/s, "
+         << window.packets << " packets, delay p50 " << ms(window.p50) << " ms, p99 " << ms(window.p99)
+         << " ms, max " << ms(window.max) << " ms; " << stats.lost << " lost, " << stats.overflowed
+         << " overflowed, " << stats.duplicated << " duplicated, " << stats.reordered << " reordered";
+  }
+  std::cout << line.str() << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc < 3) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  int port = std::atoi(argv[1]);
+  std::string server_address = argv[2];
+  quicftp::LinkConditions up_conditions;
+  quicftp::LinkConditions down_conditions;
+  std::vector<ScriptStep> steps;
+  double report_seconds = 1;
+  bool json = false;
+
+  for (int i = 3; i < argc; i++) {
+    std::string arg = argv[i];
+    if ((arg == "--link" || arg == "--up" || arg == "--down") && i + 1 < argc) {
+      quicftp::LinkConditions conditions;
+      if (!quicftp::parse_link_conditions(argv[++i], conditions)) {
+        std::cerr << "Error: cannot parse link conditions: " << argv[i] << std::endl;
+        return 1;
+      }
+      if (arg != "--down") up_conditions = conditions;
+      if (arg != "--up") down_conditions = conditions;
+    } else if (arg == "--script" && i + 1 < argc) {
+      if (!load_script(argv[++i], steps)) {
+        return 1;
+      }
+    } else if (arg == "--report" && i + 1 < argc) {
+      report_seconds = std::atof(argv[++i]);
+    } else if (arg == "--json") {
+      json = true;
+    } else {
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (port < 1 || port > 65535) {
+    std::cerr << "Error: Port must be between 1 and 65535" << std::endl;
+    return 1;
+  }
+  sockaddr_storage server;
+  socklen_t server_len;
+  if (!resolve(server_address, server, server_len)) {
+    std::cerr << "Error: cannot resolve " << server_address << std::endl;
+    return 1;
+  }
+
+  // Dual-stack where there is IPv6, like the server
+  int listen_fd = socket(AF_INET6, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  sockaddr_storage local = {};
+  socklen_t local_len;
+  if (listen_fd >= 0) {
+    int zero = 0;
+    setsockopt(listen_fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+    auto& in6 = reinterpret_cast<sockaddr_in6&>(local);
+    in6.sin6_family = AF_INET6;
+    in6.sin6_addr = in6addr_any;
+    in6.sin6_port = htons(static_cast<uint16_t>(port));
+    local_len = sizeof(in6);
+  } else {
+    listen_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    auto& in = reinterpret_cast<sockaddr_in&>(local);
+    in.sin_family = AF_INET;
+    in.sin_addr.s_addr = htonl(INADDR_ANY);
+    in.sin_port = htons(static_cast<uint16_t>(port));
+    local_len = sizeof(in);
+  }
+  int size = kSocketBufferSize;
+  setsockopt(listen_fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+  setsockopt(listen_fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+  if (listen_fd < 0 || bind(listen_fd, reinterpret_cast<sockaddr*>(&local), local_len) < 0) {
+    std::cerr << "Error: cannot listen on port " << port << ": " << std::strerror(errno) << std::endl;
+    return 1;
+  }
+  int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+  std::signal(SIGINT, signal_handler);
+  std::signal(SIGTERM, signal_handler);
+
+  quicftp::LinkEmulator up(up_conditions);
+  quicftp::LinkEmulator down(down_conditions);
+  if (!json) {
+    std::cout << "Relaying port " << port << " to " << server_address << std::endl;
+    std::cout << "Up: " << quicftp::link_conditions_name(up_conditions) << std::endl;
+    std::cout << "Down: " << quicftp::link_conditions_name(down_conditions) << std::endl;
+  }
+
+  std::vector<RelayClient> clients;
+  std::map<std::string, size_t> client_index; // by address bytes
+  std::vector<uint8_t> buffer(kMaxDatagramSize);
+  std::vector<quicftp::LinkEmulator::Packet> released;
+  std::vector<pollfd> fds;
+  Clock::time_point start = Clock::now();
+  auto report_every = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(report_seconds));
+  Clock::time_point last_report = start;
+  size_t next_step = 0;
+
+  while (!g_stop) {
+    Clock::time_point now = Clock::now();
+    double elapsed = std::chrono::duration<double>(now - start).count();
+    while (next_step < steps.size() && steps[next_step].at <= elapsed) {
+      const ScriptStep& step = steps[next_step++];
+      if (step.end) {
+        g_stop = 1;
+        break;
+      }
+      if (step.up) up.set_conditions(step.conditions);
+      if (step.down) down.set_conditions(step.conditions);
+      if (!json) {
+        std::cout << "[" << std::fixed << std::setprecision(2) << std::setw(7) << elapsed << "s] "
+                  << (step.up && step.down ? "both" : step.up ? "up" : "down") << " now "
+                  << quicftp::link_conditions_name(step.conditions) << std::endl;
+      }
+    }
+    if (g_stop) break;
+
+    // Sleep until a packet is due, a report or a script step, or traffic
+    Clock::time_point deadline = std::min(up.next_due(), down.next_due());
+    if (report_seconds > 0) {
+      deadline = std::min(deadline, last_report + report_every);
+    }
+    if (next_step < steps.size()) {
+      deadline = std::min(deadline, start + std::chrono::duration_cast<Clock::duration>(
+                                                std::chrono::duration<double>(steps[next_step].at)));
+    }
+    int timeout = -1;
+    if (deadline <= now) {
+      timeout = 0;
+    } else if (deadline != Clock::time_point::max()) {
+      auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline.time_since_epoch()).count();
+      itimerspec spec = {};
+      spec.it_value.tv_sec = static_cast<time_t>(ns / 1000000000);
+      spec.it_value.tv_nsec = static_cast<long>(ns % 1000000000);
+      timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, nullptr);
+    }
+    fds.clear();
+    fds.push_back({listen_fd, POLLIN, 0});
+    fds.push_back({timer_fd, POLLIN, 0});
+    for (const RelayClient& client : clients) {
+      fds.push_back({client.fd, POLLIN, 0});
+    }
+    if (poll(fds.data(), fds.size(), timeout) < 0 && errno != EINTR) {
+      std::cerr << "Error: poll: " << std::strerror(errno) << std::endl;
+      break;
+    }
+    uint64_t expirations;
+    while (read(timer_fd, &expirations, sizeof(expirations)) > 0) {}
+    now = Clock::now();
+
+    // Clients towards the server, each from a socket of its own so the
+    // server tells them apart
+    if (fds[0].revents & POLLIN) {
+      while (true) {
+        sockaddr_storage from;
+        socklen_t from_len = sizeof(from);
+        ssize_t n = recvfrom(listen_fd, buffer.data(), buffer.size(), 0, reinterpret_cast<sockaddr*>(&from),
+                             &from_len);
+        if (n < 0) break;
+        std::string key(reinterpret_cast<const char*>(&from), from_len);
+        auto it = client_index.find(key);
+        if (it == client_index.end()) {
+          int fd = socket(server.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+          if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&server), server_len) < 0) {
+            if (fd >= 0) close(fd);
+            continue;
+          }
+          setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+          setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+          it = client_index.emplace(key, clients.size()).first;
+          clients.push_back(RelayClient{from, from_len, fd});
+        }
+        quicftp::LinkEmulator::Packet packet;
+        packet.data.assign(buffer.begin(), buffer.begin() + n);
+        packet.tag = it->second;
+        up.submit(now, std::move(packet));
+      }
+    }
+    // And the server's replies back
+    for (size_t i = 2; i < fds.size(); ++i) {
+      if (!(fds[i].revents & POLLIN)) continue;
+      const RelayClient& client = clients[i - 2];
+      while (true) {
+        ssize_t n = recv(client.fd, buffer.data(), buffer.size(), 0);
+        if (n < 0) break;
+        quicftp::LinkEmulator::Packet packet;
+        packet.data.assign(buffer.begin(), buffer.begin() + n);
+        packet.addr = client.addr;
+        packet.addr_len = client.addr_len;
+        down.submit(now, std::move(packet));
+      }
+    }
+
+    up.release(now, released);
+    for (const quicftp::LinkEmulator::Packet& packet : released) {
+      send(clients[packet.tag].fd, packet.data.data(), packet.data.size(), 0);
+    }
+    down.release(now, released);
+    for (const quicftp::LinkEmulator::Packet& packet : released) {
+      sendto(listen_fd, packet.data.data(), packet.data.size(), 0,
+             reinterpret_cast<const sockaddr*>(&packet.addr), packet.addr_len);
+    }
+
+    if (report_seconds > 0 && now - last_report >= report_every) {
+      double seconds = std::chrono::duration<double>(now - last_report).count();
+      double at = std::chrono::duration<double>(now - start).count();
+      report(at, "up", up, seconds, json);
+      report(at, "down", down, seconds, json);
+      last_report = now;
+    }
+  }
+
+  // What the whole run carried, averaged over it
+  Clock::time_point now = Clock::now();
+  if (report_seconds <= 0) {
+    double seconds = std::chrono::duration<double>(now - start).count();
+    report(seconds, "up", up, seconds, json);
+    report(seconds, "down", down, seconds, json);
+  }
+  if (!json) {
+    for (auto* link : {&up, &down}) {
+      quicftp::LinkEmulator::Stats stats = link->stats();
+      std::cout << (link == &up ? "Up" : "Down") << " total: " << stats.packets_in << " packets in, "
+                << stats.packets_out << " out, " << stats.bytes_out << " bytes" << std::endl;
+    }
+  }
+  for (const RelayClient& client : clients) {
+    close(client.fd);
+  }
+  close(timer_fd);
+  close(listen_fd);
+  return 0;
+}
@@ -7,19 +7,21 @@
 
 #include "quicftp_server.h"
 
-static quicftp::Server* g_server = nullptr;
+// Set by the signal handler; the main loop stops the server, as stopping
+// takes locks the interrupted thread may hold
+static volatile std::sig_atomic_t g_stop_signal = 0;
 
 void signal_handler(int signal) {
-  if (g_server != nullptr) {
-    std::cerr << "\nReceived signal " << signal << ", shutting down server..." << std::endl;
-    g_server->stop();
-    std::exit(0);
-  }
+  g_stop_signal = signal;
 }
 
 void print_usage(const char* program_name) {
   std::cerr << "Usage: " << program_name 
-            << " <port> <cert_path> <key_path> [root_dir] [--quiet]" << std::endl;
+            << " <port> <cert_path> <key_path> [root_dir] [--quiet] [--workers N]"
+            << " [--durability none|file|group] [--commit-window MS]"
+            << " [--limit-stream|--limit-connection|--limit-global RATE[:BURST]]"
+            << " [--transport bridge|udp] [--congestion newreno|cubic|bbr] [--fec off|auto|K|K:R]"
+            << " [--metrics [HOST:]PORT|unix:PATH]" << std::endl;
   std::cerr << std::endl;
   std::cerr << "Arguments:" << std::endl;
   std::cerr << "  port       - Port number to listen on" << std::endl;
@@ -27,6 +29,20 @@ void print_usage(const char* program_name) {
   std::cerr << "  key_path   - Path to server private key file" << std::endl;
   std::cerr << "  root_dir   - Root directory for file storage (default: current directory)" << std::endl;
   std::cerr << "  --quiet    - Disable verbose logging" << std::endl;
+  std::cerr << "  --workers  - Event loop threads serving connections, one per core (default: 1)" << std::endl;
+  std::cerr << "  --durability - Acknowledge uploads once renamed (none, default), once synced" << std::endl;
+  std::cerr << "                 to disk one by one (file), or synced in batches (group)" << std::endl;
+  std::cerr << "  --commit-window - Milliseconds a group commit waits for more uploads (default: 5)" << std::endl;
+  std::cerr << "  --limit-stream, --limit-connection, --limit-global - Cap downloads per file, per" << std::endl;
+  std::cerr << "                 client or in total, in bytes per second with optional K/M/G suffix" << std::endl;
+  std::cerr << "                 and burst size (e.g. 10M:256K; default: unlimited)" << std::endl;
+  std::cerr << "  --transport - Serve clients on this host over shared memory (bridge) or any" << std::endl;
+  std::cerr << "                 client over UDP on the port (udp) (default: $QUICFTP_TRANSPORT or bridge)" << std::endl;
+  std::cerr << "  --congestion - Congestion control for UDP clients (default: cubic)" << std::endl;
+  std::cerr << "  --fec      - Follow every K packets sent to UDP clients with R repair packets, or as" << std::endl;
+  std::cerr << "                 many as the loss seen calls for (auto: K = 32) (default: off)" << std::endl;
+  std::cerr << "  --metrics  - Serve Prometheus metrics at /metrics over HTTP on PORT (on 127.0.0.1" << std::endl;
+  std::cerr << "                 unless HOST is given) or on a Unix socket (default: off)" << std::endl;
   std::cerr << std::endl;
   std::cerr << "Example:" << std::endl;
   std::cerr << "  " << program_name << " 4433 server.crt server.key /var/quicftp" << std::endl;
@@ -44,12 +60,70 @@ int main(int argc, char *argv[]) {
   std::string key_path = argv[3];
   std::string root_dir = ".";
   bool verbose = true;
+  size_t workers = 1;
+  quicftp::Durability durability = quicftp::Durability::None;
+  int commit_window_ms = 5;
+  quicftp::RateLimits limits;
+  quicftp::TransportKind transport = quicftp::Transport::default_kind();
+  quicftp::CongestionAlgorithm congestion = quicftp::CongestionAlgorithm::Cubic;
+  quicftp::FecConfig fec;
+  std::string metrics_endpoint;
 
   // Parse optional arguments
   for (int i = 4; i < argc; i++) {
     std::string arg = argv[i];
     if (arg == "--quiet") {
       verbose = false;
+    } else if (arg == "--workers" && i + 1 < argc) {
+      int count = std::atoi(argv[++i]);
+      if (count < 1) {
+        std::cerr << "Error: --workers must be at least 1" << std::endl;
+        return 1;
+      }
+      workers = static_cast<size_t>(count);
+    } else if (arg == "--durability" && i + 1 < argc) {
+      std::string mode = argv[++i];
+      if (mode == "none") {
+        durability = quicftp::Durability::None;
+      } else if (mode == "file") {
+        durability = quicftp::Durability::File;
+      } else if (mode == "group") {
+        durability = quicftp::Durability::Group;
+      } else {
+        std::cerr << "Error: --durability must be none, file or group" << std::endl;
+        return 1;
+      }
+    } else if (arg == "--commit-window" && i + 1 < argc) {
+      commit_window_ms = std::atoi(argv[++i]);
+      if (commit_window_ms < 0) {
+        std::cerr << "Error: --commit-window must not be negative" << std::endl;
+        return 1;
+      }
+    } else if ((arg == "--limit-stream" || arg == "--limit-connection" || arg == "--limit-global") &&
+               i + 1 < argc) {
+      quicftp::RateLimit& limit = (arg == "--limit-stream") ? limits.stream
+                                : (arg == "--limit-connection") ? limits.connection : limits.global;
+      if (!quicftp::parse_rate_limit(argv[++i], limit)) {
+        std::cerr << "Error: " << arg << " expects RATE[:BURST]" << std::endl;
+        return 1;
+      }
+    } else if (arg == "--transport" && i + 1 < argc) {
+      if (!quicftp::parse_transport_kind(argv[++i], transport)) {
+        std::cerr << "Error: --transport must be bridge or udp" << std::endl;
+        return 1;
+      }
+    } else if (arg == "--congestion" && i + 1 < argc) {
+      if (!quicftp::parse_congestion_algorithm(argv[++i], congestion)) {
+        std::cerr << "Error: --congestion must be newreno, cubic or bbr" << std::endl;
+        return 1;
+      }
+    } else if (arg == "--fec" && i + 1 < argc) {
+      if (!quicftp::parse_fec_config(argv[++i], fec)) {
+        std::cerr << "Error: --fec must be off, auto, K or K:R with K and R from 1 to 128" << std::endl;
+        return 1;
+      }
+    } else if (arg == "--metrics" && i + 1 < argc) {
+      metrics_endpoint = argv[++i];
     } else if (root_dir == "." && arg[0] != '-') {
       // First non-flag argument after required args is root_dir
       root_dir = arg;
@@ -64,10 +138,16 @@ int main(int argc, char *argv[]) {
 
   // Create and configure server
   quicftp::Server server;
-  g_server = &server; // For signal handler
 
   server.set_verbose(verbose);
   server.set_root_directory(root_dir);
+  server.set_worker_count(workers);
+  server.set_durability(durability, commit_window_ms);
+  server.set_rate_limits(limits);
+  server.set_transport(transport);
+  server.set_congestion_control(congestion);
+  server.set_fec(fec);
+  server.set_metrics_endpoint(metrics_endpoint);
 
   // Set up signal handlers for graceful shutdown
   std::signal(SIGINT, signal_handler);
@@ -92,9 +172,13 @@ int main(int argc, char *argv[]) {
   std::cout << std::endl;
 
   // Main event loop - process QUIC events
-  while (server.is_running()) {
+  while (server.is_running() && g_stop_signal == 0) {
     server.process_events(100); // Process events with 100ms timeout
   }
+  if (g_stop_signal != 0) {
+    std::cerr << "\nReceived signal " << g_stop_signal << ", shutting down server..." << std::endl;
+    server.stop();
+  }
 
   return 0;
 }
@@ -0,0 +1,287 @@
+// range_journal.cc
+
+#include "range_journal.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace quicftp {
+
+namespace {
+
+constexpr uint32_t kJournalMagic = 0x4a524651; // "QFRJ"
+constexpr uint32_t kJournalVersion = 1;
+
+// Rewrite the file once it holds this many records and mostly redundant ones
+constexpr size_t kCompactThreshold = 1024;
+
+struct JournalHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t total_size;
+};
+
+struct JournalRecord {
+  uint64_t offset;
+  uint64_t length;
+};
+
+bool write_fully(int fd, const void* data, size_t len) {
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  while (len > 0) {
+    ssize_t n = ::write(fd, bytes, len);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    bytes += n;
+    len -= static_cast<size_t>(n);
+  }
+  return true;
+}
+
+} // namespace
+
+RangeJournal::RangeJournal()
+  : fd_(-1)
+  , dir_fd_(AT_FDCWD)
+  , total_size_(0)
+  , covered_(0)
+  , records_(0)
+{
+}
+
+RangeJournal::~RangeJournal() {
+  close();
+}
+
+bool RangeJournal::load(const std::string& path, int dir_fd) {
+  close();
+  ranges_.clear();
+  covered_ = 0;
+  records_ = 0;
+  total_size_ = 0;
+  dir_fd_ = dir_fd;
+  path_ = path;
+
+  int fd = openat(dir_fd_, path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    set_error("cannot open " + path, errno);
+    return false;
+  }
+
+  JournalHeader header;
+  if (pread(fd, &header, sizeof(header), 0) != static_cast<ssize_t>(sizeof(header)) ||
+      header.magic != kJournalMagic || header.version != kJournalVersion) {
+    ::close(fd);
+    set_error("not a range journal: " + path);
+    return false;
+  }
+  total_size_ = header.total_size;
+
+  // A torn final record from a crash is simply not counted
+  std::vector<JournalRecord> records(4096);
+  off_t pos = sizeof(header);
+  while (true) {
+    ssize_t n = pread(fd, records.data(), records.size() * sizeof(JournalRecord), pos);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    size_t count = static_cast<size_t>(n) / sizeof(JournalRecord);
+    for (size_t i = 0; i < count; ++i) {
+      const JournalRecord& record = records[i];
+      if (record.offset <= total_size_ && record.length <= total_size_ - record.offset) {
+        insert(record.offset, record.offset + record.length);
+      }
+    }
+    records_ += count;
+    if (count < records.size()) break;
+    pos += static_cast<off_t>(count * sizeof(JournalRecord));
+  }
+  ::close(fd);
+  return true;
+}
+
+bool RangeJournal::open(const std::string& path, uint64_t total_size, bool keep_existing, int dir_fd) {
+  bool kept = keep_existing && load(path, dir_fd) && total_size_ == total_size;
+  if (!kept) {
+    ranges_.clear();
+    covered_ = 0;
+    total_size_ = total_size;
+  }
+  dir_fd_ = dir_fd;
+  path_ = path;
+  error_.clear();
+
+  // Start from a clean, merged file; this also drops any torn tail
+  return rewrite();
+}
+
+bool RangeJournal::add(uint64_t offset, uint64_t length) {
+  if (fd_ < 0) {
+    set_error("journal is not open");
+    return false;
+  }
+  if (length == 0) {
+    return true;
+  }
+  if (offset > total_size_ || length > total_size_ - offset) {
+    set_error("range outside file");
+    return false;
+  }
+
+  JournalRecord record{offset, length};
+  if (!write_fully(fd_, &record, sizeof(record))) {
+    set_error("cannot append to " + path_, errno);
+    return false;
+  }
+  insert(offset, offset + length);
+  records_++;
+
+  if (records_ > kCompactThreshold && records_ > 4 * ranges_.size()) {
+    return rewrite();
+  }
+  return true;
+}
+
+bool RangeJournal::sync() {
+  if (fd_ < 0) {
+    set_error("journal is not open");
+    return false;
+  }
+  if (fdatasync(fd_) != 0) {
+    set_error("cannot sync " + path_, errno);
+    return false;
+  }
+  return true;
+}
+
+void RangeJournal::close() {
+  if (fd_ >= 0) {
+    ::close(fd_);
+    fd_ = -1;
+  }
+}
+
+void RangeJournal::remove() {
+  close();
+  if (!path_.empty()) {
+    unlinkat(dir_fd_, path_.c_str(), 0);
+  }
+  ranges_.clear();
+  covered_ = 0;
+  records_ = 0;
+}
+
+bool RangeJournal::is_open() const {
+  return fd_ >= 0;
+}
+
+uint64_t RangeJournal::total_size() const {
+  return total_size_;
+}
+
+uint64_t RangeJournal::bytes_covered() const {
+  return covered_;
+}
+
+bool RangeJournal::complete() const {
+  return covered_ == total_size_;
+}
+
+std::vector<std::pair<uint64_t, uint64_t>> RangeJournal::missing() const {
+  std::vector<std::pair<uint64_t, uint64_t>> gaps;
+  uint64_t pos = 0;
+  for (const auto& [start, end] : ranges_) {
+    if (start > pos) {
+      gaps.emplace_back(pos, start - pos);
+    }
+    pos = end;
+  }
+  if (pos < total_size_) {
+    gaps.emplace_back(pos, total_size_ - pos);
+  }
+  return gaps;
+}
+
+const std::string& RangeJournal::error() const {
+  return error_;
+}
+
+void RangeJournal::insert(uint64_t start, uint64_t end) {
+  if (start >= end) return;
+
+  // Absorb every range that overlaps or touches [start, end)
+  auto it = ranges_.upper_bound(start);
+  if (it != ranges_.begin()) {
+    auto prev = std::prev(it);
+    if (prev->second >= start) {
+      start = prev->first;
+      end = std::max(end, prev->second);
+      covered_ -= prev->second - prev->first;
+      it = ranges_.erase(prev);
+    }
+  }
+  while (it != ranges_.end() && it->first <= end) {
+    end = std::max(end, it->second);
+    covered_ -= it->second - it->first;
+    it = ranges_.erase(it);
+  }
+  ranges_[start] = end;
+  covered_ += end - start;
+}
+
+bool RangeJournal::rewrite() {
+  close();
+
+  std::vector<uint8_t> contents(sizeof(JournalHeader) + ranges_.size() * sizeof(JournalRecord));
+  JournalHeader header{kJournalMagic, kJournalVersion, total_size_};
+  std::memcpy(contents.data(), &header, sizeof(header));
+  size_t pos = sizeof(header);
+  for (const auto& [start, end] : ranges_) {
+    JournalRecord record{start, end - start};
+    std::memcpy(contents.data() + pos, &record, sizeof(record));
+    pos += sizeof(record);
+  }
+
+  // Replace atomically so a crash leaves either the old or the new journal
+  std::string temp_path = path_ + ".tmp";
+  int fd = openat(dir_fd_, temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    set_error("cannot create " + temp_path, errno);
+    return false;
+  }
+  if (!write_fully(fd, contents.data(), contents.size())) {
+    set_error("cannot write " + temp_path, errno);
+    ::close(fd);
+    unlinkat(dir_fd_, temp_path.c_str(), 0);
+    return false;
+  }
+  ::close(fd);
+  if (renameat(dir_fd_, temp_path.c_str(), dir_fd_, path_.c_str()) != 0) {
+    set_error("cannot rename onto " + path_, errno);
+    unlinkat(dir_fd_, temp_path.c_str(), 0);
+    return false;
+  }
+  records_ = ranges_.size();
+
+  fd_ = openat(dir_fd_, path_.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+  if (fd_ < 0) {
+    set_error("cannot open " + path_, errno);
+    return false;
+  }
+  return true;
+}
+
+void RangeJournal::set_error(const std::string& what, int err) {
+  error_ = what;
+  if (err != 0) {
+    error_ += ": ";
+    error_ += std::strerror(err);
+  }
+}
+
+} // namespace quicftp
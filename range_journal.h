@@ -0,0 +1,78 @@
+// range_journal.h
+// Persistent record of which byte ranges of a file have arrived
+// Lets an interrupted transfer resume by asking only for what is missing.
+// On disk it is a small header carrying the expected file size followed by
+// appended (offset, length) records; it is rewritten in merged form when the
+// records pile up.
+
+#ifndef RANGE_JOURNAL_H
+#define RANGE_JOURNAL_H
+
+#include <string>
+#include <map>
+#include <vector>
+#include <utility>
+#include <cstddef>
+#include <cstdint>
+#include <fcntl.h>
+
+namespace quicftp {
+
+class RangeJournal {
+public:
+  RangeJournal();
+  ~RangeJournal();
+
+  RangeJournal(const RangeJournal&) = delete;
+  RangeJournal& operator=(const RangeJournal&) = delete;
+
+  // Read the journal at path (relative to dir_fd) without opening it for
+  // writing; false if it does not exist or is not a journal
+  bool load(const std::string& path, int dir_fd = AT_FDCWD);
+
+  // Open path for recording ranges of a total_size byte file. Ranges already
+  // in the journal are kept if keep_existing is set and they were recorded
+  // for the same size; otherwise the journal starts out empty. dir_fd must
+  // stay open while the journal is.
+  bool open(const std::string& path, uint64_t total_size, bool keep_existing = true, int dir_fd = AT_FDCWD);
+
+  // Record that [offset, offset + length) has been written
+  bool add(uint64_t offset, uint64_t length);
+
+  // Flush recorded ranges to stable storage
+  bool sync();
+
+  void close();
+
+  // Close and delete the journal file
+  void remove();
+
+  bool is_open() const;
+  uint64_t total_size() const;
+  uint64_t bytes_covered() const;
+  bool complete() const;
+
+  // Gaps still to be filled, as (offset, length) pairs in file order
+  std::vector<std::pair<uint64_t, uint64_t>> missing() const;
+
+  // Description of the last failure
+  const std::string& error() const;
+
+private:
+  int fd_;
+  int dir_fd_;
+  std::string path_;
+  uint64_t total_size_;
+  std::map<uint64_t, uint64_t> ranges_; // start -> end, merged, non-adjacent
+  uint64_t covered_;
+  size_t records_;                      // records in the file, merged or not
+  std::string error_;
+
+  void insert(uint64_t start, uint64_t end);
+  bool rewrite();
+  void set_error(const std::string& what, int err = 0);
+};
+
+} // namespace quicftp
+
+#endif
@@ -0,0 +1,175 @@
+// rate_limiter.cc
+
+#include "rate_limiter.h"
+#include <algorithm>
+#include <cstdlib>
+#include <thread>
+
+namespace quicftp {
+
+namespace {
+
+// Burst allowed when none is configured, as time at the full rate
+constexpr double kDefaultBurstSeconds = 0.02;
+
+// Waiting senders look for limit changes this often
+constexpr auto kRecheckInterval = std::chrono::milliseconds(50);
+
+bool parse_size(const std::string& text, uint64_t& value) {
+  if (text.empty()) {
+    return false;
+  }
+  char* end = nullptr;
+  unsigned long long number = std::strtoull(text.c_str(), &end, 10);
+  if (end == text.c_str() || text[0] == '-') {
+    return false;
+  }
+  uint64_t scale = 1;
+  std::string suffix(end);
+  if (suffix == "K" || suffix == "k") {
+    scale = 1024;
+  } else if (suffix == "M" || suffix == "m") {
+    scale = 1024 * 1024;
+  } else if (suffix == "G" || suffix == "g") {
+    scale = 1024 * 1024 * 1024;
+  } else if (!suffix.empty()) {
+    return false;
+  }
+  value = static_cast<uint64_t>(number) * scale;
+  return true;
+}
+
+} // namespace
+
+TokenBucket::TokenBucket(const RateLimit& limit)
+  : capacity_(0.0)
+  , tokens_(0.0)
+  , filled_at_(Clock::now())
+  , limited_(false)
+  , generation_(0)
+{
+  set_limit(limit);
+}
+
+void TokenBucket::set_limit(const RateLimit& limit) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  limit_ = limit;
+  double rate = static_cast<double>(limit.bytes_per_second);
+  capacity_ = limit.burst > 0 ? static_cast<double>(limit.burst) : rate * kDefaultBurstSeconds;
+  // Debt run up at the old rate is forgiven; waiting senders reserve again
+  tokens_ = std::max(0.0, std::min(tokens_, capacity_));
+  filled_at_ = Clock::now();
+  limited_.store(limit.bytes_per_second > 0, std::memory_order_release);
+  generation_.fetch_add(1, std::memory_order_release);
+}
+
+RateLimit TokenBucket::limit() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return limit_;
+}
+
+bool TokenBucket::limited() const {
+  return limited_.load(std::memory_order_acquire);
+}
+
+TokenBucket::Clock::time_point TokenBucket::reserve(size_t bytes, Clock::time_point now) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (limit_.bytes_per_second == 0) {
+    return now;
+  }
+  double rate = static_cast<double>(limit_.bytes_per_second);
+  if (now > filled_at_) {
+    tokens_ = std::min(capacity_, tokens_ + rate * std::chrono::duration<double>(now - filled_at_).count());
+    filled_at_ = now;
+  }
+  tokens_ -= static_cast<double>(bytes);
+  if (tokens_ >= 0.0) {
+    return now;
+  }
+  return filled_at_ + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(-tokens_ / rate));
+}
+
+void TokenBucket::refund(size_t bytes) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  tokens_ = std::min(capacity_, tokens_ + static_cast<double>(bytes));
+}
+
+uint64_t TokenBucket::generation() const {
+  return generation_.load(std::memory_order_acquire);
+}
+
+TokenBucket& TokenBucket::global() {
+  static TokenBucket bucket;
+  return bucket;
+}
+
+Reservation::Reservation(size_t bytes, TokenBucket* stream, TokenBucket* connection, Clock::time_point now)
+  : bytes_(bytes)
+  , buckets_{stream, connection, &TokenBucket::global()}
+  , generations_{}
+  , reserved_{}
+{
+  reserve(now);
+}
+
+bool Reservation::ready(Clock::time_point now) {
+  bool changed = false;
+  for (size_t i = 0; i < kLevels; ++i) {
+    changed = changed || (buckets_[i] && (reserved_[i] ? buckets_[i]->generation() != generations_[i]
+                                                       : buckets_[i]->limited()));
+  }
+  if (changed) {
+    for (size_t i = 0; i < kLevels; ++i) {
+      if (reserved_[i]) {
+        buckets_[i]->refund(bytes_);
+      }
+    }
+    reserve(now);
+  }
+  return now >= ready_at_;
+}
+
+Reservation::Clock::time_point Reservation::recheck_at(Clock::time_point now) const {
+  // Look again in slices, so a limit raised meanwhile is not waited out
+  return std::min(ready_at_, now + kRecheckInterval);
+}
+
+void Reservation::reserve(Clock::time_point now) {
+  ready_at_ = now;
+  for (size_t i = 0; i < kLevels; ++i) {
+    reserved_[i] = buckets_[i] && buckets_[i]->limited();
+    if (reserved_[i]) {
+      generations_[i] = buckets_[i]->generation();
+      ready_at_ = std::max(ready_at_, buckets_[i]->reserve(bytes_, now));
+    }
+  }
+}
+
+bool throttle(size_t bytes, TokenBucket* stream, TokenBucket* connection, const std::atomic<bool>* cancelled) {
+  Reservation reservation(bytes, stream, connection, TokenBucket::Clock::now());
+  while (true) {
+    TokenBucket::Clock::time_point now = TokenBucket::Clock::now();
+    if (reservation.ready(now)) {
+      return true;
+    }
+    if (cancelled && cancelled->load()) {
+      return false;
+    }
+    std::this_thread::sleep_until(reservation.recheck_at(now));
+  }
+}
+
+bool parse_rate_limit(const std::string& text, RateLimit& limit) {
+  size_t colon = text.find(':');
+  RateLimit parsed;
+  if (!parse_size(text.substr(0, colon), parsed.bytes_per_second)) {
+    return false;
+  }
+  if (colon != std::string::npos && !parse_size(text.substr(colon + 1), parsed.burst)) {
+    return false;
+  }
+  limit = parsed;
+  return true;
+}
+
+} // namespace quicftp
@@ -0,0 +1,109 @@
+// rate_limiter.h
+// Bandwidth limits as token buckets
+// A bucket fills at its rate up to its burst size, and senders draw on it
+// before each frame. A sender that finds it short goes into debt and sleeps
+// until the debt is repaid, so frames leave evenly spaced instead of in
+// bursts followed by stalls. Buckets stack: a frame is paced by its stream's,
+// its connection's and the process-wide bucket at once, whichever is slowest.
+
+#ifndef RATE_LIMITER_H
+#define RATE_LIMITER_H
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+namespace quicftp {
+
+struct RateLimit {
+  uint64_t bytes_per_second = 0; // 0 for unlimited
+  uint64_t burst = 0;            // bytes that may go at once; 0 for 20ms worth
+};
+
+// Limits at each level of the hierarchy
+struct RateLimits {
+  RateLimit stream;     // each transfer
+  RateLimit connection; // all transfers of one connection
+  RateLimit global;     // everything this process sends
+};
+
+class TokenBucket {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  explicit TokenBucket(const RateLimit& limit = RateLimit());
+
+  TokenBucket(const TokenBucket&) = delete;
+  TokenBucket& operator=(const TokenBucket&) = delete;
+
+  // Takes effect at once, even for senders already waiting
+  void set_limit(const RateLimit& limit);
+  RateLimit limit() const;
+  bool limited() const;
+
+  // Take bytes out of the bucket, returning when it will have covered them
+  Clock::time_point reserve(size_t bytes, Clock::time_point now);
+  // Return bytes reserved but not sent
+  void refund(size_t bytes);
+  // Changes whenever the limit does
+  uint64_t generation() const;
+
+  // The process-wide bucket
+  static TokenBucket& global();
+
+private:
+  mutable std::mutex mutex_;
+  RateLimit limit_;
+  double capacity_;  // bytes
+  double tokens_;    // negative while in debt
+  Clock::time_point filled_at_;
+  std::atomic<bool> limited_;
+  std::atomic<uint64_t> generation_;
+};
+
+// Bytes taken out of stream, connection (either may be null) and the
+// process-wide bucket, for senders that must not sleep until they may go
+class Reservation {
+public:
+  using Clock = TokenBucket::Clock;
+
+  Reservation(size_t bytes, TokenBucket* stream, TokenBucket* connection, Clock::time_point now);
+
+  Reservation(const Reservation&) = delete;
+  Reservation& operator=(const Reservation&) = delete;
+
+  // Whether the bytes may be sent at now. If a limit changed since they were
+  // reserved, they are reserved again under the new one.
+  bool ready(Clock::time_point now);
+
+  // When to ask again: once the bytes are covered, or sooner to notice a
+  // change of limit
+  Clock::time_point recheck_at(Clock::time_point now) const;
+
+private:
+  static constexpr size_t kLevels = 3;
+
+  size_t bytes_;
+  TokenBucket* buckets_[kLevels];
+  uint64_t generations_[kLevels];
+  bool reserved_[kLevels];
+  Clock::time_point ready_at_;
+
+  void reserve(Clock::time_point now);
+};
+
+// Wait until bytes may be sent under stream, connection (either may be null)
+// and the process-wide bucket; false if cancelled is set meanwhile
+bool throttle(size_t bytes, TokenBucket* stream, TokenBucket* connection,
+              const std::atomic<bool>* cancelled = nullptr);
+
+// Parse "RATE[:BURST]" in bytes, each with an optional K, M or G suffix
+// (powers of 1024); RATE is per second and 0 means unlimited
+bool parse_rate_limit(const std::string& text, RateLimit& limit);
+
+} // namespace quicftp
+
+#endif
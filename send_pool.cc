@@ -0,0 +1,93 @@
+// send_pool.cc
+
+#include "send_pool.h"
+#include <algorithm>
+#include <utility>
+
+namespace quicftp {
+
+SendPool::SendPool(size_t threads)
+  : running_(0)
+  , draining_(false)
+  , stopping_(false)
+{
+  threads = std::max<size_t>(threads, 1);
+  for (size_t i = 0; i < threads; ++i) {
+    threads_.emplace_back([this]() { run(); });
+  }
+}
+
+SendPool::~SendPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  cv_.notify_all();
+  for (std::thread& thread : threads_) {
+    thread.join();
+  }
+}
+
+void SendPool::add(Step step) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ready_.push_back(std::move(step));
+  }
+  cv_.notify_one();
+}
+
+void SendPool::drain() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  draining_ = true;
+  cv_.notify_all();
+  cv_.wait(lock, [this]() { return ready_.empty() && deferred_.empty() && running_ == 0; });
+  draining_ = false;
+}
+
+size_t SendPool::thread_count() const {
+  return threads_.size();
+}
+
+void SendPool::run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stopping_) {
+    // Deferred sends whose time has come rejoin the queue
+    Clock::time_point now = Clock::now();
+    while (!deferred_.empty() && (draining_ || deferred_.begin()->first <= now)) {
+      ready_.push_back(std::move(deferred_.begin()->second));
+      deferred_.erase(deferred_.begin());
+    }
+    if (ready_.empty()) {
+      if (deferred_.empty()) {
+        cv_.wait(lock);
+      } else {
+        cv_.wait_until(lock, deferred_.begin()->first);
+      }
+      continue;
+    }
+
+    Step step = std::move(ready_.front());
+    ready_.pop_front();
+    running_++;
+    lock.unlock();
+    Clock::time_point not_before;
+    bool more = step(not_before);
+    lock.lock();
+    running_--;
+
+    if (more && not_before > Clock::now()) {
+      // Threads waiting for a later deferral must wake up for this one
+      bool earliest = deferred_.empty() || not_before < deferred_.begin()->first;
+      deferred_.emplace(not_before, std::move(step));
+      if (earliest) {
+        cv_.notify_all();
+      }
+    } else if (more) {
+      ready_.push_back(std::move(step));
+    } else if (ready_.empty() && deferred_.empty() && running_ == 0) {
+      cv_.notify_all(); // for drain()
+    }
+  }
+}
+
+} // namespace quicftp
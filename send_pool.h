@@ -0,0 +1,63 @@
+// send_pool.h
+// A fixed set of threads taking turns on long-running sends
+// A send is a step that does one slice of its work per call and says whether
+// it has more. A send with more goes to the back of the queue, or, when a
+// rate limit holds it back, waits aside until the time it names. No thread
+// sleeps on behalf of a single send, so a few threads carry any number of
+// them.
+
+#ifndef SEND_POOL_H
+#define SEND_POOL_H
+
+#include <deque>
+#include <map>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+#include <chrono>
+#include <cstddef>
+
+namespace quicftp {
+
+class SendPool {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  // Send the next slice; false once the send is over. Setting not_before
+  // defers the next slice until then.
+  using Step = std::function<bool(Clock::time_point& not_before)>;
+
+  explicit SendPool(size_t threads);
+
+  // Sends not over yet are dropped; drain() first to finish them
+  ~SendPool();
+
+  SendPool(const SendPool&) = delete;
+  SendPool& operator=(const SendPool&) = delete;
+
+  void add(Step step);
+
+  // Run every send to its end, without waiting out deferrals. For once the
+  // sends have been told to stop, as it spins on any that keep deferring.
+  void drain();
+
+  size_t thread_count() const;
+
+private:
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<Step> ready_;
+  std::multimap<Clock::time_point, Step> deferred_;
+  size_t running_;
+  bool draining_;
+  bool stopping_;
+  std::vector<std::thread> threads_;
+
+  void run();
+};
+
+} // namespace quicftp
+
+#endif
@@ -0,0 +1,197 @@
+// send_scheduler.cc
+
+#include "send_scheduler.h"
+#include "quic_common.h"
+#include <algorithm>
+
+namespace quicftp {
+
+namespace {
+
+// Interactive, normal, background; lower classes wait for higher ones
+constexpr size_t kClassCount = 3;
+
+// A flow with allowance left keeps the turn this long after a frame while its
+// sender prepares the next one, or deficits would never span frames. Lower
+// classes likewise wait this long after a higher class's last frame.
+constexpr auto kTurnGrace = std::chrono::microseconds(500);
+
+size_t class_of(int priority) {
+  if (priority >= kPriorityInteractive) return 0;
+  return priority > kPriorityBackground ? 1 : 2;
+}
+
+uint64_t weight_of(int priority) {
+  if (priority >= kPriorityInteractive) return static_cast<uint64_t>(priority - kPriorityInteractive + 1);
+  return priority > kPriorityBackground ? static_cast<uint64_t>(priority) : 1;
+}
+
+} // namespace
+
+SendScheduler::SendScheduler(size_t quantum)
+  : quantum_(std::max<size_t>(quantum, 1))
+  , classes_(kClassCount)
+  , busy_(false)
+  , granted_(0)
+  , hold_until_(Clock::time_point::max())
+{
+}
+
+void SendScheduler::open_flow(uint64_t flow, int priority) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  add(flow, priority);
+}
+
+void SendScheduler::close_flow(uint64_t flow) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    remove(flow);
+    dispatch();
+  }
+  cv_.notify_all();
+}
+
+void SendScheduler::wait_turn(uint64_t flow, size_t bytes) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto it = flows_.find(flow);
+  Flow& waiter = (it != flows_.end()) ? it->second : add(flow, kPriorityNormal);
+  waiter.waiting = true;
+  waiter.want = bytes;
+  classes_[waiter.cls].waiting++;
+  dispatch();
+
+  while (!(busy_ && granted_ == flow)) {
+    if (flows_.count(flow) == 0) {
+      return; // closed meanwhile; the send fails on its own
+    }
+    if (hold_until_ != Clock::time_point::max()) {
+      cv_.wait_until(lock, hold_until_);
+      dispatch();
+    } else {
+      cv_.wait(lock);
+    }
+  }
+}
+
+void SendScheduler::done(uint64_t flow) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!busy_ || granted_ != flow) {
+      return;
+    }
+    busy_ = false;
+    auto it = flows_.find(flow);
+    if (it != flows_.end()) {
+      it->second.last_done = Clock::now();
+      classes_[it->second.cls].last_done = it->second.last_done;
+    }
+    dispatch();
+  }
+  // Waiters learn of a new grant, or of a hold to time out on
+  cv_.notify_all();
+}
+
+SendScheduler::Flow& SendScheduler::add(uint64_t flow, int priority) {
+  priority = std::clamp(priority, kPriorityBackground, kPriorityMax);
+  size_t cls = class_of(priority);
+  auto it = flows_.find(flow);
+  if (it != flows_.end()) {
+    if (it->second.cls == cls) {
+      it->second.weight = weight_of(priority);
+      return it->second;
+    }
+    Flow old = it->second;
+    remove(flow);
+    Flow& moved = add(flow, priority);
+    moved.waiting = old.waiting;
+    moved.want = old.want;
+    if (moved.waiting) {
+      classes_[cls].waiting++;
+    }
+    return moved;
+  }
+
+  Flow& added = flows_[flow];
+  added.cls = cls;
+  added.weight = weight_of(priority);
+  classes_[cls].ring.push_back(flow);
+  return added;
+}
+
+void SendScheduler::remove(uint64_t flow) {
+  auto it = flows_.find(flow);
+  if (it == flows_.end()) {
+    return;
+  }
+  Class& cls = classes_[it->second.cls];
+  if (it->second.waiting) {
+    cls.waiting--;
+  }
+  flows_.erase(it);
+
+  size_t index = std::find(cls.ring.begin(), cls.ring.end(), flow) - cls.ring.begin();
+  cls.ring.erase(cls.ring.begin() + index);
+  if (cls.ring.empty()) {
+    cls.cursor = 0;
+  } else if (index <= cls.cursor) {
+    // Step back so the next flow is visited, and topped up, normally
+    cls.cursor = (cls.cursor + cls.ring.size() - 1) % cls.ring.size();
+  }
+}
+
+void SendScheduler::dispatch() {
+  if (busy_) {
+    return;
+  }
+  Clock::time_point now = Clock::now();
+  hold_until_ = Clock::time_point::max();
+  for (Class& cls : classes_) {
+    uint64_t chosen;
+    if (pick(cls, now, chosen)) {
+      Flow& flow = flows_[chosen];
+      flow.waiting = false;
+      flow.deficit -= flow.want;
+      cls.waiting--;
+      busy_ = true;
+      granted_ = chosen;
+      cv_.notify_all();
+      return;
+    }
+    if (hold_until_ != Clock::time_point::max()) {
+      return; // lower classes wait for this one's flow too
+    }
+  }
+}
+
+bool SendScheduler::pick(Class& cls, Clock::time_point now, uint64_t& chosen) {
+  if (cls.ring.empty()) {
+    return false;
+  }
+  if (cls.waiting == 0) {
+    if (now < cls.last_done + kTurnGrace) {
+      hold_until_ = cls.last_done + kTurnGrace;
+    }
+    return false;
+  }
+  while (true) {
+    Flow& current = flows_[cls.ring[cls.cursor]];
+    if (current.waiting && current.deficit >= current.want) {
+      chosen = cls.ring[cls.cursor];
+      return true;
+    }
+    if (!current.waiting && current.deficit > 0 && now < current.last_done + kTurnGrace) {
+      hold_until_ = current.last_done + kTurnGrace;
+      return false;
+    }
+    if (!current.waiting) {
+      current.deficit = 0; // idle flows bank nothing
+    }
+    cls.cursor = (cls.cursor + 1) % cls.ring.size();
+    Flow& next = flows_[cls.ring[cls.cursor]];
+    if (next.waiting) {
+      next.deficit += quantum_ * next.weight;
+    }
+  }
+}
+
+} // namespace quicftp
@@ -0,0 +1,84 @@
+// send_scheduler.h
+// Decides which of a connection's concurrent flows sends the next frame
+// A flow is the outgoing data of one request. Its sender asks for a turn
+// before each frame, and one frame is sent at a time. Priorities map to three
+// strict classes: interactive (kPriorityInteractive and up) goes before
+// everything, background (kPriorityBackground) only when nothing else is
+// waiting, and normal is everything in between. Within a class, flows take
+// turns by deficit round robin. Each visit tops up a flow's allowance by a
+// quantum scaled by its weight, and the flow keeps the turn while the
+// allowance covers its frames. A small file on an interactive flow therefore
+// never queues behind a bulk transfer on the same connection.
+
+#ifndef SEND_SCHEDULER_H
+#define SEND_SCHEDULER_H
+
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace quicftp {
+
+class SendScheduler {
+public:
+  // Each turn a flow of weight w may send quantum * w bytes
+  explicit SendScheduler(size_t quantum = 64 * 1024);
+
+  SendScheduler(const SendScheduler&) = delete;
+  SendScheduler& operator=(const SendScheduler&) = delete;
+
+  // Start scheduling flow at priority (or move it there)
+  void open_flow(uint64_t flow, int priority);
+
+  // Stop scheduling flow; it sends nothing more
+  void close_flow(uint64_t flow);
+
+  // Block until flow may send a frame of bytes, then call done() once it is
+  // sent. Flows not opened yet are opened at kPriorityNormal.
+  void wait_turn(uint64_t flow, size_t bytes);
+  void done(uint64_t flow);
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  struct Flow {
+    size_t cls = 0;
+    uint64_t weight = 1;
+    uint64_t deficit = 0;       // bytes it may still send this turn
+    size_t want = 0;            // size of the frame it is waiting to send
+    bool waiting = false;
+    Clock::time_point last_done;
+  };
+
+  struct Class {
+    std::vector<uint64_t> ring; // flows in round robin order
+    size_t cursor = 0;          // whose turn it is
+    size_t waiting = 0;
+    Clock::time_point last_done;
+  };
+
+  size_t quantum_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::unordered_map<uint64_t, Flow> flows_;
+  std::vector<Class> classes_;
+  bool busy_;                   // a granted frame is being sent
+  uint64_t granted_;
+  Clock::time_point hold_until_;
+
+  Flow& add(uint64_t flow, int priority);
+  void remove(uint64_t flow);
+  // Grant the next turn if nobody holds one
+  void dispatch();
+  // Next flow of cls by deficit round robin. False if none is waiting, or if
+  // the turn is held for a flow that is preparing its next frame.
+  bool pick(Class& cls, Clock::time_point now, uint64_t& chosen);
+};
+
+} // namespace quicftp
+
+#endif
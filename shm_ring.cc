@@ -0,0 +1,351 @@
+// shm_ring.cc
+
+#include "shm_ring.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <csignal>
+#include <linux/futex.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace quicftp {
+
+namespace {
+
+constexpr uint32_t kRingMagic = 0x51465242; // "QFRB"
+constexpr uint32_t kRingVersion = 2;
+constexpr size_t kRecordAlign = 8;
+constexpr size_t kLengthPrefix = sizeof(uint32_t);
+
+// How often a producer waiting for the lock checks that its holder is alive
+constexpr int kOwnerCheckMs = 100;
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free, "futex words must be lock-free");
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "ring indices must be lock-free");
+
+// The ring is shared between processes, so the futex calls must not use
+// FUTEX_PRIVATE_FLAG
+long futex_wait(std::atomic<uint32_t>* addr, uint32_t expected, int timeout_ms) {
+  struct timespec ts;
+  struct timespec* tsp = nullptr;
+  if (timeout_ms >= 0) {
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = static_cast<long>(timeout_ms % 1000) * 1000000L;
+    tsp = &ts;
+  }
+  return syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr), FUTEX_WAIT, expected, tsp, nullptr, 0);
+}
+
+void futex_wake(std::atomic<uint32_t>* addr, int count) {
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr), FUTEX_WAKE, count, nullptr, nullptr, 0);
+}
+
+size_t round_up_pow2(size_t n) {
+  size_t p = 4096;
+  while (p < n) p <<= 1;
+  return p;
+}
+
+size_t record_footprint(size_t len) {
+  return (kLengthPrefix + len + kRecordAlign - 1) & ~(kRecordAlign - 1);
+}
+
+} // namespace
+
+// Shared header at the start of the mapping; the data area follows it.
+// Producer and consumer fields live on separate cache lines.
+struct ShmRingHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t capacity;
+
+  alignas(64) std::atomic<uint64_t> head;          // next write position
+  std::atomic<uint32_t> data_seq;                  // bumped on every publish
+  std::atomic<uint32_t> consumer_waiting;
+  std::atomic<uint32_t> producer_lock;             // 0 free, 1 held, 2 contended
+  std::atomic<uint32_t> producer_owner;            // pid holding producer_lock, 0 if unknown
+
+  alignas(64) std::atomic<uint64_t> tail;          // next read position
+  std::atomic<uint32_t> space_seq;                 // bumped on every pop
+  std::atomic<uint32_t> producers_waiting;
+};
+
+static constexpr size_t kHeaderSize = (sizeof(ShmRingHeader) + 4095) & ~size_t(4095);
+
+ShmRing::ShmRing()
+  : header_(nullptr)
+  , data_(nullptr)
+  , mapped_size_(0)
+  , mask_(0)
+  , fd_(-1)
+{
+}
+
+ShmRing::~ShmRing() {
+  close();
+}
+
+bool ShmRing::open(const std::string& path, size_t capacity, bool create) {
+  close();
+
+  int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0600);
+  if (fd < 0) {
+    return false;
+  }
+
+  // Serialize first-time initialization between processes opening concurrently
+  if (flock(fd, LOCK_EX) != 0) {
+    ::close(fd);
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    ::close(fd);
+    return false;
+  }
+
+  bool fresh = (st.st_size == 0);
+  if (fresh && !create) {
+    // Creator has not initialized it yet
+    ::close(fd);
+    return false;
+  }
+  size_t data_capacity = round_up_pow2(capacity);
+  if (fresh) {
+    if (ftruncate(fd, static_cast<off_t>(kHeaderSize + data_capacity)) != 0) {
+      ::close(fd);
+      return false;
+    }
+  } else {
+    // Existing ring: its stored capacity wins over the requested one
+    struct { uint32_t magic; uint32_t version; uint64_t capacity; } probe;
+    if (pread(fd, &probe, sizeof(probe), 0) != static_cast<ssize_t>(sizeof(probe)) ||
+        probe.magic != kRingMagic || probe.version != kRingVersion ||
+        static_cast<size_t>(st.st_size) != kHeaderSize + probe.capacity) {
+      ::close(fd);
+      return false;
+    }
+    data_capacity = probe.capacity;
+  }
+
+  size_t mapped_size = kHeaderSize + data_capacity;
+  void* mem = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (mem == MAP_FAILED) {
+    ::close(fd);
+    return false;
+  }
+
+  header_ = static_cast<ShmRingHeader*>(mem);
+  if (fresh) {
+    // The file is zero-filled, which is a valid empty state for every atomic
+    header_->capacity = data_capacity;
+    header_->version = kRingVersion;
+    std::atomic_thread_fence(std::memory_order_release);
+    header_->magic = kRingMagic;
+  }
+  flock(fd, LOCK_UN);
+
+  fd_ = fd;
+  data_ = static_cast<uint8_t*>(mem) + kHeaderSize;
+  mapped_size_ = mapped_size;
+  mask_ = data_capacity - 1;
+  return true;
+}
+
+void ShmRing::close() {
+  if (header_) {
+    munmap(header_, mapped_size_);
+    header_ = nullptr;
+    data_ = nullptr;
+    mapped_size_ = 0;
+    mask_ = 0;
+  }
+  if (fd_ >= 0) {
+    ::close(fd_);
+    fd_ = -1;
+  }
+}
+
+bool ShmRing::is_open() const {
+  return header_ != nullptr;
+}
+
+size_t ShmRing::capacity() const {
+  return header_ ? mask_ + 1 : 0;
+}
+
+size_t ShmRing::max_record_size() const {
+  // Keep room for at least two records so producer and consumer can overlap
+  return header_ ? capacity() / 2 - kLengthPrefix : 0;
+}
+
+void ShmRing::copy_in(uint64_t pos, const void* src, size_t len) {
+  size_t index = pos & mask_;
+  size_t first = std::min(len, capacity() - index);
+  std::memcpy(data_ + index, src, first);
+  if (first < len) {
+    std::memcpy(data_, static_cast<const uint8_t*>(src) + first, len - first);
+  }
+}
+
+void ShmRing::copy_out(uint64_t pos, void* dest, size_t len) const {
+  size_t index = pos & mask_;
+  size_t first = std::min(len, capacity() - index);
+  std::memcpy(dest, data_ + index, first);
+  if (first < len) {
+    std::memcpy(static_cast<uint8_t*>(dest) + first, data_, len - first);
+  }
+}
+
+void ShmRing::lock_producers() {
+  // Three-state futex mutex (Drepper, "Futexes Are Tricky")
+  uint32_t c = 0;
+  if (!header_->producer_lock.compare_exchange_strong(c, 1, std::memory_order_acquire)) {
+    if (c != 2) {
+      c = header_->producer_lock.exchange(2, std::memory_order_acquire);
+    }
+    while (c != 0) {
+      long rc = futex_wait(&header_->producer_lock, 2, kOwnerCheckMs);
+      if (rc != 0 && errno == ETIMEDOUT) {
+        recover_dead_producer();
+      }
+      c = header_->producer_lock.exchange(2, std::memory_order_acquire);
+    }
+  }
+  header_->producer_owner.store(static_cast<uint32_t>(getpid()), std::memory_order_relaxed);
+}
+
+void ShmRing::recover_dead_producer() {
+  // A producer killed mid-write never published its record (head moves
+  // last), so taking its lock over leaves the ring consistent
+  uint32_t owner = header_->producer_owner.load(std::memory_order_relaxed);
+  if (owner == 0 || kill(static_cast<pid_t>(owner), 0) == 0 || errno != ESRCH) {
+    return;
+  }
+  if (header_->producer_owner.compare_exchange_strong(owner, 0, std::memory_order_relaxed)) {
+    header_->producer_lock.store(0, std::memory_order_release);
+    futex_wake(&header_->producer_lock, 1);
+  }
+}
+
+void ShmRing::unlock_producers() {
+  header_->producer_owner.store(0, std::memory_order_relaxed);
+  if (header_->producer_lock.exchange(0, std::memory_order_release) == 2) {
+    futex_wake(&header_->producer_lock, 1);
+  }
+}
+
+bool ShmRing::write(const struct iovec* parts, size_t count, int timeout_ms) {
+  if (!header_) return false;
+
+  size_t len = 0;
+  for (size_t i = 0; i < count; ++i) {
+    len += parts[i].iov_len;
+  }
+  if (len > max_record_size() || len > UINT32_MAX) {
+    return false;
+  }
+  size_t needed = record_footprint(len);
+
+  lock_producers();
+
+  uint64_t head = header_->head.load(std::memory_order_relaxed);
+  while (capacity() - (head - header_->tail.load(std::memory_order_acquire)) < needed) {
+    uint32_t seq = header_->space_seq.load(std::memory_order_acquire);
+    header_->producers_waiting.fetch_add(1, std::memory_order_seq_cst);
+    bool full = capacity() - (head - header_->tail.load(std::memory_order_seq_cst)) < needed;
+    long rc = full ? futex_wait(&header_->space_seq, seq, timeout_ms) : 0;
+    header_->producers_waiting.fetch_sub(1, std::memory_order_relaxed);
+    if (rc != 0 && errno == ETIMEDOUT) {
+      unlock_producers();
+      return false;
+    }
+  }
+
+  uint32_t prefix = static_cast<uint32_t>(len);
+  copy_in(head, &prefix, kLengthPrefix);
+  uint64_t pos = head + kLengthPrefix;
+  for (size_t i = 0; i < count; ++i) {
+    copy_in(pos, parts[i].iov_base, parts[i].iov_len);
+    pos += parts[i].iov_len;
+  }
+
+  header_->head.store(head + needed, std::memory_order_seq_cst);
+  unlock_producers();
+
+  header_->data_seq.fetch_add(1, std::memory_order_release);
+  if (header_->consumer_waiting.load(std::memory_order_seq_cst)) {
+    futex_wake(&header_->data_seq, 1);
+  }
+  return true;
+}
+
+bool ShmRing::front(size_t& record_len) const {
+  if (!header_) return false;
+  uint64_t tail = header_->tail.load(std::memory_order_relaxed);
+  if (header_->head.load(std::memory_order_acquire) == tail) {
+    return false;
+  }
+  uint32_t prefix;
+  copy_out(tail, &prefix, kLengthPrefix);
+  record_len = prefix;
+  return true;
+}
+
+void ShmRing::copy_front(size_t offset, void* dest, size_t len) const {
+  uint64_t tail = header_->tail.load(std::memory_order_relaxed);
+  copy_out(tail + kLengthPrefix + offset, dest, len);
+}
+
+void ShmRing::pop() {
+  size_t len;
+  if (!front(len)) return;
+
+  uint64_t tail = header_->tail.load(std::memory_order_relaxed);
+  header_->tail.store(tail + record_footprint(len), std::memory_order_seq_cst);
+
+  header_->space_seq.fetch_add(1, std::memory_order_release);
+  if (header_->producers_waiting.load(std::memory_order_seq_cst)) {
+    futex_wake(&header_->space_seq, INT_MAX);
+  }
+}
+
+bool ShmRing::empty() const {
+  if (!header_) return true;
+  return header_->head.load(std::memory_order_acquire) ==
+         header_->tail.load(std::memory_order_relaxed);
+}
+
+bool ShmRing::wait_for_data(int timeout_ms) {
+  if (!header_) return false;
+
+  uint32_t seq = header_->data_seq.load(std::memory_order_acquire);
+  if (!empty()) return true;
+  if (timeout_ms == 0) return false;
+
+  // Announce ourselves before the final check so a producer that publishes
+  // concurrently either sees the flag or we see its record
+  header_->consumer_waiting.store(1, std::memory_order_seq_cst);
+  if (header_->head.load(std::memory_order_seq_cst) == header_->tail.load(std::memory_order_relaxed)) {
+    futex_wait(&header_->data_seq, seq, timeout_ms);
+  }
+  header_->consumer_waiting.store(0, std::memory_order_relaxed);
+  return !empty();
+}
+
+void ShmRing::wake_consumer() {
+  if (!header_) return;
+  header_->data_seq.fetch_add(1, std::memory_order_release);
+  futex_wake(&header_->data_seq, INT_MAX);
+}
+
+} // namespace quicftp
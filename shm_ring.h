@@ -0,0 +1,76 @@
+// shm_ring.h
+// Memory-mapped ring buffer for passing records between processes
+// The ring is a lock-free single-producer/single-consumer queue; concurrent
+// producers (several client threads or processes) serialize on a small shared
+// lock, the consumer never takes it. Sleeping sides are woken with futexes.
+
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <string>
+#include <cstddef>
+#include <cstdint>
+#include <sys/uio.h>
+
+namespace quicftp {
+
+struct ShmRingHeader;
+
+class ShmRing {
+public:
+  ShmRing();
+  ~ShmRing();
+
+  ShmRing(const ShmRing&) = delete;
+  ShmRing& operator=(const ShmRing&) = delete;
+
+  // Map the ring stored at path, creating it with the given data capacity
+  // (rounded up to a power of two) if it does not exist yet and create is set
+  bool open(const std::string& path, size_t capacity, bool create = true);
+  void close();
+  bool is_open() const;
+
+  size_t capacity() const;
+
+  // Largest record accepted by write()
+  size_t max_record_size() const;
+
+  // Producer: append one record gathered from parts. Blocks while the ring is
+  // full, up to timeout_ms (-1 waits forever). Returns false on timeout or if
+  // the record can never fit.
+  bool write(const struct iovec* parts, size_t count, int timeout_ms = -1);
+
+  // Consumer: length of the record at the front, false if the ring is empty
+  bool front(size_t& record_len) const;
+
+  // Consumer: copy len bytes starting at offset within the front record
+  void copy_front(size_t offset, void* dest, size_t len) const;
+
+  // Consumer: release the front record to producers
+  void pop();
+
+  bool empty() const;
+
+  // Consumer: sleep until a record is available or timeout_ms elapses
+  bool wait_for_data(int timeout_ms);
+
+  // Wake a consumer sleeping in wait_for_data() without publishing anything
+  void wake_consumer();
+
+private:
+  ShmRingHeader* header_;
+  uint8_t* data_;
+  size_t mapped_size_;
+  size_t mask_;
+  int fd_;
+
+  void copy_in(uint64_t pos, const void* src, size_t len);
+  void copy_out(uint64_t pos, void* dest, size_t len) const;
+  void lock_producers();
+  void unlock_producers();
+  void recover_dead_producer();
+};
+
+} // namespace quicftp
+
+#endif
@@ -2,11 +2,42 @@
 
 #include "stream_manager.h"
 #include <algorithm>
+#include <cmath>
 #include <numeric>
+#include <thread>
 
 namespace quicftp {
 
-StreamManager::StreamManager() : next_stream_id_(1) {
+namespace {
+
+// The current speed is sampled at most this often, by whichever update
+// crosses the interval, and smoothed over about kRateWindow
+constexpr int64_t kSampleIntervalNs = 100 * 1000 * 1000;
+constexpr double kRateWindowNs = 1e9;
+
+int64_t now_ns(std::chrono::steady_clock::time_point now) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count();
+}
+
+// Move rate towards the speed of moving delta bytes in elapsed_ns, weighted
+// by how much of the window elapsed_ns covers
+double smooth(double rate, size_t delta, int64_t elapsed_ns) {
+  if (elapsed_ns <= 0) {
+    return rate;
+  }
+  double sample = static_cast<double>(delta) * 1e9 / static_cast<double>(elapsed_ns);
+  double alpha = 1.0 - std::exp(-static_cast<double>(elapsed_ns) / kRateWindowNs);
+  return rate + alpha * (sample - rate);
+}
+
+} // namespace
+
+StreamManager::StreamManager(size_t slot_count)
+  : next_stream_id_(1)
+  , slots_(new Slot[std::max<size_t>(slot_count, 1)])
+  , slot_count_(std::max<size_t>(slot_count, 1))
+  , slots_used_(0)
+{
 }
 
 StreamManager::~StreamManager() = default;
@@ -14,6 +45,17 @@ StreamManager::~StreamManager() = default;
 StreamId StreamManager::create_stream(const std::string& file_path, size_t total_bytes, int priority, bool is_upload) {
   std::lock_guard<std::mutex> lock(mutex_);
   
+  // A stream's slot is the one its id maps to, so skip ids whose slot is
+  // taken. With every slot taken the stream is counted under the lock.
+  Slot* slot = nullptr;
+  if (slots_used_ < slot_count_) {
+    while (slots_[next_stream_id_ % slot_count_].id.load(std::memory_order_relaxed) != 0) {
+      next_stream_id_++;
+    }
+    slot = &slots_[next_stream_id_ % slot_count_];
+    slots_used_++;
+  }
+
   StreamId id = next_stream_id_++;
   StreamInfo info;
   info.id = id;
@@ -21,17 +63,50 @@ StreamId StreamManager::create_stream(const std::string& file_path, size_t total
   info.file_path = file_path;
   info.bytes_transferred = 0;
   info.total_bytes = total_bytes;
-  info.start_time = std::chrono::steady_clock::now();
+  info.start_time = Clock::now();
   info.current_speed = 0.0;
   info.average_speed = 0.0;
   info.priority = priority;
   info.is_upload = is_upload;
-  
-  streams_[id] = info;
+
+  if (slot) {
+    slot->bytes.store(0, std::memory_order_relaxed);
+    slot->sampled_at.store(now_ns(info.start_time), std::memory_order_relaxed);
+    slot->sampled_bytes.store(0, std::memory_order_relaxed);
+    slot->rate.store(0.0, std::memory_order_relaxed);
+    slot->id.store(id, std::memory_order_release);
+  }
+  streams_[id] = Entry{info, slot, std::make_shared<TokenBucket>(stream_limit_)};
   return id;
 }
 
 bool StreamManager::update_stream(StreamId id, size_t bytes_transferred) {
+  Slot& slot = slots_[id % slot_count_];
+  // Announce the update before checking the slot is still ours, so the
+  // slot cannot be freed and reused under it (see release_slot)
+  slot.writers.fetch_add(1);
+  if (slot.id.load() == id) {
+    size_t seen = slot.bytes.load(std::memory_order_relaxed);
+    while (bytes_transferred > seen &&
+           !slot.bytes.compare_exchange_weak(seen, bytes_transferred, std::memory_order_relaxed)) {
+    }
+
+    // One update per interval takes the sample; the rest only count
+    int64_t now = now_ns(Clock::now());
+    int64_t last = slot.sampled_at.load(std::memory_order_relaxed);
+    if (now - last >= kSampleIntervalNs &&
+        slot.sampled_at.compare_exchange_strong(last, now, std::memory_order_relaxed)) {
+      size_t bytes = slot.bytes.load(std::memory_order_relaxed);
+      size_t before = slot.sampled_bytes.exchange(bytes, std::memory_order_relaxed);
+      double rate = slot.rate.load(std::memory_order_relaxed);
+      slot.rate.store(smooth(rate, bytes > before ? bytes - before : 0, now - last), std::memory_order_relaxed);
+    }
+    slot.writers.fetch_sub(1, std::memory_order_release);
+    return true;
+  }
+  slot.writers.fetch_sub(1, std::memory_order_release);
+
+  // Closed, or never given a slot
   std::lock_guard<std::mutex> lock(mutex_);
   
   auto it = streams_.find(id);
@@ -39,9 +114,12 @@ bool StreamManager::update_stream(StreamId id, size_t bytes_transferred) {
     return false;
   }
   
-  it->second.bytes_transferred = bytes_transferred;
-  it->second.state = StreamState::Open;
-  update_speed(it->second);
+  StreamInfo& info = it->second.info;
+  info.bytes_transferred = std::max(info.bytes_transferred, bytes_transferred);
+  if (info.state == StreamState::Open) {
+    update_speed(info, Clock::now());
+    info.current_speed = info.average_speed; // no slot to sample in
+  }
   return true;
 }
 
@@ -50,8 +128,8 @@ void StreamManager::complete_stream(StreamId id) {
   
   auto it = streams_.find(id);
   if (it != streams_.end()) {
-    it->second.state = StreamState::Closed;
-    update_speed(it->second);
+    release_slot(it->second, Clock::now());
+    it->second.info.state = StreamState::Closed;
   }
 }
 
@@ -60,27 +138,55 @@ void StreamManager::error_stream(StreamId id, const std::string& error) {
   
   auto it = streams_.find(id);
   if (it != streams_.end()) {
-    it->second.state = StreamState::Error;
+    release_slot(it->second, Clock::now());
+    it->second.info.state = StreamState::Error;
   }
 }
 
 void StreamManager::remove_stream(StreamId id) {
   std::lock_guard<std::mutex> lock(mutex_);
-  streams_.erase(id);
+  auto it = streams_.find(id);
+  if (it != streams_.end()) {
+    release_slot(it->second, Clock::now());
+    streams_.erase(it);
+  }
+}
+
+bool StreamManager::get_stream(StreamId id, StreamInfo& info) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = streams_.find(id);
+  if (it == streams_.end()) {
+    return false;
+  }
+  info = snapshot(it->second, Clock::now());
+  return true;
+}
+
+std::vector<StreamInfo> StreamManager::get_streams() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Clock::time_point now = Clock::now();
+  std::vector<StreamInfo> result;
+  result.reserve(streams_.size());
+  
+  for (const auto& [id, entry] : streams_) {
+    result.push_back(snapshot(entry, now));
+  }
+  
+  return result;
 }
 
-StreamInfo* StreamManager::get_stream(StreamId id) {
+bool StreamManager::is_stream_open(StreamId id) const {
   std::lock_guard<std::mutex> lock(mutex_);
   auto it = streams_.find(id);
-  return (it != streams_.end()) ? &it->second : nullptr;
+  return it != streams_.end() && it->second.info.state == StreamState::Open;
 }
 
 std::vector<StreamId> StreamManager::get_active_streams() const {
   std::lock_guard<std::mutex> lock(mutex_);
   std::vector<StreamId> active;
   
-  for (const auto& [id, info] : streams_) {
-    if (info.state == StreamState::Open) {
+  for (const auto& [id, entry] : streams_) {
+    if (entry.info.state == StreamState::Open) {
       active.push_back(id);
     }
   }
@@ -92,8 +198,8 @@ std::vector<StreamId> StreamManager::get_streams_by_priority(int priority) const
   std::lock_guard<std::mutex> lock(mutex_);
   std::vector<StreamId> result;
   
-  for (const auto& [id, info] : streams_) {
-    if (info.priority == priority && info.state == StreamState::Open) {
+  for (const auto& [id, entry] : streams_) {
+    if (entry.info.priority == priority && entry.info.state == StreamState::Open) {
       result.push_back(id);
     }
   }
@@ -101,13 +207,20 @@ std::vector<StreamId> StreamManager::get_streams_by_priority(int priority) const
   return result;
 }
 
+int StreamManager::get_priority(StreamId id) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = streams_.find(id);
+  return (it != streams_.end()) ? it->second.info.priority : kPriorityNormal;
+}
+
 size_t StreamManager::get_total_active_bytes() const {
   std::lock_guard<std::mutex> lock(mutex_);
+  Clock::time_point now = Clock::now();
   
   size_t total = 0;
-  for (const auto& [id, info] : streams_) {
-    if (info.state == StreamState::Open) {
-      total += info.bytes_transferred;
+  for (const auto& [id, entry] : streams_) {
+    if (entry.info.state == StreamState::Open) {
+      total += snapshot(entry, now).bytes_transferred;
     }
   }
   
@@ -116,10 +229,11 @@ size_t StreamManager::get_total_active_bytes() const {
 
 size_t StreamManager::get_total_bytes_transferred() const {
   std::lock_guard<std::mutex> lock(mutex_);
+  Clock::time_point now = Clock::now();
   
   size_t total = 0;
-  for (const auto& [id, info] : streams_) {
-    total += info.bytes_transferred;
+  for (const auto& [id, entry] : streams_) {
+    total += snapshot(entry, now).bytes_transferred;
   }
   
   return total;
@@ -130,12 +244,14 @@ double StreamManager::get_total_average_speed() const {
   
   if (streams_.empty()) return 0.0;
   
+  Clock::time_point now = Clock::now();
   double total_speed = 0.0;
   size_t count = 0;
   
-  for (const auto& [id, info] : streams_) {
-    if (info.average_speed > 0.0) {
-      total_speed += info.average_speed;
+  for (const auto& [id, entry] : streams_) {
+    double speed = snapshot(entry, now).average_speed;
+    if (speed > 0.0) {
+      total_speed += speed;
       count++;
     }
   }
@@ -143,17 +259,87 @@ double StreamManager::get_total_average_speed() const {
   return (count > 0) ? total_speed / count : 0.0;
 }
 
-void StreamManager::update_speed(StreamInfo& info) {
-  auto now = std::chrono::steady_clock::now();
+double StreamManager::get_total_current_speed() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Clock::time_point now = Clock::now();
+  
+  double total = 0.0;
+  for (const auto& [id, entry] : streams_) {
+    if (entry.info.state == StreamState::Open) {
+      total += snapshot(entry, now).current_speed;
+    }
+  }
+  
+  return total;
+}
+
+void StreamManager::set_stream_rate_limit(const RateLimit& limit) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  stream_limit_ = limit;
+  for (auto& [id, entry] : streams_) {
+    entry.limiter->set_limit(limit);
+  }
+}
+
+RateLimit StreamManager::get_stream_rate_limit() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stream_limit_;
+}
+
+std::shared_ptr<TokenBucket> StreamManager::get_rate_limiter(StreamId id) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = streams_.find(id);
+  return (it != streams_.end()) ? it->second.limiter : nullptr;
+}
+
+StreamInfo StreamManager::snapshot(const Entry& entry, Clock::time_point now) const {
+  StreamInfo info = entry.info;
+  if (!entry.slot) {
+    return info;
+  }
+  const Slot& slot = *entry.slot;
+  info.bytes_transferred = slot.bytes.load(std::memory_order_relaxed);
+  update_speed(info, now);
+
+  // Bytes since the last sample count as a sample in progress, so a stream
+  // that stalls is seen slowing down without waiting for its next update
+  int64_t elapsed = now_ns(now) - slot.sampled_at.load(std::memory_order_relaxed);
+  size_t before = slot.sampled_bytes.load(std::memory_order_relaxed);
+  double rate = slot.rate.load(std::memory_order_relaxed);
+  if (elapsed >= kSampleIntervalNs) {
+    rate = smooth(rate, info.bytes_transferred > before ? info.bytes_transferred - before : 0, elapsed);
+  }
+  info.current_speed = rate;
+  return info;
+}
+
+void StreamManager::release_slot(Entry& entry, Clock::time_point now) {
+  if (!entry.slot) {
+    if (entry.info.state == StreamState::Open) {
+      update_speed(entry.info, now);
+      entry.info.current_speed = 0.0;
+    }
+    return;
+  }
+  Slot& slot = *entry.slot;
+  slot.id.store(0);
+  // Updates that saw the old id finish before the slot can be reused
+  while (slot.writers.load() != 0) {
+    std::this_thread::yield();
+  }
+  entry.info.bytes_transferred = std::max(entry.info.bytes_transferred, slot.bytes.load(std::memory_order_relaxed));
+  update_speed(entry.info, now);
+  entry.info.current_speed = 0.0; // a closed stream moves nothing
+  entry.slot = nullptr;
+  slots_used_--;
+}
+
+void StreamManager::update_speed(StreamInfo& info, Clock::time_point now) {
   auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(now - info.start_time).count();
   
   if (duration > 0) {
     info.average_speed = (static_cast<double>(info.bytes_transferred) / duration) * 1000.0;
-    
-    // For current speed, use last update interval (simplified - would need more tracking for accurate current speed)
-    info.current_speed = info.average_speed;
   }
 }
 
 } // namespace quicftp
-
@@ -1,13 +1,21 @@
 // stream_manager.h
 // Stream management for concurrent file transfers
+// Progress is counted outside the lock: each open stream owns a cache-line
+// sized slot of atomic counters, found directly from its id, so workers
+// reporting every chunk never contend with each other or with readers. The
+// mutex only guards creating, closing and listing streams.
 
 #ifndef STREAM_MANAGER_H
 #define STREAM_MANAGER_H
 
 #include "quic_common.h"
+#include "rate_limiter.h"
 #include <map>
+#include <memory>
 #include <mutex>
 #include <string>
+#include <vector>
+#include <atomic>
 #include <chrono>
 
 namespace quicftp {
@@ -20,7 +28,7 @@ struct StreamInfo {
   size_t bytes_transferred;
   size_t total_bytes;
   std::chrono::steady_clock::time_point start_time;
-  double current_speed; // bytes per second
+  double current_speed; // bytes per second, over roughly the last second
   double average_speed; // bytes per second
   int priority; // Higher = more priority
   bool is_upload; // true for upload, false for download
@@ -29,35 +37,81 @@ struct StreamInfo {
 // Stream manager for tracking multiple concurrent streams
 class StreamManager {
 public:
-  StreamManager();
+  // Up to slot_count streams are open at once with lock-free progress;
+  // any beyond that are counted under the lock
+  explicit StreamManager(size_t slot_count = 1024);
   ~StreamManager();
 
+  StreamManager(const StreamManager&) = delete;
+  StreamManager& operator=(const StreamManager&) = delete;
+
   // Stream lifecycle
   StreamId create_stream(const std::string& file_path, size_t total_bytes, int priority, bool is_upload);
+  // Lock-free while the stream is open; progress reported out of order by
+  // several workers never moves it backwards
   bool update_stream(StreamId id, size_t bytes_transferred);
   void complete_stream(StreamId id);
   void error_stream(StreamId id, const std::string& error);
   void remove_stream(StreamId id);
 
-  // Stream queries
-  StreamInfo* get_stream(StreamId id);
+  // Stream queries; the snapshots are copies, consistent per stream
+  bool get_stream(StreamId id, StreamInfo& info) const;
+  std::vector<StreamInfo> get_streams() const;
+  bool is_stream_open(StreamId id) const;
   std::vector<StreamId> get_active_streams() const;
   std::vector<StreamId> get_streams_by_priority(int priority) const;
+  // kPriorityNormal for unknown streams
+  int get_priority(StreamId id) const;
   size_t get_total_active_bytes() const;
 
   // Statistics
   size_t get_total_bytes_transferred() const;
   double get_total_average_speed() const;
+  // Sum of the open streams' current speeds
+  double get_total_current_speed() const;
+
+  // Bandwidth limit of every stream, open ones included (default none)
+  void set_stream_rate_limit(const RateLimit& limit);
+  RateLimit get_stream_rate_limit() const;
+  // The bucket pacing a stream's frames; null for unknown streams
+  std::shared_ptr<TokenBucket> get_rate_limiter(StreamId id) const;
 
 private:
+  using Clock = std::chrono::steady_clock;
+
+  // Counters of one open stream, alone on its cache line
+  struct alignas(64) Slot {
+    std::atomic<StreamId> id{0};         // 0 while free
+    std::atomic<uint32_t> writers{0};    // updates in progress
+    std::atomic<size_t> bytes{0};
+    std::atomic<int64_t> sampled_at{0};  // ns since start of the last rate sample
+    std::atomic<size_t> sampled_bytes{0};
+    std::atomic<double> rate{0.0};       // bytes per second, smoothed
+  };
+
+  // Per-stream state the hot path never touches
+  struct Entry {
+    StreamInfo info;
+    Slot* slot; // null once closed, or if no slot was free
+    std::shared_ptr<TokenBucket> limiter;
+  };
+
   mutable std::mutex mutex_;
-  std::map<StreamId, StreamInfo> streams_;
+  std::map<StreamId, Entry> streams_;
   StreamId next_stream_id_;
-  
-  void update_speed(StreamInfo& info);
+  std::unique_ptr<Slot[]> slots_;
+  size_t slot_count_;
+  size_t slots_used_;
+  RateLimit stream_limit_;
+
+  // Copy of entry's info with its live counters (caller holds mutex_)
+  StreamInfo snapshot(const Entry& entry, Clock::time_point now) const;
+  // Freeze the slot's counters into entry.info and free the slot for another
+  // stream (caller holds mutex_)
+  void release_slot(Entry& entry, Clock::time_point now);
+  static void update_speed(StreamInfo& info, Clock::time_point now);
 };
 
 } // namespace quicftp
 
 #endif
-
@@ -2,203 +2,303 @@
 
 #include "test_bridge.h"
 #include "quic_common.h"
-#include <fstream>
-#include <chrono>
 #include <algorithm>
-#include <sstream>
-#include <filesystem>
 #include <cstring>
 #include <cstdlib>
-#include <iterator>
+#include <functional>
+#include <unistd.h>
 
 namespace quicftp {
 
+namespace {
+
+// Default ring size; override with QUICFTP_BRIDGE_RING_SIZE (bytes)
+constexpr size_t kDefaultRingSize = 64 * 1024 * 1024;
+
+// Size of each client's reply ring
+constexpr size_t kReplyRingSize = 16 * 1024 * 1024;
+
+size_t inbound_ring_size() {
+  size_t ring_size = kDefaultRingSize;
+  if (const char* env = std::getenv("QUICFTP_BRIDGE_RING_SIZE")) {
+    size_t requested = std::strtoull(env, nullptr, 10);
+    if (requested > 0) ring_size = requested;
+  }
+  return ring_size;
+}
+
+// Producers give up if the reader has not drained the ring within this time
+constexpr int kSendTimeoutMs = 10000;
+
+// Binary frame header stored at the start of every ring record, followed by
+// addr_len bytes of address and then the payload
+struct BridgeFrameHeader {
+  uint64_t stream_id;
+  uint32_t addr_len;
+  uint32_t flags;
+};
+
+// Pop the front record of ring into its parts
+bool read_frame(ShmRing& ring, std::string& addr, StreamId& stream_id, BufferRef& data, uint32_t* flags) {
+  size_t record_len;
+  if (!ring.front(record_len)) {
+    return false;
+  }
+
+  BridgeFrameHeader header;
+  if (record_len < sizeof(header)) {
+    // Malformed record: drop it rather than wedging the queue
+    ring.pop();
+    return false;
+  }
+  ring.copy_front(0, &header, sizeof(header));
+  if (header.addr_len > record_len - sizeof(header)) {
+    ring.pop();
+    return false;
+  }
+
+  size_t payload_offset = sizeof(header) + header.addr_len;
+  size_t payload_len = record_len - payload_offset;
+
+  addr.resize(header.addr_len);
+  ring.copy_front(sizeof(header), &addr[0], header.addr_len);
+  stream_id = header.stream_id;
+  // The payload lands in a pooled buffer that the receiver can hold on to
+  if (payload_len > 0) {
+    data = BufferPool::instance().acquire(payload_len);
+    ring.copy_front(payload_offset, data.data(), payload_len);
+  } else {
+    data.reset();
+  }
+  ring.pop();
+  if (flags) {
+    *flags = header.flags;
+  }
+  return true;
+}
+
+} // namespace
+
 TestBridge::TestBridge() {
   queue_file_path_ = get_queue_path();
+  rings_.push_back(std::make_shared<ShmRing>());
+  ensure_open();
 }
 
 std::string TestBridge::get_queue_path() const {
+  return get_ring_path("quicftp_test_bridge");
+}
+
+std::string TestBridge::get_shard_path(size_t shard) const {
+  return shard == 0 ? queue_file_path_ : get_ring_path("quicftp_test_bridge.shard-" + std::to_string(shard));
+}
+
+std::string TestBridge::get_ring_path(const std::string& name) const {
+  // Prefer tmpfs so the ring never touches a disk
+  if (access("/dev/shm", W_OK) == 0) {
+    return "/dev/shm/" + name + ".ring";
+  }
   const char* tmpdir = std::getenv("TMPDIR");
   if (!tmpdir) tmpdir = std::getenv("TMP");
   if (!tmpdir) tmpdir = "/tmp";
-  return std::string(tmpdir) + "/quicftp_test_bridge.queue";
+  return std::string(tmpdir) + "/" + name + ".ring";
+}
+
+bool TestBridge::ensure_open() {
+  if (rings_[0]->is_open()) return true;
+  return rings_[0]->open(queue_file_path_, inbound_ring_size());
 }
 
-bool TestBridge::send_to_server(const std::string& server_addr, StreamId stream_id, const uint8_t* data, size_t len) {
+bool TestBridge::listen(size_t shards, int port) {
+  (void)port; // rings are found by name
   std::lock_guard<std::mutex> lock(mutex_);
-  
-  // Write message to file queue (append mode)
-  std::ofstream queue_file(queue_file_path_, std::ios::binary | std::ios::app);
-  if (!queue_file.is_open()) {
+  if (!ensure_open()) {
     return false;
   }
-  
-  // Format: server_addr\nstream_id\nlen\ndata
-  queue_file << server_addr << "\n";
-  queue_file << stream_id << "\n";
-  queue_file << len << "\n";
-  queue_file.write(reinterpret_cast<const char*>(data), len);
-  queue_file << "\n"; // separator
-  queue_file.flush();
-  queue_file.close();
-  
-  // #region agent log
-  {
-    std::ofstream log_file("/home/tprettol/repo/Quicftp/.cursor/debug.log", std::ios::app);
-    if (log_file.is_open()) {
-      std::string preview(data, data + std::min(len, size_t(50)));
-      log_file << "{\"sessionId\":\"debug-session\",\"runId\":\"run1\",\"hypothesisId\":\"N\",\"location\":\"test_bridge.cc:35\",\"message\":\"TestBridge: message written to file\",\"data\":{\"server_addr\":\"" << server_addr << "\",\"stream_id\":" << stream_id << ",\"len\":" << len << ",\"queue_file\":\"" << queue_file_path_ << "\",\"preview\":\"" << preview << "\"},\"timestamp\":" << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() << "}\n";
-      log_file.close();
+  shards = std::max<size_t>(shards, 1);
+  rings_.resize(1);
+  for (size_t shard = 1; shard < shards; ++shard) {
+    auto ring = std::make_shared<ShmRing>();
+    if (!ring->open(get_shard_path(shard), inbound_ring_size())) {
+      rings_.resize(1);
+      return false;
     }
+    rings_.push_back(ring);
+  }
+  // Rings of a previous run with more shards would attract clients nobody serves
+  for (size_t shard = shards; access(get_shard_path(shard).c_str(), F_OK) == 0; ++shard) {
+    unlink(get_shard_path(shard).c_str());
   }
-  // #endregion
   return true;
 }
 
-bool TestBridge::receive_from_client(std::string& client_addr, StreamId& stream_id, std::vector<uint8_t>& data) {
+void TestBridge::stop_listening() {
+  // Rings stay mapped for clients still writing to them
+}
+
+std::shared_ptr<ShmRing> TestBridge::inbound_ring(size_t shard) const {
   std::lock_guard<std::mutex> lock(mutex_);
-  
-  // #region agent log
-  {
-    std::ofstream log_file("/home/tprettol/repo/Quicftp/.cursor/debug.log", std::ios::app);
-    if (log_file.is_open()) {
-      log_file << "{\"sessionId\":\"debug-session\",\"runId\":\"run1\",\"hypothesisId\":\"N\",\"location\":\"test_bridge.cc:60\",\"message\":\"TestBridge: attempting to read from file\",\"data\":{\"queue_file\":\"" << queue_file_path_ << "\"},\"timestamp\":" << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() << "}\n";
-      log_file.close();
-    }
+  if (shard >= rings_.size() || !rings_[shard]->is_open()) {
+    return nullptr;
   }
-  // #endregion
-  
-  std::ifstream queue_file(queue_file_path_, std::ios::binary);
-  if (!queue_file.is_open()) {
-    // #region agent log
-    {
-      std::ofstream log_file("/home/tprettol/repo/Quicftp/.cursor/debug.log", std::ios::app);
-      if (log_file.is_open()) {
-        log_file << "{\"sessionId\":\"debug-session\",\"runId\":\"run1\",\"hypothesisId\":\"N\",\"location\":\"test_bridge.cc:68\",\"message\":\"TestBridge: queue file not open\",\"data\":{\"queue_file\":\"" << queue_file_path_ << "\"},\"timestamp\":" << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() << "}\n";
-        log_file.close();
-      }
-    }
-    // #endregion
-    return false;
+  return rings_[shard];
+}
+
+std::shared_ptr<ShmRing> TestBridge::route(const std::string& client_addr) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = routes_.find(client_addr);
+  if (it != routes_.end()) {
+    return it->second;
   }
-  
-  if (queue_file.peek() == std::ifstream::traits_type::eof()) {
-    queue_file.close();
-    // #region agent log
-    {
-      std::ofstream log_file("/home/tprettol/repo/Quicftp/.cursor/debug.log", std::ios::app);
-      if (log_file.is_open()) {
-        log_file << "{\"sessionId\":\"debug-session\",\"runId\":\"run1\",\"hypothesisId\":\"N\",\"location\":\"test_bridge.cc:80\",\"message\":\"TestBridge: queue file is empty\",\"data\":{\"queue_file\":\"" << queue_file_path_ << "\"},\"timestamp\":" << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() << "}\n";
-        log_file.close();
-      }
-    }
-    // #endregion
-    return false;
+  if (!ensure_open()) {
+    return nullptr;
   }
-  
-  // Read message: server_addr\nstream_id\nlen\ndata\n
-  std::getline(queue_file, client_addr);
-  if (queue_file.fail()) {
-    queue_file.close();
-    // #region agent log
-    {
-      std::ofstream log_file("/home/tprettol/repo/Quicftp/.cursor/debug.log", std::ios::app);
-      if (log_file.is_open()) {
-        log_file << "{\"sessionId\":\"debug-session\",\"runId\":\"run1\",\"hypothesisId\":\"N\",\"location\":\"test_bridge.cc:95\",\"message\":\"TestBridge: failed to read server_addr\",\"data\":{},\"timestamp\":" << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() << "}\n";
-        log_file.close();
-      }
+
+  // The server publishes one ring per shard; pick ours by address
+  size_t shards = 1;
+  while (access(get_shard_path(shards).c_str(), F_OK) == 0) {
+    ++shards;
+  }
+  size_t shard = std::hash<std::string>()(client_addr) % shards;
+  std::shared_ptr<ShmRing> ring = rings_[0];
+  if (shard > 0) {
+    auto shard_ring = std::make_shared<ShmRing>();
+    if (shard_ring->open(get_shard_path(shard), inbound_ring_size(), false)) {
+      ring = shard_ring;
     }
-    // #endregion
-    return false;
   }
-  
-  std::string stream_id_str;
-  std::getline(queue_file, stream_id_str);
-  if (queue_file.fail()) {
-    queue_file.close();
-    return false;
+  routes_[client_addr] = ring;
+  return ring;
+}
+
+std::shared_ptr<ShmRing> TestBridge::client_ring(const std::string& client_addr, bool create) {
+  std::lock_guard<std::mutex> lock(client_rings_mutex_);
+  auto it = client_rings_.find(client_addr);
+  if (it != client_rings_.end()) {
+    return it->second;
   }
-  stream_id = std::stoull(stream_id_str);
-  
-  std::string len_str;
-  std::getline(queue_file, len_str);
-  if (queue_file.fail()) {
-    queue_file.close();
+
+  auto ring = std::make_shared<ShmRing>();
+  if (!ring->open(get_ring_path("quicftp_test_bridge." + client_addr), kReplyRingSize, create)) {
+    return nullptr;
+  }
+  client_rings_[client_addr] = ring;
+  return ring;
+}
+
+bool TestBridge::send_to_server(const std::string& client_addr, StreamId stream_id, const uint8_t* head,
+                                size_t head_len, const uint8_t* data, size_t len) {
+  return send_frame(client_addr, stream_id, 0, head, head_len, data, len);
+}
+
+bool TestBridge::finish_stream(const std::string& client_addr, StreamId stream_id) {
+  return send_frame(client_addr, stream_id, kEndOfStream, nullptr, 0, nullptr, 0);
+}
+
+bool TestBridge::reset_stream(const std::string& client_addr, StreamId stream_id) {
+  return send_frame(client_addr, stream_id, kResetStream, nullptr, 0, nullptr, 0);
+}
+
+bool TestBridge::disconnect(const std::string& client_addr) {
+  return send_frame(client_addr, 0, kDisconnect, nullptr, 0, nullptr, 0);
+}
+
+bool TestBridge::send_frame(const std::string& client_addr, StreamId stream_id, uint32_t flags,
+                            const uint8_t* head, size_t head_len, const uint8_t* data, size_t len) {
+  // The ring serializes producers itself
+  std::shared_ptr<ShmRing> ring = route(client_addr);
+  if (!ring) {
     return false;
   }
-  size_t len = std::stoull(len_str);
-  
-  data.resize(len);
-  queue_file.read(reinterpret_cast<char*>(data.data()), len);
-  size_t bytes_read = queue_file.gcount();
-  if (bytes_read != len) {
-    queue_file.close();
-    // #region agent log
-    {
-      std::ofstream log_file("/home/tprettol/repo/Quicftp/.cursor/debug.log", std::ios::app);
-      if (log_file.is_open()) {
-        log_file << "{\"sessionId\":\"debug-session\",\"runId\":\"run1\",\"hypothesisId\":\"N\",\"location\":\"test_bridge.cc:125\",\"message\":\"TestBridge: incomplete data read\",\"data\":{\"expected\":" << len << ",\"read\":" << bytes_read << "},\"timestamp\":" << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() << "}\n";
-        log_file.close();
-      }
-    }
-    // #endregion
+  return send_frame(*ring, client_addr, stream_id, flags, head, head_len, data, len);
+}
+
+bool TestBridge::send_frame(ShmRing& ring, const std::string& addr, StreamId stream_id, uint32_t flags,
+                            const uint8_t* head, size_t head_len, const uint8_t* data, size_t len) {
+  BridgeFrameHeader header;
+  header.stream_id = stream_id;
+  header.addr_len = static_cast<uint32_t>(addr.size());
+  header.flags = flags;
+
+  struct iovec parts[4];
+  parts[0].iov_base = &header;
+  parts[0].iov_len = sizeof(header);
+  parts[1].iov_base = const_cast<char*>(addr.data());
+  parts[1].iov_len = addr.size();
+  parts[2].iov_base = const_cast<uint8_t*>(head);
+  parts[2].iov_len = head_len;
+  parts[3].iov_base = const_cast<uint8_t*>(data);
+  parts[3].iov_len = len;
+
+  return ring.write(parts, 4, kSendTimeoutMs);
+}
+
+bool TestBridge::open_client_channel(const std::string& client_addr, const std::string& server_address) {
+  (void)server_address; // the server's rings are found by name
+  // A leftover ring from a crashed process with a recycled pid may hold stale frames
+  unlink(get_ring_path("quicftp_test_bridge." + client_addr).c_str());
+  return client_ring(client_addr, true) != nullptr;
+}
+
+void TestBridge::close_client_channel(const std::string& client_addr) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    routes_.erase(client_addr);
+  }
+  std::lock_guard<std::mutex> lock(client_rings_mutex_);
+  client_rings_.erase(client_addr);
+  unlink(get_ring_path("quicftp_test_bridge." + client_addr).c_str());
+}
+
+bool TestBridge::receive_from_server(const std::string& client_addr, StreamId& stream_id,
+                                     BufferRef& data, uint32_t* flags, int timeout_ms) {
+  std::shared_ptr<ShmRing> ring = client_ring(client_addr, false);
+  if (!ring || !ring->wait_for_data(timeout_ms)) {
     return false;
   }
-  
-  // Read separator newline
-  char sep;
-  queue_file.get(sep);
-  if (sep != '\n') {
-    queue_file.close();
-    // #region agent log
-    {
-      std::ofstream log_file("/home/tprettol/repo/Quicftp/.cursor/debug.log", std::ios::app);
-      if (log_file.is_open()) {
-        log_file << "{\"sessionId\":\"debug-session\",\"runId\":\"run1\",\"hypothesisId\":\"N\",\"location\":\"test_bridge.cc:140\",\"message\":\"TestBridge: missing separator\",\"data\":{\"sep_char\":" << int(sep) << "},\"timestamp\":" << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() << "}\n";
-        log_file.close();
-      }
-    }
-    // #endregion
+  std::string addr;
+  return read_frame(*ring, addr, stream_id, data, flags);
+}
+
+bool TestBridge::receive_from_client(size_t shard, std::string& client_addr, StreamId& stream_id, BufferRef& data,
+                                     uint32_t* flags) {
+  std::shared_ptr<ShmRing> ring = inbound_ring(shard);
+  if (!ring) {
     return false;
   }
-  
-  std::streampos current_pos = queue_file.tellg();
-  queue_file.close();
-  
-  // Remove processed message from file (read remaining, write back)
-  std::ifstream remaining_file(queue_file_path_, std::ios::binary);
-  remaining_file.seekg(current_pos);
-  std::vector<char> remaining((std::istreambuf_iterator<char>(remaining_file)),
-                              std::istreambuf_iterator<char>());
-  remaining_file.close();
-  
-  // Rewrite file with remaining messages
-  std::ofstream write_file(queue_file_path_, std::ios::binary | std::ios::trunc);
-  if (write_file.is_open() && !remaining.empty()) {
-    write_file.write(remaining.data(), remaining.size());
-  }
-  write_file.close();
-  
-  // #region agent log
-  {
-    std::ofstream log_file("/home/tprettol/repo/Quicftp/.cursor/debug.log", std::ios::app);
-    if (log_file.is_open()) {
-      log_file << "{\"sessionId\":\"debug-session\",\"runId\":\"run1\",\"hypothesisId\":\"N\",\"location\":\"test_bridge.cc:165\",\"message\":\"TestBridge: message read successfully\",\"data\":{\"client_addr\":\"" << client_addr << "\",\"stream_id\":" << stream_id << ",\"len\":" << len << "},\"timestamp\":" << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() << "}\n";
-      log_file.close();
-    }
+  return read_frame(*ring, client_addr, stream_id, data, flags);
+}
+
+bool TestBridge::send_to_client(const std::string& client_addr, StreamId stream_id, const uint8_t* head,
+                                size_t head_len, const uint8_t* data, size_t len, uint32_t flags) {
+  // Never create a reply ring here: a missing one means the client has gone
+  std::shared_ptr<ShmRing> ring = client_ring(client_addr, false);
+  if (!ring) {
+    return false;
   }
-  // #endregion
-  
-  return true;
+  return send_frame(*ring, std::string(), stream_id, flags, head, head_len, data, len);
 }
 
-bool TestBridge::has_data() const {
-  std::lock_guard<std::mutex> lock(mutex_);
-  std::ifstream queue_file(queue_file_path_, std::ios::binary);
-  bool has_data = queue_file.is_open() && queue_file.peek() != std::ifstream::traits_type::eof();
-  queue_file.close();
-  return has_data;
+void TestBridge::forget_client(const std::string& client_addr) {
+  std::lock_guard<std::mutex> lock(client_rings_mutex_);
+  client_rings_.erase(client_addr);
 }
 
-} // namespace quicftp
+bool TestBridge::has_data(size_t shard) const {
+  std::shared_ptr<ShmRing> ring = inbound_ring(shard);
+  return ring && !ring->empty();
+}
 
+bool TestBridge::wait_for_data(size_t shard, int timeout_ms) {
+  std::shared_ptr<ShmRing> ring = inbound_ring(shard);
+  return ring && ring->wait_for_data(timeout_ms);
+}
+
+void TestBridge::interrupt_wait(size_t shard) {
+  std::shared_ptr<ShmRing> ring = inbound_ring(shard);
+  if (ring) {
+    ring->wake_consumer();
+  }
+}
+
+} // namespace quicftp
@@ -1,49 +1,99 @@
 // test_bridge.h
 // Simple test bridge for QUIC stubs - allows client/server communication for testing
 // This is a temporary solution until real QUIC library is integrated
-// Uses file-based queue for inter-process communication
+// Uses shared-memory ring buffers (see shm_ring.h) for inter-process communication:
+// one ring into each server shard, and one reply ring per client named by its address
 
 #ifndef TEST_BRIDGE_H
 #define TEST_BRIDGE_H
 
 #include "quic_common.h"
+#include "transport.h"
+#include "shm_ring.h"
+#include "buffer_pool.h"
 #include <string>
 #include <vector>
+#include <map>
+#include <memory>
 #include <mutex>
-#include <fstream>
 
 namespace quicftp {
 
-// File-based message queue for inter-process communication
-class TestBridge {
+// Shared-memory message queue for inter-process communication. Each send
+// is one ring record; client_addr is the sender's own name, which the server
+// uses to route replies, and server addresses and ports are not used.
+class TestBridge : public Transport {
 public:
   static TestBridge& instance() {
     static TestBridge inst;
     return inst;
   }
 
-  // Client side: send data
-  bool send_to_server(const std::string& server_addr, StreamId stream_id, const uint8_t* data, size_t len);
-  
-  // Server side: receive data
-  bool receive_from_client(std::string& client_addr, StreamId& stream_id, std::vector<uint8_t>& data);
-  
-  // Check if data is available
-  bool has_data() const;
+  // Client side: records go straight into the server's ring
+  bool send_to_server(const std::string& client_addr, StreamId stream_id, const uint8_t* head, size_t head_len,
+                      const uint8_t* data, size_t len) override;
+  bool finish_stream(const std::string& client_addr, StreamId stream_id) override;
+  // The server discards what it received on the stream
+  bool reset_stream(const std::string& client_addr, StreamId stream_id) override;
+  bool disconnect(const std::string& client_addr) override;
+
+  // Client side: create / remove the ring the server replies on
+  bool open_client_channel(const std::string& client_addr, const std::string& server_address) override;
+  void close_client_channel(const std::string& client_addr) override;
+
+  bool receive_from_server(const std::string& client_addr, StreamId& stream_id, BufferRef& data,
+                           uint32_t* flags, int timeout_ms) override;
+
+  // Server side: accept clients on `shards` inbound rings. Each client is
+  // hashed by address onto one of them, the way SO_REUSEPORT spreads peers
+  // over sockets, so every ring has a single consumer. Call before receiving.
+  bool listen(size_t shards, int port) override;
+  void stop_listening() override;
+
+  bool receive_from_client(size_t shard, std::string& client_addr, StreamId& stream_id, BufferRef& data,
+                           uint32_t* flags = nullptr) override;
+  bool send_to_client(const std::string& client_addr, StreamId stream_id, const uint8_t* head, size_t head_len,
+                      const uint8_t* data, size_t len, uint32_t flags = 0) override;
+
+  // Server side: drop the cached mapping of a client's reply ring
+  void forget_client(const std::string& client_addr) override;
+
+  bool has_data(size_t shard) const override;
+  bool wait_for_data(size_t shard, int timeout_ms) override;
+  void interrupt_wait(size_t shard) override;
 
 private:
   TestBridge();
-  ~TestBridge() = default;
+  ~TestBridge() override = default;
   TestBridge(const TestBridge&) = delete;
   TestBridge& operator=(const TestBridge&) = delete;
 
   std::string queue_file_path_;
+
+  // Inbound rings by shard; ring 0 always exists and is all a single-loop
+  // server reads. Clients remember the ring their address hashed to.
+  std::vector<std::shared_ptr<ShmRing>> rings_;
+  std::map<std::string, std::shared_ptr<ShmRing>> routes_;
   mutable std::mutex mutex_;
-  
+
+  // Reply rings, keyed by client address; shared so a ring stays mapped
+  // while a sender is using it even if the client is forgotten meanwhile
+  std::map<std::string, std::shared_ptr<ShmRing>> client_rings_;
+  std::mutex client_rings_mutex_;
+
   std::string get_queue_path() const;
+  std::string get_ring_path(const std::string& name) const;
+  std::string get_shard_path(size_t shard) const;
+  bool ensure_open();
+  std::shared_ptr<ShmRing> inbound_ring(size_t shard) const;
+  std::shared_ptr<ShmRing> route(const std::string& client_addr);
+  std::shared_ptr<ShmRing> client_ring(const std::string& client_addr, bool create);
+  bool send_frame(ShmRing& ring, const std::string& addr, StreamId stream_id, uint32_t flags,
+                  const uint8_t* head, size_t head_len, const uint8_t* data, size_t len);
+  bool send_frame(const std::string& client_addr, StreamId stream_id, uint32_t flags,
+                  const uint8_t* head, size_t head_len, const uint8_t* data, size_t len);
 };
 
 } // namespace quicftp
 
 #endif
-
@@ -0,0 +1,37 @@
+// transport.cc
+
+#include "transport.h"
+#include "test_bridge.h"
+#include "udp_transport.h"
+#include <cstdlib>
+
+namespace quicftp {
+
+bool parse_transport_kind(const std::string& text, TransportKind& kind) {
+  if (text == "bridge") {
+    kind = TransportKind::Bridge;
+  } else if (text == "udp") {
+    kind = TransportKind::Udp;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+Transport& Transport::get(TransportKind kind) {
+  if (kind == TransportKind::Udp) {
+    return UdpTransport::instance();
+  }
+  return TestBridge::instance();
+}
+
+TransportKind Transport::default_kind() {
+  TransportKind kind = TransportKind::Bridge;
+  const char* name = std::getenv("QUICFTP_TRANSPORT");
+  if (name) {
+    parse_transport_kind(name, kind);
+  }
+  return kind;
+}
+
+} // namespace quicftp
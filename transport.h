@@ -0,0 +1,130 @@
+// transport.h
+// Carries client streams between the wrappers and the peer
+// Each side sees ordered byte streams per (client, stream), plus end, reset
+// and disconnect markers. Two backends implement it: the shared-memory
+// TestBridge for client and server on one host, and UdpTransport, which
+// speaks a QUIC-like protocol over UDP sockets.
+
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include "quic_common.h"
+#include "buffer_pool.h"
+#include "congestion_control.h"
+#include "fec.h"
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+namespace quicftp {
+
+enum class TransportKind {
+  Bridge, // shared-memory rings, same host only
+  Udp     // UDP datagrams, anywhere reachable
+};
+
+// Packet counters of a transport that has them
+struct TransportStats {
+  uint64_t packets_sent = 0;
+  uint64_t packets_received = 0;
+  uint64_t packets_lost = 0;
+  uint64_t bytes_sent = 0;
+  uint64_t bytes_received = 0;
+  uint64_t bytes_retransmitted = 0;
+  uint64_t smoothed_rtt_us = 0;   // of the most recently active connection
+  uint64_t congestion_window = 0; // bytes, likewise
+  uint64_t send_calls = 0;        // system calls that sent packets
+  uint64_t receive_calls = 0;     // and that received them
+  std::string io_backend;         // how: "mmsg+gso+gro" down to "plain"
+  uint64_t fec_repairs_sent = 0;
+  uint64_t fec_recovered = 0;     // packets rebuilt from repairs instead of resent
+};
+
+// "bridge" or "udp"
+bool parse_transport_kind(const std::string& text, TransportKind& kind);
+
+class Transport {
+public:
+  // Flags reported by receive_from_client() / receive_from_server()
+  static constexpr uint32_t kEndOfStream = 0x1; // sender finished the stream
+  static constexpr uint32_t kResetStream = 0x2; // sender abandoned the stream
+  static constexpr uint32_t kDisconnect = 0x4;  // client is going away
+
+  // The backend of kind; both live for the whole process
+  static Transport& get(TransportKind kind);
+
+  // From QUICFTP_TRANSPORT ("bridge" or "udp"), Bridge if unset
+  static TransportKind default_kind();
+
+  virtual ~Transport() = default;
+
+  // Client side: reach the server at server_address ("host[:port]") under
+  // the name client_addr, which the calls below then take. Blocks until the
+  // server answers or gives up.
+  virtual bool open_client_channel(const std::string& client_addr, const std::string& server_address) = 0;
+  virtual void close_client_channel(const std::string& client_addr) = 0;
+
+  // Client side: send head followed by data on stream_id. The two parts are
+  // gathered by the transport, so a frame header and its payload need not be
+  // joined first. Blocks while the transport is backed up.
+  virtual bool send_to_server(const std::string& client_addr, StreamId stream_id, const uint8_t* head,
+                              size_t head_len, const uint8_t* data, size_t len) = 0;
+
+  // Client side: no more data follows on stream_id / abandon stream_id
+  virtual bool finish_stream(const std::string& client_addr, StreamId stream_id) = 0;
+  virtual bool reset_stream(const std::string& client_addr, StreamId stream_id) = 0;
+
+  // Client side: tell the server this client is gone
+  virtual bool disconnect(const std::string& client_addr) = 0;
+
+  // Client side: receive what the server sent, waiting up to timeout_ms. The
+  // data is placed in a buffer from BufferPool (empty for a bare flag).
+  virtual bool receive_from_server(const std::string& client_addr, StreamId& stream_id, BufferRef& data,
+                                   uint32_t* flags, int timeout_ms) = 0;
+
+  // Server side: accept clients on port, spread over `shards` queues that
+  // each have a single consumer. Every client sticks to one shard.
+  virtual bool listen(size_t shards, int port) = 0;
+  virtual void stop_listening() = 0;
+
+  // Server side: receive from a shard into a pooled buffer as for
+  // receive_from_server(); flags carries kEndOfStream/kResetStream/kDisconnect
+  virtual bool receive_from_client(size_t shard, std::string& client_addr, StreamId& stream_id, BufferRef& data,
+                                   uint32_t* flags = nullptr) = 0;
+
+  // Server side: reply on one of a client's streams, gathered as for
+  // send_to_server(); false once the client is gone
+  virtual bool send_to_client(const std::string& client_addr, StreamId stream_id, const uint8_t* head,
+                              size_t head_len, const uint8_t* data, size_t len, uint32_t flags = 0) = 0;
+
+  // Server side: drop what is kept about a client that disconnected
+  virtual void forget_client(const std::string& client_addr) = 0;
+
+  // Server side: whether a shard has something to receive; block until it
+  // does or timeout_ms elapses; make a blocked wait return early
+  virtual bool has_data(size_t shard) const = 0;
+  virtual bool wait_for_data(size_t shard, int timeout_ms) = 0;
+  virtual void interrupt_wait(size_t shard) = 0;
+
+  // Congestion control for connections set up from now on, where the
+  // backend has any (the bridge has no network to congest)
+  virtual void set_congestion_control(CongestionAlgorithm algorithm) {
+    (void)algorithm;
+  }
+
+  // Forward error correction for packets sent from now on, where the
+  // backend can lose any
+  virtual void set_fec(const FecConfig& config) {
+    (void)config;
+  }
+
+  // Counters since start, if the backend keeps any
+  virtual bool stats(TransportStats& stats) const {
+    (void)stats;
+    return false;
+  }
+};
+
+} // namespace quicftp
+
+#endif
@@ -0,0 +1,2197 @@
+// udp_transport.cc
+
+#include "udp_transport.h"
+#include "congestion_control.h"
+#include "fec.h"
+#include "link_emulator.h"
+#include "packet_io.h"
+#include "wire_protocol.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <random>
+#include <thread>
+#include <unordered_map>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+namespace quicftp {
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// Port a client dials when the server address names none
+constexpr int kDefaultPort = 4433;
+
+// Largest datagram sent; fits a 1500-byte Ethernet MTU even over IPv6
+constexpr size_t kMaxDatagramSize = 1452;
+constexpr size_t kConnectionIdSize = 8;
+
+// Packet types, the first byte of every datagram. Initial (client) and
+// Handshake (server) carry both connection ids and set a connection up;
+// Short packets carry the receiver's id, a packet number and frames.
+constexpr uint8_t kPacketInitial = 0xc0;
+constexpr uint8_t kPacketHandshake = 0xc1;
+constexpr uint8_t kPacketShort = 0x40;
+constexpr size_t kShortHeaderMax = 1 + kConnectionIdSize + 8;
+// FEC repair packets carry the receiver's id, the packet number that starts
+// their block, the block's size, the repair's index and then the repair
+// symbol. They have no packet number and are never acknowledged.
+constexpr uint8_t kPacketRepair = 0x42;
+constexpr size_t kRepairHeaderMax = 1 + kConnectionIdSize + 8 + 2;
+
+// Frame types
+constexpr uint8_t kFramePing = 0x01;
+constexpr uint8_t kFrameAck = 0x02;         // largest, delay us, range count, first range, (gap, range)...
+constexpr uint8_t kFrameResetStream = 0x04; // stream
+constexpr uint8_t kFrameStream = 0x08;      // stream, offset, length, data; | kStreamFin on the last
+constexpr uint8_t kStreamFin = 0x01;
+constexpr uint8_t kFrameMaxData = 0x10;     // total stream bytes the peer may send
+constexpr uint8_t kFrameClose = 0x1c;
+constexpr uint8_t kFrameFecRecovered = 0x20; // packets rebuilt from repairs so far
+
+// STREAM frame header at its largest
+constexpr size_t kStreamFrameOverhead = 1 + 3 * 8;
+
+// A packet in an FEC block is encoded as a symbol of its length, two bytes,
+// then its bytes; it is kept short enough for that symbol to fit a repair
+constexpr size_t kFecLengthSize = 2;
+constexpr size_t kFecSymbolMax = kMaxDatagramSize - kRepairHeaderMax;
+constexpr size_t kProtectedDatagramSize = kFecSymbolMax - kFecLengthSize;
+
+// Packets a receiver keeps, once the peer sends repairs, to rebuild others
+// from; and blocks whose repairs wait for enough of them
+constexpr size_t kFecHistory = 256;
+constexpr size_t kFecPendingBlocks = 8;
+
+// The sender's loss rate, which adaptive FEC sizes blocks' repairs by, is
+// sampled every this many packets
+constexpr uint64_t kFecLossSample = 256;
+
+// Stream bytes a receiver takes before the application has read them
+constexpr uint64_t kReceiveWindow = 16 * 1024 * 1024;
+
+// Connections a server endpoint keeps; Initials beyond this are ignored
+constexpr size_t kMaxConnections = 1024;
+
+// Paced packets may bunch up to this long's worth, and never fewer than
+// kPacingBurstPackets, so the I/O thread wakes a few thousand times a second
+// rather than for every datagram
+constexpr auto kPacingBurstTime = std::chrono::microseconds(250);
+constexpr size_t kPacingBurstPackets = 2;
+
+// Stream bytes queued per connection before senders block
+constexpr size_t kMaxQueuedSend = 4 * 1024 * 1024;
+constexpr int kSendTimeoutMs = 10000;
+
+// Stream data is queued, and delivered, in buffers of this size
+constexpr size_t kChunkSize = 64 * 1024;
+
+// Acknowledge every second packet, or after kMaxAckDelay, whichever is first
+constexpr int kAckEveryPackets = 2;
+constexpr auto kMaxAckDelay = std::chrono::milliseconds(5);
+constexpr size_t kMaxAckRanges = 32;
+constexpr size_t kMaxAckRangesSent = 16;
+
+// Loss detection (RFC 9002): a packet is lost once kPacketThreshold later
+// ones are acknowledged, or 9/8 of an RTT after a later one was
+constexpr uint64_t kPacketThreshold = 3;
+// Losses spanning this many PTOs, with nothing between them acknowledged, are
+// persistent congestion (RFC 9002 section 7.6)
+constexpr int kPersistentCongestionThreshold = 3;
+constexpr auto kInitialRtt = std::chrono::milliseconds(100);
+constexpr auto kGranularity = std::chrono::milliseconds(1);
+
+constexpr int kConnectTimeoutMs = 5000;
+constexpr int kConnectRetryMs = 200;
+constexpr auto kKeepAlive = std::chrono::seconds(5);
+constexpr auto kIdleTimeout = std::chrono::seconds(30);
+
+constexpr int kSocketBufferSize = 8 * 1024 * 1024;
+
+// Datagrams read, or built, per turn of the I/O loop; a send batch holds a
+// few GSO runs
+constexpr size_t kReadBatch = 256;
+constexpr size_t kSendBatch = 256;
+
+constexpr auto kMaxLoopWait = std::chrono::seconds(1);
+
+void put_cid(uint8_t* out, uint64_t cid) {
+  for (size_t i = 0; i < kConnectionIdSize; ++i) {
+    out[i] = static_cast<uint8_t>(cid >> (8 * (kConnectionIdSize - 1 - i)));
+  }
+}
+
+uint64_t get_cid(const uint8_t* in) {
+  uint64_t cid = 0;
+  for (size_t i = 0; i < kConnectionIdSize; ++i) {
+    cid = (cid << 8) | in[i];
+  }
+  return cid;
+}
+
+std::string format_peer(const sockaddr_storage& addr) {
+  char host[INET6_ADDRSTRLEN] = "?";
+  int port = 0;
+  if (addr.ss_family == AF_INET) {
+    const auto& in = reinterpret_cast<const sockaddr_in&>(addr);
+    inet_ntop(AF_INET, &in.sin_addr, host, sizeof(host));
+    port = ntohs(in.sin_port);
+  } else if (addr.ss_family == AF_INET6) {
+    const auto& in6 = reinterpret_cast<const sockaddr_in6&>(addr);
+    inet_ntop(AF_INET6, &in6.sin6_addr, host, sizeof(host));
+    port = ntohs(in6.sin6_port);
+    // Dual-stack sockets see IPv4 peers as ::ffff:a.b.c.d
+    if (std::strncmp(host, "::ffff:", 7) == 0) {
+      std::memmove(host, host + 7, std::strlen(host + 7) + 1);
+    } else {
+      return "[" + std::string(host) + "]:" + std::to_string(port);
+    }
+  }
+  return std::string(host) + ":" + std::to_string(port);
+}
+
+// "host", "host:port" or "[v6addr]:port"
+bool resolve(const std::string& address, sockaddr_storage& out, socklen_t& out_len) {
+  std::string host = address;
+  std::string port = std::to_string(kDefaultPort);
+  if (!address.empty() && address[0] == '[') {
+    size_t close = address.find(']');
+    if (close == std::string::npos) return false;
+    host = address.substr(1, close - 1);
+    if (close + 1 < address.size() && address[close + 1] == ':') {
+      port = address.substr(close + 2);
+    }
+  } else if (std::count(address.begin(), address.end(), ':') == 1) {
+    size_t colon = address.find(':');
+    host = address.substr(0, colon);
+    port = address.substr(colon + 1);
+  }
+
+  addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+  addrinfo* result = nullptr;
+  if (getaddrinfo(host.c_str(), port.c_str(), &hints, &result) != 0 || !result) {
+    return false;
+  }
+  // Prefer IPv4 for names like localhost that resolve both ways, as a server
+  // bound to one family only still hears it
+  addrinfo* chosen = result;
+  for (addrinfo* ai = result; ai; ai = ai->ai_next) {
+    if (ai->ai_family == AF_INET) {
+      chosen = ai;
+      break;
+    }
+  }
+  std::memcpy(&out, chosen->ai_addr, chosen->ai_addrlen);
+  out_len = chosen->ai_addrlen;
+  freeaddrinfo(result);
+  return true;
+}
+
+// Stream bytes inside a queued buffer, or a bare FIN or RESET_STREAM
+struct Piece {
+  StreamId stream = 0;
+  uint64_t offset = 0;
+  BufferRef buffer;
+  size_t pos = 0;
+  size_t len = 0;
+  bool fin = false;
+  bool reset = false;
+};
+
+struct SentPacket {
+  Clock::time_point sent_at;
+  size_t size = 0;
+  bool ack_eliciting = false;
+  bool max_data = false;
+  std::vector<Piece> pieces;
+  uint64_t previous_eliciting = 0; // number + 1 of the ack-eliciting packet sent before, 0 if none
+
+  // Where loss detection counts from: the packet itself, or once its FEC
+  // block's repairs are out, the block's last packet and when they went. A
+  // protected packet is not given up on while its repairs can still save it.
+  uint64_t loss_pn = 0;
+  Clock::time_point loss_clock;
+
+  // Connection's delivery state when sent, to measure the delivery rate
+  // over its flight when it is acknowledged
+  uint64_t delivered = 0;
+  Clock::time_point delivered_time;
+  Clock::time_point first_sent_time;
+  bool app_limited = false;
+};
+
+struct ReceiveStream {
+  uint64_t next = 0;                               // offset delivered up to
+  uint64_t highest = 0;                            // end of the data received
+  std::map<uint64_t, std::vector<uint8_t>> early;  // arrived ahead of next, no overlaps
+  bool fin_known = false;
+  uint64_t fin_offset = 0;
+  bool done = false;                               // ended or reset
+  BufferRef staging;                               // in order, not yet delivered
+};
+
+// Repairs received for one FEC block, waiting for enough of its packets
+struct FecBlock {
+  size_t size = 0;        // source packets
+  size_t symbol_len = 0;
+  std::vector<size_t> indexes;
+  std::vector<std::vector<uint8_t>> repairs;
+};
+
+} // namespace
+
+struct UdpConnection {
+  std::string name;
+  uint64_t local_cid = 0;
+  uint64_t peer_cid = 0;
+  sockaddr_storage peer = {};
+  socklen_t peer_len = 0;
+  bool established = false;
+  bool closed = false;
+  bool close_pending = false;     // CONNECTION_CLOSE still to send
+  bool handshake_pending = false; // server: Handshake still to send
+  Clock::time_point last_received;
+  Clock::time_point last_sent;
+
+  // Sending: new data waits in queue, lost data in lost, ahead of it
+  std::deque<Piece> queue;
+  size_t queued_bytes = 0;
+  std::map<StreamId, uint64_t> send_offsets;
+  std::deque<Piece> lost;
+  uint64_t next_packet_number = 0;
+  std::map<uint64_t, SentPacket> sent;
+  size_t bytes_in_flight = 0;
+  std::unique_ptr<CongestionController> congestion;
+  uint64_t delivered = 0;             // bytes acknowledged so far
+  Clock::time_point delivered_time;   // when delivered last grew
+  Clock::time_point first_sent_time;  // send time of the newest packet acked
+  double pace_tokens = 0;             // bytes that may leave now
+  Clock::time_point pace_refill;
+  Clock::time_point pace_until;       // when the next paced packet may leave
+  uint64_t largest_acked = 0;
+  bool any_acked = false;
+  Clock::time_point loss_time = Clock::time_point::max();
+  Clock::time_point last_eliciting_sent;
+  uint64_t last_eliciting_pn = 0;     // number + 1, 0 before the first
+  int pto_count = 0;
+  int probes = 0;
+  bool ping_pending = false;
+  uint64_t peer_max_data = kReceiveWindow;
+  uint64_t data_sent = 0;
+  uint64_t packets_sent = 0; // ack-eliciting
+  uint64_t packets_lost = 0;
+
+  // FEC, sending: the open block's repairs, summed as its packets go
+  bool fec_open = false;
+  uint64_t fec_first = 0;      // the block's first packet number
+  size_t fec_count = 0;        // its packets so far
+  size_t fec_symbol_len = 0;   // its longest symbol
+  std::vector<std::vector<uint8_t>> fec_repairs;
+  double fec_loss_rate = -1;   // packets lost or rebuilt by the peer; < 0 until sampled
+  uint64_t fec_sample_sent = 0;
+  uint64_t fec_sample_lost = 0;
+  uint64_t fec_sample_recovered = 0;
+  uint64_t peer_recovered = 0; // as the peer last reported
+
+  // RTT estimate (RFC 9002 section 5)
+  bool has_rtt = false;
+  Clock::time_point first_rtt_sample;
+  Clock::duration latest_rtt = kInitialRtt;
+  Clock::duration smoothed_rtt = kInitialRtt;
+  Clock::duration rtt_var = kInitialRtt / 2;
+  Clock::duration min_rtt = kInitialRtt;
+
+  // Receiving
+  std::map<uint64_t, uint64_t> received; // packet number ranges, first -> last
+  uint64_t ack_floor = 0;                // numbers below were forgotten
+  Clock::time_point largest_received_at;
+  bool ack_pending = false;
+  int unacked_eliciting = 0;
+  Clock::time_point ack_deadline = Clock::time_point::max();
+  std::map<StreamId, ReceiveStream> streams;
+  uint64_t consumed = 0;                 // stream bytes the application read
+  uint64_t max_data_sent = kReceiveWindow;
+  uint64_t data_received = 0;            // sum of the streams' highest offsets
+  bool max_data_pending = false;
+
+  // FEC, receiving: recent packets by number, kept once the peer sends repairs
+  bool fec_seen = false;
+  std::vector<uint8_t> fec_history;     // kFecHistory slots of kMaxDatagramSize
+  std::vector<uint64_t> fec_history_pn; // number + 1 in each slot, 0 if empty
+  std::vector<size_t> fec_history_len;
+  std::map<uint64_t, FecBlock> fec_blocks;
+  uint64_t fec_recovered = 0;
+
+  CongestionController::Rtt rtt() const {
+    return CongestionController::Rtt{smoothed_rtt, min_rtt, latest_rtt};
+  }
+
+  Clock::duration pto() const {
+    return smoothed_rtt + std::max<Clock::duration>(4 * rtt_var, kGranularity) + kMaxAckDelay;
+  }
+
+  // Whether packet pn has arrived, as far as the ranges still kept tell
+  bool has_received(uint64_t pn) const {
+    auto next = received.upper_bound(pn);
+    return next != received.begin() && pn <= std::prev(next)->second;
+  }
+};
+
+namespace {
+
+struct Delivery {
+  std::shared_ptr<UdpConnection> conn;
+  StreamId stream = 0;
+  BufferRef data;
+  uint32_t flags = 0;
+};
+
+struct Datagram {
+  sockaddr_storage addr;
+  socklen_t addr_len;
+  size_t len;
+  uint8_t data[kMaxDatagramSize];
+};
+
+} // namespace
+
+class UdpEndpoint {
+public:
+  UdpEndpoint(bool server, uint8_t shard, CongestionAlgorithm algorithm, const FecConfig& fec);
+  ~UdpEndpoint();
+
+  UdpEndpoint(const UdpEndpoint&) = delete;
+  UdpEndpoint& operator=(const UdpEndpoint&) = delete;
+
+  // Server: accept connections on port
+  bool listen(int port, bool reuse_port);
+  // Client: set up the one connection to server_address
+  bool connect(const std::string& server_address);
+  // Say goodbye to every peer, then stop the I/O thread
+  void close();
+
+  bool send(const std::string& name, StreamId stream, const uint8_t* head, size_t head_len, const uint8_t* data,
+            size_t len, uint32_t flags);
+  bool disconnect(const std::string& name);
+  void forget(const std::string& name);
+  bool receive(std::string& name, StreamId& stream, BufferRef& data, uint32_t* flags, int timeout_ms);
+
+  bool has_data() const;
+  bool wait_for_data(int timeout_ms);
+  void interrupt_wait();
+
+  void add_stats(TransportStats& stats) const;
+
+  // For connections set up from now on
+  void set_congestion_control(CongestionAlgorithm algorithm) { algorithm_ = algorithm; }
+  void set_fec(const FecConfig& fec);
+
+  // The client's one connection
+  const std::string& peer_name() const { return peer_name_; }
+
+private:
+  bool server_;
+  uint8_t shard_;
+  int fd_;
+  int wake_fd_;
+  int timer_fd_; // paces sends and runs the protocol timers
+  std::atomic<CongestionAlgorithm> algorithm_;
+  std::thread io_thread_;
+  std::atomic<bool> running_;
+  std::string peer_name_;
+  std::mt19937_64 random_;
+
+  // Connection state, shared by the I/O thread and senders
+  mutable std::mutex mutex_;
+  std::condition_variable send_cv_; // queue room, connection set up or closed
+  std::unordered_map<uint64_t, std::shared_ptr<UdpConnection>> by_cid_;
+  std::unordered_map<uint64_t, std::shared_ptr<UdpConnection>> by_peer_cid_; // server: Initial retries
+  std::unordered_map<std::string, std::shared_ptr<UdpConnection>> by_name_;
+  std::vector<Delivery> pending_;   // built while processing, published after
+  std::vector<std::pair<std::shared_ptr<UdpConnection>, StreamId>> staged_;
+  TransportStats stats_;
+  FecConfig fec_;
+
+  // What the application has yet to receive
+  mutable std::mutex inbound_mutex_;
+  std::condition_variable inbound_cv_;
+  std::deque<Delivery> inbound_;
+  bool interrupted_;
+
+  // I/O thread only
+  std::unique_ptr<PacketIo> io_;
+  std::unique_ptr<LinkEmulator> link_; // what sent datagrams pass through first, if emulating a path
+  std::vector<LinkEmulator::Packet> released_;
+  std::deque<LinkEmulator::Packet> unsent_; // the socket had no room; they go first
+  std::vector<Datagram> out_;
+  std::vector<PacketIo::Outgoing> outgoing_;
+  std::vector<PacketIo::Incoming> incoming_;
+
+  bool open_socket(int family, int port, bool reuse_port);
+  void wake();
+  void run();
+  void read_datagrams();
+  void flush();
+  bool send_unsent();
+  void count_sent(size_t count); // the first count of outgoing_
+  void update_io_stats(); // mutex_ held
+  void publish();
+  Clock::time_point next_deadline(Clock::time_point now);
+  void on_timers(Clock::time_point now);
+
+  // All below run with mutex_ held
+  uint64_t new_cid();
+  std::shared_ptr<UdpConnection> add_connection(uint64_t peer_cid, const sockaddr_storage& peer,
+                                                socklen_t peer_len);
+  void process(const uint8_t* data, size_t len, const sockaddr_storage& from, socklen_t from_len,
+               Clock::time_point now);
+  bool process_frames(UdpConnection& conn, const std::shared_ptr<UdpConnection>& ref, const uint8_t* p,
+                      const uint8_t* end, Clock::time_point now, bool& eliciting);
+  bool record_packet_number(UdpConnection& conn, uint64_t pn);
+  void on_ack(UdpConnection& conn, const uint8_t*& p, const uint8_t* end, Clock::time_point now, bool& ok);
+  void on_repair(const uint8_t* data, size_t len, Clock::time_point now);
+  void keep_for_fec(UdpConnection& conn, uint64_t pn, const uint8_t* data, size_t len);
+  void fec_recover(const std::shared_ptr<UdpConnection>& conn, uint64_t first, Clock::time_point now);
+  void update_rtt(UdpConnection& conn, Clock::duration sample, Clock::duration ack_delay);
+  void detect_lost(UdpConnection& conn, Clock::time_point now);
+  void lose(UdpConnection& conn, SentPacket& packet);
+  // Whether a paced datagram may leave now; if not, sets conn.pace_until
+  bool pacer_ready(UdpConnection& conn, Clock::time_point now);
+  // False if the data goes past the credit given the peer
+  bool on_stream(const std::shared_ptr<UdpConnection>& conn, StreamId stream, uint64_t offset, const uint8_t* data,
+                 size_t len, bool fin);
+  void keep_early(ReceiveStream& rs, uint64_t offset, const uint8_t* data, size_t len);
+  void stage(const std::shared_ptr<UdpConnection>& conn, StreamId stream, ReceiveStream& rs, const uint8_t* data,
+             size_t len);
+  void unstage(const std::shared_ptr<UdpConnection>& conn, StreamId stream, ReceiveStream& rs);
+  void close_connection(const std::shared_ptr<UdpConnection>& conn, bool tell_app);
+  void enqueue(UdpConnection& conn, StreamId stream, const uint8_t* data, size_t len);
+  // Append datagrams for conn to out_, up to limit in all
+  void build(UdpConnection& conn, Clock::time_point now, size_t limit);
+  Datagram& next_datagram(const UdpConnection& conn);
+  size_t write_ack(UdpConnection& conn, uint8_t* out, size_t room, Clock::time_point now);
+  // Start an FEC block with this packet, if the loss rate calls for repairs
+  void fec_open(UdpConnection& conn);
+  void fec_add(UdpConnection& conn, const uint8_t* data, size_t len);
+  // Send the open block's repairs
+  void fec_close(UdpConnection& conn, Clock::time_point now);
+};
+
+UdpEndpoint::UdpEndpoint(bool server, uint8_t shard, CongestionAlgorithm algorithm, const FecConfig& fec)
+  : server_(server)
+  , shard_(shard)
+  , fd_(-1)
+  , wake_fd_(-1)
+  , timer_fd_(-1)
+  , algorithm_(algorithm)
+  , running_(false)
+  , random_(std::random_device()())
+  , fec_(fec)
+  , interrupted_(false)
+{
+  // QUICFTP_LINK="rate=10M,delay=20ms,loss=1%" puts what this side sends
+  // through such a link
+  LinkConditions conditions;
+  if (const char* env = std::getenv("QUICFTP_LINK")) {
+    if (parse_link_conditions(env, conditions)) {
+      link_ = std::make_unique<LinkEmulator>(conditions);
+    } else {
+      std::fprintf(stderr, "Ignoring QUICFTP_LINK: cannot parse \"%s\"\n", env);
+    }
+  }
+}
+
+UdpEndpoint::~UdpEndpoint() {
+  close();
+}
+
+bool UdpEndpoint::open_socket(int family, int port, bool reuse_port) {
+  fd_ = socket(family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd_ < 0) {
+    return false;
+  }
+  int one = 1;
+  if (reuse_port && setsockopt(fd_, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+    ::close(fd_);
+    fd_ = -1;
+    return false;
+  }
+  int size = kSocketBufferSize;
+  setsockopt(fd_, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+  setsockopt(fd_, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+  sockaddr_storage addr = {};
+  socklen_t addr_len;
+  if (family == AF_INET6) {
+    int zero = 0; // dual-stack, so IPv4 clients are heard too
+    setsockopt(fd_, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+    auto& in6 = reinterpret_cast<sockaddr_in6&>(addr);
+    in6.sin6_family = AF_INET6;
+    in6.sin6_addr = in6addr_any;
+    in6.sin6_port = htons(static_cast<uint16_t>(port));
+    addr_len = sizeof(in6);
+  } else {
+    auto& in = reinterpret_cast<sockaddr_in&>(addr);
+    in.sin_family = AF_INET;
+    in.sin_addr.s_addr = htonl(INADDR_ANY);
+    in.sin_port = htons(static_cast<uint16_t>(port));
+    addr_len = sizeof(in);
+  }
+  if (bind(fd_, reinterpret_cast<sockaddr*>(&addr), addr_len) < 0) {
+    ::close(fd_);
+    fd_ = -1;
+    return false;
+  }
+  io_ = std::make_unique<PacketIo>(fd_, kMaxDatagramSize);
+  out_.reserve(kSendBatch);
+  wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (wake_fd_ < 0 || timer_fd_ < 0) {
+    for (int* fd : {&fd_, &wake_fd_, &timer_fd_}) {
+      if (*fd >= 0) ::close(*fd);
+      *fd = -1;
+    }
+    return false;
+  }
+  running_ = true;
+  io_thread_ = std::thread([this]() { run(); });
+  return true;
+}
+
+bool UdpEndpoint::listen(int port, bool reuse_port) {
+  return open_socket(AF_INET6, port, reuse_port) || open_socket(AF_INET, port, reuse_port);
+}
+
+bool UdpEndpoint::connect(const std::string& server_address) {
+  sockaddr_storage peer;
+  socklen_t peer_len;
+  if (!resolve(server_address, peer, peer_len) || !open_socket(peer.ss_family, 0, false)) {
+    return false;
+  }
+  peer_name_ = server_address;
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  std::shared_ptr<UdpConnection> conn = add_connection(0, peer, peer_len);
+  conn->name = peer_name_;
+  by_name_[conn->name] = conn;
+
+  // Initial carries our id; the Handshake answering it carries the server's
+  auto deadline = Clock::now() + std::chrono::milliseconds(kConnectTimeoutMs);
+  int retry_ms = kConnectRetryMs;
+  while (!conn->established && Clock::now() < deadline) {
+    uint8_t packet[1 + 2 * kConnectionIdSize];
+    packet[0] = kPacketInitial;
+    put_cid(packet + 1, new_cid());
+    put_cid(packet + 1 + kConnectionIdSize, conn->local_cid);
+    sendto(fd_, packet, sizeof(packet), 0, reinterpret_cast<const sockaddr*>(&peer), peer_len);
+    send_cv_.wait_until(lock, std::min(deadline, Clock::now() + std::chrono::milliseconds(retry_ms)),
+                        [&]() { return conn->established; });
+    retry_ms *= 2;
+  }
+  return conn->established;
+}
+
+void UdpEndpoint::close() {
+  if (running_.exchange(false)) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (auto& [cid, conn] : by_cid_) {
+        if (!conn->closed) {
+          conn->closed = true;
+          conn->close_pending = true;
+        }
+      }
+    }
+    wake();
+    io_thread_.join(); // flushes the closes on its way out
+  }
+  send_cv_.notify_all();
+  if (fd_ >= 0) {
+    ::close(fd_);
+    fd_ = -1;
+  }
+  if (wake_fd_ >= 0) {
+    ::close(wake_fd_);
+    wake_fd_ = -1;
+  }
+  if (timer_fd_ >= 0) {
+    ::close(timer_fd_);
+    timer_fd_ = -1;
+  }
+}
+
+void UdpEndpoint::wake() {
+  uint64_t one = 1;
+  ssize_t rc = write(wake_fd_, &one, sizeof(one));
+  (void)rc; // a saturated counter still wakes the loop
+}
+
+uint64_t UdpEndpoint::new_cid() {
+  while (true) {
+    // The low byte names the shard, so replies find their endpoint by name
+    uint64_t cid = (random_() & ~uint64_t(0xff)) | shard_;
+    if (cid != 0 && by_cid_.count(cid) == 0) {
+      return cid;
+    }
+  }
+}
+
+std::shared_ptr<UdpConnection> UdpEndpoint::add_connection(uint64_t peer_cid, const sockaddr_storage& peer,
+                                                           socklen_t peer_len) {
+  auto conn = std::make_shared<UdpConnection>();
+  conn->local_cid = new_cid();
+  conn->peer_cid = peer_cid;
+  conn->peer = peer;
+  conn->peer_len = peer_len;
+  conn->last_received = Clock::now();
+  conn->last_sent = conn->last_received;
+  conn->congestion = CongestionController::create(algorithm_, kMaxDatagramSize);
+  conn->pace_refill = conn->last_received;
+  conn->pace_tokens = static_cast<double>(conn->congestion->congestion_window());
+  by_cid_[conn->local_cid] = conn;
+  return conn;
+}
+
+bool UdpEndpoint::send(const std::string& name, StreamId stream, const uint8_t* head, size_t head_len,
+                       const uint8_t* data, size_t len, uint32_t flags) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto it = by_name_.find(name);
+  if (it == by_name_.end()) {
+    return false;
+  }
+  std::shared_ptr<UdpConnection> conn = it->second;
+  if (head_len + len > 0) {
+    // Backpressure: wait for the I/O thread to move queued data out
+    auto deadline = Clock::now() + std::chrono::milliseconds(kSendTimeoutMs);
+    if (!send_cv_.wait_until(lock, deadline,
+                             [&]() { return conn->closed || conn->queued_bytes < kMaxQueuedSend; })) {
+      return false;
+    }
+  }
+  if (conn->closed) {
+    return false;
+  }
+
+  if (flags & Transport::kResetStream) {
+    // Nothing more of the stream goes out, not even what was lost
+    auto unsent = [stream](const Piece& piece) { return piece.stream == stream && !piece.reset; };
+    for (const Piece& piece : conn->queue) {
+      if (unsent(piece)) conn->queued_bytes -= piece.len;
+    }
+    conn->queue.erase(std::remove_if(conn->queue.begin(), conn->queue.end(), unsent), conn->queue.end());
+    conn->lost.erase(std::remove_if(conn->lost.begin(), conn->lost.end(), unsent), conn->lost.end());
+    Piece reset;
+    reset.stream = stream;
+    reset.reset = true;
+    conn->queue.push_back(reset);
+  } else {
+    enqueue(*conn, stream, head, head_len);
+    enqueue(*conn, stream, data, len);
+    if (flags & Transport::kEndOfStream) {
+      Piece* tail = conn->queue.empty() ? nullptr : &conn->queue.back();
+      if (tail && tail->stream == stream && !tail->reset && !tail->fin) {
+        tail->fin = true;
+      } else {
+        Piece fin;
+        fin.stream = stream;
+        fin.offset = conn->send_offsets[stream];
+        fin.fin = true;
+        conn->queue.push_back(fin);
+      }
+    }
+  }
+  lock.unlock();
+  wake();
+  return true;
+}
+
+void UdpEndpoint::enqueue(UdpConnection& conn, StreamId stream, const uint8_t* data, size_t len) {
+  uint64_t& offset = conn.send_offsets[stream];
+  while (len > 0) {
+    // Top up the last buffer if it holds this stream's latest bytes
+    Piece* tail = conn.queue.empty() ? nullptr : &conn.queue.back();
+    if (!tail || tail->stream != stream || tail->reset || tail->fin || !tail->buffer ||
+        tail->pos + tail->len == tail->buffer.capacity()) {
+      Piece piece;
+      piece.stream = stream;
+      piece.offset = offset;
+      piece.buffer = BufferPool::instance().acquire(kChunkSize);
+      conn.queue.push_back(piece);
+      tail = &conn.queue.back();
+    }
+    size_t n = std::min(len, tail->buffer.capacity() - tail->pos - tail->len);
+    std::memcpy(tail->buffer.data() + tail->pos + tail->len, data, n);
+    tail->len += n;
+    conn.queued_bytes += n;
+    offset += n;
+    data += n;
+    len -= n;
+  }
+}
+
+bool UdpEndpoint::disconnect(const std::string& name) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = by_name_.find(name);
+    if (it == by_name_.end() || it->second->closed) {
+      return false;
+    }
+    it->second->closed = true;
+    it->second->close_pending = true;
+  }
+  send_cv_.notify_all();
+  wake();
+  return true;
+}
+
+void UdpEndpoint::forget(const std::string& name) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = by_name_.find(name);
+  if (it == by_name_.end()) {
+    return;
+  }
+  std::shared_ptr<UdpConnection> conn = it->second;
+  by_name_.erase(it);
+  by_cid_.erase(conn->local_cid);
+  by_peer_cid_.erase(conn->peer_cid);
+  conn->closed = true;
+}
+
+bool UdpEndpoint::receive(std::string& name, StreamId& stream, BufferRef& data, uint32_t* flags, int timeout_ms) {
+  Delivery delivery;
+  {
+    std::unique_lock<std::mutex> lock(inbound_mutex_);
+    if (timeout_ms != 0 &&
+        !inbound_cv_.wait_for(lock, std::chrono::milliseconds(std::max(timeout_ms, 0)),
+                              [this]() { return !inbound_.empty(); })) {
+      return false;
+    }
+    if (inbound_.empty()) {
+      return false;
+    }
+    delivery = std::move(inbound_.front());
+    inbound_.pop_front();
+  }
+  name = delivery.conn->name;
+  stream = delivery.stream;
+  data = std::move(delivery.data);
+  if (flags) {
+    *flags = delivery.flags;
+  }
+
+  if (!data.empty()) {
+    // Reading frees receive window; top the peer's credit up once a quarter
+    // of it has been used, rather than for every buffer
+    std::lock_guard<std::mutex> lock(mutex_);
+    UdpConnection& conn = *delivery.conn;
+    conn.consumed += data.size();
+    if (conn.consumed + kReceiveWindow - conn.max_data_sent >= kReceiveWindow / 4 && !conn.closed) {
+      conn.max_data_pending = true;
+      wake();
+    }
+  }
+  return true;
+}
+
+bool UdpEndpoint::has_data() const {
+  std::lock_guard<std::mutex> lock(inbound_mutex_);
+  return !inbound_.empty();
+}
+
+bool UdpEndpoint::wait_for_data(int timeout_ms) {
+  std::unique_lock<std::mutex> lock(inbound_mutex_);
+  inbound_cv_.wait_for(lock, std::chrono::milliseconds(timeout_ms),
+                       [this]() { return !inbound_.empty() || interrupted_; });
+  interrupted_ = false;
+  return !inbound_.empty();
+}
+
+void UdpEndpoint::interrupt_wait() {
+  {
+    std::lock_guard<std::mutex> lock(inbound_mutex_);
+    interrupted_ = true;
+  }
+  inbound_cv_.notify_all();
+}
+
+void UdpEndpoint::set_fec(const FecConfig& fec) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  fec_ = fec;
+}
+
+void UdpEndpoint::add_stats(TransportStats& stats) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  stats.packets_sent += stats_.packets_sent;
+  stats.packets_received += stats_.packets_received;
+  stats.packets_lost += stats_.packets_lost;
+  stats.bytes_sent += stats_.bytes_sent;
+  stats.bytes_received += stats_.bytes_received;
+  stats.bytes_retransmitted += stats_.bytes_retransmitted;
+  if (stats_.smoothed_rtt_us > 0) {
+    stats.smoothed_rtt_us = stats_.smoothed_rtt_us;
+    stats.congestion_window = stats_.congestion_window;
+  }
+  stats.send_calls += stats_.send_calls;
+  stats.receive_calls += stats_.receive_calls;
+  stats.fec_repairs_sent += stats_.fec_repairs_sent;
+  stats.fec_recovered += stats_.fec_recovered;
+  if (stats.io_backend.empty()) {
+    stats.io_backend = stats_.io_backend;
+  }
+}
+
+void UdpEndpoint::run() {
+  while (running_) {
+    Clock::time_point now = Clock::now();
+    Clock::time_point deadline;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      deadline = next_deadline(now);
+    }
+    if (link_) {
+      deadline = std::min(deadline, link_->next_due());
+    }
+    if (!unsent_.empty()) {
+      // Sending waits for room in the socket, so deadlines already passed,
+      // which are for sends, must not spin the loop meanwhile
+      deadline = std::max(deadline, now + kGranularity);
+    }
+    // The timer has nanosecond resolution, which pacing needs and poll's
+    // millisecond timeout lacks; steady_clock is CLOCK_MONOTONIC
+    int timeout = 0;
+    if (deadline > now) {
+      auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline.time_since_epoch()).count();
+      itimerspec spec = {};
+      spec.it_value.tv_sec = static_cast<time_t>(ns / 1000000000);
+      spec.it_value.tv_nsec = static_cast<long>(ns % 1000000000);
+      timerfd_settime(timer_fd_, TFD_TIMER_ABSTIME, &spec, nullptr);
+      timeout = -1;
+    }
+    short events = unsent_.empty() ? POLLIN : POLLIN | POLLOUT;
+    pollfd fds[3] = {{fd_, events, 0}, {wake_fd_, POLLIN, 0}, {timer_fd_, POLLIN, 0}};
+    poll(fds, 3, timeout);
+    uint64_t count;
+    if (fds[1].revents & POLLIN) {
+      while (read(wake_fd_, &count, sizeof(count)) > 0) {}
+    }
+    if (fds[2].revents & POLLIN) {
+      while (read(timer_fd_, &count, sizeof(count)) > 0) {}
+    }
+    if (fds[0].revents & POLLIN) {
+      read_datagrams();
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      on_timers(Clock::now());
+    }
+    publish();
+    flush();
+  }
+  flush();
+}
+
+Clock::time_point UdpEndpoint::next_deadline(Clock::time_point now) {
+  Clock::time_point next = now + kMaxLoopWait;
+  for (const auto& [cid, conn] : by_cid_) {
+    if (conn->closed) {
+      continue;
+    }
+    next = std::min(next, conn->ack_deadline);
+    next = std::min(next, conn->loss_time);
+    if (!conn->sent.empty()) {
+      next = std::min(next, conn->last_eliciting_sent + conn->pto() * (1 << std::min(conn->pto_count, 16)));
+    }
+    next = std::min(next, conn->last_sent + kKeepAlive);
+    if (conn->pace_until > now && (!conn->lost.empty() || !conn->queue.empty())) {
+      next = std::min(next, conn->pace_until);
+    }
+  }
+  return next;
+}
+
+void UdpEndpoint::on_timers(Clock::time_point now) {
+  std::vector<std::shared_ptr<UdpConnection>> expired;
+  for (auto& [cid, ref] : by_cid_) {
+    UdpConnection& conn = *ref;
+    if (conn.closed) {
+      continue;
+    }
+    if (now - conn.last_received > kIdleTimeout) {
+      expired.push_back(ref);
+      continue;
+    }
+    if (conn.loss_time <= now) {
+      detect_lost(conn, now);
+    }
+    if (!conn.sent.empty() &&
+        now >= conn.last_eliciting_sent + conn.pto() * (1 << std::min(conn.pto_count, 16))) {
+      // Acknowledgements stopped: send probes past the in-flight limit and
+      // back off. A probe timeout is not a loss (RFC 9002 section 6.2): the
+      // window stays, and the packets stay in flight until an ACK or loss
+      // detection settles them. Probes carry new data if there is any, else
+      // a copy of the oldest packet's data, else a PING.
+      conn.pto_count++;
+      conn.probes = 2;
+      bool have_data = !conn.lost.empty() || (!conn.queue.empty() && conn.data_sent < conn.peer_max_data);
+      if (!have_data) {
+        for (const Piece& piece : conn.sent.begin()->second.pieces) {
+          stats_.bytes_retransmitted += piece.len;
+          conn.lost.push_back(piece);
+        }
+      }
+      if (conn.lost.empty() && !have_data) {
+        conn.ping_pending = true;
+      }
+      conn.last_eliciting_sent = now;
+    }
+    if (conn.established && now - conn.last_sent >= kKeepAlive) {
+      conn.ping_pending = true;
+    }
+  }
+  for (auto& conn : expired) {
+    close_connection(conn, true);
+  }
+}
+
+void UdpEndpoint::read_datagrams() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  size_t count = 0;
+  while (count < kReadBatch && io_->receive(incoming_)) {
+    Clock::time_point now = Clock::now();
+    for (const PacketIo::Incoming& datagram : incoming_) {
+      stats_.packets_received++;
+      stats_.bytes_received += datagram.len;
+      process(datagram.data, datagram.len, *datagram.addr, datagram.addr_len, now);
+    }
+    count += incoming_.size();
+  }
+  update_io_stats();
+  // Whatever arrived in order goes up now rather than when a buffer fills
+  for (auto& [conn, stream] : staged_) {
+    auto it = conn->streams.find(stream);
+    if (it != conn->streams.end()) {
+      unstage(conn, stream, it->second);
+    }
+  }
+  staged_.clear();
+}
+
+void UdpEndpoint::publish() {
+  std::vector<Delivery> ready;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ready.swap(pending_);
+  }
+  if (ready.empty()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(inbound_mutex_);
+    for (Delivery& delivery : ready) {
+      inbound_.push_back(std::move(delivery));
+    }
+  }
+  inbound_cv_.notify_all();
+}
+
+void UdpEndpoint::process(const uint8_t* data, size_t len, const sockaddr_storage& from, socklen_t from_len,
+                          Clock::time_point now) {
+  if (len < 1 + kConnectionIdSize) {
+    return;
+  }
+  uint8_t type = data[0];
+  uint64_t dcid = get_cid(data + 1);
+  const uint8_t* p = data + 1 + kConnectionIdSize;
+  const uint8_t* end = data + len;
+
+  if (type == kPacketInitial || type == kPacketHandshake) {
+    if (end - p < static_cast<ptrdiff_t>(kConnectionIdSize)) {
+      return;
+    }
+    uint64_t scid = get_cid(p);
+    if (type == kPacketInitial && server_) {
+      // A retried Initial finds the connection its first one made
+      auto known = by_peer_cid_.find(scid);
+      std::shared_ptr<UdpConnection> conn;
+      if (known != by_peer_cid_.end()) {
+        conn = known->second;
+      } else if (by_cid_.size() >= kMaxConnections) {
+        return; // full; the client's handshake times out
+      } else {
+        conn = add_connection(scid, from, from_len);
+        conn->established = true;
+        conn->name = format_peer(from) + "#" + [&]() {
+          char hex[17];
+          std::snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(conn->local_cid));
+          return std::string(hex);
+        }();
+        by_peer_cid_[scid] = conn;
+        by_name_[conn->name] = conn;
+      }
+      conn->handshake_pending = true;
+    } else if (type == kPacketHandshake && !server_) {
+      auto it = by_cid_.find(dcid);
+      if (it != by_cid_.end() && !it->second->established) {
+        it->second->peer_cid = scid;
+        it->second->established = true;
+        it->second->last_received = now;
+        send_cv_.notify_all();
+      }
+    }
+    return;
+  }
+  if (type == kPacketRepair) {
+    on_repair(data, len, now);
+    return;
+  }
+  if (type != kPacketShort) {
+    return;
+  }
+
+  auto it = by_cid_.find(dcid);
+  if (it == by_cid_.end() || it->second->closed || !it->second->established) {
+    return;
+  }
+  std::shared_ptr<UdpConnection> ref = it->second;
+  UdpConnection& conn = *ref;
+  uint64_t pn;
+  if (!get_varint(p, end, pn)) {
+    return;
+  }
+  conn.last_received = now;
+  // Follow a peer whose address changed, e.g. behind a NAT rebinding
+  conn.peer = from;
+  conn.peer_len = from_len;
+
+  bool fresh = record_packet_number(conn, pn);
+  if (fresh && conn.fec_seen) {
+    keep_for_fec(conn, pn, data, len);
+  }
+  bool eliciting = false;
+  if (fresh && !process_frames(conn, ref, p, end, now, eliciting)) {
+    return; // malformed; what was understood stands
+  }
+  if (!fresh) {
+    // A duplicate: our acknowledgement was probably lost, repeat it now
+    conn.ack_pending = true;
+    conn.ack_deadline = now;
+    return;
+  }
+  if (eliciting) {
+    conn.ack_pending = true;
+    bool reordered = conn.received.rbegin()->second != pn;
+    if (++conn.unacked_eliciting >= kAckEveryPackets || reordered) {
+      conn.ack_deadline = now;
+    } else {
+      conn.ack_deadline = std::min(conn.ack_deadline, now + kMaxAckDelay);
+    }
+  }
+}
+
+bool UdpEndpoint::record_packet_number(UdpConnection& conn, uint64_t pn) {
+  if (pn < conn.ack_floor) {
+    return false;
+  }
+  auto next = conn.received.upper_bound(pn);
+  if (next != conn.received.begin()) {
+    auto prev = std::prev(next);
+    if (pn <= prev->second) {
+      return false;
+    }
+    if (pn == prev->second + 1) {
+      prev->second = pn;
+      if (next != conn.received.end() && next->first == pn + 1) {
+        prev->second = next->second;
+        conn.received.erase(next);
+      }
+      if (pn == conn.received.rbegin()->second) {
+        conn.largest_received_at = Clock::now();
+      }
+      return true;
+    }
+  }
+  if (next != conn.received.end() && next->first == pn + 1) {
+    uint64_t last = next->second;
+    conn.received.erase(next);
+    conn.received[pn] = last;
+  } else {
+    conn.received[pn] = pn;
+  }
+  if (pn == conn.received.rbegin()->second) {
+    conn.largest_received_at = Clock::now();
+  }
+  // Old ranges are forgotten; anything below them counts as a duplicate
+  while (conn.received.size() > kMaxAckRanges) {
+    conn.ack_floor = conn.received.begin()->second + 1;
+    conn.received.erase(conn.received.begin());
+  }
+  return true;
+}
+
+void UdpEndpoint::keep_for_fec(UdpConnection& conn, uint64_t pn, const uint8_t* data, size_t len) {
+  if (len > kMaxDatagramSize) {
+    return;
+  }
+  size_t slot = static_cast<size_t>(pn % kFecHistory);
+  std::memcpy(&conn.fec_history[slot * kMaxDatagramSize], data, len);
+  conn.fec_history_pn[slot] = pn + 1;
+  conn.fec_history_len[slot] = len;
+}
+
+void UdpEndpoint::on_repair(const uint8_t* data, size_t len, Clock::time_point now) {
+  auto it = by_cid_.find(get_cid(data + 1));
+  if (it == by_cid_.end() || it->second->closed || !it->second->established) {
+    return;
+  }
+  std::shared_ptr<UdpConnection> ref = it->second;
+  UdpConnection& conn = *ref;
+  const uint8_t* p = data + 1 + kConnectionIdSize;
+  const uint8_t* end = data + len;
+  uint64_t first;
+  if (!get_varint(p, end, first) || end - p < 2) {
+    return;
+  }
+  size_t size = *p++;
+  size_t index = *p++;
+  size_t symbol_len = static_cast<size_t>(end - p);
+  if (size == 0 || size > kFecMaxSources || index >= kFecMaxRepairs || symbol_len <= kFecLengthSize) {
+    return;
+  }
+  conn.last_received = now;
+  if (!conn.fec_seen) {
+    // From now on keep packets to rebuild others from; this block's are gone
+    conn.fec_seen = true;
+    conn.fec_history.resize(kFecHistory * kMaxDatagramSize);
+    conn.fec_history_pn.assign(kFecHistory, 0);
+    conn.fec_history_len.assign(kFecHistory, 0);
+  }
+  if (first + size <= conn.ack_floor) {
+    return;
+  }
+  FecBlock& block = conn.fec_blocks[first];
+  if (block.size == 0) {
+    block.size = size;
+    block.symbol_len = symbol_len;
+  }
+  if (block.size != size || block.symbol_len != symbol_len ||
+      std::find(block.indexes.begin(), block.indexes.end(), index) != block.indexes.end()) {
+    return;
+  }
+  block.indexes.push_back(index);
+  block.repairs.emplace_back(p, end);
+  while (conn.fec_blocks.size() > kFecPendingBlocks && conn.fec_blocks.begin()->first != first) {
+    conn.fec_blocks.erase(conn.fec_blocks.begin());
+  }
+  fec_recover(ref, first, now);
+}
+
+void UdpEndpoint::fec_recover(const std::shared_ptr<UdpConnection>& ref, uint64_t first, Clock::time_point now) {
+  UdpConnection& conn = *ref;
+  auto found = conn.fec_blocks.find(first);
+  if (found == conn.fec_blocks.end()) {
+    return;
+  }
+  FecBlock& block = found->second;
+  bool present[kFecMaxSources];
+  size_t missing = 0;
+  for (size_t i = 0; i < block.size; ++i) {
+    if (first + i < conn.ack_floor) {
+      conn.fec_blocks.erase(found); // forgotten which arrived
+      return;
+    }
+    present[i] = conn.has_received(first + i);
+    if (!present[i]) ++missing;
+  }
+  if (missing == 0) {
+    conn.fec_blocks.erase(found);
+    return;
+  }
+  if (missing > block.repairs.size()) {
+    return; // more repairs may yet come
+  }
+
+  // Rebuild the symbols of the packets that arrived, from the history
+  size_t len = block.symbol_len;
+  std::vector<uint8_t> symbols(block.size * len, 0);
+  uint8_t* sources[kFecMaxSources];
+  for (size_t i = 0; i < block.size; ++i) {
+    sources[i] = &symbols[i * len];
+    if (!present[i]) continue;
+    size_t slot = static_cast<size_t>((first + i) % kFecHistory);
+    size_t packet_len = conn.fec_history_len[slot];
+    if (conn.fec_history_pn[slot] != first + i + 1 || kFecLengthSize + packet_len > len) {
+      conn.fec_blocks.erase(found); // arrived before repairs were expected, or too long ago
+      return;
+    }
+    sources[i][0] = static_cast<uint8_t>(packet_len >> 8);
+    sources[i][1] = static_cast<uint8_t>(packet_len);
+    std::memcpy(sources[i] + kFecLengthSize, &conn.fec_history[slot * kMaxDatagramSize], packet_len);
+  }
+  std::vector<const uint8_t*> repairs;
+  for (const std::vector<uint8_t>& repair : block.repairs) {
+    repairs.push_back(repair.data());
+  }
+  bool decoded = fec_decode(block.size, len, sources, present, repairs.data(), block.indexes.data(), repairs.size());
+  size_t size = block.size;
+  conn.fec_blocks.erase(found);
+  if (!decoded) {
+    return;
+  }
+
+  // Take the rebuilt packets in as if they had arrived
+  sockaddr_storage peer = conn.peer;
+  socklen_t peer_len = conn.peer_len;
+  for (size_t i = 0; i < size; ++i) {
+    if (present[i]) continue;
+    size_t packet_len = (static_cast<size_t>(sources[i][0]) << 8) | sources[i][1];
+    if (packet_len == 0 || kFecLengthSize + packet_len > len) {
+      continue;
+    }
+    conn.fec_recovered++;
+    stats_.fec_recovered++;
+    process(sources[i] + kFecLengthSize, packet_len, peer, peer_len, now);
+  }
+}
+
+bool UdpEndpoint::process_frames(UdpConnection& conn, const std::shared_ptr<UdpConnection>& ref, const uint8_t* p,
+                                 const uint8_t* end, Clock::time_point now, bool& eliciting) {
+  while (p < end) {
+    uint8_t type = *p++;
+    if (type == kFramePing) {
+      eliciting = true;
+    } else if (type == kFrameAck) {
+      bool ok = true;
+      on_ack(conn, p, end, now, ok);
+      if (!ok) return false;
+    } else if ((type & ~kStreamFin) == kFrameStream) {
+      uint64_t stream, offset, length;
+      if (!get_varint(p, end, stream) || !get_varint(p, end, offset) || !get_varint(p, end, length) ||
+          length > static_cast<uint64_t>(end - p)) {
+        return false;
+      }
+      eliciting = true;
+      if (!on_stream(ref, stream, offset, p, static_cast<size_t>(length), (type & kStreamFin) != 0)) {
+        // Flow control violated: the peer is broken or hostile
+        close_connection(ref, true);
+        conn.close_pending = true;
+        return true;
+      }
+      p += length;
+    } else if (type == kFrameResetStream) {
+      uint64_t stream;
+      if (!get_varint(p, end, stream)) return false;
+      eliciting = true;
+      ReceiveStream& rs = conn.streams[stream];
+      if (!rs.done) {
+        rs.done = true;
+        rs.early.clear();
+        rs.staging.reset();
+        pending_.push_back(Delivery{ref, stream, BufferRef(), Transport::kResetStream});
+      }
+    } else if (type == kFrameMaxData) {
+      uint64_t limit;
+      if (!get_varint(p, end, limit)) return false;
+      eliciting = true;
+      conn.peer_max_data = std::max(conn.peer_max_data, limit);
+    } else if (type == kFrameFecRecovered) {
+      uint64_t recovered;
+      if (!get_varint(p, end, recovered)) return false;
+      conn.peer_recovered = std::max(conn.peer_recovered, recovered);
+    } else if (type == kFrameClose) {
+      close_connection(ref, true);
+      return true;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+void UdpEndpoint::on_ack(UdpConnection& conn, const uint8_t*& p, const uint8_t* end, Clock::time_point now,
+                         bool& ok) {
+  uint64_t largest, delay_us, range_count, first_range;
+  if (!get_varint(p, end, largest) || !get_varint(p, end, delay_us) || !get_varint(p, end, range_count) ||
+      !get_varint(p, end, first_range) || first_range > largest) {
+    ok = false;
+    return;
+  }
+  std::vector<std::pair<uint64_t, uint64_t>> ranges;
+  ranges.emplace_back(largest - first_range, largest);
+  for (uint64_t i = 0; i < range_count; ++i) {
+    uint64_t gap, length;
+    if (!get_varint(p, end, gap) || !get_varint(p, end, length)) {
+      ok = false;
+      return;
+    }
+    uint64_t below = ranges.back().first;
+    if (below < gap + 2 + length) {
+      ok = false;
+      return;
+    }
+    uint64_t last = below - gap - 2;
+    ranges.emplace_back(last - length, last);
+  }
+
+  bool sample = false;
+  Clock::time_point sample_sent_at;
+  size_t bytes_acked = 0;
+  uint64_t newest_pn = 0;
+  SentPacket newest; // delivery state of the newest packet acked, pieces aside
+  for (const auto& [first, last] : ranges) {
+    auto it = conn.sent.lower_bound(first);
+    while (it != conn.sent.end() && it->first <= last) {
+      const SentPacket& packet = it->second;
+      if (it->first == largest && packet.ack_eliciting) {
+        sample = true;
+        sample_sent_at = packet.sent_at;
+      }
+      if (bytes_acked == 0 || it->first > newest_pn) {
+        newest_pn = it->first;
+        newest.sent_at = packet.sent_at;
+        newest.delivered = packet.delivered;
+        newest.delivered_time = packet.delivered_time;
+        newest.first_sent_time = packet.first_sent_time;
+        newest.app_limited = packet.app_limited;
+      }
+      conn.bytes_in_flight -= packet.size;
+      conn.delivered += packet.size;
+      bytes_acked += packet.size;
+      it = conn.sent.erase(it);
+    }
+  }
+  if (bytes_acked == 0) {
+    return;
+  }
+  if (!conn.any_acked || largest > conn.largest_acked) {
+    conn.largest_acked = largest;
+    conn.any_acked = true;
+  }
+  if (sample) {
+    update_rtt(conn, now - sample_sent_at, std::chrono::microseconds(delay_us));
+  }
+  conn.pto_count = 0;
+
+  // Delivery rate over the newest packet's flight: bytes acked since it was
+  // sent, over the longer of its send and ack intervals so neither a burst
+  // of sends nor a burst of ACKs inflates it
+  conn.delivered_time = now;
+  CongestionController::Ack ack;
+  ack.now = now;
+  ack.bytes_acked = bytes_acked;
+  ack.bytes_in_flight = conn.bytes_in_flight;
+  ack.largest_sent_at = newest.sent_at;
+  ack.delivered = conn.delivered;
+  ack.prior_delivered = newest.delivered;
+  ack.app_limited = newest.app_limited;
+  Clock::duration interval = std::max(newest.sent_at - newest.first_sent_time, now - newest.delivered_time);
+  if (interval > Clock::duration::zero()) {
+    ack.delivery_rate = static_cast<double>(conn.delivered - newest.delivered) /
+                        std::chrono::duration<double>(interval).count();
+  }
+  conn.first_sent_time = newest.sent_at;
+  conn.congestion->on_ack(ack, conn.rtt());
+  stats_.congestion_window = conn.congestion->congestion_window();
+
+  detect_lost(conn, now);
+}
+
+void UdpEndpoint::update_rtt(UdpConnection& conn, Clock::duration sample, Clock::duration ack_delay) {
+  conn.latest_rtt = sample;
+  if (!conn.has_rtt) {
+    conn.has_rtt = true;
+    conn.first_rtt_sample = Clock::now();
+    conn.min_rtt = sample;
+    conn.smoothed_rtt = sample;
+    conn.rtt_var = sample / 2;
+  } else {
+    conn.min_rtt = std::min(conn.min_rtt, sample);
+    ack_delay = std::min<Clock::duration>(ack_delay, kMaxAckDelay);
+    Clock::duration adjusted = sample >= conn.min_rtt + ack_delay ? sample - ack_delay : sample;
+    Clock::duration deviation = conn.smoothed_rtt > adjusted ? conn.smoothed_rtt - adjusted
+                                                             : adjusted - conn.smoothed_rtt;
+    conn.rtt_var = (3 * conn.rtt_var + deviation) / 4;
+    conn.smoothed_rtt = (7 * conn.smoothed_rtt + adjusted) / 8;
+  }
+  stats_.smoothed_rtt_us =
+      static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(conn.smoothed_rtt).count());
+}
+
+void UdpEndpoint::detect_lost(UdpConnection& conn, Clock::time_point now) {
+  conn.loss_time = Clock::time_point::max();
+  if (!conn.any_acked) {
+    return;
+  }
+  Clock::duration loss_delay =
+      std::max<Clock::duration>(9 * std::max(conn.latest_rtt, conn.smoothed_rtt) / 8, kGranularity);
+  Clock::duration persistent_duration = kPersistentCongestionThreshold * conn.pto();
+  CongestionController::Loss loss;
+  // The run of losses being followed: consecutive ack-eliciting packets, so
+  // none between its ends was acknowledged
+  uint64_t run_last = 0; // number + 1 of its newest packet, 0 if none
+  Clock::time_point run_start;
+  for (auto it = conn.sent.begin(); it != conn.sent.end() && it->first < conn.largest_acked;) {
+    SentPacket& packet = it->second;
+    if (conn.largest_acked >= packet.loss_pn + kPacketThreshold || packet.loss_clock + loss_delay <= now) {
+      loss.bytes_lost += packet.size;
+      loss.largest_sent_at = std::max(loss.largest_sent_at, packet.sent_at);
+      if (run_last == 0 || packet.previous_eliciting != run_last) {
+        run_start = packet.sent_at;
+      }
+      run_last = it->first + 1;
+      // Only packets sent once the RTT was known count toward it
+      if (conn.has_rtt && run_start > conn.first_rtt_sample && packet.sent_at - run_start >= persistent_duration) {
+        loss.persistent_congestion = true;
+      }
+      lose(conn, packet);
+      it = conn.sent.erase(it);
+    } else {
+      conn.loss_time = std::min(conn.loss_time, packet.loss_clock + loss_delay);
+      run_last = 0;
+      ++it;
+    }
+  }
+  if (loss.bytes_lost > 0) {
+    loss.now = now;
+    loss.bytes_in_flight = conn.bytes_in_flight;
+    conn.congestion->on_loss(loss, conn.rtt());
+    stats_.congestion_window = conn.congestion->congestion_window();
+  }
+}
+
+void UdpEndpoint::lose(UdpConnection& conn, SentPacket& packet) {
+  conn.bytes_in_flight -= packet.size;
+  conn.packets_lost++;
+  stats_.packets_lost++;
+  for (Piece& piece : packet.pieces) {
+    stats_.bytes_retransmitted += piece.len;
+    conn.lost.push_back(std::move(piece));
+  }
+  if (packet.max_data) {
+    conn.max_data_pending = true;
+  }
+}
+
+bool UdpEndpoint::pacer_ready(UdpConnection& conn, Clock::time_point now) {
+  double rate = conn.congestion->pacing_rate(conn.rtt());
+  double burst = std::max(static_cast<double>(kPacingBurstPackets * kMaxDatagramSize),
+                          rate * std::chrono::duration<double>(kPacingBurstTime).count());
+  // Tokens beyond the burst (the initial window) are spent, not topped up
+  if (conn.pace_tokens < burst) {
+    double elapsed = std::chrono::duration<double>(now - conn.pace_refill).count();
+    conn.pace_tokens = std::min(burst, conn.pace_tokens + rate * elapsed);
+  }
+  conn.pace_refill = now;
+  double needed = static_cast<double>(kMaxDatagramSize) - conn.pace_tokens;
+  if (needed <= 0) {
+    return true;
+  }
+  conn.pace_until = now + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(needed / rate));
+  return false;
+}
+
+bool UdpEndpoint::on_stream(const std::shared_ptr<UdpConnection>& conn, StreamId stream, uint64_t offset,
+                            const uint8_t* data, size_t len, bool fin) {
+  ReceiveStream& rs = conn->streams[stream];
+  if (rs.done) {
+    return true;
+  }
+  uint64_t end = offset + len;
+  if (end > rs.highest) {
+    // New stream bytes count against the credit last advertised in MAX_DATA
+    conn->data_received += end - rs.highest;
+    rs.highest = end;
+    if (conn->data_received > conn->max_data_sent) {
+      return false;
+    }
+  }
+  if (fin) {
+    rs.fin_known = true;
+    rs.fin_offset = end;
+  }
+  if (end > rs.next) {
+    if (offset <= rs.next) {
+      size_t skip = static_cast<size_t>(rs.next - offset);
+      stage(conn, stream, rs, data + skip, len - skip);
+      // Pull in whatever had arrived ahead of the gap just filled
+      while (!rs.early.empty() && rs.early.begin()->first <= rs.next) {
+        auto first = rs.early.begin();
+        uint64_t first_end = first->first + first->second.size();
+        if (first_end > rs.next) {
+          size_t from = static_cast<size_t>(rs.next - first->first);
+          stage(conn, stream, rs, first->second.data() + from, first->second.size() - from);
+        }
+        rs.early.erase(first);
+      }
+    } else {
+      keep_early(rs, offset, data, len);
+    }
+  }
+  if (rs.fin_known && rs.next >= rs.fin_offset) {
+    unstage(conn, stream, rs);
+    rs.done = true;
+    rs.early.clear();
+    pending_.push_back(Delivery{conn, stream, BufferRef(), Transport::kEndOfStream});
+  }
+  return true;
+}
+
+void UdpEndpoint::keep_early(ReceiveStream& rs, uint64_t offset, const uint8_t* data, size_t len) {
+  // Only bytes not held yet are kept, so early data never exceeds the stream
+  // bytes received past next, which the receive window bounds
+  auto after = rs.early.upper_bound(offset);
+  if (after != rs.early.begin()) {
+    auto before = std::prev(after);
+    uint64_t before_end = before->first + before->second.size();
+    if (before_end >= offset + len) {
+      return;
+    }
+    if (before_end > offset) {
+      size_t skip = static_cast<size_t>(before_end - offset);
+      offset += skip;
+      data += skip;
+      len -= skip;
+    }
+  }
+  while (after != rs.early.end() && after->first < offset + len) {
+    if (after->first + after->second.size() <= offset + len) {
+      after = rs.early.erase(after); // inside the new piece
+    } else {
+      len = static_cast<size_t>(after->first - offset);
+      break;
+    }
+  }
+  if (len > 0) {
+    rs.early[offset].assign(data, data + len);
+  }
+}
+
+void UdpEndpoint::stage(const std::shared_ptr<UdpConnection>& conn, StreamId stream, ReceiveStream& rs,
+                        const uint8_t* data, size_t len) {
+  if (rs.staging.empty() && len > 0) {
+    staged_.emplace_back(conn, stream);
+  }
+  while (len > 0) {
+    if (rs.staging.empty()) {
+      rs.staging = BufferPool::instance().acquire(kChunkSize);
+      rs.staging.set_size(0);
+    }
+    size_t n = std::min(len, rs.staging.capacity() - rs.staging.size());
+    std::memcpy(rs.staging.data() + rs.staging.size(), data, n);
+    rs.staging.set_size(rs.staging.size() + n);
+    rs.next += n;
+    data += n;
+    len -= n;
+    if (rs.staging.size() == rs.staging.capacity()) {
+      unstage(conn, stream, rs);
+    }
+  }
+}
+
+void UdpEndpoint::unstage(const std::shared_ptr<UdpConnection>& conn, StreamId stream, ReceiveStream& rs) {
+  if (!rs.staging.empty() && rs.staging.size() > 0) {
+    pending_.push_back(Delivery{conn, stream, std::move(rs.staging), 0});
+  }
+  rs.staging.reset();
+}
+
+void UdpEndpoint::close_connection(const std::shared_ptr<UdpConnection>& conn, bool tell_app) {
+  if (conn->closed) {
+    return;
+  }
+  conn->closed = true;
+  conn->queue.clear();
+  conn->lost.clear();
+  conn->sent.clear();
+  conn->bytes_in_flight = 0;
+  if (tell_app && server_) {
+    pending_.push_back(Delivery{conn, 0, BufferRef(), Transport::kDisconnect});
+  }
+  send_cv_.notify_all();
+}
+
+void UdpEndpoint::flush() {
+  // Datagrams the socket had no room for leave first, in order. Nothing new
+  // is built until they have, so a full socket buffer holds packets back
+  // instead of losing ones already counted in flight.
+  if (!unsent_.empty() && !send_unsent()) {
+    return;
+  }
+  while (true) {
+    out_.clear();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      Clock::time_point now = Clock::now();
+      for (auto& [cid, conn] : by_cid_) {
+        build(*conn, now, kSendBatch);
+        if (out_.size() >= kSendBatch) break;
+      }
+    }
+    // Senders waiting for queue room may go on
+    send_cv_.notify_all();
+    if (out_.empty() && !link_) {
+      return;
+    }
+    outgoing_.clear();
+    if (link_) {
+      // Into the emulated link, and out of it whatever is due
+      Clock::time_point now = Clock::now();
+      for (const Datagram& datagram : out_) {
+        LinkEmulator::Packet packet;
+        packet.data.assign(datagram.data, datagram.data + datagram.len);
+        packet.addr = datagram.addr;
+        packet.addr_len = datagram.addr_len;
+        link_->submit(now, std::move(packet));
+      }
+      link_->release(now, released_);
+      for (const LinkEmulator::Packet& packet : released_) {
+        outgoing_.push_back(PacketIo::Outgoing{&packet.addr, packet.addr_len, packet.data.data(), packet.data.size()});
+      }
+    } else {
+      for (const Datagram& datagram : out_) {
+        outgoing_.push_back(PacketIo::Outgoing{&datagram.addr, datagram.addr_len, datagram.data, datagram.len});
+      }
+    }
+    size_t sent = io_->send(outgoing_.data(), outgoing_.size());
+    count_sent(sent);
+    if (sent < outgoing_.size()) {
+      // The socket buffer is full: keep the rest until poll finds room
+      for (size_t i = sent; i < outgoing_.size(); ++i) {
+        const PacketIo::Outgoing& datagram = outgoing_[i];
+        LinkEmulator::Packet packet;
+        packet.data.assign(datagram.data, datagram.data + datagram.len);
+        std::memcpy(&packet.addr, datagram.addr, datagram.addr_len);
+        packet.addr_len = datagram.addr_len;
+        unsent_.push_back(std::move(packet));
+      }
+      return;
+    }
+    if (out_.size() < kSendBatch) {
+      return;
+    }
+  }
+}
+
+bool UdpEndpoint::send_unsent() {
+  outgoing_.clear();
+  for (const LinkEmulator::Packet& packet : unsent_) {
+    outgoing_.push_back(PacketIo::Outgoing{&packet.addr, packet.addr_len, packet.data.data(), packet.data.size()});
+  }
+  size_t sent = io_->send(outgoing_.data(), outgoing_.size());
+  count_sent(sent);
+  unsent_.erase(unsent_.begin(), unsent_.begin() + static_cast<ptrdiff_t>(sent));
+  return unsent_.empty();
+}
+
+void UdpEndpoint::count_sent(size_t count) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  stats_.packets_sent += count;
+  for (size_t i = 0; i < count; ++i) {
+    stats_.bytes_sent += outgoing_[i].len;
+  }
+  update_io_stats();
+}
+
+void UdpEndpoint::update_io_stats() {
+  PacketIo::Stats io = io_->stats();
+  stats_.io_backend = io.backend;
+  stats_.send_calls = io.send_calls;
+  stats_.receive_calls = io.receive_calls;
+}
+
+Datagram& UdpEndpoint::next_datagram(const UdpConnection& conn) {
+  out_.emplace_back();
+  Datagram& datagram = out_.back();
+  datagram.addr = conn.peer;
+  datagram.addr_len = conn.peer_len;
+  datagram.len = 0;
+  return datagram;
+}
+
+size_t UdpEndpoint::write_ack(UdpConnection& conn, uint8_t* out, size_t room, Clock::time_point now) {
+  // Ranges from the top down: the first as its length below largest, the
+  // rest as (gap, length) pairs
+  uint8_t frame[1 + 4 * 8 + 2 * 8 * kMaxAckRangesSent];
+  uint8_t* p = frame;
+  *p++ = kFrameAck;
+  auto range = conn.received.rbegin();
+  uint64_t largest = range->second;
+  uint64_t delay_us = static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::microseconds>(now - conn.largest_received_at).count());
+  size_t count = std::min(conn.received.size(), kMaxAckRangesSent);
+  p = put_varint(p, largest);
+  p = put_varint(p, delay_us);
+  p = put_varint(p, count - 1);
+  p = put_varint(p, range->second - range->first);
+  uint64_t below = range->first;
+  for (size_t i = 1; i < count; ++i) {
+    ++range;
+    p = put_varint(p, below - range->second - 2);
+    p = put_varint(p, range->second - range->first);
+    below = range->first;
+  }
+  size_t len = static_cast<size_t>(p - frame);
+  if (len > room) {
+    return 0;
+  }
+  std::memcpy(out, frame, len);
+  conn.ack_pending = false;
+  conn.unacked_eliciting = 0;
+  conn.ack_deadline = Clock::time_point::max();
+  return len;
+}
+
+void UdpEndpoint::build(UdpConnection& conn, Clock::time_point now, size_t limit) {
+  if (conn.handshake_pending && out_.size() < limit) {
+    Datagram& datagram = next_datagram(conn);
+    datagram.data[0] = kPacketHandshake;
+    put_cid(datagram.data + 1, conn.peer_cid);
+    put_cid(datagram.data + 1 + kConnectionIdSize, conn.local_cid);
+    datagram.len = 1 + 2 * kConnectionIdSize;
+    conn.handshake_pending = false;
+  }
+  if (!conn.established) {
+    return;
+  }
+  if (conn.closed) {
+    if (conn.close_pending && out_.size() < limit) {
+      Datagram& datagram = next_datagram(conn);
+      uint8_t* p = datagram.data;
+      *p++ = kPacketShort;
+      put_cid(p, conn.peer_cid);
+      p += kConnectionIdSize;
+      p = put_varint(p, conn.next_packet_number++);
+      *p++ = kFrameClose;
+      datagram.len = static_cast<size_t>(p - datagram.data);
+      conn.close_pending = false;
+    }
+    return;
+  }
+
+  while (out_.size() < limit) {
+    bool window_open = conn.bytes_in_flight < conn.congestion->congestion_window() || conn.probes > 0;
+    bool flow_open = conn.data_sent < conn.peer_max_data;
+    bool have_data = !conn.lost.empty() ||
+                     (!conn.queue.empty() && (flow_open || conn.queue.front().len == 0));
+    // Data waits for the pacer, probes excepted; ACKs and credit never do
+    bool send_data = window_open && have_data && (conn.probes > 0 || pacer_ready(conn, now));
+    bool ack_due = conn.ack_pending && now >= conn.ack_deadline;
+    bool control = conn.max_data_pending || conn.ping_pending;
+    if (!send_data && !ack_due && !control) {
+      if (conn.fec_open && !have_data) {
+        fec_close(conn, now); // the data ran out; protect what went
+      }
+      return;
+    }
+
+    if (send_data && fec_.enabled && !conn.fec_open) {
+      fec_open(conn);
+    }
+    Datagram& datagram = next_datagram(conn);
+    uint8_t* start = datagram.data;
+    uint8_t* p = start;
+    uint8_t* end = start + (conn.fec_open ? kProtectedDatagramSize : kMaxDatagramSize);
+    uint64_t pn = conn.next_packet_number++;
+    *p++ = kPacketShort;
+    put_cid(p, conn.peer_cid);
+    p += kConnectionIdSize;
+    p = put_varint(p, pn);
+
+    SentPacket packet;
+    if (conn.ack_pending) {
+      size_t ack_len = write_ack(conn, p, static_cast<size_t>(end - p), now);
+      p += ack_len;
+      if (ack_len > 0 && conn.fec_recovered > 0) {
+        // With every ACK, so the sender's loss rate still sees what FEC hid
+        *p++ = kFrameFecRecovered;
+        p = put_varint(p, conn.fec_recovered);
+      }
+    }
+    if (conn.max_data_pending) {
+      conn.max_data_sent = conn.consumed + kReceiveWindow;
+      *p++ = kFrameMaxData;
+      p = put_varint(p, conn.max_data_sent);
+      conn.max_data_pending = false;
+      packet.max_data = true;
+      packet.ack_eliciting = true;
+    }
+    if (conn.ping_pending) {
+      *p++ = kFramePing;
+      conn.ping_pending = false;
+      packet.ack_eliciting = true;
+    }
+
+    // Lost data first, then new data as far as the peer's credit allows
+    while (send_data && static_cast<size_t>(end - p) > kStreamFrameOverhead) {
+      bool from_lost = !conn.lost.empty();
+      if (!from_lost && conn.queue.empty()) break;
+      Piece& source = from_lost ? conn.lost.front() : conn.queue.front();
+      // Fill the packet to the byte, so full packets are all one size and
+      // leave together as a GSO run; the length takes two bytes from 64 up
+      size_t header = 1 + varint_size(source.stream) + varint_size(source.offset) + 2;
+      size_t room = static_cast<size_t>(end - p) - header;
+      size_t n = std::min(source.len, room);
+      if (!from_lost) {
+        n = static_cast<size_t>(std::min<uint64_t>(n, conn.peer_max_data - std::min(conn.peer_max_data,
+                                                                                      conn.data_sent)));
+        if (n == 0 && source.len > 0) break; // out of credit
+      }
+
+      Piece sent;
+      sent.stream = source.stream;
+      sent.offset = source.offset;
+      sent.buffer = source.buffer;
+      sent.pos = source.pos;
+      sent.len = n;
+      sent.reset = source.reset;
+      sent.fin = source.fin && n == source.len;
+      if (sent.reset) {
+        *p++ = kFrameResetStream;
+        p = put_varint(p, sent.stream);
+      } else {
+        *p++ = static_cast<uint8_t>(kFrameStream | (sent.fin ? kStreamFin : 0));
+        p = put_varint(p, sent.stream);
+        p = put_varint(p, sent.offset);
+        p = put_varint(p, n);
+        std::memcpy(p, source.buffer.data() + source.pos, n);
+        p += n;
+      }
+      packet.pieces.push_back(std::move(sent));
+      packet.ack_eliciting = true;
+
+      source.pos += n;
+      source.offset += n;
+      source.len -= n;
+      if (!from_lost) {
+        conn.data_sent += n;
+        conn.queued_bytes -= n;
+      }
+      if (source.len == 0) {
+        (from_lost ? conn.lost : conn.queue).pop_front();
+      }
+    }
+
+    datagram.len = static_cast<size_t>(p - start);
+    if (datagram.len <= kShortHeaderMax && !packet.ack_eliciting && conn.ack_pending) {
+      // Nothing fitted after all
+      out_.pop_back();
+      conn.next_packet_number--;
+      return;
+    }
+    conn.last_sent = now;
+    if (!packet.pieces.empty()) {
+      conn.pace_tokens -= static_cast<double>(datagram.len);
+    }
+    if (packet.ack_eliciting) {
+      if (conn.bytes_in_flight == 0) {
+        conn.first_sent_time = now;
+        conn.delivered_time = now;
+      }
+      packet.sent_at = now;
+      packet.size = datagram.len;
+      packet.loss_pn = conn.fec_open ? kMaxVarint : pn;
+      packet.loss_clock = now;
+      packet.delivered = conn.delivered;
+      packet.delivered_time = conn.delivered_time;
+      packet.first_sent_time = conn.first_sent_time;
+      // Nothing more ready to go, so what the ACK shows is the offered load
+      packet.app_limited = conn.lost.empty() && (conn.queue.empty() || conn.data_sent >= conn.peer_max_data);
+      packet.previous_eliciting = conn.last_eliciting_pn;
+      conn.bytes_in_flight += datagram.len;
+      conn.last_eliciting_sent = now;
+      conn.last_eliciting_pn = pn + 1;
+      conn.packets_sent++;
+      conn.sent.emplace(pn, std::move(packet));
+      conn.congestion->on_packet_sent(now, datagram.len, conn.bytes_in_flight);
+      if (conn.probes > 0) {
+        conn.probes--;
+      }
+    }
+    if (conn.fec_open) {
+      fec_add(conn, start, datagram.len);
+      if (conn.fec_count >= fec_.block_size) {
+        fec_close(conn, now);
+      }
+    }
+  }
+}
+
+void UdpEndpoint::fec_open(UdpConnection& conn) {
+  // Sample the loss rate: packets given up on, and those the peer rebuilt
+  // so that this side never saw them lost, over packets sent
+  uint64_t sent = conn.packets_sent - conn.fec_sample_sent;
+  if (sent >= kFecLossSample) {
+    uint64_t lost = conn.packets_lost - conn.fec_sample_lost + conn.peer_recovered - conn.fec_sample_recovered;
+    double sample = std::min(1.0, static_cast<double>(lost) / static_cast<double>(sent));
+    conn.fec_loss_rate = conn.fec_loss_rate < 0 ? sample : (3 * conn.fec_loss_rate + sample) / 4;
+    conn.fec_sample_sent = conn.packets_sent;
+    conn.fec_sample_lost = conn.packets_lost;
+    conn.fec_sample_recovered = conn.peer_recovered;
+  }
+  size_t repairs = fec_.repairs;
+  if (repairs == 0) {
+    repairs = fec_repairs_for(fec_.block_size, std::max(conn.fec_loss_rate, 0.0),
+                              std::max<size_t>(fec_.block_size / 2, 1));
+  }
+  if (repairs == 0) {
+    return; // a clean path: no block, no overhead
+  }
+  conn.fec_open = true;
+  conn.fec_first = conn.next_packet_number;
+  conn.fec_count = 0;
+  conn.fec_symbol_len = 0;
+  conn.fec_repairs.resize(repairs);
+  for (std::vector<uint8_t>& repair : conn.fec_repairs) {
+    repair.assign(kFecSymbolMax, 0);
+  }
+}
+
+void UdpEndpoint::fec_add(UdpConnection& conn, const uint8_t* data, size_t len) {
+  uint8_t length[kFecLengthSize] = {static_cast<uint8_t>(len >> 8), static_cast<uint8_t>(len)};
+  size_t index = conn.fec_count++;
+  for (size_t j = 0; j < conn.fec_repairs.size(); ++j) {
+    uint8_t* repair = conn.fec_repairs[j].data();
+    fec_encode(repair, j, length, index, kFecLengthSize);
+    fec_encode(repair + kFecLengthSize, j, data, index, len);
+  }
+  conn.fec_symbol_len = std::max(conn.fec_symbol_len, kFecLengthSize + len);
+}
+
+void UdpEndpoint::fec_close(UdpConnection& conn, Clock::time_point now) {
+  conn.fec_open = false;
+  if (conn.fec_count == 0) {
+    return;
+  }
+  uint64_t last = conn.fec_first + conn.fec_count - 1;
+  for (size_t j = 0; j < conn.fec_repairs.size(); ++j) {
+    Datagram& datagram = next_datagram(conn);
+    uint8_t* p = datagram.data;
+    *p++ = kPacketRepair;
+    put_cid(p, conn.peer_cid);
+    p += kConnectionIdSize;
+    p = put_varint(p, conn.fec_first);
+    *p++ = static_cast<uint8_t>(conn.fec_count);
+    *p++ = static_cast<uint8_t>(j);
+    std::memcpy(p, conn.fec_repairs[j].data(), conn.fec_symbol_len);
+    datagram.len = static_cast<size_t>(p - datagram.data) + conn.fec_symbol_len;
+    conn.pace_tokens -= static_cast<double>(datagram.len);
+    stats_.fec_repairs_sent++;
+  }
+  // The block's packets are given up on only once packets after it are
+  // acknowledged, or an RTT from now, by when the repairs have had their turn
+  for (auto it = conn.sent.lower_bound(conn.fec_first); it != conn.sent.end() && it->first <= last; ++it) {
+    it->second.loss_pn = last;
+    it->second.loss_clock = now;
+  }
+}
+
+UdpTransport& UdpTransport::instance() {
+  static UdpTransport transport;
+  return transport;
+}
+
+UdpTransport::UdpTransport() {
+  // Constructed first, the pool is destroyed after any endpoint still
+  // holding its buffers at exit
+  BufferPool::instance();
+}
+
+UdpTransport::~UdpTransport() {
+  stop_listening();
+}
+
+std::shared_ptr<UdpEndpoint> UdpTransport::shard(size_t index) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return index < shards_.size() ? shards_[index] : nullptr;
+}
+
+std::shared_ptr<UdpEndpoint> UdpTransport::client(const std::string& client_addr) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = clients_.find(client_addr);
+  return it != clients_.end() ? it->second : nullptr;
+}
+
+std::shared_ptr<UdpEndpoint> UdpTransport::shard_of(const std::string& client_addr) const {
+  // Names end in the connection id, whose low byte is the shard
+  size_t hash = client_addr.rfind('#');
+  if (hash == std::string::npos || client_addr.size() < hash + 3) {
+    return nullptr;
+  }
+  size_t index = std::strtoul(client_addr.substr(client_addr.size() - 2).c_str(), nullptr, 16);
+  return shard(index);
+}
+
+bool UdpTransport::open_client_channel(const std::string& client_addr, const std::string& server_address) {
+  auto endpoint = std::make_shared<UdpEndpoint>(false, 0, congestion_control(), fec());
+  if (!endpoint->connect(server_address)) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  clients_[client_addr] = endpoint;
+  return true;
+}
+
+void UdpTransport::close_client_channel(const std::string& client_addr) {
+  std::shared_ptr<UdpEndpoint> endpoint;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = clients_.find(client_addr);
+    if (it == clients_.end()) {
+      return;
+    }
+    endpoint = it->second;
+    clients_.erase(it);
+  }
+  endpoint->close();
+}
+
+bool UdpTransport::send_to_server(const std::string& client_addr, StreamId stream_id, const uint8_t* head,
+                                  size_t head_len, const uint8_t* data, size_t len) {
+  std::shared_ptr<UdpEndpoint> endpoint = client(client_addr);
+  return endpoint && endpoint->send(endpoint->peer_name(), stream_id, head, head_len, data, len, 0);
+}
+
+bool UdpTransport::finish_stream(const std::string& client_addr, StreamId stream_id) {
+  std::shared_ptr<UdpEndpoint> endpoint = client(client_addr);
+  return endpoint && endpoint->send(endpoint->peer_name(), stream_id, nullptr, 0, nullptr, 0, kEndOfStream);
+}
+
+bool UdpTransport::reset_stream(const std::string& client_addr, StreamId stream_id) {
+  std::shared_ptr<UdpEndpoint> endpoint = client(client_addr);
+  return endpoint && endpoint->send(endpoint->peer_name(), stream_id, nullptr, 0, nullptr, 0, kResetStream);
+}
+
+bool UdpTransport::disconnect(const std::string& client_addr) {
+  std::shared_ptr<UdpEndpoint> endpoint = client(client_addr);
+  return endpoint && endpoint->disconnect(endpoint->peer_name());
+}
+
+bool UdpTransport::receive_from_server(const std::string& client_addr, StreamId& stream_id, BufferRef& data,
+                                       uint32_t* flags, int timeout_ms) {
+  std::shared_ptr<UdpEndpoint> endpoint = client(client_addr);
+  std::string name;
+  return endpoint && endpoint->receive(name, stream_id, data, flags, timeout_ms);
+}
+
+bool UdpTransport::listen(size_t shards, int port) {
+  stop_listening();
+  std::vector<std::shared_ptr<UdpEndpoint>> endpoints;
+  shards = std::max<size_t>(shards, 1);
+  for (size_t i = 0; i < shards; ++i) {
+    auto endpoint = std::make_shared<UdpEndpoint>(true, static_cast<uint8_t>(i), congestion_control(), fec());
+    if (!endpoint->listen(port, shards > 1)) {
+      return false;
+    }
+    endpoints.push_back(endpoint);
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  shards_ = std::move(endpoints);
+  return true;
+}
+
+void UdpTransport::stop_listening() {
+  std::vector<std::shared_ptr<UdpEndpoint>> endpoints;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    endpoints.swap(shards_);
+  }
+  for (auto& endpoint : endpoints) {
+    endpoint->close();
+  }
+}
+
+bool UdpTransport::receive_from_client(size_t shard_index, std::string& client_addr, StreamId& stream_id,
+                                       BufferRef& data, uint32_t* flags) {
+  std::shared_ptr<UdpEndpoint> endpoint = shard(shard_index);
+  return endpoint && endpoint->receive(client_addr, stream_id, data, flags, 0);
+}
+
+bool UdpTransport::send_to_client(const std::string& client_addr, StreamId stream_id, const uint8_t* head,
+                                  size_t head_len, const uint8_t* data, size_t len, uint32_t flags) {
+  std::shared_ptr<UdpEndpoint> endpoint = shard_of(client_addr);
+  return endpoint && endpoint->send(client_addr, stream_id, head, head_len, data, len, flags);
+}
+
+void UdpTransport::forget_client(const std::string& client_addr) {
+  std::shared_ptr<UdpEndpoint> endpoint = shard_of(client_addr);
+  if (endpoint) {
+    endpoint->forget(client_addr);
+  }
+}
+
+bool UdpTransport::has_data(size_t shard_index) const {
+  std::shared_ptr<UdpEndpoint> endpoint = shard(shard_index);
+  return endpoint && endpoint->has_data();
+}
+
+bool UdpTransport::wait_for_data(size_t shard_index, int timeout_ms) {
+  std::shared_ptr<UdpEndpoint> endpoint = shard(shard_index);
+  return endpoint && endpoint->wait_for_data(timeout_ms);
+}
+
+void UdpTransport::interrupt_wait(size_t shard_index) {
+  std::shared_ptr<UdpEndpoint> endpoint = shard(shard_index);
+  if (endpoint) {
+    endpoint->interrupt_wait();
+  }
+}
+
+void UdpTransport::set_congestion_control(CongestionAlgorithm algorithm) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  congestion_ = algorithm;
+  for (const auto& endpoint : shards_) {
+    endpoint->set_congestion_control(algorithm);
+  }
+  for (const auto& [addr, endpoint] : clients_) {
+    endpoint->set_congestion_control(algorithm);
+  }
+}
+
+CongestionAlgorithm UdpTransport::congestion_control() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return congestion_;
+}
+
+void UdpTransport::set_fec(const FecConfig& config) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  fec_ = config;
+  for (const auto& endpoint : shards_) {
+    endpoint->set_fec(config);
+  }
+  for (const auto& [addr, endpoint] : clients_) {
+    endpoint->set_fec(config);
+  }
+}
+
+FecConfig UdpTransport::fec() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return fec_;
+}
+
+bool UdpTransport::stats(TransportStats& stats) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  stats = TransportStats();
+  for (const auto& endpoint : shards_) {
+    endpoint->add_stats(stats);
+  }
+  for (const auto& [addr, endpoint] : clients_) {
+    endpoint->add_stats(stats);
+  }
+  return true;
+}
+
+} // namespace quicftp
@@ -0,0 +1,99 @@
+// udp_transport.h
+// Client streams over UDP with a QUIC-like protocol
+// Every connection is named by an 8-byte connection id chosen by each end,
+// and carries numbered packets of frames: STREAM data at stream offsets,
+// ACK ranges, MAX_DATA flow-control credit, RESET_STREAM, PING and
+// CONNECTION_CLOSE. Lost packets are found from acknowledgements (three
+// later packets acked, or an RTT and a bit gone by) and by a probe timeout
+// when acknowledgements stop; their stream data is sent again in new
+// packets. The receiver reorders by offset and delivers each stream in
+// order. There is no encryption; this is a transport for trusted networks
+// and for measuring wire behaviour on loopback.
+//
+// How much each connection keeps in flight, and how fast packets leave, is
+// up to its CongestionController (congestion_control.h). Packets are paced
+// from a timerfd rather than sent a window at a time. Full data packets are
+// all one size, so PacketIo (packet_io.h) can hand a run of them to the
+// kernel in one GSO send.
+//
+// With FEC on (fec.h), a sender follows each block of packets with repair
+// packets, as many as the loss it has measured calls for, and the receiver
+// rebuilds lost packets of the block from them instead of waiting for them
+// to be sent again.
+//
+// QUICFTP_LINK puts the datagrams an endpoint sends through a LinkEmulator
+// (link_emulator.h) with the conditions it gives, e.g. "delay=20ms,loss=1%".
+//
+// Each endpoint has one socket and one I/O thread. The server runs an
+// endpoint per shard, all bound to the listening port with SO_REUSEPORT so
+// the kernel keeps every client on one shard.
+
+#ifndef UDP_TRANSPORT_H
+#define UDP_TRANSPORT_H
+
+#include "transport.h"
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace quicftp {
+
+class UdpEndpoint;
+
+class UdpTransport : public Transport {
+public:
+  static UdpTransport& instance();
+
+  bool open_client_channel(const std::string& client_addr, const std::string& server_address) override;
+  void close_client_channel(const std::string& client_addr) override;
+  bool send_to_server(const std::string& client_addr, StreamId stream_id, const uint8_t* head, size_t head_len,
+                      const uint8_t* data, size_t len) override;
+  bool finish_stream(const std::string& client_addr, StreamId stream_id) override;
+  bool reset_stream(const std::string& client_addr, StreamId stream_id) override;
+  bool disconnect(const std::string& client_addr) override;
+  bool receive_from_server(const std::string& client_addr, StreamId& stream_id, BufferRef& data,
+                           uint32_t* flags, int timeout_ms) override;
+
+  bool listen(size_t shards, int port) override;
+  void stop_listening() override;
+  bool receive_from_client(size_t shard, std::string& client_addr, StreamId& stream_id, BufferRef& data,
+                           uint32_t* flags = nullptr) override;
+  bool send_to_client(const std::string& client_addr, StreamId stream_id, const uint8_t* head, size_t head_len,
+                      const uint8_t* data, size_t len, uint32_t flags = 0) override;
+  void forget_client(const std::string& client_addr) override;
+  bool has_data(size_t shard) const override;
+  bool wait_for_data(size_t shard, int timeout_ms) override;
+  void interrupt_wait(size_t shard) override;
+
+  void set_congestion_control(CongestionAlgorithm algorithm) override;
+  CongestionAlgorithm congestion_control() const;
+
+  void set_fec(const FecConfig& config) override;
+  FecConfig fec() const;
+
+  bool stats(TransportStats& stats) const override;
+
+private:
+  UdpTransport();
+  ~UdpTransport() override;
+  UdpTransport(const UdpTransport&) = delete;
+  UdpTransport& operator=(const UdpTransport&) = delete;
+
+  // One endpoint per server shard, and one per client connection
+  mutable std::mutex mutex_;
+  std::vector<std::shared_ptr<UdpEndpoint>> shards_;
+  std::map<std::string, std::shared_ptr<UdpEndpoint>> clients_;
+  CongestionAlgorithm congestion_ = CongestionAlgorithm::Cubic;
+  FecConfig fec_;
+
+  std::shared_ptr<UdpEndpoint> shard(size_t index) const;
+  std::shared_ptr<UdpEndpoint> client(const std::string& client_addr) const;
+  // The shard serving a client, from the shard index in its name
+  std::shared_ptr<UdpEndpoint> shard_of(const std::string& client_addr) const;
+};
+
+} // namespace quicftp
+
+#endif
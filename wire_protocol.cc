@@ -0,0 +1,216 @@
+// wire_protocol.cc
+
+#include "wire_protocol.h"
+#include <cstring>
+
+namespace quicftp {
+
+namespace {
+
+constexpr size_t kChecksumSize = 4;
+
+// Reflected CRC32C (Castagnoli) polynomial
+constexpr uint32_t kCrc32cPoly = 0x82f63b78;
+
+struct Crc32cTable {
+  uint32_t entries[256];
+  Crc32cTable() {
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t crc = i;
+      for (int bit = 0; bit < 8; ++bit) {
+        crc = (crc >> 1) ^ ((crc & 1) ? kCrc32cPoly : 0);
+      }
+      entries[i] = crc;
+    }
+  }
+};
+
+uint32_t crc32c_table(const uint8_t* data, size_t len, uint32_t crc) {
+  static const Crc32cTable table;
+  for (size_t i = 0; i < len; ++i) {
+    crc = table.entries[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+uint32_t crc32c_sse42(const uint8_t* data, size_t len, uint32_t crc) {
+  uint64_t crc64 = crc;
+  while (len >= 8) {
+    uint64_t word;
+    std::memcpy(&word, data, sizeof(word));
+    crc64 = __builtin_ia32_crc32di(crc64, word);
+    data += 8;
+    len -= 8;
+  }
+  crc = static_cast<uint32_t>(crc64);
+  while (len > 0) {
+    crc = __builtin_ia32_crc32qi(crc, *data++);
+    --len;
+  }
+  return crc;
+}
+#endif
+
+} // namespace
+
+size_t varint_size(uint64_t value) {
+  if (value < (uint64_t(1) << 6)) return 1;
+  if (value < (uint64_t(1) << 14)) return 2;
+  if (value < (uint64_t(1) << 30)) return 4;
+  return 8;
+}
+
+uint8_t* put_varint(uint8_t* out, uint64_t value) {
+  if (value > kMaxVarint) {
+    value = kMaxVarint;
+  }
+  // The top two bits of the first byte give the length: 1, 2, 4 or 8 bytes
+  size_t size = varint_size(value);
+  uint8_t prefix = size == 1 ? 0x00 : size == 2 ? 0x40 : size == 4 ? 0x80 : 0xc0;
+  for (size_t i = size; i-- > 0;) {
+    out[i] = static_cast<uint8_t>(value);
+    value >>= 8;
+  }
+  out[0] |= prefix;
+  return out + size;
+}
+
+bool get_varint(const uint8_t*& in, const uint8_t* end, uint64_t& value) {
+  if (in >= end) {
+    return false;
+  }
+  size_t size = size_t(1) << (*in >> 6);
+  if (static_cast<size_t>(end - in) < size) {
+    return false;
+  }
+  value = *in & 0x3f;
+  for (size_t i = 1; i < size; ++i) {
+    value = (value << 8) | in[i];
+  }
+  in += size;
+  return true;
+}
+
+uint32_t crc32c(const uint8_t* data, size_t len, uint32_t crc) {
+  crc = ~crc;
+#if defined(__x86_64__)
+  static const bool have_sse42 = __builtin_cpu_supports("sse4.2");
+  if (have_sse42) {
+    return ~crc32c_sse42(data, len, crc);
+  }
+#endif
+  return ~crc32c_table(data, len, crc);
+}
+
+size_t encode_frame_header(uint8_t* out, FrameType type, uint32_t flags, uint64_t request_id, uint64_t offset,
+                           const uint8_t* payload, size_t length) {
+  uint8_t* p = out;
+  *p++ = kWireVersion;
+  p = put_varint(p, static_cast<uint64_t>(type));
+  p = put_varint(p, flags);
+  p = put_varint(p, request_id);
+  p = put_varint(p, offset);
+  p = put_varint(p, length);
+  if (flags & kFrameChecksum) {
+    uint32_t crc = crc32c(payload, length);
+    for (size_t i = 0; i < kChecksumSize; ++i) {
+      *p++ = static_cast<uint8_t>(crc >> (8 * i));
+    }
+  }
+  return static_cast<size_t>(p - out);
+}
+
+DecodeStatus decode_frame(const uint8_t* data, size_t len, Frame& frame, size_t& consumed) {
+  if (len == 0) {
+    return DecodeStatus::NeedMore;
+  }
+  if (data[0] != kWireVersion) {
+    return DecodeStatus::Malformed;
+  }
+
+  const uint8_t* p = data + 1;
+  const uint8_t* end = data + len;
+  uint64_t type;
+  uint64_t flags;
+  uint64_t length;
+  if (!get_varint(p, end, type) || !get_varint(p, end, flags) || !get_varint(p, end, frame.request_id) ||
+      !get_varint(p, end, frame.offset) || !get_varint(p, end, length)) {
+    return DecodeStatus::NeedMore;
+  }
+  if (type == 0 || type > 0xff || flags > UINT32_MAX || length > kMaxFramePayload) {
+    return DecodeStatus::Malformed;
+  }
+
+  size_t checksum_size = (flags & kFrameChecksum) ? kChecksumSize : 0;
+  if (static_cast<size_t>(end - p) < checksum_size + length) {
+    return DecodeStatus::NeedMore;
+  }
+  frame.type = static_cast<FrameType>(type);
+  frame.flags = static_cast<uint32_t>(flags);
+  frame.payload = p + checksum_size;
+  frame.length = static_cast<size_t>(length);
+  frame.intact = true;
+  if (checksum_size > 0) {
+    uint32_t expected = 0;
+    for (size_t i = 0; i < kChecksumSize; ++i) {
+      expected |= static_cast<uint32_t>(p[i]) << (8 * i);
+    }
+    frame.intact = crc32c(frame.payload, frame.length) == expected;
+  }
+  consumed = static_cast<size_t>(frame.payload + frame.length - data);
+  return DecodeStatus::Ok;
+}
+
+PayloadWriter& PayloadWriter::varint(uint64_t value) {
+  uint8_t buffer[8];
+  uint8_t* end = put_varint(buffer, value);
+  data_.insert(data_.end(), buffer, end);
+  return *this;
+}
+
+PayloadWriter& PayloadWriter::bytes(const std::string& value) {
+  data_.insert(data_.end(), value.begin(), value.end());
+  return *this;
+}
+
+std::string PayloadReader::rest() {
+  std::string value(reinterpret_cast<const char*>(pos_), static_cast<size_t>(end_ - pos_));
+  pos_ = end_;
+  return value;
+}
+
+bool FrameDecoder::feed(const uint8_t* data, size_t len, const std::function<bool(const Frame&)>& on_frame) {
+  if (pending_.empty()) {
+    return drain(data, len, on_frame);
+  }
+  // Finish the split frame; whatever is still incomplete goes back to pending_
+  std::vector<uint8_t> buffer;
+  buffer.swap(pending_);
+  buffer.insert(buffer.end(), data, data + len);
+  return drain(buffer.data(), buffer.size(), on_frame);
+}
+
+bool FrameDecoder::drain(const uint8_t* data, size_t len, const std::function<bool(const Frame&)>& on_frame) {
+  while (len > 0) {
+    Frame frame;
+    size_t consumed = 0;
+    DecodeStatus status = decode_frame(data, len, frame, consumed);
+    if (status == DecodeStatus::Malformed) {
+      return false;
+    }
+    if (status == DecodeStatus::NeedMore) {
+      pending_.assign(data, data + len);
+      return true;
+    }
+    if (!on_frame(frame)) {
+      return false;
+    }
+    data += consumed;
+    len -= consumed;
+  }
+  return true;
+}
+
+} // namespace quicftp
@@ -0,0 +1,136 @@
+// wire_protocol.h
+// Binary framing for requests and replies carried on client streams
+// Every frame is a version byte, then QUIC-style varints for type, flags,
+// request id, offset and payload length, an optional CRC32C of the payload,
+// and the payload itself. Request ids are unique per connection, so any
+// number of requests can be pipelined on one stream and their frames
+// interleaved; replies carry the id of the request they answer.
+
+#ifndef WIRE_PROTOCOL_H
+#define WIRE_PROTOCOL_H
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <cstddef>
+#include <cstdint>
+
+namespace quicftp {
+
+constexpr uint8_t kWireVersion = 1;
+
+// Largest value a varint can hold
+constexpr uint64_t kMaxVarint = (uint64_t(1) << 62) - 1;
+
+// Version byte, five 8-byte varints and a checksum
+constexpr size_t kMaxFrameHeaderSize = 1 + 5 * 8 + 4;
+
+// Frames announcing a larger payload are treated as garbage
+constexpr size_t kMaxFramePayload = 16 * 1024 * 1024;
+
+enum class FrameType : uint8_t {
+  // Client requests; the payload holds varint arguments then the path
+  Upload = 1,        // path
+  UploadRange = 2,   // offset = range start; total_size, path
+  UploadStatus = 3,  // total_size, path
+  Download = 4,      // path
+  DownloadRange = 5, // offset = range start; length, path
+  Stat = 6,          // path
+  Cancel = 7,        // client abandons the request
+  Window = 12,       // offset = reply Data bytes the client has room for in all
+
+  // Both directions
+  Data = 8,          // offset = file position of the payload
+
+  // Server replies
+  Reply = 9,         // offset = body start; file_size, length
+  Error = 10,        // reason; ends the request
+  Ack = 11,          // offset = end of the data stored; ends an upload
+};
+
+// Frame flags
+constexpr uint32_t kFrameFin = 0x1;      // last frame of this side of the request
+constexpr uint32_t kFrameChecksum = 0x2; // a CRC32C of the payload follows the header
+constexpr uint32_t kFramePriority = 0x4; // requests: a varint priority leads the arguments
+constexpr uint32_t kFrameWindow = 0x8;   // requests: reply Data stays within the Window granted
+
+// Reply Data a windowed request may be sent before any Window frame; clients
+// grant more in steps of this as they consume it
+constexpr uint64_t kReplyWindow = 8 * 1024 * 1024;
+
+// A decoded frame. payload points into the buffer it was decoded from.
+struct Frame {
+  FrameType type = FrameType::Data;
+  uint32_t flags = 0;
+  uint64_t request_id = 0;
+  uint64_t offset = 0;
+  const uint8_t* payload = nullptr;
+  size_t length = 0;
+  bool intact = true; // false if the payload failed its checksum
+};
+
+enum class DecodeStatus {
+  Ok,
+  NeedMore,  // data ends inside the frame
+  Malformed, // unknown version or nonsense lengths; the stream is unusable
+};
+
+size_t varint_size(uint64_t value);
+// Values above kMaxVarint are clamped
+uint8_t* put_varint(uint8_t* out, uint64_t value);
+bool get_varint(const uint8_t*& in, const uint8_t* end, uint64_t& value);
+
+uint32_t crc32c(const uint8_t* data, size_t len, uint32_t crc = 0);
+
+// Write the header for a frame carrying payload into out (kMaxFrameHeaderSize
+// bytes); returns its size. The payload itself is sent separately.
+size_t encode_frame_header(uint8_t* out, FrameType type, uint32_t flags, uint64_t request_id, uint64_t offset,
+                           const uint8_t* payload, size_t length);
+
+// Decode the frame at the start of data without copying it
+DecodeStatus decode_frame(const uint8_t* data, size_t len, Frame& frame, size_t& consumed);
+
+// Builds request and reply payloads
+class PayloadWriter {
+public:
+  PayloadWriter& varint(uint64_t value);
+  PayloadWriter& bytes(const std::string& value);
+  const std::vector<uint8_t>& data() const { return data_; }
+
+private:
+  std::vector<uint8_t> data_;
+};
+
+// Reads the payload written by PayloadWriter
+class PayloadReader {
+public:
+  PayloadReader(const uint8_t* data, size_t len) : pos_(data), end_(data + len) {}
+  bool varint(uint64_t& value) { return get_varint(pos_, end_, value); }
+  // Everything left, as a string
+  std::string rest();
+
+private:
+  const uint8_t* pos_;
+  const uint8_t* end_;
+};
+
+// Splits a byte stream into frames. Frames that arrive whole are handed out
+// in place; only a frame split across reads is reassembled in a buffer.
+class FrameDecoder {
+public:
+  // Pass every complete frame in data to on_frame. False if the stream is
+  // malformed or on_frame returned false.
+  bool feed(const uint8_t* data, size_t len, const std::function<bool(const Frame&)>& on_frame);
+
+  // True if no partial frame is pending
+  bool idle() const { return pending_.empty(); }
+
+private:
+  std::vector<uint8_t> pending_;
+
+  bool drain(const uint8_t* data, size_t len, const std::function<bool(const Frame&)>& on_frame);
+};
+
+} // namespace quicftp
+
+#endif